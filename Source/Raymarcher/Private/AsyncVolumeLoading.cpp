@@ -0,0 +1,250 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "AsyncVolumeLoading.h"
+#include "Async/AsyncWork.h"
+#include "Containers/Ticker.h"
+#include "RaymarchRendering.h"
+#include "TextureHelperFunctions.h"
+
+// Runs a volume load on the thread pool and fulfills the promise with its result.
+class FVolumeLoadTask : public FNonAbandonableTask {
+  friend class FAutoDeleteAsyncTask<FVolumeLoadTask>;
+
+public:
+  FVolumeLoadTask(TFunction<FLoadedVolumePtr()>&& InLoad, TPromise<FLoadedVolumePtr>&& InPromise)
+    : Load(MoveTemp(InLoad)), Promise(MoveTemp(InPromise)) {}
+
+  void DoWork() { Promise.SetValue(Load()); }
+
+  FORCEINLINE TStatId GetStatId() const {
+    RETURN_QUICK_DECLARE_CYCLE_STAT(FVolumeLoadTask, STATGROUP_ThreadPoolAsyncTasks);
+  }
+
+private:
+  TFunction<FLoadedVolumePtr()> Load;
+  TPromise<FLoadedVolumePtr> Promise;
+};
+
+static TFuture<FLoadedVolumePtr> StartVolumeLoadTask(TFunction<FLoadedVolumePtr()> Load) {
+  TPromise<FLoadedVolumePtr> Promise;
+  TFuture<FLoadedVolumePtr> Future = Promise.GetFuture();
+  (new FAutoDeleteAsyncTask<FVolumeLoadTask>(MoveTemp(Load), MoveTemp(Promise)))
+      ->StartBackgroundTask();
+  return Future;
+}
+
+FLoadedVolumePtr LoadMhdVolume(const FString MhdFileName, FVolumeLoadProgress* Progress,
+                               const FVoxelWindow* Window) {
+  const FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+  if (!Info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return nullptr;
+  }
+
+  FLoadedVolumePtr Volume = MakeShared<FLoadedVolume, ESPMode::ThreadSafe>();
+  FVoxelStatisticsAccumulator Statistics;
+  Volume->Data = LoadMhdDataConverted(Info, MhdFileName, Volume->PixelFormat, Window, Progress,
+                                      &Statistics);
+  if (!Volume->Data) {
+    return nullptr;
+  }
+  Volume->Statistics = Statistics.GetStatistics();
+  Volume->Dimensions = Info.Dimensions;
+  Volume->WorldDimensions = Info.GetWorldDimensions();
+  return Volume;
+}
+
+TFuture<FLoadedVolumePtr> LoadMhdDataAsync(const FString MhdFileName,
+                                           FVolumeLoadProgressPtr Progress,
+                                           const TOptional<FVoxelWindow> Window) {
+  return StartVolumeLoadTask([MhdFileName, Progress, Window]() -> FLoadedVolumePtr {
+    return LoadMhdVolume(MhdFileName, Progress.Get(),
+                         Window.IsSet() ? &Window.GetValue() : nullptr);
+  });
+}
+
+TFuture<FLoadedVolumePtr> LoadMhdDataDecimatedAsync(const FString MhdFileName, const int32 Factor,
+                                                    const EVolumeDecimation Decimation,
+                                                    FVolumeLoadProgressPtr Progress) {
+  return StartVolumeLoadTask([MhdFileName, Factor, Decimation, Progress]() -> FLoadedVolumePtr {
+    const FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+    if (!Info.ParseSuccessful) {
+      MY_LOG("MHD Parsing failed!");
+      return nullptr;
+    }
+
+    FLoadedVolumePtr Volume = MakeShared<FLoadedVolume, ESPMode::ThreadSafe>();
+    FVoxelStatisticsAccumulator Statistics;
+    Volume->Data = LoadMhdDataDecimated(Info, MhdFileName, Factor, Decimation, Volume->PixelFormat,
+                                        Volume->Dimensions, nullptr, Progress.Get(), &Statistics);
+    if (!Volume->Data) {
+      return nullptr;
+    }
+    Volume->Statistics = Statistics.GetStatistics();
+    Volume->WorldDimensions = Info.GetWorldDimensions();
+    return Volume;
+  });
+}
+
+TFuture<FLoadedVolumePtr> LoadRawDataAsync(const FString RawFileName, const FIntVector Dimensions,
+                                           const EMhdElementType ElementType,
+                                           FVolumeLoadProgressPtr Progress) {
+  return StartVolumeLoadTask(
+      [RawFileName, Dimensions, ElementType, Progress]() -> FLoadedVolumePtr {
+        const int64 NumElements = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z;
+        FLoadedVolumePtr Volume = MakeShared<FLoadedVolume, ESPMode::ThreadSafe>();
+        FVoxelStatisticsAccumulator Statistics;
+        Volume->Data = LoadRawFileConverted(RawFileName, NumElements, ElementType,
+                                            Volume->PixelFormat, nullptr, false, 0,
+                                            Progress.Get(), &Statistics);
+        if (!Volume->Data) {
+          return nullptr;
+        }
+        Volume->Statistics = Statistics.GetStatistics();
+        Volume->Dimensions = Dimensions;
+        Volume->WorldDimensions = FVector(Dimensions);
+        return Volume;
+      });
+}
+
+ULoadVolumeAsyncAction* ULoadVolumeAsyncAction::LoadMhdIntoNewVolumeTextureAssetAsync(
+    FString FileName, FString TextureName, bool Persistent) {
+  ULoadVolumeAsyncAction* Action = NewObject<ULoadVolumeAsyncAction>();
+  Action->TextureName = TextureName;
+  Action->bPersistent = Persistent;
+  Action->StartLoad = [FileName](FVolumeLoadProgressPtr Progress) {
+    return LoadMhdDataAsync(FileName, Progress);
+  };
+  return Action;
+}
+
+ULoadVolumeAsyncAction* ULoadVolumeAsyncAction::LoadMhdIntoVolumeTextureAssetAsync(
+    FString FileName, UVolumeTexture* VolumeAsset, bool Persistent) {
+  ULoadVolumeAsyncAction* Action = NewObject<ULoadVolumeAsyncAction>();
+  Action->TargetTexture = VolumeAsset;
+  Action->bPersistent = Persistent;
+  Action->StartLoad = [FileName](FVolumeLoadProgressPtr Progress) {
+    return LoadMhdDataAsync(FileName, Progress);
+  };
+  return Action;
+}
+
+ULoadVolumeAsyncAction* ULoadVolumeAsyncAction::LoadMhdWithPreviewIntoNewVolumeTextureAssetAsync(
+    FString FileName, FString TextureName, int32 PreviewFactor, EVolumeDecimation Decimation,
+    bool Persistent) {
+  ULoadVolumeAsyncAction* Action =
+      LoadMhdIntoNewVolumeTextureAssetAsync(FileName, TextureName, Persistent);
+  Action->StartPreviewLoad = [FileName, PreviewFactor,
+                              Decimation](FVolumeLoadProgressPtr Progress) {
+    return LoadMhdDataDecimatedAsync(FileName, PreviewFactor, Decimation, Progress);
+  };
+  return Action;
+}
+
+ULoadVolumeAsyncAction* ULoadVolumeAsyncAction::LoadRawIntoNewVolumeTextureAssetAsync(
+    FString RawFileName, FString TextureName, FIntVector Dimensions, EMhdElementType ElementType,
+    bool Persistent) {
+  ULoadVolumeAsyncAction* Action = NewObject<ULoadVolumeAsyncAction>();
+  Action->TextureName = TextureName;
+  Action->bPersistent = Persistent;
+  Action->StartLoad = [RawFileName, Dimensions, ElementType](FVolumeLoadProgressPtr Progress) {
+    return LoadRawDataAsync(RawFileName, Dimensions, ElementType, Progress);
+  };
+  return Action;
+}
+
+ULoadVolumeAsyncAction* ULoadVolumeAsyncAction::LoadRawIntoVolumeTextureAssetAsync(
+    FString RawFileName, UVolumeTexture* VolumeAsset, FIntVector Dimensions,
+    EMhdElementType ElementType, bool Persistent) {
+  ULoadVolumeAsyncAction* Action = NewObject<ULoadVolumeAsyncAction>();
+  Action->TargetTexture = VolumeAsset;
+  Action->bPersistent = Persistent;
+  Action->StartLoad = [RawFileName, Dimensions, ElementType](FVolumeLoadProgressPtr Progress) {
+    return LoadRawDataAsync(RawFileName, Dimensions, ElementType, Progress);
+  };
+  return Action;
+}
+
+void ULoadVolumeAsyncAction::Cancel() {
+  bCanceled = true;
+  if (Progress.IsValid()) {
+    Progress->Cancel();
+  }
+}
+
+void ULoadVolumeAsyncAction::Activate() {
+  if (bCanceled) {
+    OnFailed.Broadcast(nullptr, FIntVector::ZeroValue, FVector::ZeroVector, FVolumeStatistics());
+    SetReadyToDestroy();
+    return;
+  }
+  Progress = MakeShared<FVolumeLoadProgress, ESPMode::ThreadSafe>();
+  if (StartPreviewLoad) {
+    PreviewFuture = StartPreviewLoad(Progress);
+  } else {
+    Future = StartLoad(Progress);
+  }
+  // Keep the action alive until the worker threads are done with the load.
+  AddToRoot();
+  FTicker::GetCoreTicker().AddTicker(
+      FTickerDelegate::CreateUObject(this, &ULoadVolumeAsyncAction::Tick));
+}
+
+bool ULoadVolumeAsyncAction::Tick(float DeltaTime) {
+  if (PreviewFuture.IsValid()) {
+    if (!PreviewFuture.IsReady()) {
+      OnProgress.Broadcast(Progress->GetFraction());
+      return true;
+    }
+    const FLoadedVolumePtr Preview = PreviewFuture.Get();
+    PreviewFuture = TFuture<FLoadedVolumePtr>();
+    UVolumeTexture* PreviewTexture = nullptr;
+    if (Preview.IsValid()) {
+      // The preview is replaced by the full volume soon, never make it persistent.
+      CreateVolumeTextureAsset(TextureName + TEXT("_Preview"), Preview->PixelFormat,
+                               Preview->Dimensions, PreviewTexture, MoveTemp(Preview->Data),
+                               false);
+    }
+    if (PreviewTexture) {
+      OnPreview.Broadcast(PreviewTexture, Preview->Dimensions, Preview->WorldDimensions,
+                          Preview->Statistics);
+    }
+    // Refine to full resolution even if there is no preview (e.g. for compressed volumes). A
+    // canceled load stops at its first slab.
+    Future = StartLoad(Progress);
+    return true;
+  }
+
+  if (!Future.IsReady()) {
+    OnProgress.Broadcast(Progress->GetFraction());
+    return true;
+  }
+
+  const FLoadedVolumePtr Volume = Future.Get();
+  UVolumeTexture* Texture = nullptr;
+  if (Volume.IsValid()) {
+    // Only copying the data into the texture and creating its resource happens on the game thread.
+    // The texture takes over the loaded voxels, they aren't needed afterwards.
+    if (TargetTexture) {
+      UpdateVolumeTextureAsset(TargetTexture, Volume->PixelFormat, Volume->Dimensions,
+                               MoveTemp(Volume->Data), bPersistent);
+      Texture = TargetTexture;
+    } else {
+      CreateVolumeTextureAsset(TextureName, Volume->PixelFormat, Volume->Dimensions, Texture,
+                               MoveTemp(Volume->Data), bPersistent);
+    }
+  }
+
+  if (Texture) {
+    OnProgress.Broadcast(1.0f);
+    OnLoaded.Broadcast(Texture, Volume->Dimensions, Volume->WorldDimensions, Volume->Statistics);
+  } else {
+    OnFailed.Broadcast(nullptr, FIntVector::ZeroValue, FVector::ZeroVector, FVolumeStatistics());
+  }
+
+  RemoveFromRoot();
+  SetReadyToDestroy();
+  // Returning false removes the ticker.
+  return false;
+}
@@ -0,0 +1,498 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "BrickedVolume.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "RaymarchRendering.h"
+#include "Serialization/MemoryWriter.h"
+#include "TextureHelperFunctions.h"
+#include "VoxelConversion.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "zlib.h"
+THIRD_PARTY_INCLUDES_END
+
+// "BRVL" - first four bytes of every bricked volume file.
+#define BRICKED_VOLUME_MAGIC 0x4252564C
+// Increase whenever the file layout changes.
+#define BRICKED_VOLUME_VERSION 1
+
+FArchive& operator<<(FArchive& Ar, FBrickInfo& Brick) {
+  // Every field has a fixed size, so the index can be rewritten in place once all bricks are
+  // written.
+  Ar << Brick.Offset << Brick.StoredSize << Brick.bCompressed << Brick.bConstant
+     << Brick.ConstantValue << Brick.Min << Brick.Max << Brick.Occupancy;
+  return Ar;
+}
+
+// Serializes everything in front of the brick index.
+static void SerializeBrickedVolumeHeader(FArchive& Ar, FIntVector& Dimensions, FVector& Spacing,
+                                         EMhdElementType& ElementType, int32& BrickSize,
+                                         float& OccupancyThreshold) {
+  uint8 Type = uint8(ElementType);
+  Ar << Dimensions << Spacing << Type << BrickSize << OccupancyThreshold;
+  ElementType = EMhdElementType(FMath::Min<uint8>(Type, uint8(EMhdElementType::MET_UNKNOWN)));
+}
+
+bool FBrickedVolume::Open(const FString InFileName) {
+  Bricks.Empty();
+  TUniquePtr<FArchive> Reader(IFileManager::Get().CreateFileReader(*InFileName, FILEREAD_Silent));
+  if (!Reader) {
+    MY_LOG("Bricked volume file could not be opened.");
+    return false;
+  }
+
+  uint32 Magic = 0;
+  uint32 Version = 0;
+  *Reader << Magic << Version;
+  if (Reader->IsError() || Magic != BRICKED_VOLUME_MAGIC || Version != BRICKED_VOLUME_VERSION) {
+    MY_LOG("File is not a bricked volume or was written by a different version.");
+    return false;
+  }
+  SerializeBrickedVolumeHeader(*Reader, Dimensions, Spacing, ElementType, BrickSize,
+                               OccupancyThreshold);
+  int32 NumBricks = 0;
+  *Reader << NumBricks;
+  if (Reader->IsError() || BrickSize <= 0 || ElementType == EMhdElementType::MET_UNKNOWN ||
+      Dimensions.X <= 0 || Dimensions.Y <= 0 || Dimensions.Z <= 0) {
+    MY_LOG("Bricked volume header is corrupt.");
+    return false;
+  }
+  // The writer keeps a brick in an array, so no brick can be bigger than that.
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int64 MaxBrickBytes = (int64)FMath::Min(BrickSize, Dimensions.X) *
+                              FMath::Min(BrickSize, Dimensions.Y) *
+                              FMath::Min(BrickSize, Dimensions.Z) * ElementSize;
+  if (MaxBrickBytes > MAX_int32) {
+    MY_LOG("Bricked volume header is corrupt.");
+    return false;
+  }
+
+  BrickCounts = FIntVector(FMath::DivideAndRoundUp(Dimensions.X, BrickSize),
+                           FMath::DivideAndRoundUp(Dimensions.Y, BrickSize),
+                           FMath::DivideAndRoundUp(Dimensions.Z, BrickSize));
+  // Every index entry takes bytes in the file, so the index can't be bigger than the file either.
+  const int64 FileSize = Reader->TotalSize();
+  TArray<uint8> IndexEntry;
+  FMemoryWriter IndexEntryWriter(IndexEntry);
+  FBrickInfo EmptyBrick;
+  IndexEntryWriter << EmptyBrick;
+  const int64 IndexEntryBytes = IndexEntry.Num();
+  if ((int64)BrickCounts.X * BrickCounts.Y * BrickCounts.Z != NumBricks ||
+      (int64)NumBricks * IndexEntryBytes > FileSize - Reader->Tell()) {
+    MY_LOG("Bricked volume index doesn't match its dimensions.");
+    return false;
+  }
+  Bricks.SetNum(NumBricks);
+  for (FBrickInfo& Brick : Bricks) {
+    *Reader << Brick;
+  }
+  if (Reader->IsError()) {
+    MY_LOG("Bricked volume index is truncated.");
+    Bricks.Empty();
+    return false;
+  }
+
+  // The bricks are stored after the index and must be inside the file. Uncompressed bricks are
+  // stored with exactly their voxels, compressed ones only if that made them smaller.
+  const int64 DataStart = Reader->Tell();
+  for (int32 BrickIndex = 0; BrickIndex < NumBricks; BrickIndex++) {
+    const FBrickInfo& Brick = Bricks[BrickIndex];
+    if (Brick.bConstant) {
+      continue;
+    }
+    const FIntVector Extent = GetBrickExtent(BrickIndex);
+    const int64 BrickBytes = (int64)Extent.X * Extent.Y * Extent.Z * ElementSize;
+    if (Brick.StoredSize <= 0 || Brick.Offset < DataStart ||
+        Brick.Offset > FileSize - Brick.StoredSize ||
+        (Brick.bCompressed ? Brick.StoredSize >= BrickBytes : Brick.StoredSize != BrickBytes)) {
+      UE_LOG(LogTemp, Warning, TEXT("Brick %d of %s is outside the file or has a wrong size."),
+             BrickIndex, *InFileName);
+      Bricks.Empty();
+      return false;
+    }
+  }
+  FileName = InFileName;
+  return true;
+}
+
+FIntVector FBrickedVolume::GetBrickCoordinates(const int32 BrickIndex) const {
+  const int32 BricksPerLayer = BrickCounts.X * BrickCounts.Y;
+  return FIntVector(BrickIndex % BrickCounts.X, (BrickIndex % BricksPerLayer) / BrickCounts.X,
+                    BrickIndex / BricksPerLayer);
+}
+
+FIntVector FBrickedVolume::GetBrickExtent(const int32 BrickIndex) const {
+  const FIntVector Origin = GetBrickOrigin(BrickIndex);
+  return FIntVector(FMath::Min(BrickSize, Dimensions.X - Origin.X),
+                    FMath::Min(BrickSize, Dimensions.Y - Origin.Y),
+                    FMath::Min(BrickSize, Dimensions.Z - Origin.Z));
+}
+
+TArray<int32> FBrickedVolume::FindBricks(const FIntVector RegionMin, const FIntVector RegionSize,
+                                         const bool bSkipEmpty) const {
+  TArray<int32> Found;
+  if (RegionSize.X <= 0 || RegionSize.Y <= 0 || RegionSize.Z <= 0 || BrickSize <= 0) {
+    return Found;
+  }
+  const FIntVector RegionMax = RegionMin + RegionSize;
+  const int32 MinX = FMath::Max(RegionMin.X, 0) / BrickSize;
+  const int32 MinY = FMath::Max(RegionMin.Y, 0) / BrickSize;
+  const int32 MinZ = FMath::Max(RegionMin.Z, 0) / BrickSize;
+  const int32 MaxX = FMath::Min(FMath::DivideAndRoundUp(RegionMax.X, BrickSize), BrickCounts.X);
+  const int32 MaxY = FMath::Min(FMath::DivideAndRoundUp(RegionMax.Y, BrickSize), BrickCounts.Y);
+  const int32 MaxZ = FMath::Min(FMath::DivideAndRoundUp(RegionMax.Z, BrickSize), BrickCounts.Z);
+  for (int32 Z = MinZ; Z < MaxZ; Z++) {
+    for (int32 Y = MinY; Y < MaxY; Y++) {
+      for (int32 X = MinX; X < MaxX; X++) {
+        const int32 BrickIndex = GetBrickIndex(FIntVector(X, Y, Z));
+        if (!bSkipEmpty || !Bricks[BrickIndex].IsEmpty()) {
+          Found.Add(BrickIndex);
+        }
+      }
+    }
+  }
+  return Found;
+}
+
+bool FBrickedVolume::ReadBrick(IFileHandle& FileHandle, const int32 BrickIndex,
+                               TArray<uint8>& StoredData, uint8* Voxels) const {
+  const FBrickInfo& Brick = Bricks[BrickIndex];
+  const FIntVector Extent = GetBrickExtent(BrickIndex);
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int64 NumVoxels = (int64)Extent.X * Extent.Y * Extent.Z;
+  const int64 BrickBytes = NumVoxels * ElementSize;
+
+  if (Brick.bConstant) {
+    for (int64 i = 0; i < NumVoxels; i++) {
+      FMemory::Memcpy(Voxels + i * ElementSize, &Brick.ConstantValue, ElementSize);
+    }
+    return true;
+  }
+  if (!Brick.bCompressed) {
+    return Brick.StoredSize == BrickBytes && FileHandle.Seek(Brick.Offset) &&
+           FileHandle.Read(Voxels, BrickBytes);
+  }
+  StoredData.SetNumUninitialized(Brick.StoredSize, false);
+  if (!FileHandle.Seek(Brick.Offset) || !FileHandle.Read(StoredData.GetData(), Brick.StoredSize)) {
+    return false;
+  }
+  uLongf DecompressedBytes = uLongf(BrickBytes);
+  return uncompress(Voxels, &DecompressedBytes, StoredData.GetData(), uLong(Brick.StoredSize)) ==
+             Z_OK &&
+         DecompressedBytes == uLongf(BrickBytes);
+}
+
+bool FBrickedVolume::ReadBricks(
+    const TArray<int32>& BrickIndices,
+    TFunctionRef<void(int32 BrickIndex, const uint8* Voxels)> ProcessBrick,
+    FVolumeLoadProgress* Progress) const {
+  if (BrickIndices.Num() == 0) {
+    return true;
+  }
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  // Bricks are never bigger than the volume.
+  const int64 MaxBrickBytes = (int64)FMath::Min(BrickSize, Dimensions.X) *
+                              FMath::Min(BrickSize, Dimensions.Y) *
+                              FMath::Min(BrickSize, Dimensions.Z) * ElementSize;
+
+  // Readers take bricks from the sorted list in turn, so the file is read roughly front to back.
+  TArray<int32> SortedBricks = BrickIndices;
+  SortedBricks.Sort(
+      [this](const int32 A, const int32 B) { return Bricks[A].Offset < Bricks[B].Offset; });
+  if (Progress) {
+    int64 TotalBytes = 0;
+    for (const int32 BrickIndex : SortedBricks) {
+      const FIntVector Extent = GetBrickExtent(BrickIndex);
+      TotalBytes += (int64)Extent.X * Extent.Y * Extent.Z * ElementSize;
+    }
+    Progress->Start(TotalBytes);
+  }
+
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  const int32 NumReaders = FMath::Min(
+      FMath::Clamp(FPlatformMisc::NumberOfCoresIncludingHyperthreads(), 2, 16), SortedBricks.Num());
+  FThreadSafeCounter NextBrick;
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  ParallelFor(NumReaders, [&](int32 ReaderIndex) {
+    TUniquePtr<IFileHandle> FileHandle(PlatformFile.OpenRead(*FileName));
+    if (!FileHandle) {
+      bFailed = true;
+      return;
+    }
+    TArray<uint8> StoredData;
+    TUniquePtr<uint8[]> Voxels(new uint8[MaxBrickBytes]);
+
+    for (int32 i = NextBrick.Increment() - 1; i < SortedBricks.Num() && !bFailed && !bCanceled;
+         i = NextBrick.Increment() - 1) {
+      const int32 BrickIndex = SortedBricks[i];
+      if (!ReadBrick(*FileHandle, BrickIndex, StoredData, Voxels.Get())) {
+        UE_LOG(LogTemp, Warning, TEXT("Brick %d of %s could not be read."), BrickIndex, *FileName);
+        bFailed = true;
+        return;
+      }
+      ProcessBrick(BrickIndex, Voxels.Get());
+      const FIntVector Extent = GetBrickExtent(BrickIndex);
+      if (Progress &&
+          !Progress->Advance((int64)Extent.X * Extent.Y * Extent.Z * ElementSize)) {
+        bCanceled = true;
+      }
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return false;
+  }
+  return !bFailed;
+}
+
+TUniquePtr<uint8> FBrickedVolume::LoadRegionConverted(const FIntVector RegionMin,
+                                                      const FIntVector RegionSize,
+                                                      EPixelFormat& OutPixelFormat,
+                                                      FVolumeLoadProgress* Progress) const {
+  const FIntVector RegionMax = RegionMin + RegionSize;
+  if (RegionSize.X <= 0 || RegionSize.Y <= 0 || RegionSize.Z <= 0 || RegionMin.X < 0 ||
+      RegionMin.Y < 0 || RegionMin.Z < 0 || RegionMax.X > Dimensions.X ||
+      RegionMax.Y > Dimensions.Y || RegionMax.Z > Dimensions.Z) {
+    MY_LOG("Region is empty or not inside the volume.");
+    return nullptr;
+  }
+  OutPixelFormat = FMhdInfo::GetConvertedPixelFormat(ElementType);
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int32 ConvertedElementSize = GPixelFormats[OutPixelFormat].BlockBytes;
+  auto ConvertedArray = TUniquePtr<uint8>(
+      new uint8[(int64)RegionSize.X * RegionSize.Y * RegionSize.Z * ConvertedElementSize]);
+  uint8* ConvertedData = ConvertedArray.Get();
+
+  // Bricks cover disjoint parts of the region, so they can be copied in from any thread.
+  auto CopyBrick = [&](int32 BrickIndex, const uint8* Voxels) {
+    const FIntVector Origin = GetBrickOrigin(BrickIndex);
+    const FIntVector Extent = GetBrickExtent(BrickIndex);
+    const FIntVector Low(FMath::Max(Origin.X, RegionMin.X), FMath::Max(Origin.Y, RegionMin.Y),
+                         FMath::Max(Origin.Z, RegionMin.Z));
+    const FIntVector High(FMath::Min(Origin.X + Extent.X, RegionMax.X),
+                          FMath::Min(Origin.Y + Extent.Y, RegionMax.Y),
+                          FMath::Min(Origin.Z + Extent.Z, RegionMax.Z));
+    for (int32 Z = Low.Z; Z < High.Z; Z++) {
+      for (int32 Y = Low.Y; Y < High.Y; Y++) {
+        const int64 SourceIndex =
+            ((int64)(Z - Origin.Z) * Extent.Y + (Y - Origin.Y)) * Extent.X + (Low.X - Origin.X);
+        const int64 DestIndex = ((int64)(Z - RegionMin.Z) * RegionSize.Y + (Y - RegionMin.Y)) *
+                                    RegionSize.X +
+                                (Low.X - RegionMin.X);
+        FMhdInfo::ConvertElements(Voxels + SourceIndex * ElementSize,
+                                  ConvertedData + DestIndex * ConvertedElementSize,
+                                  High.X - Low.X, ElementType, false);
+      }
+    }
+  };
+
+  if (!ReadBricks(FindBricks(RegionMin, RegionSize), CopyBrick, Progress)) {
+    MY_LOG("Reading the bricked volume failed.");
+    return nullptr;
+  }
+  return ConvertedArray;
+}
+
+// Computes the value range, occupancy and constness of a brick's voxels.
+template <typename T>
+static void SummarizeBrick(const T* Voxels, const int64 NumVoxels, const float OccupancyThreshold,
+                           FBrickInfo& Brick) {
+  T MinValue = Voxels[0];
+  T MaxValue = Voxels[0];
+  int64 Occupied = 0;
+  for (int64 i = 0; i < NumVoxels; i++) {
+    MinValue = FMath::Min(MinValue, Voxels[i]);
+    MaxValue = FMath::Max(MaxValue, Voxels[i]);
+    Occupied += (Voxels[i] > OccupancyThreshold) ? 1 : 0;
+  }
+  Brick.Min = float(MinValue);
+  Brick.Max = float(MaxValue);
+  Brick.Occupancy = float(double(Occupied) / NumVoxels);
+  // Compare the exact values, float can't represent every int32 or double.
+  Brick.bConstant = MinValue == MaxValue;
+  if (Brick.bConstant) {
+    FMemory::Memcpy(&Brick.ConstantValue, &Voxels[0], sizeof(T));
+  }
+}
+
+static void SummarizeBrick(const uint8* Voxels, const int64 NumVoxels,
+                           const EMhdElementType ElementType, const float OccupancyThreshold,
+                           FBrickInfo& Brick) {
+  switch (ElementType) {
+    case EMhdElementType::MET_UCHAR:
+      SummarizeBrick(Voxels, NumVoxels, OccupancyThreshold, Brick);
+      break;
+    case EMhdElementType::MET_USHORT:
+      SummarizeBrick(reinterpret_cast<const uint16*>(Voxels), NumVoxels, OccupancyThreshold, Brick);
+      break;
+    case EMhdElementType::MET_SHORT:
+      SummarizeBrick(reinterpret_cast<const int16*>(Voxels), NumVoxels, OccupancyThreshold, Brick);
+      break;
+    case EMhdElementType::MET_INT:
+      SummarizeBrick(reinterpret_cast<const int32*>(Voxels), NumVoxels, OccupancyThreshold, Brick);
+      break;
+    case EMhdElementType::MET_FLOAT:
+      SummarizeBrick(reinterpret_cast<const float*>(Voxels), NumVoxels, OccupancyThreshold, Brick);
+      break;
+    case EMhdElementType::MET_FLOAT64:
+      SummarizeBrick(reinterpret_cast<const double*>(Voxels), NumVoxels, OccupancyThreshold, Brick);
+      break;
+    default: break;
+  }
+}
+
+// Swaps big-endian voxels to little-endian in place.
+static void SwapElementBytes(uint8* Data, const int64 NumElements, const int32 ElementSize) {
+  switch (ElementSize) {
+    case 2: SwapVoxelBytes((uint16*)Data, (uint16*)Data, NumElements); break;
+    case 4: SwapVoxelBytes((uint32*)Data, (uint32*)Data, NumElements); break;
+    case 8: SwapVoxelBytes((uint64*)Data, (uint64*)Data, NumElements); break;
+    default: break;
+  }
+}
+
+bool ConvertMhdToBrickedVolume(const FString MhdFileName, const FString OutFileName,
+                               const int32 BrickSize, const bool bCompress,
+                               const float OccupancyThreshold) {
+  FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+  if (!Info.ParseSuccessful || Info.CompressedData || Info.NumChannels > 1) {
+    MY_LOG("Only uncompressed single-channel MHDs can be converted to bricked volumes.");
+    return false;
+  }
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(Info.ElementType)].SizeBytes;
+  const TArray<FString> DataFiles = Info.DataFiles.Num() > 0
+                                        ? Info.GetDataFilePaths(MhdFileName)
+                                        : TArray<FString>{Info.GetDataFilePath(MhdFileName)};
+  if (ElementSize == 0 || BrickSize <= 0 || Info.Dimensions.Z % DataFiles.Num() != 0) {
+    MY_LOG("Volume can't be converted to a bricked volume.");
+    return false;
+  }
+
+  TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*OutFileName));
+  if (!Writer) {
+    MY_LOG("Bricked volume file could not be written.");
+    return false;
+  }
+  // Doesn't leave a partially written file behind, which would look like a valid one at first.
+  auto DeleteOutput = [&Writer, &OutFileName]() {
+    Writer.Reset();
+    IFileManager::Get().Delete(*OutFileName, false, false, true);
+  };
+
+  const FIntVector Dimensions = Info.Dimensions;
+  const FIntVector BrickCounts(FMath::DivideAndRoundUp(Dimensions.X, BrickSize),
+                               FMath::DivideAndRoundUp(Dimensions.Y, BrickSize),
+                               FMath::DivideAndRoundUp(Dimensions.Z, BrickSize));
+  const int32 BricksPerLayer = BrickCounts.X * BrickCounts.Y;
+  TArray<FBrickInfo> Bricks;
+  Bricks.SetNum(BricksPerLayer * BrickCounts.Z);
+
+  // Write the header and a placeholder index, which is filled in once the bricks are written.
+  uint32 Magic = BRICKED_VOLUME_MAGIC;
+  uint32 Version = BRICKED_VOLUME_VERSION;
+  int32 NumBricks = Bricks.Num();
+  FIntVector HeaderDimensions = Dimensions;
+  FVector Spacing = Info.Spacing;
+  EMhdElementType ElementType = Info.ElementType;
+  int32 HeaderBrickSize = BrickSize;
+  float Threshold = OccupancyThreshold;
+  *Writer << Magic << Version;
+  SerializeBrickedVolumeHeader(*Writer, HeaderDimensions, Spacing, ElementType, HeaderBrickSize,
+                               Threshold);
+  *Writer << NumBricks;
+  const int64 IndexOffset = Writer->Tell();
+  for (FBrickInfo& Brick : Bricks) {
+    *Writer << Brick;
+  }
+
+  const int64 RowBytes = (int64)Dimensions.X * ElementSize;
+  const int64 SliceBytes = RowBytes * Dimensions.Y;
+  FRawSliceReader Reader(DataFiles, SliceBytes, Dimensions.Z / DataFiles.Num(), Info.HeaderSize);
+  TUniquePtr<uint8[]> Layer(new uint8[SliceBytes * FMath::Min(BrickSize, Dimensions.Z)]);
+  TArray<TArray<uint8>> StoredBricks;
+  StoredBricks.SetNum(BricksPerLayer);
+
+  for (int32 LayerZ = 0; LayerZ < BrickCounts.Z; LayerZ++) {
+    // Slices of a layer are contiguous in the file, read them sequentially.
+    const int32 FirstZ = LayerZ * BrickSize;
+    const int32 LayerDepth = FMath::Min(BrickSize, Dimensions.Z - FirstZ);
+    for (int32 Z = 0; Z < LayerDepth; Z++) {
+      if (!Reader.Read(FirstZ + Z, 0, Layer.Get() + Z * SliceBytes, SliceBytes)) {
+        MY_LOG("Reading the volume failed.");
+        DeleteOutput();
+        return false;
+      }
+    }
+
+    ParallelFor(BricksPerLayer, [&](int32 BrickInLayer) {
+      const int32 BrickIndex = LayerZ * BricksPerLayer + BrickInLayer;
+      const FIntVector Origin(BrickInLayer % BrickCounts.X * BrickSize,
+                              BrickInLayer / BrickCounts.X * BrickSize, FirstZ);
+      const FIntVector Extent(FMath::Min(BrickSize, Dimensions.X - Origin.X),
+                              FMath::Min(BrickSize, Dimensions.Y - Origin.Y), LayerDepth);
+      const int64 NumVoxels = (int64)Extent.X * Extent.Y * Extent.Z;
+      const int64 BrickRowBytes = (int64)Extent.X * ElementSize;
+
+      TArray<uint8> Voxels;
+      Voxels.SetNumUninitialized(NumVoxels * ElementSize);
+      for (int32 Z = 0; Z < Extent.Z; Z++) {
+        for (int32 Y = 0; Y < Extent.Y; Y++) {
+          FMemory::Memcpy(Voxels.GetData() + ((int64)Z * Extent.Y + Y) * BrickRowBytes,
+                          Layer.Get() + Z * SliceBytes + (Origin.Y + Y) * RowBytes +
+                              (int64)Origin.X * ElementSize,
+                          BrickRowBytes);
+        }
+      }
+      if (Info.ByteOrderMSB) {
+        SwapElementBytes(Voxels.GetData(), NumVoxels, ElementSize);
+      }
+
+      FBrickInfo& Brick = Bricks[BrickIndex];
+      SummarizeBrick(Voxels.GetData(), NumVoxels, Info.ElementType, OccupancyThreshold, Brick);
+      TArray<uint8>& Stored = StoredBricks[BrickInLayer];
+      Stored.Reset();
+      if (Brick.bConstant) {
+        return;
+      }
+      if (bCompress) {
+        uLongf CompressedBytes = compressBound(uLong(Voxels.Num()));
+        Stored.SetNumUninitialized(CompressedBytes);
+        if (compress2(Stored.GetData(), &CompressedBytes, Voxels.GetData(), uLong(Voxels.Num()),
+                      6) == Z_OK &&
+            CompressedBytes < uLongf(Voxels.Num())) {
+          Stored.SetNum(CompressedBytes, false);
+          Brick.bCompressed = true;
+          return;
+        }
+      }
+      Stored = MoveTemp(Voxels);
+    });
+
+    for (int32 BrickInLayer = 0; BrickInLayer < BricksPerLayer; BrickInLayer++) {
+      FBrickInfo& Brick = Bricks[LayerZ * BricksPerLayer + BrickInLayer];
+      TArray<uint8>& Stored = StoredBricks[BrickInLayer];
+      Brick.Offset = Writer->Tell();
+      Brick.StoredSize = Stored.Num();
+      Writer->Serialize(Stored.GetData(), Stored.Num());
+    }
+  }
+
+  Writer->Seek(IndexOffset);
+  for (FBrickInfo& Brick : Bricks) {
+    *Writer << Brick;
+  }
+  const bool bSuccess = !Writer->IsError() && Writer->Close();
+  if (!bSuccess) {
+    MY_LOG("Bricked volume file could not be written.");
+    DeleteOutput();
+  }
+  return bSuccess;
+}
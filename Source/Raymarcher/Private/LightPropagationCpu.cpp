@@ -0,0 +1,351 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "LightPropagationCpu.h"
+#include "Async/ParallelFor.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+#define LIGHT_PROPAGATION_SSE 1
+#include <xmmintrin.h>
+#else
+#define LIGHT_PROPAGATION_SSE 0
+#endif
+
+// Same as RAYMARCH_FIXED_DENSITY in RaymarcherCommon.usf.
+#define LIGHT_PROPAGATION_FIXED_DENSITY 200.0f
+
+// Same as ONE_OVER_SQRT_3 in RaymarcherCommon.usf.
+#define LIGHT_PROPAGATION_ONE_OVER_SQRT_3 0.57735026919f
+
+bool FLightPropagationVolume::Init(UVolumeTexture* Volume, UTexture2D* TransferFunction,
+                                   const FTransferFunctionRangeParameters& TFRange) {
+  if (!Volume || !TransferFunction || !Volume->PlatformData || !TransferFunction->PlatformData ||
+      Volume->PlatformData->Mips.Num() == 0 || TransferFunction->PlatformData->Mips.Num() == 0) {
+    return false;
+  }
+  FTexture2DMipMap& VolumeMip = Volume->PlatformData->Mips[0];
+  FTexture2DMipMap& TFMip = TransferFunction->PlatformData->Mips[0];
+  const EPixelFormat PixelFormat = Volume->PlatformData->PixelFormat;
+  const EPixelFormat TFPixelFormat = TransferFunction->PlatformData->PixelFormat;
+  if (TFPixelFormat != PF_FloatRGBA && TFPixelFormat != PF_B8G8R8A8) {
+    UE_LOG(LogTemp, Warning, TEXT("Pixel format not supported by light propagation on the CPU."));
+    return false;
+  }
+
+  const FIntVector VolumeDimensions(VolumeMip.SizeX, VolumeMip.SizeY, VolumeMip.SizeZ);
+  const int64 NumVoxels = (int64)VolumeDimensions.X * VolumeDimensions.Y * VolumeDimensions.Z;
+  const int64 TFTexels = (int64)TFMip.SizeX * TFMip.SizeY;
+  // Cooked textures may have dropped their CPU copy once the resource was created.
+  if (TFTexels == 0 ||
+      VolumeMip.BulkData.GetBulkDataSize() != NumVoxels * GPixelFormats[PixelFormat].BlockBytes ||
+      TFMip.BulkData.GetBulkDataSize() != TFTexels * GPixelFormats[TFPixelFormat].BlockBytes) {
+    return false;
+  }
+
+  // The shaders sample the transfer function in the middle row. All rows of the transfer functions
+  // created by ColorCurveToTexture are the same anyway.
+  const uint8* TFData = (const uint8*)TFMip.BulkData.LockReadOnly();
+  const int64 RowStart = (int64)(TFMip.SizeY / 2) * TFMip.SizeX;
+  TArray<float> Opacities;
+  Opacities.SetNumUninitialized(TFMip.SizeX);
+  for (int32 i = 0; i < Opacities.Num(); i++) {
+    if (TFPixelFormat == PF_FloatRGBA) {
+      Opacities[i] = ((const FFloat16Color*)TFData)[RowStart + i].A.GetFloat();
+    } else {
+      Opacities[i] = ((const FColor*)TFData)[RowStart + i].A / 255.0f;
+    }
+  }
+  TFMip.BulkData.Unlock();
+
+  const uint8* Voxels = (const uint8*)VolumeMip.BulkData.LockReadOnly();
+  const bool bSuccess = InitFromVoxels(Voxels, VolumeDimensions, PixelFormat, Opacities,
+                                       TFRange.IntensityDomain);
+  VolumeMip.BulkData.Unlock();
+  return bSuccess;
+}
+
+bool FLightPropagationVolume::InitFromVoxels(const uint8* Voxels,
+                                             const FIntVector VolumeDimensions,
+                                             const EPixelFormat PixelFormat,
+                                             const TArray<float>& Opacities,
+                                             const FVector2D Domain) {
+  if (PixelFormat != PF_G8 && PixelFormat != PF_G16 && PixelFormat != PF_R32_FLOAT) {
+    UE_LOG(LogTemp, Warning, TEXT("Pixel format not supported by light propagation on the CPU."));
+    return false;
+  }
+  const int64 SliceVoxels = (int64)VolumeDimensions.X * VolumeDimensions.Y;
+  const int64 NumVoxels = SliceVoxels * VolumeDimensions.Z;
+  if (!Voxels || NumVoxels == 0 || NumVoxels > MAX_int32 || Opacities.Num() == 0) {
+    return false;
+  }
+
+  Dimensions = VolumeDimensions;
+  IntensityDomain = Domain;
+  TFOpacities = Opacities;
+
+  Intensities.SetNumUninitialized(NumVoxels);
+  ParallelFor(Dimensions.Z, [&](int32 Slice) {
+    const int64 First = Slice * SliceVoxels;
+    float* Dst = Intensities.GetData() + First;
+    if (PixelFormat == PF_G8) {
+      const uint8* Src = Voxels + First;
+      for (int64 i = 0; i < SliceVoxels; i++) {
+        Dst[i] = Src[i] / 255.0f;
+      }
+    } else if (PixelFormat == PF_G16) {
+      const uint16* Src = (const uint16*)Voxels + First;
+      for (int64 i = 0; i < SliceVoxels; i++) {
+        Dst[i] = Src[i] / 65535.0f;
+      }
+    } else {
+      FMemory::Memcpy(Dst, (const float*)Voxels + First, SliceVoxels * sizeof(float));
+    }
+  });
+  return true;
+}
+
+float FLightPropagationVolume::SampleOpacity(const FVector& UVW, const float StepSize) const {
+  // Texel coordinates of the clamped UVW, texel centers are at whole numbers.
+  const float X = FMath::Clamp(UVW.X, 0.0f, 1.0f) * Dimensions.X - 0.5f;
+  const float Y = FMath::Clamp(UVW.Y, 0.0f, 1.0f) * Dimensions.Y - 0.5f;
+  const float Z = FMath::Clamp(UVW.Z, 0.0f, 1.0f) * Dimensions.Z - 0.5f;
+  const int32 X0 = FMath::FloorToInt(X);
+  const int32 Y0 = FMath::FloorToInt(Y);
+  const int32 Z0 = FMath::FloorToInt(Z);
+  const float FX = X - X0;
+  const float FY = Y - Y0;
+  const float FZ = Z - Z0;
+
+  // The volume sampler's border color is 0.
+  const float* Voxels = Intensities.GetData();
+  auto Voxel = [this, Voxels](const int32 VX, const int32 VY, const int32 VZ) {
+    if (VX < 0 || VY < 0 || VZ < 0 || VX >= Dimensions.X || VY >= Dimensions.Y ||
+        VZ >= Dimensions.Z) {
+      return 0.0f;
+    }
+    return Voxels[((int64)VZ * Dimensions.Y + VY) * Dimensions.X + VX];
+  };
+  const float Front =
+      FMath::Lerp(FMath::Lerp(Voxel(X0, Y0, Z0), Voxel(X0 + 1, Y0, Z0), FX),
+                  FMath::Lerp(Voxel(X0, Y0 + 1, Z0), Voxel(X0 + 1, Y0 + 1, Z0), FX), FY);
+  const float Back =
+      FMath::Lerp(FMath::Lerp(Voxel(X0, Y0, Z0 + 1), Voxel(X0 + 1, Y0, Z0 + 1), FX),
+                  FMath::Lerp(Voxel(X0, Y0 + 1, Z0 + 1), Voxel(X0 + 1, Y0 + 1, Z0 + 1), FX), FY);
+  const float Intensity = FMath::Lerp(Front, Back, FZ);
+
+  // RemapIntensity, then a linear, clamped lookup into the transfer function.
+  const float Remapped = FMath::Clamp(
+      (Intensity - IntensityDomain.X) / (IntensityDomain.Y - IntensityDomain.X), 0.0f, 1.0f);
+  const float T = Remapped * TFOpacities.Num() - 0.5f;
+  const int32 T0 = FMath::FloorToInt(T);
+  const int32 LastTexel = TFOpacities.Num() - 1;
+  const float Opacity = FMath::Lerp(TFOpacities[FMath::Clamp(T0, 0, LastTexel)],
+                                    TFOpacities[FMath::Clamp(T0 + 1, 0, LastTexel)], T - T0);
+
+  // CorrectForStepSize. Most of a volume is usually transparent, skip the pow there.
+  if (Opacity <= 0.0f) {
+    return 0.0f;
+  }
+  return 1.0f - FMath::Pow(1.0f - Opacity, StepSize * LIGHT_PROPAGATION_FIXED_DENSITY);
+}
+
+// Computes Count texels of the write buffer. Row0 and Row1 point to the read buffer texels below
+// and left of the samples, Wx and Wy are the bilinear weights of the texels to the right and above.
+// The sampled light is attenuated by Opacities. The scalar loop computes exactly the same thing as
+// the vector one.
+static void PropagateRow(const float* Row0, const float* Row1, const float* Opacities, float* Out,
+                         const int32 Count, const float Wx, const float Wy) {
+  const float W00 = (1.0f - Wx) * (1.0f - Wy);
+  const float W10 = Wx * (1.0f - Wy);
+  const float W01 = (1.0f - Wx) * Wy;
+  const float W11 = Wx * Wy;
+  int32 i = 0;
+#if LIGHT_PROPAGATION_SSE
+  const __m128 V00 = _mm_set1_ps(W00);
+  const __m128 V10 = _mm_set1_ps(W10);
+  const __m128 V01 = _mm_set1_ps(W01);
+  const __m128 V11 = _mm_set1_ps(W11);
+  const __m128 One = _mm_set1_ps(1.0f);
+  for (; i + 4 <= Count; i += 4) {
+    __m128 Light = _mm_mul_ps(_mm_loadu_ps(Row0 + i), V00);
+    Light = _mm_add_ps(Light, _mm_mul_ps(_mm_loadu_ps(Row0 + i + 1), V10));
+    Light = _mm_add_ps(Light, _mm_mul_ps(_mm_loadu_ps(Row1 + i), V01));
+    Light = _mm_add_ps(Light, _mm_mul_ps(_mm_loadu_ps(Row1 + i + 1), V11));
+    _mm_storeu_ps(Out + i, _mm_mul_ps(Light, _mm_sub_ps(One, _mm_loadu_ps(Opacities + i))));
+  }
+#endif
+  for (; i < Count; i++) {
+    float Light = Row0[i] * W00;
+    Light += Row0[i + 1] * W10;
+    Light += Row1[i] * W01;
+    Light += Row1[i + 1] * W11;
+    Out[i] = Light * (1.0f - Opacities[i]);
+  }
+}
+
+// State of one light in a sweep - its propagation and its read/write buffers.
+struct FSweptLight {
+  const FDirLightAxisPropagation* Propagation;
+  // Every texel samples the read buffer at the same offset from itself, split into whole texels
+  // and bilinear weights.
+  int32 ShiftX0;
+  int32 ShiftY0;
+  float Wx;
+  float Wy;
+  // The buffer rows are padded with the light entering from outside (the border color of the GPU
+  // read buffer sampler) and there's one more row of it, so rows can be sampled without checks.
+  int32 Pad;
+  int32 PaddedX;
+  TArray<float> Buffers[2];
+};
+
+// Propagates all lights entering the volume through the same face in one sweep, one slice after
+// another, like AddDirLightToSingleLightVolume_RenderThread dispatches AddDirLightShader.usf for
+// a single light. Every light has its own buffers and samples the volume at its own offsets, but
+// the light volume is only read and written once per voxel for all of them. Removed lights have a
+// negative light alpha, which the propagation carries through to the light volume.
+static void PropagateGroup(const FLightPropagationVolume& Volume, float* LightVolume,
+                           const FIntVector LightVolumeDimensions,
+                           const TArray<FDirLightAxisPropagation>& Group,
+                           const FClippingPlaneParameters& LocalClipping) {
+  // Dimensions, permutation and loop are the same for all lights entering through a face.
+  const FDirLightAxisPropagation& Sweep = Group[0];
+  const FIntVector TransposedDimensions = Sweep.TransposedDimensions;
+  const int32 SizeY = TransposedDimensions.Y;
+  const int32 NumLights = Group.Num();
+
+  // The rows of the permutation matrix map buffer X, buffer Y and the slice into the light volume.
+  FVector Permuted[3];
+  int64 Strides[3];
+  for (int32 Row = 0; Row < 3; Row++) {
+    Permuted[Row] = FVector(Sweep.PermutationMatrix.M[Row][0], Sweep.PermutationMatrix.M[Row][1],
+                            Sweep.PermutationMatrix.M[Row][2]);
+    Strides[Row] = int64(Permuted[Row].X) + int64(Permuted[Row].Y) * LightVolumeDimensions.X +
+                   int64(Permuted[Row].Z) * LightVolumeDimensions.X * LightVolumeDimensions.Y;
+  }
+  const FVector Resolution(LightVolumeDimensions);
+
+  // The shader weights opacity by clamp(0.5 + VoxelDistance * sign(Distance) / sqrt(3)), where
+  // VoxelDistance is the distance to the clipping plane in voxels. That's linear in Distance.
+  const float ClipScale =
+      LIGHT_PROPAGATION_ONE_OVER_SQRT_3 * (LocalClipping.Direction * Resolution).Size();
+
+  TArray<FSweptLight> Lights;
+  Lights.SetNum(NumLights);
+  for (int32 i = 0; i < NumLights; i++) {
+    FSweptLight& Light = Lights[i];
+    Light.Propagation = &Group[i];
+    const float ShiftX = Group[i].UVOffset.X * TransposedDimensions.X;
+    const float ShiftY = Group[i].UVOffset.Y * TransposedDimensions.Y;
+    Light.ShiftX0 = FMath::FloorToInt(ShiftX);
+    Light.ShiftY0 = FMath::FloorToInt(ShiftY);
+    Light.Wx = ShiftX - Light.ShiftX0;
+    Light.Wy = ShiftY - Light.ShiftY0;
+    Light.Pad = FMath::Abs(Light.ShiftX0) + 1;
+    Light.PaddedX = TransposedDimensions.X + 2 * Light.Pad;
+    Light.Buffers[0].Init(Group[i].LightAlpha, Light.PaddedX * (SizeY + 1));
+    Light.Buffers[1].Init(Group[i].LightAlpha, Light.PaddedX * (SizeY + 1));
+  }
+  TArray<float> Opacities;
+  Opacities.SetNumUninitialized(TransposedDimensions.X * SizeY);
+
+  int32 ReadIndex = 0;
+  for (int Slice = Sweep.Start; Slice != Sweep.Stop; Slice += Sweep.AxisDirection) {
+    ParallelFor(SizeY, [&](int32 Y) {
+      float* RowOpacities = Opacities.GetData() + (int64)Y * TransposedDimensions.X;
+      const FVector RowPosition = Permuted[1] * Y + Permuted[2] * Slice;
+      const int64 RowIndex = Strides[1] * Y + Strides[2] * Slice;
+      TArray<const float*, TInlineAllocator<MAX_FUSED_DIR_LIGHTS>> WriteRows;
+
+      for (FSweptLight& Light : Lights) {
+        const FDirLightAxisPropagation& Propagation = *Light.Propagation;
+        for (int32 X = 0; X < TransposedDimensions.X; X++) {
+          const FVector SampleUVW =
+              (RowPosition + Permuted[0] * X + 0.5f) / Resolution + Propagation.UVWOffset;
+          const float Distance =
+              FVector::DotProduct(SampleUVW - LocalClipping.Center, LocalClipping.Direction);
+          const float AlphaWeight = FMath::Clamp(0.5f + Distance * ClipScale, 0.0f, 1.0f);
+          RowOpacities[X] = 0.0f;
+          if (AlphaWeight > 0.0f) {
+            RowOpacities[X] = Volume.SampleOpacity(SampleUVW, Propagation.StepSize) * AlphaWeight;
+          }
+        }
+
+        const float* Read = Light.Buffers[ReadIndex].GetData();
+        auto ReadRow = [&](const int32 ReadY) {
+          const int32 Row = (ReadY >= 0 && ReadY < SizeY) ? ReadY : SizeY;
+          return Read + (int64)Row * Light.PaddedX + Light.Pad + Light.ShiftX0;
+        };
+        float* WriteRow = Light.Buffers[1 - ReadIndex].GetData() + (int64)Y * Light.PaddedX +
+                          Light.Pad;
+        PropagateRow(ReadRow(Y + Light.ShiftY0), ReadRow(Y + Light.ShiftY0 + 1), RowOpacities,
+                     WriteRow, TransposedDimensions.X, Light.Wx, Light.Wy);
+        WriteRows.Add(WriteRow);
+      }
+
+      for (int32 X = 0; X < TransposedDimensions.X; X++) {
+        float LightChange = 0.0f;
+        for (const float* WriteRow : WriteRows) {
+          // Ignore changes smaller than 0.001 like the shader does.
+          if (FMath::Abs(WriteRow[X]) > 1e-3f) {
+            LightChange += WriteRow[X];
+          }
+        }
+        if (LightChange != 0.0f) {
+          LightVolume[RowIndex + Strides[0] * X] += LightChange;
+        }
+      }
+    });
+    ReadIndex = 1 - ReadIndex;
+  }
+}
+
+// Propagates grouped lights (see GroupDirLightPropagations), one sweep per face.
+static void PropagateGroups(const FLightPropagationVolume& Volume, float* LightVolume,
+                            const FIntVector LightVolumeDimensions,
+                            const TArray<FDirLightAxisPropagation> Groups[6],
+                            const FRaymarchWorldParameters& WorldParameters) {
+  if (!LightVolume || Volume.Intensities.Num() == 0 || Volume.TFOpacities.Num() == 0) {
+    return;
+  }
+  const FClippingPlaneParameters LocalClippingParameters =
+      GetLocalClippingParameters(WorldParameters);
+  for (int32 Face = 0; Face < 6; Face++) {
+    if (Groups[Face].Num() > 0) {
+      PropagateGroup(Volume, LightVolume, LightVolumeDimensions, Groups[Face],
+                     LocalClippingParameters);
+    }
+  }
+}
+
+void AddDirLightsToLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                   const FIntVector LightVolumeDimensions,
+                                   const TArray<FDirLightParameters>& LightParameters,
+                                   const bool Added,
+                                   const FRaymarchWorldParameters WorldParameters) {
+  TArray<FDirLightAxisPropagation> Groups[6];
+  GroupDirLightPropagations(LightParameters, Added, LightVolumeDimensions, WorldParameters, Groups);
+  PropagateGroups(Volume, LightVolume, LightVolumeDimensions, Groups, WorldParameters);
+}
+
+void ChangeDirLightInLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                     const FIntVector LightVolumeDimensions,
+                                     const FDirLightParameters OldLightParameters,
+                                     const FDirLightParameters NewLightParameters,
+                                     const FRaymarchWorldParameters WorldParameters) {
+  TArray<FDirLightAxisPropagation> Groups[6];
+  GroupDirLightPropagations({OldLightParameters}, false, LightVolumeDimensions, WorldParameters,
+                            Groups);
+  GroupDirLightPropagations({NewLightParameters}, true, LightVolumeDimensions, WorldParameters,
+                            Groups);
+  PropagateGroups(Volume, LightVolume, LightVolumeDimensions, Groups, WorldParameters);
+}
+
+void AddDirLightToLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                  const FIntVector LightVolumeDimensions,
+                                  const FDirLightParameters LightParameters, const bool Added,
+                                  const FRaymarchWorldParameters WorldParameters) {
+  AddDirLightsToLightVolume_Cpu(Volume, LightVolume, LightVolumeDimensions,
+                                TArray<FDirLightParameters>{LightParameters}, Added,
+                                WorldParameters);
+}
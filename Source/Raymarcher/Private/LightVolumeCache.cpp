@@ -0,0 +1,329 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "LightVolumeCache.h"
+#include "Async/Async.h"
+#include "Misc/Crc.h"
+#include "RenderingThread.h"
+#include "TextureHelperFunctions.h"
+#include "VolumeCodec.h"
+
+static int32 Quantize(const float Value, const float Steps) {
+  return FMath::RoundToInt(Value * Steps);
+}
+
+static FIntVector Quantize(const FVector& Value, const float Steps) {
+  return FIntVector(Quantize(Value.X, Steps), Quantize(Value.Y, Steps), Quantize(Value.Z, Steps));
+}
+
+// A light's quantized local direction (X, Y, Z) and intensity.
+struct FQuantizedLight {
+  int32 Values[4];
+
+  bool operator<(const FQuantizedLight& Other) const {
+    for (int32 i = 0; i < 4; i++) {
+      if (Values[i] != Other.Values[i]) {
+        return Values[i] < Other.Values[i];
+      }
+    }
+    return false;
+  }
+};
+
+static int64 GetUncompressedBytes(const FIntVector Dimensions) {
+  return (int64)Dimensions.X * Dimensions.Y * Dimensions.Z * sizeof(float);
+}
+
+uint32 HashTransferFunction(UTexture2D* TransferFunction,
+                            const FTransferFunctionRangeParameters& TFRange) {
+  uint32 Hash = 0;
+  if (TransferFunction) {
+    FTexturePlatformData* PlatformData = TransferFunction->PlatformData;
+    if (PlatformData && PlatformData->Mips.Num() > 0 &&
+        PlatformData->Mips[0].BulkData.GetBulkDataSize() > 0) {
+      // Hashing the texels notices transfer functions changed in place (see ColorCurveToTexture).
+      FByteBulkData& BulkData = PlatformData->Mips[0].BulkData;
+      Hash = FCrc::MemCrc32(BulkData.LockReadOnly(), BulkData.GetBulkDataSize());
+      BulkData.Unlock();
+    } else {
+      Hash = GetTypeHash(TransferFunction->GetPathName());
+    }
+  }
+  Hash = HashCombine(Hash, GetTypeHash(TFRange.IntensityDomain));
+  Hash = HashCombine(Hash, GetTypeHash(TFRange.Cutoffs));
+  return HashCombine(Hash, ((uint32)TFRange.LowCutMode << 8) | (uint32)TFRange.HighCutMode);
+}
+
+FLightVolumeCacheKey FLightVolumeCacheKey::Make(const FBasicRaymarchRenderingResources& Resources,
+                                                const TArray<FDirLightParameters>& LightParameters,
+                                                const FRaymarchWorldParameters& WorldParameters) {
+  FLightVolumeCacheKey Key;
+  if (Resources.VolumeTextureRef) {
+    Key.VolumeId = FName(*Resources.VolumeTextureRef->GetPathName());
+  }
+  if (Resources.ALightVolumeRef) {
+    Key.LightVolumeDimensions =
+        FIntVector(Resources.ALightVolumeRef->GetSizeX(), Resources.ALightVolumeRef->GetSizeY(),
+                   Resources.ALightVolumeRef->GetSizeZ());
+  }
+  Key.TransferFunctionHash =
+      HashTransferFunction(Resources.TFTextureRef, Resources.TFRangeParameters);
+
+  const FClippingPlaneParameters LocalClipping = GetLocalClippingParameters(WorldParameters);
+  Key.ClippingCenter = Quantize(LocalClipping.Center, LIGHT_VOLUME_CACHE_CLIPPING_STEPS);
+  Key.ClippingDirection = Quantize(LocalClipping.Direction, LIGHT_VOLUME_CACHE_CLIPPING_STEPS);
+  Key.Scale =
+      Quantize(WorldParameters.VolumeTransform.GetScale3D(), LIGHT_VOLUME_CACHE_SCALE_STEPS);
+
+  TArray<FQuantizedLight> LocalLights;
+  for (const FDirLightParameters& Light : LightParameters) {
+    FDirLightParameters LocalLight;
+    FMajorAxes LocalAxes;
+    GetLocalLightParamsAndAxes(Light, WorldParameters.VolumeTransform, LocalLight, LocalAxes);
+    const FIntVector Direction =
+        Quantize(LocalLight.LightDirection, LIGHT_VOLUME_CACHE_DIRECTION_STEPS);
+    LocalLights.Add({{Direction.X, Direction.Y, Direction.Z,
+                      Quantize(LocalLight.LightIntensity, LIGHT_VOLUME_CACHE_INTENSITY_STEPS)}});
+  }
+  LocalLights.Sort();
+  Key.Lights.Reserve(LocalLights.Num() * 4);
+  for (const FQuantizedLight& Light : LocalLights) {
+    Key.Lights.Append(Light.Values, 4);
+  }
+  return Key;
+}
+
+bool FLightVolumeCacheKey::operator==(const FLightVolumeCacheKey& Other) const {
+  return VolumeId == Other.VolumeId && LightVolumeDimensions == Other.LightVolumeDimensions &&
+         TransferFunctionHash == Other.TransferFunctionHash &&
+         ClippingCenter == Other.ClippingCenter && ClippingDirection == Other.ClippingDirection &&
+         Scale == Other.Scale && Lights == Other.Lights;
+}
+
+uint32 GetTypeHash(const FLightVolumeCacheKey& Key) {
+  uint32 Hash = HashCombine(GetTypeHash(Key.VolumeId), Key.TransferFunctionHash);
+  Hash = HashCombine(Hash, GetTypeHash(Key.LightVolumeDimensions));
+  Hash = HashCombine(Hash, GetTypeHash(Key.ClippingCenter));
+  Hash = HashCombine(Hash, GetTypeHash(Key.ClippingDirection));
+  Hash = HashCombine(Hash, GetTypeHash(Key.Scale));
+  return HashCombine(Hash, FCrc::MemCrc32(Key.Lights.GetData(), Key.Lights.Num() * sizeof(int32)));
+}
+
+FLightVolumeCache::FLightVolumeCache(const int64 InBudgetBytes,
+                                     const ELightVolumeCacheResidency InResidency)
+  : BudgetBytes(InBudgetBytes),
+    Residency(InResidency),
+    PendingEncodes(MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>()) {
+}
+
+FLightVolumeCache& FLightVolumeCache::Get() {
+  static FLightVolumeCache Cache;
+  return Cache;
+}
+
+void FLightVolumeCache::Store(const FLightVolumeCacheKey& Key,
+                              const FBasicRaymarchRenderingResources& Resources) {
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  if (!LightVolume || !LightVolume->Resource || !LightVolume->Resource->TextureRHI) {
+    MY_LOG("Can't cache the light volume, it has no resource.");
+    return;
+  }
+  // Restore only accepts float light volumes, don't cache anything it couldn't put back.
+  if (!LightVolume->PlatformData || LightVolume->PlatformData->PixelFormat != PF_R32_FLOAT) {
+    MY_LOG("Can't cache the light volume, it isn't a float volume texture.");
+    return;
+  }
+
+  FEntryPtr Entry = MakeShared<FEntry, ESPMode::ThreadSafe>();
+  Entry->Residency = Residency;
+  Entry->Dimensions =
+      FIntVector(LightVolume->GetSizeX(), LightVolume->GetSizeY(), LightVolume->GetSizeZ());
+  Entry->Bytes.Set(GetUncompressedBytes(Entry->Dimensions));
+  if (Residency == ELightVolumeCacheResidency::Cpu && Entry->Bytes.GetValue() > MAX_uint32) {
+    MY_LOG("Can't cache the light volume in system memory, it's too big to be read back.");
+    return;
+  }
+
+  if (Residency == ELightVolumeCacheResidency::Cpu) {
+    PendingEncodes->Increment();
+  }
+  // Call the actual rendering code on RenderThread.
+  ENQUEUE_RENDER_COMMAND(CaptureCommand)
+  ([Entry, Resources, PendingEncodes = PendingEncodes](FRHICommandListImmediate& RHICmdList) {
+    FRHITexture3D* Source = Resources.ALightVolumeRef->Resource->TextureRHI->GetTexture3D();
+    const FIntVector& Dimensions = Entry->Dimensions;
+    if (Entry->Residency == ELightVolumeCacheResidency::Gpu) {
+      FRHIResourceCreateInfo CreateInfo(FClearValueBinding::Black);
+      Entry->Texture =
+          RHICreateTexture3D(Dimensions.X, Dimensions.Y, Dimensions.Z, PF_R32_FLOAT, 1,
+                             TexCreate_ShaderResource | TexCreate_UAV, CreateInfo);
+      CopyVolumeTexture_RenderThread(RHICmdList, Source, Entry->Texture);
+      Entry->bReady = true;
+      return;
+    }
+
+    TArray<float> Voxels;
+    Voxels.SetNumUninitialized(Dimensions.X * Dimensions.Y * Dimensions.Z);
+    if (!ReadVolumeTexture_RenderThread(RHICmdList, Source, Voxels.GetData())) {
+      Entry->Bytes.Set(0);
+      Entry->bReady = true;
+      PendingEncodes->Decrement();
+      return;
+    }
+    // Only the readback has to wait for the GPU, compressing doesn't hold up the render thread.
+    Async<void>(EAsyncExecution::ThreadPool,
+                [Entry, PendingEncodes, Voxels = MoveTemp(Voxels)]() {
+                  EncodeVolumeLossless((const uint8*)Voxels.GetData(), Entry->Dimensions,
+                                       sizeof(float), Entry->Encoded);
+                  Entry->Bytes.Set(Entry->Encoded.Num());
+                  Entry->bReady = true;
+                  PendingEncodes->Decrement();
+                });
+  });
+
+  Add(Key, Entry);
+}
+
+bool FLightVolumeCache::Restore(const FLightVolumeCacheKey& Key,
+                                const FBasicRaymarchRenderingResources& Resources) {
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  FEntryPtr Entry = Find(Key);
+  if (!Entry || !LightVolume || !LightVolume->Resource || !LightVolume->PlatformData ||
+      LightVolume->PlatformData->PixelFormat != PF_R32_FLOAT ||
+      Entry->Dimensions != FIntVector(LightVolume->GetSizeX(), LightVolume->GetSizeY(),
+                                      LightVolume->GetSizeZ())) {
+    return false;
+  }
+
+  if (Entry->Residency == ELightVolumeCacheResidency::Gpu) {
+    ENQUEUE_RENDER_COMMAND(CaptureCommand)
+    ([Entry, Resources](FRHICommandListImmediate& RHICmdList) {
+      CopyVolumeTexture_RenderThread(
+          RHICmdList, Entry->Texture,
+          Resources.ALightVolumeRef->Resource->TextureRHI->GetTexture3D());
+    });
+    return true;
+  }
+
+  TUniquePtr<uint8> Voxels(new uint8[GetUncompressedBytes(Entry->Dimensions)]);
+  if (!Decode(*Entry, (float*)Voxels.Get())) {
+    return false;
+  }
+  // Format and dimensions stay the same, so the light volume is uploaded straight from the buffer.
+  return UpdateVolumeTextureAsset(LightVolume, PF_R32_FLOAT, Entry->Dimensions, MoveTemp(Voxels),
+                                  false, false, LightVolume->bUAVCompatible);
+}
+
+void FLightVolumeCache::StoreVoxels(const FLightVolumeCacheKey& Key, const float* LightVolume,
+                                    const FIntVector Dimensions) {
+  FEntryPtr Entry = MakeShared<FEntry, ESPMode::ThreadSafe>();
+  Entry->Residency = ELightVolumeCacheResidency::Cpu;
+  Entry->Dimensions = Dimensions;
+  if (!EncodeVolumeLossless((const uint8*)LightVolume, Dimensions, sizeof(float),
+                            Entry->Encoded)) {
+    return;
+  }
+  Entry->Bytes.Set(Entry->Encoded.Num());
+  Entry->bReady = true;
+  Add(Key, Entry);
+}
+
+bool FLightVolumeCache::RestoreVoxels(const FLightVolumeCacheKey& Key, float* OutLightVolume,
+                                      const FIntVector Dimensions) {
+  FEntryPtr Entry = Find(Key);
+  if (!Entry || Entry->Dimensions != Dimensions) {
+    return false;
+  }
+  if (Entry->Residency == ELightVolumeCacheResidency::Gpu) {
+    // Read on the render thread, the flush below waits for it.
+    bool bRead = false;
+    ENQUEUE_RENDER_COMMAND(CaptureCommand)
+    ([Entry, OutLightVolume, &bRead](FRHICommandListImmediate& RHICmdList) {
+      bRead = Entry->Texture.IsValid() &&
+              ReadVolumeTexture_RenderThread(RHICmdList, Entry->Texture, OutLightVolume);
+    });
+    FlushRenderingCommands();
+    return bRead;
+  }
+  return Decode(*Entry, OutLightVolume);
+}
+
+bool FLightVolumeCache::Decode(FEntry& Entry, float* OutLightVolume) {
+  WaitUntilReady(Entry);
+  return DecodeVolumeLossless(Entry.Encoded, (uint8*)OutLightVolume);
+}
+
+void FLightVolumeCache::WaitUntilReady(FEntry& Entry) {
+  if (Entry.bReady) {
+    return;
+  }
+  // The render thread hasn't read the light volume back yet, or it's still being compressed.
+  FlushRenderingCommands();
+  while (!Entry.bReady) {
+    FPlatformProcess::Sleep(0.001f);
+  }
+}
+
+void FLightVolumeCache::RemoveVolume(const FName VolumeId) {
+  for (int32 i = LruOrder.Num() - 1; i >= 0; i--) {
+    if (LruOrder[i].VolumeId == VolumeId) {
+      Entries.Remove(LruOrder[i]);
+      LruOrder.RemoveAt(i);
+    }
+  }
+}
+
+void FLightVolumeCache::Empty() {
+  // Compressing light volumes on the thread pool must not outlive the module - including the ones
+  // of entries that were evicted or replaced while they were being compressed.
+  if (PendingEncodes->GetValue() > 0) {
+    FlushRenderingCommands();
+    while (PendingEncodes->GetValue() > 0) {
+      FPlatformProcess::Sleep(0.001f);
+    }
+  }
+  Entries.Empty();
+  LruOrder.Empty();
+}
+
+void FLightVolumeCache::SetBudget(const int64 InBudgetBytes) {
+  BudgetBytes = InBudgetBytes;
+  EvictToBudget();
+}
+
+int64 FLightVolumeCache::GetUsedBytes() const {
+  int64 UsedBytes = 0;
+  for (const TPair<FLightVolumeCacheKey, FEntryPtr>& Entry : Entries) {
+    UsedBytes += Entry.Value->Bytes.GetValue();
+  }
+  return UsedBytes;
+}
+
+void FLightVolumeCache::Add(const FLightVolumeCacheKey& Key, const FEntryPtr& Entry) {
+  LruOrder.Remove(Key);
+  LruOrder.Add(Key);
+  Entries.Add(Key, Entry);
+  EvictToBudget();
+}
+
+FLightVolumeCache::FEntryPtr FLightVolumeCache::Find(const FLightVolumeCacheKey& Key) {
+  FEntryPtr* Entry = Entries.Find(Key);
+  if (!Entry) {
+    return nullptr;
+  }
+  LruOrder.Remove(Key);
+  LruOrder.Add(Key);
+  return *Entry;
+}
+
+void FLightVolumeCache::EvictToBudget() {
+  // Light volumes read back from the GPU count with their uncompressed size until they're
+  // compressed, so storing one may evict more than it ends up needing, but never too little.
+  int64 UsedBytes = GetUsedBytes();
+  while (UsedBytes > BudgetBytes && LruOrder.Num() > 1) {
+    FEntryPtr Evicted;
+    Entries.RemoveAndCopyValue(LruOrder[0], Evicted);
+    UsedBytes -= Evicted->Bytes.GetValue();
+    LruOrder.RemoveAt(0);
+  }
+}
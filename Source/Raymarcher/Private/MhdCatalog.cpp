@@ -0,0 +1,162 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "MhdCatalog.h"
+#include "FileHelper.h"
+#include "Paths.h"
+#include "PlatformFilemanager.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+// "MHDC" - first four bytes of every catalog file.
+#define MHD_CATALOG_MAGIC 0x4D484443
+// Increase whenever FMhdCatalogEntry serialization changes, older catalogs are then rebuilt.
+#define MHD_CATALOG_VERSION 1
+
+FMhdCatalogEntry::FMhdCatalogEntry(const FString& FileName, const FDateTime ModificationTime,
+                                   const int64 FileSize, const FMhdInfo& Info)
+  : MhdFileName(FileName),
+    ModificationTicks(ModificationTime.GetTicks()),
+    HeaderFileSize(FileSize),
+    Dimensions(Info.Dimensions),
+    Spacing(Info.Spacing),
+    ElementType(Info.ElementType),
+    NumChannels(Info.NumChannels),
+    CompressedData(Info.CompressedData) {
+  DataSize = (int64)Dimensions.X * Dimensions.Y * FMath::Max(Dimensions.Z, 1) * NumChannels *
+             FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+}
+
+FArchive& operator<<(FArchive& Ar, FMhdCatalogEntry& Entry) {
+  uint8 ElementType = uint8(Entry.ElementType);
+  Ar << Entry.MhdFileName << Entry.ModificationTicks << Entry.HeaderFileSize << Entry.Dimensions
+     << Entry.Spacing << ElementType << Entry.NumChannels << Entry.CompressedData
+     << Entry.DataSize;
+  Entry.ElementType =
+      EMhdElementType(FMath::Min<uint8>(ElementType, uint8(EMhdElementType::MET_UNKNOWN)));
+  return Ar;
+}
+
+bool FMhdCatalog::LoadFromFile(const FString CatalogFileName) {
+  Entries.Empty();
+  TArray<uint8> Bytes;
+  if (!FFileHelper::LoadFileToArray(Bytes, *CatalogFileName, FILEREAD_Silent)) {
+    return false;
+  }
+
+  FMemoryReader Reader(Bytes);
+  uint32 Magic = 0;
+  uint32 Version = 0;
+  int32 NumEntries = 0;
+  Reader << Magic << Version << NumEntries;
+  if (Reader.IsError() || Magic != MHD_CATALOG_MAGIC || Version != MHD_CATALOG_VERSION) {
+    return false;
+  }
+
+  Entries.Reserve(NumEntries);
+  for (int32 i = 0; i < NumEntries && !Reader.IsError(); i++) {
+    FMhdCatalogEntry Entry;
+    Reader << Entry;
+    Entries.Add(Entry.MhdFileName, MoveTemp(Entry));
+  }
+  if (Reader.IsError()) {
+    UE_LOG(LogTemp, Warning, TEXT("MHD catalog %s is truncated, ignoring it."), *CatalogFileName);
+    Entries.Empty();
+    return false;
+  }
+  return true;
+}
+
+bool FMhdCatalog::SaveToFile(const FString CatalogFileName) const {
+  TArray<uint8> Bytes;
+  FMemoryWriter Writer(Bytes);
+  uint32 Magic = MHD_CATALOG_MAGIC;
+  uint32 Version = MHD_CATALOG_VERSION;
+  int32 NumEntries = Entries.Num();
+  Writer << Magic << Version << NumEntries;
+  for (const auto& Pair : Entries) {
+    Writer << const_cast<FMhdCatalogEntry&>(Pair.Value);
+  }
+  return FFileHelper::SaveArrayToFile(Bytes, *CatalogFileName);
+}
+
+// Collects the .mhd files of a directory together with their stat data, in the same pass that
+// lists the directory.
+class FMhdStatVisitor : public IPlatformFile::FDirectoryStatVisitor {
+public:
+  TArray<TPair<FString, FFileStatData>> Files;
+
+  virtual bool Visit(const TCHAR* FilenameOrDirectory, const FFileStatData& StatData) override {
+    if (!StatData.bIsDirectory && FPaths::GetExtension(FilenameOrDirectory) == TEXT("mhd")) {
+      Files.Emplace(FilenameOrDirectory, StatData);
+    }
+    return true;
+  }
+};
+
+int32 FMhdCatalog::UpdateFromDirectory(const FString Directory, const bool bRecursive) {
+  FString FullDirectory = FPaths::ConvertRelativePathToFull(Directory);
+  FPaths::NormalizeDirectoryName(FullDirectory);
+
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  FMhdStatVisitor Visitor;
+  if (bRecursive) {
+    PlatformFile.IterateDirectoryStatRecursively(*FullDirectory, Visitor);
+  } else {
+    PlatformFile.IterateDirectoryStat(*FullDirectory, Visitor);
+  }
+
+  // Find the headers that are new or changed since they were cataloged.
+  TSet<FString> FoundFiles;
+  TArray<int32> ChangedFiles;
+  for (int32 i = 0; i < Visitor.Files.Num(); i++) {
+    const FString& FileName = Visitor.Files[i].Key;
+    const FFileStatData& StatData = Visitor.Files[i].Value;
+    FoundFiles.Add(FileName);
+    const FMhdCatalogEntry* Entry = Entries.Find(FileName);
+    if (!Entry || Entry->ModificationTicks != StatData.ModificationTime.GetTicks() ||
+        Entry->HeaderFileSize != StatData.FileSize) {
+      ChangedFiles.Add(i);
+    }
+  }
+
+  // Drop entries of files in this directory which are gone.
+  const FString Prefix = FullDirectory + TEXT("/");
+  for (auto It = Entries.CreateIterator(); It; ++It) {
+    const FString& FileName = It.Key();
+    if (FileName.StartsWith(Prefix) && !FoundFiles.Contains(FileName) &&
+        (bRecursive || !FileName.Mid(Prefix.Len()).Contains(TEXT("/")))) {
+      It.RemoveCurrent();
+    }
+  }
+
+  // Headers are small, so parsing is dominated by opening the files - do it in parallel.
+  TArray<FMhdInfo> ParsedInfos;
+  ParsedInfos.SetNum(ChangedFiles.Num());
+  ParallelFor(ChangedFiles.Num(), [&](int32 Index) {
+    TArray<uint8> Header;
+    if (FFileHelper::LoadFileToArray(Header, *Visitor.Files[ChangedFiles[Index]].Key)) {
+      ParsedInfos[Index] = FMhdInfo::ParseFromBytes(
+          reinterpret_cast<const ANSICHAR*>(Header.GetData()), Header.Num());
+    }
+  });
+
+  for (int32 Index = 0; Index < ChangedFiles.Num(); Index++) {
+    const FString& FileName = Visitor.Files[ChangedFiles[Index]].Key;
+    const FFileStatData& StatData = Visitor.Files[ChangedFiles[Index]].Value;
+    if (ParsedInfos[Index].ParseSuccessful) {
+      Entries.Add(FileName, FMhdCatalogEntry(FileName, StatData.ModificationTime,
+                                             StatData.FileSize, ParsedInfos[Index]));
+    } else {
+      Entries.Remove(FileName);
+      UE_LOG(LogTemp, Warning, TEXT("MHD header %s could not be parsed."), *FileName);
+    }
+  }
+  return ChangedFiles.Num();
+}
+
+const FMhdCatalogEntry* FMhdCatalog::Find(const FString MhdFileName) const {
+  return Entries.Find(FPaths::ConvertRelativePathToFull(MhdFileName));
+}
@@ -0,0 +1,253 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "MhdCompression.h"
+#include "FileHelper.h"
+#include "MhdInfo.h"
+#include "Paths.h"
+#include "RaymarchRendering.h"
+#include "TextureHelperFunctions.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "zlib.h"
+THIRD_PARTY_INCLUDES_END
+
+// zlib counts input and output in 32-bit integers, so feed it at most this many bytes at once.
+#define MAX_ZLIB_BLOCK_SIZE (1024 * 1024 * 1024)
+
+bool InflateInSlabs(
+    const uint8* CompressedData, const int64 CompressedSize, const int64 UncompressedSize,
+    const int64 SlabSize,
+    TFunctionRef<void(uint8* SlabData, int64 SlabOffset, int64 SlabBytes)> ProcessSlab,
+    FVolumeLoadProgress* Progress) {
+  z_stream Stream;
+  FMemory::Memzero(Stream);
+  // 15 + 32 -> maximum window size and automatic zlib/gzip header detection.
+  if (inflateInit2(&Stream, 15 + 32) != Z_OK) {
+    return false;
+  }
+
+  TUniquePtr<uint8[]> Slab(new uint8[FMath::Min(SlabSize, UncompressedSize)]);
+  int64 InputOffset = 0;
+  int64 OutputOffset = 0;
+  int64 SlabFill = 0;
+  bool bFailed = false;
+  bool bCanceled = false;
+  if (Progress) {
+    Progress->Start(UncompressedSize);
+  }
+
+  while (OutputOffset < UncompressedSize) {
+    if (Stream.avail_in == 0 && InputOffset < CompressedSize) {
+      const int64 InputBytes = FMath::Min<int64>(CompressedSize - InputOffset, MAX_ZLIB_BLOCK_SIZE);
+      Stream.next_in = const_cast<Bytef*>(CompressedData + InputOffset);
+      Stream.avail_in = uInt(InputBytes);
+      InputOffset += InputBytes;
+    }
+
+    const int64 SlabTarget = FMath::Min(SlabSize, UncompressedSize - OutputOffset);
+    Stream.next_out = Slab.Get() + SlabFill;
+    Stream.avail_out = uInt(SlabTarget - SlabFill);
+
+    const int Result = inflate(&Stream, Z_NO_FLUSH);
+    SlabFill = SlabTarget - Stream.avail_out;
+
+    if (Result == Z_STREAM_END) {
+      // Data written in chunks is several streams back to back, continue with the next one.
+      if (inflateReset(&Stream) != Z_OK) {
+        bFailed = true;
+        break;
+      }
+    } else if (Result == Z_BUF_ERROR) {
+      // No progress possible - fine if we just need more input, an error if there is none left.
+      if (Stream.avail_in == 0 && InputOffset >= CompressedSize) {
+        bFailed = true;
+        break;
+      }
+    } else if (Result != Z_OK) {
+      bFailed = true;
+      break;
+    }
+
+    if (SlabFill == SlabTarget) {
+      ProcessSlab(Slab.Get(), OutputOffset, SlabFill);
+      OutputOffset += SlabFill;
+      if (Progress && !Progress->Advance(SlabFill)) {
+        bCanceled = true;
+        break;
+      }
+      SlabFill = 0;
+    }
+  }
+
+  inflateEnd(&Stream);
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return false;
+  }
+  if (bFailed) {
+    MY_LOG("Decompressing data failed - file is corrupt or truncated.");
+  }
+  return !bFailed && OutputOffset == UncompressedSize;
+}
+
+bool InflateChunksInParallel(
+    const uint8* CompressedData, const int64 CompressedSize,
+    const TArray<int64>& CompressedChunkSizes, const int64 ChunkSize, const int64 UncompressedSize,
+    uint8* Destination,
+    TFunctionRef<void(uint8* ChunkData, int64 ChunkOffset, int64 ChunkBytes)> ProcessChunk,
+    FVolumeLoadProgress* Progress) {
+  const int32 NumChunks = CompressedChunkSizes.Num();
+  if (ChunkSize <= 0 || ChunkSize > MAX_ZLIB_BLOCK_SIZE ||
+      NumChunks != FMath::DivideAndRoundUp(UncompressedSize, ChunkSize)) {
+    MY_LOG("Compressed chunk table doesn't match the volume size.");
+    return false;
+  }
+
+  // Prefix sum of the chunk sizes gives the offset of every chunk in the compressed data.
+  TArray<int64> ChunkOffsets;
+  ChunkOffsets.SetNumUninitialized(NumChunks + 1);
+  ChunkOffsets[0] = 0;
+  for (int32 i = 0; i < NumChunks; i++) {
+    ChunkOffsets[i + 1] = ChunkOffsets[i] + CompressedChunkSizes[i];
+  }
+  if (ChunkOffsets[NumChunks] > CompressedSize) {
+    MY_LOG("Compressed chunk table is larger than the compressed data.");
+    return false;
+  }
+
+  if (Progress) {
+    Progress->Start(UncompressedSize);
+  }
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  ParallelFor(NumChunks, [&](int32 Chunk) {
+    if (bFailed || bCanceled) {
+      return;
+    }
+    const int64 ChunkOffset = Chunk * ChunkSize;
+    const int64 ChunkBytes = FMath::Min(ChunkSize, UncompressedSize - ChunkOffset);
+
+    // Without a destination, every chunk is decompressed into a buffer of its own for ProcessChunk.
+    TUniquePtr<uint8[]> ChunkBuffer;
+    uint8* ChunkData = nullptr;
+    if (Destination) {
+      ChunkData = Destination + ChunkOffset;
+    } else {
+      ChunkBuffer.Reset(new uint8[ChunkBytes]);
+      ChunkData = ChunkBuffer.Get();
+    }
+
+    uLongf DecompressedBytes = uLongf(ChunkBytes);
+    const int Result = uncompress(ChunkData, &DecompressedBytes,
+                                  CompressedData + ChunkOffsets[Chunk],
+                                  uLong(CompressedChunkSizes[Chunk]));
+    if (Result != Z_OK || int64(DecompressedBytes) != ChunkBytes) {
+      bFailed = true;
+      return;
+    }
+    ProcessChunk(ChunkData, ChunkOffset, ChunkBytes);
+    if (Progress && !Progress->Advance(ChunkBytes)) {
+      bCanceled = true;
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return false;
+  }
+  if (bFailed) {
+    MY_LOG("Decompressing data failed - file is corrupt or truncated.");
+    return false;
+  }
+  return true;
+}
+
+void CompressInChunks(const uint8* Data, const int64 Size, const int64 ChunkSize,
+                      TArray<TArray<uint8>>& OutChunks, const int32 CompressionLevel) {
+  check(ChunkSize > 0 && ChunkSize <= MAX_ZLIB_BLOCK_SIZE);
+  const int32 NumChunks = int32(FMath::DivideAndRoundUp(Size, ChunkSize));
+  OutChunks.SetNum(NumChunks);
+
+  ParallelFor(NumChunks, [&](int32 Chunk) {
+    const int64 ChunkOffset = Chunk * ChunkSize;
+    const uLong ChunkBytes = uLong(FMath::Min(ChunkSize, Size - ChunkOffset));
+
+    TArray<uint8>& Compressed = OutChunks[Chunk];
+    Compressed.SetNumUninitialized(compressBound(ChunkBytes));
+    uLongf CompressedBytes = Compressed.Num();
+    const int Result = compress2(Compressed.GetData(), &CompressedBytes, Data + ChunkOffset,
+                                 ChunkBytes, CompressionLevel);
+    check(Result == Z_OK);
+    Compressed.SetNum(CompressedBytes, false);
+  });
+}
+
+bool CompressMhdForParallelLoading(const FString MhdFileName, const FString OutMhdFileName,
+                                   const int64 ChunkSize) {
+  FString HeaderString;
+  if (!FFileHelper::LoadFileToString(HeaderString, *MhdFileName)) {
+    MY_LOG("MHD file could not be opened.");
+    return false;
+  }
+  FMhdInfo Info = FMhdInfo::ParseFromString(HeaderString);
+  if (!Info.ParseSuccessful || Info.CompressedData || Info.DataFiles.Num() > 0 ||
+      Info.NumChannels > 1 || Info.HeaderSize != 0) {
+    MY_LOG("Only uncompressed, single-channel, headerless single-file MHDs can be compressed.");
+    return false;
+  }
+
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(Info.ElementType)].SizeBytes;
+  const int64 TotalSize =
+      (int64)Info.Dimensions.X * Info.Dimensions.Y * Info.Dimensions.Z * ElementSize;
+  auto Data = LoadRawFileIntoArray(Info.GetDataFilePath(MhdFileName), TotalSize);
+  if (!Data) {
+    return false;
+  }
+
+  // Keep chunks element-aligned so they can be converted as soon as they are decompressed.
+  const int64 AlignedChunkSize =
+      FMath::Max<int64>(ChunkSize - (ChunkSize % ElementSize), ElementSize);
+  TArray<TArray<uint8>> Chunks;
+  CompressInChunks(Data.Get(), TotalSize, AlignedChunkSize, Chunks);
+
+  const FString ZrawFileName = FPaths::ChangeExtension(OutMhdFileName, TEXT(".zraw"));
+  TUniquePtr<IFileHandle> FileHandle(
+      FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*ZrawFileName));
+  if (!FileHandle) {
+    MY_LOG("Compressed data file could not be written.");
+    return false;
+  }
+  int64 CompressedSize = 0;
+  FString ChunkTable = FString::Printf(TEXT("%lld"), AlignedChunkSize);
+  for (const TArray<uint8>& Chunk : Chunks) {
+    if (!FileHandle->Write(Chunk.GetData(), Chunk.Num())) {
+      MY_LOG("Compressed data file could not be written.");
+      return false;
+    }
+    CompressedSize += Chunk.Num();
+    ChunkTable += FString::Printf(TEXT(" %d"), Chunk.Num());
+  }
+  FileHandle.Reset();
+
+  // Copy the original header, replacing the data file and compression keys. ElementDataFile has to
+  // stay the last line of the header.
+  TArray<FString> Lines;
+  HeaderString.ParseIntoArrayLines(Lines);
+  FString OutHeader;
+  for (const FString& Line : Lines) {
+    FString Key = Line.TrimStart();
+    Key = Key.Left(Key.Find(TEXT("="))).TrimEnd();
+    if (Key != TEXT("ElementDataFile") && !Key.StartsWith(TEXT("CompressedData"))) {
+      OutHeader += Line + TEXT("\n");
+    }
+  }
+  OutHeader += TEXT("CompressedData = True\n");
+  OutHeader += FString::Printf(TEXT("CompressedDataSize = %lld\n"), CompressedSize);
+  OutHeader += TEXT("CompressedDataChunks = ") + ChunkTable + TEXT("\n");
+  OutHeader += TEXT("ElementDataFile = ") + FPaths::GetCleanFilename(ZrawFileName) + TEXT("\n");
+
+  return FFileHelper::SaveStringToFile(OutHeader, *OutMhdFileName);
+}
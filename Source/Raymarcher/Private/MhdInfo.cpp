@@ -4,14 +4,11 @@
 #include "MhdInfo.h"
 #include "FileHelper.h"
 #include "Paths.h"
+#include "RHI.h"
+#include "VoxelConversion.h"
 
 #include "Runtime/Core/Public/Async/ParallelFor.h"
 
-THIRD_PARTY_INCLUDES_START
-#include <sstream>
-#include <string>
-THIRD_PARTY_INCLUDES_START
-
 FMhdElementTypeInfo FMhdInfo::ElementTypeInfo[7] = {
     {"MET_UCHAR", 1, PF_G8, EMhdElementType::MET_UCHAR},
     {"MET_USHORT", 2, PF_G16, EMhdElementType::MET_USHORT},
@@ -21,110 +18,472 @@ FMhdElementTypeInfo FMhdInfo::ElementTypeInfo[7] = {
     {"MET_FLOAT64", 8, PF_R32_FLOAT, EMhdElementType::MET_FLOAT64},
     {"MET_UNKNOWN", 0, PF_Unknown, EMhdElementType::MET_UNKNOWN}};
 
+// Expands an ElementDataFile of the form "Slice%03d.raw Min Max [Step]" into the file names. Only a
+// single %d conversion with an optional zero flag and width is supported.
+static bool ExpandDataFilePattern(const FString &Value, TArray<FString> &OutFiles) {
+  TArray<FString> Tokens;
+  Value.ParseIntoArrayWS(Tokens);
+  if (Tokens.Num() < 3) {
+    return false;
+  }
+  const FString &Pattern = Tokens[0];
+  const int32 Min = FCString::Atoi(*Tokens[1]);
+  const int32 Max = FCString::Atoi(*Tokens[2]);
+  const int32 Step = Tokens.Num() > 3 ? FCString::Atoi(*Tokens[3]) : 1;
+  if (Step == 0 || (Max - Min) / Step < 0) {
+    return false;
+  }
+
+  const int32 PercentIndex = Pattern.Find(TEXT("%"));
+  int32 Index = PercentIndex + 1;
+  const bool bZeroPadded = Index < Pattern.Len() && Pattern[Index] == TEXT('0');
+  int32 Width = 0;
+  while (Index < Pattern.Len() && FChar::IsDigit(Pattern[Index])) {
+    Width = Width * 10 + (Pattern[Index++] - TEXT('0'));
+  }
+  if (Index >= Pattern.Len() || (Pattern[Index] != TEXT('d') && Pattern[Index] != TEXT('i')) ||
+      Pattern.Mid(Index + 1).Contains(TEXT("%"))) {
+    return false;
+  }
+  const FString Prefix = Pattern.Left(PercentIndex);
+  const FString Suffix = Pattern.Mid(Index + 1);
+
+  for (int32 FileIndex = Min; Step > 0 ? FileIndex <= Max : FileIndex >= Max; FileIndex += Step) {
+    FString Number = FString::FromInt(FMath::Abs(FileIndex));
+    while (Number.Len() < Width - (FileIndex < 0 ? 1 : 0)) {
+      Number = (bZeroPadded ? TEXT("0") : TEXT(" ")) + Number;
+    }
+    OutFiles.Add(Prefix + (FileIndex < 0 ? TEXT("-") : TEXT("")) + Number + Suffix);
+  }
+  return true;
+}
+
+// A range of characters inside the header buffer. Header parsing only ever points into the buffer,
+// so tokenizing doesn't allocate - only the values that end up in FMhdInfo as strings do.
+struct FHeaderToken {
+  const ANSICHAR *Begin{nullptr};
+  const ANSICHAR *End{nullptr};
+
+  int32 Len() const { return int32(End - Begin); }
+  bool IsEmpty() const { return Begin == End; }
+
+  bool Equals(const ANSICHAR *Literal) const {
+    // Tokens may contain NUL bytes (binary data after the header), so compare lengths first and
+    // the bytes without stopping at a NUL.
+    const int32 Length = Len();
+    return FCStringAnsi::Strlen(Literal) == Length && FMemory::Memcmp(Begin, Literal, Length) == 0;
+  }
+
+  bool IsTrue() const { return Equals("True") || Equals("TRUE") || Equals("true"); }
+
+  FString ToString() const {
+    FUTF8ToTCHAR Converted(Begin, Len());
+    return FString(Converted.Length(), Converted.Get());
+  }
+};
+
+static bool IsHeaderWhitespace(const ANSICHAR Char) {
+  return Char == ' ' || Char == '\t' || Char == '\r' || Char == '\n';
+}
+
+static FHeaderToken TrimToken(FHeaderToken Token) {
+  while (Token.Begin < Token.End && IsHeaderWhitespace(*Token.Begin)) {
+    Token.Begin++;
+  }
+  while (Token.End > Token.Begin && IsHeaderWhitespace(*(Token.End - 1))) {
+    Token.End--;
+  }
+  return Token;
+}
+
+// Returns the next line of the remaining text and advances Rest past it.
+static bool NextLine(FHeaderToken &Rest, FHeaderToken &OutLine) {
+  if (Rest.IsEmpty()) {
+    return false;
+  }
+  OutLine.Begin = Rest.Begin;
+  OutLine.End = Rest.Begin;
+  while (OutLine.End < Rest.End && *OutLine.End != '\n') {
+    OutLine.End++;
+  }
+  Rest.Begin = OutLine.End < Rest.End ? OutLine.End + 1 : Rest.End;
+  return true;
+}
+
+// Returns the next whitespace-separated word of the remaining text and advances Rest past it.
+static bool NextWord(FHeaderToken &Rest, FHeaderToken &OutWord) {
+  Rest = TrimToken(Rest);
+  if (Rest.IsEmpty()) {
+    return false;
+  }
+  OutWord.Begin = Rest.Begin;
+  OutWord.End = Rest.Begin;
+  while (OutWord.End < Rest.End && !IsHeaderWhitespace(*OutWord.End)) {
+    OutWord.End++;
+  }
+  Rest.Begin = OutWord.End;
+  return true;
+}
+
+template <typename IntType>
+static bool NextInt(FHeaderToken &Rest, IntType &OutValue) {
+  FHeaderToken Word;
+  if (!NextWord(Rest, Word)) {
+    return false;
+  }
+  const ANSICHAR *Char = Word.Begin;
+  const bool bNegative = *Char == '-';
+  if (bNegative || *Char == '+') {
+    Char++;
+  }
+  if (Char == Word.End) {
+    return false;
+  }
+  int64 Value = 0;
+  for (; Char < Word.End; Char++) {
+    if (*Char < '0' || *Char > '9') {
+      return false;
+    }
+    Value = Value * 10 + (*Char - '0');
+  }
+  OutValue = IntType(bNegative ? -Value : Value);
+  return true;
+}
+
+static bool NextFloat(FHeaderToken &Rest, float &OutValue) {
+  FHeaderToken Word;
+  if (!NextWord(Rest, Word)) {
+    return false;
+  }
+  // Atof needs a terminated string, numbers are short enough for a stack copy.
+  ANSICHAR Buffer[64];
+  const int32 Length = FMath::Min(Word.Len(), int32(ARRAY_COUNT(Buffer)) - 1);
+  FMemory::Memcpy(Buffer, Word.Begin, Length);
+  Buffer[Length] = '\0';
+  OutValue = FCStringAnsi::Atof(Buffer);
+  return true;
+}
+
+static EMhdElementType ParseElementType(const FHeaderToken &Value) {
+  if (Value.Equals("MET_UCHAR")) return EMhdElementType::MET_UCHAR;
+  if (Value.Equals("MET_USHORT")) return EMhdElementType::MET_USHORT;
+  if (Value.Equals("MET_SHORT")) return EMhdElementType::MET_SHORT;
+  if (Value.Equals("MET_INT")) return EMhdElementType::MET_INT;
+  if (Value.Equals("MET_FLOAT")) return EMhdElementType::MET_FLOAT;
+  if (Value.Equals("MET_FLOAT64") || Value.Equals("MET_DOUBLE")) {
+    return EMhdElementType::MET_FLOAT64;
+  }
+  return EMhdElementType::MET_UNKNOWN;
+}
+
 FMhdInfo FMhdInfo::ParseFromString(const FString FileString) {
-  {
-    FMhdInfo info;
-
-    std::string MyStdString(TCHAR_TO_UTF8(*FileString));
-    std::istringstream inStream = std::istringstream(MyStdString);
-
-    std::string DummyString;  // Dummy string object used to skip over input
-    std::string Line;
-    while (std::getline(inStream, Line)) {
-      std::istringstream LineStream{Line};
-      std::string KeyWord;
-      LineStream >> KeyWord;
-
-      LineStream >> DummyString;  // skip the equal sign
-
-      if (KeyWord == "DimSize") {
-        // Read the three values;
-        LineStream >> info.Dimensions.X;
-        LineStream >> info.Dimensions.Y;
-        LineStream >> info.Dimensions.Z;
-      } else if (KeyWord == "ElementSpacing") {
-        // Read the three values;
-        LineStream >> info.Spacing.X;
-        LineStream >> info.Spacing.Y;
-        LineStream >> info.Spacing.Z;
-      } else if (KeyWord == "CompressedData") {
-        std::string CompressedData;
-        LineStream >> CompressedData;
-        if (CompressedData == "True" || CompressedData == "TRUE" || CompressedData == "true") {
-          info.CompressedData = true;
+  FTCHARToUTF8 Converted(*FileString);
+  return ParseFromBytes(reinterpret_cast<const ANSICHAR *>(Converted.Get()), Converted.Length());
+}
+
+FMhdInfo FMhdInfo::ParseFromBytes(const ANSICHAR *Header, const int64 HeaderLength) {
+  FMhdInfo info;
+
+  FHeaderToken Rest{Header, Header + HeaderLength};
+  FHeaderToken Line;
+  while (NextLine(Rest, Line)) {
+    // Every line is "Key = Value".
+    const ANSICHAR *Equals = Line.Begin;
+    while (Equals < Line.End && *Equals != '=') {
+      Equals++;
+    }
+    if (Equals == Line.End) {
+      continue;
+    }
+    const FHeaderToken KeyWord = TrimToken({Line.Begin, Equals});
+    FHeaderToken Value = TrimToken({Equals + 1, Line.End});
+    FHeaderToken Word;
+
+    if (KeyWord.Equals("DimSize")) {
+      NextInt(Value, info.Dimensions.X);
+      NextInt(Value, info.Dimensions.Y);
+      NextInt(Value, info.Dimensions.Z);
+    } else if (KeyWord.Equals("NDims")) {
+      NextInt(Value, info.NDims);
+    } else if (KeyWord.Equals("ElementSpacing")) {
+      NextFloat(Value, info.Spacing.X);
+      NextFloat(Value, info.Spacing.Y);
+      NextFloat(Value, info.Spacing.Z);
+    } else if (KeyWord.Equals("CompressedData")) {
+      info.CompressedData = Value.IsTrue();
+    } else if (KeyWord.Equals("CompressedDataSize")) {
+      NextInt(Value, info.CompressedDataSize);
+    } else if (KeyWord.Equals("CompressedDataChunks")) {
+      // Our own extension - uncompressed chunk size followed by the compressed chunk sizes.
+      NextInt(Value, info.CompressedChunkSize);
+      int64 ChunkSize;
+      while (NextInt(Value, ChunkSize)) {
+        info.CompressedChunkSizes.Add(ChunkSize);
+      }
+    } else if (KeyWord.Equals("BinaryDataByteOrderMSB") ||
+               KeyWord.Equals("ElementByteOrderMSB")) {
+      info.ByteOrderMSB = Value.IsTrue();
+    } else if (KeyWord.Equals("ElementNumberOfChannels")) {
+      NextInt(Value, info.NumChannels);
+    } else if (KeyWord.Equals("HeaderSize")) {
+      NextInt(Value, info.HeaderSize);
+    } else if (KeyWord.Equals("ElementType")) {
+      if (NextWord(Value, Word)) {
+        info.ElementType = ParseElementType(Word);
+      }
+    } else if (KeyWord.Equals("ElementDataFile")) {
+      info.DataFile = Value.ToString();
+
+      if (NextWord(Value, Word) && Word.Equals("LIST")) {
+        // LIST [2D|3D] - all following lines are data file names.
+        while (NextLine(Rest, Line)) {
+          const FHeaderToken ListedFile = TrimToken(Line);
+          if (!ListedFile.IsEmpty()) {
+            info.DataFiles.Add(ListedFile.ToString());
+          }
+        }
+      } else if (info.DataFile.Contains(TEXT("%"))) {
+        if (!ExpandDataFilePattern(info.DataFile, info.DataFiles)) {
+          // Headers may be parsed on worker threads (see FMhdCatalog), so only log here.
+          UE_LOG(LogTemp, Warning, TEXT("Invalid ElementDataFile file name pattern."));
         }
-      } else if (KeyWord == "ElementType") {
-        std::string Value;
-        LineStream >> Value;
-        if (Value == "MET_UCHAR")
-          info.ElementType = EMhdElementType::MET_UCHAR;
-        else if (Value == "MET_USHORT")
-          info.ElementType = EMhdElementType::MET_USHORT;
-        else if (Value == "MET_SHORT")
-          info.ElementType = EMhdElementType::MET_SHORT;
-        else if (Value == "MET_INT")
-          info.ElementType = EMhdElementType::MET_INT;
-        else if (Value == "MET_FLOAT")
-          info.ElementType = EMhdElementType::MET_FLOAT;
-        else if (Value == "MET_FLOAT64" || Value == "MET_DOUBLE")
-          info.ElementType = EMhdElementType::MET_FLOAT64;
-      } else if (KeyWord == "ElementDataFile") {
-        std::string File;
-        std::getline(LineStream, File);
-        info.DataFile = UTF8_TO_TCHAR(File.c_str());
       }
     }
+  }
 
-    // check if at least basic information was read
-    if (!info.Dimensions.IsZero() && !info.Spacing.IsZero() && !info.DataFile.IsEmpty())
-      info.ParseSuccessful = true;
+  // check if at least basic information was read
+  if (!info.Dimensions.IsZero() && !info.Spacing.IsZero() && !info.DataFile.IsEmpty())
+    info.ParseSuccessful = true;
 
-    return info;
-  }
+  return info;
 }
 
 EPixelFormat FMhdInfo::ConvertToBestPixelFormat(TUniquePtr<uint8> &DataArray, uint64 NumElements,
-                                                EMhdElementType ElementType) {
-  int16 *DataPtrInt16;
-  uint16 *DataPtrUint16;
-  int32 *DataPtrInt32;
-  float *DataPtrFloat32;
-  double *DataPtrFloat64;
-  TUniquePtr<uint8> DataFloat32;
+                                                EMhdElementType ElementType, bool ByteOrderMSB,
+                                                int64 ChunkSize) {
+  const EPixelFormat PixelFormat = GetConvertedPixelFormat(ElementType);
+  if (PixelFormat == PF_Unknown || (IsNativePixelFormat(ElementType) && !ByteOrderMSB)) {
+    return PixelFormat;
+  }
+  if (ElementType == EMhdElementType::MET_INT) {
+    MY_LOG("Warning: Integer format is not directly supported. Converting data to float.");
+  }
+
+  const int64 ElementCount = int64(NumElements);
+  const int32 SourceElementSize = ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int32 ConvertedElementSize = GPixelFormats[PixelFormat].BlockBytes;
+  const int64 ChunkElements = FMath::Max<int64>(ChunkSize / SourceElementSize, 1);
+  const int32 NumChunks = int32(FMath::DivideAndRoundUp(ElementCount, ChunkElements));
+  uint8 *Data = DataArray.Get();
+
+  if (SourceElementSize == ConvertedElementSize) {
+    // Every element is overwritten by its own converted value, so chunks can be converted in-place
+    // in parallel without any extra memory.
+    ParallelFor(NumChunks, [&](int32 Chunk) {
+      const int64 FirstElement = Chunk * ChunkElements;
+      const int64 ChunkCount = FMath::Min(ChunkElements, ElementCount - FirstElement);
+      uint8 *ChunkData = Data + FirstElement * SourceElementSize;
+      ConvertElements(ChunkData, ChunkData, ChunkCount, ElementType, ByteOrderMSB);
+    });
+    return PixelFormat;
+  }
 
+  // Narrowing conversion - the converted chunk overlaps source data of earlier chunks, so chunks
+  // are processed front-to-back, each converted in parallel into a scratch buffer and then copied
+  // to its final place. The scratch buffer is the only extra memory needed.
+  const int64 PieceElements = FMath::Max<int64>((1024 * 1024) / SourceElementSize, 1);
+  TUniquePtr<uint8> Scratch(
+      new uint8[FMath::Min(ChunkElements, ElementCount) * ConvertedElementSize]);
+  for (int32 Chunk = 0; Chunk < NumChunks; Chunk++) {
+    const int64 FirstElement = Chunk * ChunkElements;
+    const int64 ChunkCount = FMath::Min(ChunkElements, ElementCount - FirstElement);
+    const uint8 *ChunkData = Data + FirstElement * SourceElementSize;
+
+    ParallelFor(int32(FMath::DivideAndRoundUp(ChunkCount, PieceElements)), [&](int32 Piece) {
+      const int64 FirstPieceElement = Piece * PieceElements;
+      const int64 PieceCount = FMath::Min(PieceElements, ChunkCount - FirstPieceElement);
+      ConvertElements(ChunkData + FirstPieceElement * SourceElementSize,
+                      Scratch.Get() + FirstPieceElement * ConvertedElementSize, PieceCount,
+                      ElementType, ByteOrderMSB);
+    });
+    FMemory::Memcpy(Data + FirstElement * ConvertedElementSize, Scratch.Get(),
+                    ChunkCount * ConvertedElementSize);
+  }
+  Scratch.Reset();
+
+  // Give back the now unused tail of the array. Arrays allocated with new[] go through FMemory, so
+  // they can be shrunk with FMemory::Realloc (which usually doesn't even need to move them).
+  DataArray.Reset(static_cast<uint8 *>(
+      FMemory::Realloc(DataArray.Release(), ElementCount * ConvertedElementSize)));
+  return PixelFormat;
+}
+
+bool FMhdInfo::IsNativePixelFormat(EMhdElementType ElementType) {
+  switch (ElementType) {
+    case EMhdElementType::MET_UCHAR:
+    case EMhdElementType::MET_USHORT:
+    case EMhdElementType::MET_FLOAT: return true;
+    default: return false;
+  }
+}
+
+EPixelFormat FMhdInfo::GetConvertedPixelFormat(EMhdElementType ElementType) {
   switch (ElementType) {
     case EMhdElementType::MET_UCHAR: return PF_G8;
-    case EMhdElementType::MET_USHORT: return PF_G16;
+    case EMhdElementType::MET_USHORT:
+    case EMhdElementType::MET_SHORT: return PF_G16;
+    case EMhdElementType::MET_INT:
+    case EMhdElementType::MET_FLOAT:
+    case EMhdElementType::MET_FLOAT64: return PF_R32_FLOAT;
+    default: return PF_Unknown;
+  }
+}
+
+void FMhdInfo::ConvertElements(const uint8* Source, uint8* Dest, int64 NumElements,
+                               EMhdElementType ElementType, bool SwapBytes) {
+  // All conversions go front-to-back and never produce larger elements than they consume, so
+  // converting in-place is safe.
+  switch (ElementType) {
     case EMhdElementType::MET_SHORT:
-      DataPtrInt16 = reinterpret_cast<int16 *>(DataArray.Get());
-      DataPtrUint16 = reinterpret_cast<uint16 *>(DataArray.Get());
-      // Convert by adding 32767
-      ParallelFor(NumElements, [&](int32 Idx) {
-        int32 value = DataPtrInt16[Idx];
-        DataPtrUint16[Idx] = uint16(value + 0x7FFF);
-      });
-      return PF_G16;
+      ConvertVoxels(reinterpret_cast<const int16*>(Source), reinterpret_cast<uint16*>(Dest),
+                    NumElements, SwapBytes);
+      break;
     case EMhdElementType::MET_INT:
-      MY_LOG("Warning: Integer format is not directly supported. Converting data to float.");
-      DataPtrInt32 = reinterpret_cast<int32 *>(DataArray.Get());
-      DataPtrFloat32 = reinterpret_cast<float *>(DataArray.Get());
-      // Convert directly to float
-      ParallelFor(NumElements, [&](int32 Idx) {
-        int32 value = DataPtrInt32[Idx];
-        DataPtrFloat32[Idx] = float(value);
-      });
-      return PF_R32_FLOAT;
-    case EMhdElementType::MET_FLOAT: return PF_R32_FLOAT;
-    // convert double to float by lossy conversion
+      ConvertVoxels(reinterpret_cast<const int32*>(Source), reinterpret_cast<float*>(Dest),
+                    NumElements, SwapBytes);
+      break;
+    case EMhdElementType::MET_FLOAT64:
+      ConvertVoxels(reinterpret_cast<const double*>(Source), reinterpret_cast<float*>(Dest),
+                    NumElements, SwapBytes);
+      break;
+    default: {
+      // Natively supported types only need their byte order fixed, if anything.
+      const int32 ElementSize = ElementTypeInfo[int32(ElementType)].SizeBytes;
+      if (SwapBytes && ElementSize == 2) {
+        SwapVoxelBytes(reinterpret_cast<const uint16*>(Source), reinterpret_cast<uint16*>(Dest),
+                       NumElements);
+      } else if (SwapBytes && ElementSize == 4) {
+        SwapVoxelBytes(reinterpret_cast<const uint32*>(Source), reinterpret_cast<uint32*>(Dest),
+                       NumElements);
+      } else if (Source != Dest) {
+        FMemory::Memcpy(Dest, Source, NumElements * ElementSize);
+      }
+      break;
+    }
+  }
+}
+
+EPixelFormat FMhdInfo::GetPackedPixelFormat(EMhdElementType ElementType) {
+  switch (ElementType) {
+    case EMhdElementType::MET_UCHAR: return PF_R8G8B8A8;
+    case EMhdElementType::MET_USHORT:
+    case EMhdElementType::MET_SHORT:
+    case EMhdElementType::MET_INT:
+    case EMhdElementType::MET_FLOAT:
+    case EMhdElementType::MET_FLOAT64: return PF_FloatRGBA;
+    default: return PF_Unknown;
+  }
+}
+
+// Number of voxels byte-swapped at once when packing big-endian channels.
+#define PACK_SWAP_BLOCK 256
+
+template <typename SrcType>
+static void PackChannelsToHalf(const uint8* Source, uint8* Dest, int64 NumVoxels,
+                               int32 NumChannels, bool SwapBytes) {
+  const SrcType* Src = reinterpret_cast<const SrcType*>(Source);
+  FFloat16* Dst = reinterpret_cast<FFloat16*>(Dest);
+  SrcType SwappedBlock[PACK_SWAP_BLOCK * 4];
+
+  for (int64 FirstVoxel = 0; FirstVoxel < NumVoxels; FirstVoxel += PACK_SWAP_BLOCK) {
+    const int64 BlockVoxels = FMath::Min<int64>(PACK_SWAP_BLOCK, NumVoxels - FirstVoxel);
+    const SrcType* Values = Src + FirstVoxel * NumChannels;
+    if (SwapBytes) {
+      SwapVoxelBytes(Values, SwappedBlock, BlockVoxels * NumChannels);
+      Values = SwappedBlock;
+    }
+    FFloat16* Texels = Dst + FirstVoxel * 4;
+    for (int64 Voxel = 0; Voxel < BlockVoxels; Voxel++) {
+      for (int32 Channel = 0; Channel < 4; Channel++) {
+        Texels[Voxel * 4 + Channel] =
+            FFloat16(Channel < NumChannels ? float(Values[Voxel * NumChannels + Channel]) : 0.0f);
+      }
+    }
+  }
+}
+
+void FMhdInfo::PackChannels(const uint8* Source, uint8* Dest, int64 NumVoxels, int32 NumChannels,
+                            EMhdElementType ElementType, bool SwapBytes) {
+  switch (ElementType) {
+    case EMhdElementType::MET_UCHAR:
+      for (int64 Voxel = 0; Voxel < NumVoxels; Voxel++) {
+        for (int32 Channel = 0; Channel < 4; Channel++) {
+          Dest[Voxel * 4 + Channel] =
+              Channel < NumChannels ? Source[Voxel * NumChannels + Channel] : 0;
+        }
+      }
+      break;
+    case EMhdElementType::MET_USHORT:
+      PackChannelsToHalf<uint16>(Source, Dest, NumVoxels, NumChannels, SwapBytes);
+      break;
+    case EMhdElementType::MET_SHORT:
+      PackChannelsToHalf<int16>(Source, Dest, NumVoxels, NumChannels, SwapBytes);
+      break;
+    case EMhdElementType::MET_INT:
+      PackChannelsToHalf<int32>(Source, Dest, NumVoxels, NumChannels, SwapBytes);
+      break;
+    case EMhdElementType::MET_FLOAT:
+      PackChannelsToHalf<float>(Source, Dest, NumVoxels, NumChannels, SwapBytes);
+      break;
     case EMhdElementType::MET_FLOAT64:
-      DataFloat32.Reset(new uint8[NumElements * 8]);
-      DataPtrFloat32 = reinterpret_cast<float *>(DataFloat32.Get());
-      DataPtrFloat64 = reinterpret_cast<double *>(DataArray.Get());
-      ParallelFor(NumElements, [&](int32 Idx) { DataPtrFloat32[Idx] = DataPtrFloat64[Idx]; });
-      Swap(DataArray, DataFloat32);
-      return PF_R32_FLOAT;
+      PackChannelsToHalf<double>(Source, Dest, NumVoxels, NumChannels, SwapBytes);
+      break;
+    default: break;
+  }
+}
+
+bool FMhdInfo::IsPlainRawFile() const {
+  return !CompressedData && !ByteOrderMSB && DataFiles.Num() == 0 && NumChannels == 1 &&
+         HeaderSize == 0;
+}
+
+template <typename SrcType>
+static void WindowElementsOfType(const uint8* Source, uint8* Dest, int64 NumElements,
+                                 const FVoxelWindow& Window, bool SwapBytes) {
+  const SrcType* Src = reinterpret_cast<const SrcType*>(Source);
+  if (Window.PixelFormat == PF_G8) {
+    WindowVoxels(Src, Dest, NumElements, Window.Min, Window.Max, SwapBytes);
+  } else {
+    WindowVoxels(Src, reinterpret_cast<uint16*>(Dest), NumElements, Window.Min, Window.Max,
+                 SwapBytes);
+  }
+}
+
+void FMhdInfo::WindowElements(const uint8* Source, uint8* Dest, int64 NumElements,
+                              EMhdElementType ElementType, const FVoxelWindow& Window,
+                              bool SwapBytes) {
+  check(Window.PixelFormat == PF_G8 || Window.PixelFormat == PF_G16);
+  switch (ElementType) {
+    case EMhdElementType::MET_UCHAR:
+      WindowElementsOfType<uint8>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    case EMhdElementType::MET_USHORT:
+      WindowElementsOfType<uint16>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    case EMhdElementType::MET_SHORT:
+      WindowElementsOfType<int16>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    case EMhdElementType::MET_INT:
+      WindowElementsOfType<int32>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    case EMhdElementType::MET_FLOAT:
+      WindowElementsOfType<float>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    case EMhdElementType::MET_FLOAT64:
+      WindowElementsOfType<double>(Source, Dest, NumElements, Window, SwapBytes);
+      break;
+    default: break;
   }
-  return PF_Unknown;
 }
 
 FString FMhdInfo::ToString() const {
@@ -163,23 +522,48 @@ FMhdInfo FMhdInfo::LoadAndParseMhdFile(FString FileName) {
   FMhdInfo MhdInfo;
   MhdInfo.ParseSuccessful = false;
 
-  FString FileContent;
+  TArray<uint8> FileContent;
   // First, try to read as absolute path
-  if (!FFileHelper::LoadFileToString(/*out*/ FileContent, *FileName)) {
+  if (!FFileHelper::LoadFileToArray(/*out*/ FileContent, *FileName)) {
     // Try it as a relative path
     FString RelativePath = FPaths::ProjectContentDir();
     FString FullPath =
         IFileManager::Get().ConvertToAbsolutePathForExternalAppForRead(*RelativePath) + FileName;
     FileName = FullPath;
-    if (!FFileHelper::LoadFileToString(/*out*/ FileContent, *FullPath)) {
+    if (!FFileHelper::LoadFileToArray(/*out*/ FileContent, *FullPath)) {
       return MhdInfo;
     }
   }
 
-  MhdInfo = FMhdInfo::ParseFromString(FileContent);
+  // The header is parsed as bytes, without converting it to an FString first.
+  MhdInfo = FMhdInfo::ParseFromBytes(reinterpret_cast<const ANSICHAR *>(FileContent.GetData()),
+                                     FileContent.Num());
   return MhdInfo;
 }
 
+FString FMhdInfo::GetDataFilePath(const FString MhdFileName) const {
+  FString DataFileName = DataFile.TrimStartAndEnd();
+  if (!DataFileName.IsEmpty()) {
+    FString DataFilePath = FPaths::IsRelative(DataFileName)
+                               ? FPaths::Combine(FPaths::GetPath(MhdFileName), DataFileName)
+                               : DataFileName;
+    if (FPaths::FileExists(DataFilePath) ||
+        FPaths::FileExists(FPaths::ProjectContentDir() + DataFilePath)) {
+      return DataFilePath;
+    }
+  }
+  return FPaths::ChangeExtension(MhdFileName, CompressedData ? TEXT(".zraw") : TEXT(".raw"));
+}
+
+TArray<FString> FMhdInfo::GetDataFilePaths(const FString MhdFileName) const {
+  TArray<FString> Paths;
+  for (const FString &File : DataFiles) {
+    Paths.Add(FPaths::IsRelative(File) ? FPaths::Combine(FPaths::GetPath(MhdFileName), File)
+                                       : File);
+  }
+  return Paths;
+}
+
 FVector FMhdInfo::GetWorldDimensions() const {
   return FVector(this->Spacing.X * this->Dimensions.X, this->Spacing.Y * this->Dimensions.Y,
                  this->Spacing.Z * this->Dimensions.Z);
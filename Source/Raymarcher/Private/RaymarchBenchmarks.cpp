@@ -0,0 +1,677 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "RaymarchBenchmarks.h"
+#include "LightPropagationCpu.h"
+#include "LightVolumeCache.h"
+#include "MhdCatalog.h"
+#include "MhdCompression.h"
+#include "MhdInfo.h"
+#include "Paths.h"
+#include "RaymarchRendering.h"
+#include "ShVisibilityVolume.h"
+#include "TextureHelperFunctions.h"
+#include "VolumeCodec.h"
+#include "VoxelConversion.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+// Chunk size used when compressing volumes for the benchmarks.
+#define BENCHMARK_CHUNK_SIZE (16 * 1024 * 1024)
+
+// Number of voxels every ParallelFor task of the vectorized benchmarks converts.
+#define BENCHMARK_VOXELS_PER_TASK (256 * 1024)
+
+// Number of texels of the transfer function the light propagation benchmark uses, same as the
+// ones created by ColorCurveToTexture.
+#define BENCHMARK_TF_SIZE 1000
+
+static double GigabytesPerSecond(const int64 Bytes, const double Seconds) {
+  return Seconds > 0.0 ? (Bytes / 1.0e9) / Seconds : 0.0;
+}
+
+FString BenchmarkCompressedLoading(const FString MhdFileName) {
+  FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+  if (!Info.ParseSuccessful || Info.CompressedData) {
+    MY_LOG("Compressed loading benchmark needs an uncompressed MHD file.");
+    return FString();
+  }
+
+  const int32 ElementSize = FMhdInfo::ElementTypeInfo[int32(Info.ElementType)].SizeBytes;
+  const int64 TotalSize =
+      (int64)Info.Dimensions.X * Info.Dimensions.Y * Info.Dimensions.Z * ElementSize;
+
+  // Disk read of the uncompressed data (in slabs, the same way the raw loader reads).
+  auto RawData = TUniquePtr<uint8>(new uint8[TotalSize]);
+  double StartTime = FPlatformTime::Seconds();
+  bool bSuccess = ReadRawFileInSlabs(Info.GetDataFilePath(MhdFileName), TotalSize,
+                                     BENCHMARK_CHUNK_SIZE, RawData.Get(),
+                                     [](uint8* SlabData, int64 SlabOffset, int64 SlabBytes) {});
+  const double ReadSeconds = FPlatformTime::Seconds() - StartTime;
+  if (!bSuccess) {
+    return FString();
+  }
+
+  StartTime = FPlatformTime::Seconds();
+  TArray<TArray<uint8>> Chunks;
+  CompressInChunks(RawData.Get(), TotalSize, BENCHMARK_CHUNK_SIZE, Chunks);
+  const double CompressSeconds = FPlatformTime::Seconds() - StartTime;
+
+  // Lay the chunks out back to back, as they would be in a .zraw file.
+  TArray<int64> ChunkSizes;
+  int64 CompressedSize = 0;
+  for (const TArray<uint8>& Chunk : Chunks) {
+    ChunkSizes.Add(Chunk.Num());
+    CompressedSize += Chunk.Num();
+  }
+  auto CompressedData = TUniquePtr<uint8>(new uint8[CompressedSize]);
+  int64 Offset = 0;
+  for (const TArray<uint8>& Chunk : Chunks) {
+    FMemory::Memcpy(CompressedData.Get() + Offset, Chunk.GetData(), Chunk.Num());
+    Offset += Chunk.Num();
+  }
+  Chunks.Empty();
+
+  // Decompress into the raw buffer, so the benchmark doesn't need another full-size allocation.
+  StartTime = FPlatformTime::Seconds();
+  bSuccess = InflateInSlabs(CompressedData.Get(), CompressedSize, TotalSize, BENCHMARK_CHUNK_SIZE,
+                            [&](uint8* SlabData, int64 SlabOffset, int64 SlabBytes) {
+                              FMemory::Memcpy(RawData.Get() + SlabOffset, SlabData, SlabBytes);
+                            });
+  const double StreamingSeconds = FPlatformTime::Seconds() - StartTime;
+
+  StartTime = FPlatformTime::Seconds();
+  bSuccess &= InflateChunksInParallel(CompressedData.Get(), CompressedSize, ChunkSizes,
+                                      BENCHMARK_CHUNK_SIZE, TotalSize, RawData.Get(),
+                                      [](uint8* ChunkData, int64 ChunkOffset, int64 ChunkBytes) {});
+  const double ParallelSeconds = FPlatformTime::Seconds() - StartTime;
+  if (!bSuccess) {
+    return FString();
+  }
+
+  // Reading the compressed file overlaps with decompressing it, so the slower of the two dominates.
+  const double DiskGBs = GigabytesPerSecond(TotalSize, ReadSeconds);
+  const double CompressedReadSeconds = DiskGBs > 0.0 ? (CompressedSize / 1.0e9) / DiskGBs : 0.0;
+  const double EffectiveSeconds = FMath::Max(CompressedReadSeconds, ParallelSeconds);
+
+  const FString Result = FString::Printf(
+      TEXT("Compressed loading of %s (%lld B): disk read %.2f GB/s, compression ratio %.2fx "
+           "(compress %.2f GB/s), streaming inflate %.2f GB/s, parallel inflate %.2f GB/s, "
+           "effective compressed load %.2f GB/s vs raw load %.2f GB/s"),
+      *MhdFileName, TotalSize, DiskGBs, double(TotalSize) / CompressedSize,
+      GigabytesPerSecond(TotalSize, CompressSeconds),
+      GigabytesPerSecond(TotalSize, StreamingSeconds),
+      GigabytesPerSecond(TotalSize, ParallelSeconds),
+      GigabytesPerSecond(TotalSize, EffectiveSeconds), DiskGBs);
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+// Returns the best of three runs of Function in seconds.
+static double TimeBestOfThree(TFunctionRef<void()> Function) {
+  double BestSeconds = TNumericLimits<double>::Max();
+  for (int32 Run = 0; Run < 3; Run++) {
+    const double StartTime = FPlatformTime::Seconds();
+    Function();
+    BestSeconds = FMath::Min(BestSeconds, FPlatformTime::Seconds() - StartTime);
+  }
+  return BestSeconds;
+}
+
+template <typename SrcType>
+static void FillRandomVoxels(SrcType* Data, const int32 NumElements, const float MinValue,
+                             const float MaxValue) {
+  FRandomStream Random(42);
+  for (int32 i = 0; i < NumElements; i++) {
+    Data[i] = SrcType(Random.FRandRange(MinValue, MaxValue));
+  }
+}
+
+// Benchmarks one type pair. ScalarOp converts a single voxel, KernelOp a range of them.
+template <typename SrcType, typename DstType, typename ScalarOpType, typename KernelOpType>
+static FString BenchmarkVoxelPair(const TCHAR* Name, const int32 NumElements, const float MinValue,
+                                  const float MaxValue, ScalarOpType ScalarOp,
+                                  KernelOpType KernelOp) {
+  TArray<SrcType> Source;
+  Source.SetNumUninitialized(NumElements);
+  FillRandomVoxels(Source.GetData(), NumElements, MinValue, MaxValue);
+  TArray<DstType> Dest;
+  Dest.SetNumUninitialized(NumElements);
+  const SrcType* Src = Source.GetData();
+  DstType* Dst = Dest.GetData();
+
+  const double ScalarSeconds = TimeBestOfThree(
+      [&]() { ParallelFor(NumElements, [&](int32 Idx) { Dst[Idx] = ScalarOp(Src[Idx]); }); });
+
+  const int32 NumTasks = FMath::DivideAndRoundUp(NumElements, BENCHMARK_VOXELS_PER_TASK);
+  const double KernelSeconds = TimeBestOfThree([&]() {
+    ParallelFor(NumTasks, [&](int32 Task) {
+      const int32 First = Task * BENCHMARK_VOXELS_PER_TASK;
+      KernelOp(Src + First, Dst + First,
+               FMath::Min(BENCHMARK_VOXELS_PER_TASK, NumElements - First));
+    });
+  });
+
+  const int64 SourceBytes = int64(NumElements) * sizeof(SrcType);
+  return FString::Printf(TEXT("%s: scalar %.2f GB/s, vectorized %.2f GB/s (%.2fx)\n"), Name,
+                         GigabytesPerSecond(SourceBytes, ScalarSeconds),
+                         GigabytesPerSecond(SourceBytes, KernelSeconds),
+                         ScalarSeconds / FMath::Max(KernelSeconds, 1e-9));
+}
+
+FString BenchmarkVoxelConversion(const int32 NumElements) {
+  const float WindowMin = -1000.0f;
+  const float WindowMax = 1000.0f;
+  const float Scale8 = VoxelConversion::MaxValue<uint8>() / (WindowMax - WindowMin);
+  const float Scale16 = VoxelConversion::MaxValue<uint16>() / (WindowMax - WindowMin);
+
+#if VOXEL_CONVERSION_AVX2
+  const TCHAR* InstructionSet = TEXT("AVX2");
+#elif VOXEL_CONVERSION_SSE2
+  const TCHAR* InstructionSet = TEXT("SSE2");
+#else
+  const TCHAR* InstructionSet = TEXT("scalar");
+#endif
+  FString Result = FString::Printf(TEXT("Voxel conversion of %d voxels (%s kernels):\n"),
+                                   NumElements, InstructionSet);
+  Result += BenchmarkVoxelPair<int16, uint16>(
+      TEXT("int16 -> uint16"), NumElements, -32768.0f, 32767.0f,
+      [](int16 Value) { return uint16(int32(Value) + 0x8000); },
+      [](const int16* Src, uint16* Dst, int64 Count) { ConvertVoxels(Src, Dst, Count); });
+  Result += BenchmarkVoxelPair<int32, float>(
+      TEXT("int32 -> float"), NumElements, -100000.0f, 100000.0f,
+      [](int32 Value) { return float(Value); },
+      [](const int32* Src, float* Dst, int64 Count) { ConvertVoxels(Src, Dst, Count); });
+  Result += BenchmarkVoxelPair<double, float>(
+      TEXT("double -> float"), NumElements, -100000.0f, 100000.0f,
+      [](double Value) { return float(Value); },
+      [](const double* Src, float* Dst, int64 Count) { ConvertVoxels(Src, Dst, Count); });
+  Result += BenchmarkVoxelPair<int16, uint8>(
+      TEXT("int16 -> G8 window"), NumElements, -2000.0f, 2000.0f,
+      [&](int16 Value) {
+        return VoxelConversion::WindowValue<int16, uint8>(Value, WindowMin, Scale8);
+      },
+      [&](const int16* Src, uint8* Dst, int64 Count) {
+        WindowVoxels(Src, Dst, Count, WindowMin, WindowMax);
+      });
+  Result += BenchmarkVoxelPair<int16, uint16>(
+      TEXT("int16 -> G16 window"), NumElements, -2000.0f, 2000.0f,
+      [&](int16 Value) {
+        return VoxelConversion::WindowValue<int16, uint16>(Value, WindowMin, Scale16);
+      },
+      [&](const int16* Src, uint16* Dst, int64 Count) {
+        WindowVoxels(Src, Dst, Count, WindowMin, WindowMax);
+      });
+  Result += BenchmarkVoxelPair<uint16, uint8>(
+      TEXT("uint16 -> G8 window"), NumElements, 0.0f, 4000.0f,
+      [&](uint16 Value) {
+        return VoxelConversion::WindowValue<uint16, uint8>(Value, WindowMin, Scale8);
+      },
+      [&](const uint16* Src, uint8* Dst, int64 Count) {
+        WindowVoxels(Src, Dst, Count, WindowMin, WindowMax);
+      });
+  Result += BenchmarkVoxelPair<float, uint8>(
+      TEXT("float -> G8 window"), NumElements, -2000.0f, 2000.0f,
+      [&](float Value) {
+        return VoxelConversion::WindowValue<float, uint8>(Value, WindowMin, Scale8);
+      },
+      [&](const float* Src, uint8* Dst, int64 Count) {
+        WindowVoxels(Src, Dst, Count, WindowMin, WindowMax);
+      });
+  Result += BenchmarkVoxelPair<double, uint16>(
+      TEXT("double -> G16 window"), NumElements, -2000.0f, 2000.0f,
+      [&](double Value) {
+        return VoxelConversion::WindowValue<double, uint16>(Value, WindowMin, Scale16);
+      },
+      [&](const double* Src, uint16* Dst, int64 Count) {
+        WindowVoxels(Src, Dst, Count, WindowMin, WindowMax);
+      });
+
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+FString BenchmarkMhdCatalog(const FString Directory) {
+  const FString CatalogFileName = FPaths::ProjectSavedDir() / TEXT("MhdCatalogBenchmark.bin");
+
+  FMhdCatalog Catalog;
+  double StartTime = FPlatformTime::Seconds();
+  const int32 NumParsed = Catalog.UpdateFromDirectory(Directory);
+  const double BuildSeconds = FPlatformTime::Seconds() - StartTime;
+  if (NumParsed == 0) {
+    MY_LOG("Catalog benchmark found no MHD headers in the directory.");
+    return FString();
+  }
+
+  StartTime = FPlatformTime::Seconds();
+  Catalog.SaveToFile(CatalogFileName);
+  const double SaveSeconds = FPlatformTime::Seconds() - StartTime;
+
+  FMhdCatalog LoadedCatalog;
+  StartTime = FPlatformTime::Seconds();
+  LoadedCatalog.LoadFromFile(CatalogFileName);
+  const int32 NumReparsed = LoadedCatalog.UpdateFromDirectory(Directory);
+  const double RefreshSeconds = FPlatformTime::Seconds() - StartTime;
+  IFileManager::Get().Delete(*CatalogFileName);
+
+  const FString Result = FString::Printf(
+      TEXT("MHD catalog of %s (%d headers): build %.1f ms (%.0f headers/s), save %.1f ms, "
+           "load and refresh %.1f ms (%d headers re-parsed)"),
+      *Directory, NumParsed, BuildSeconds * 1000.0, NumParsed / FMath::Max(BuildSeconds, 1e-9),
+      SaveSeconds * 1000.0, RefreshSeconds * 1000.0, NumReparsed);
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+FString BenchmarkVolumeCodec(const FString MhdFileName) {
+  FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+  if (!Info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return FString();
+  }
+  EPixelFormat PixelFormat;
+  auto Voxels = LoadMhdDataConverted(Info, MhdFileName, PixelFormat);
+  if (!Voxels) {
+    return FString();
+  }
+  const int32 BytesPerVoxel = GPixelFormats[PixelFormat].BlockBytes;
+  const int64 TotalSize =
+      (int64)Info.Dimensions.X * Info.Dimensions.Y * Info.Dimensions.Z * BytesPerVoxel;
+
+  TArray<uint8> Encoded;
+  const double EncodeSeconds = TimeBestOfThree(
+      [&]() { EncodeVolumeLossless(Voxels.Get(), Info.Dimensions, BytesPerVoxel, Encoded); });
+
+  auto Decoded = TUniquePtr<uint8>(new uint8[TotalSize]);
+  bool bSuccess = true;
+  const double DecodeSeconds =
+      TimeBestOfThree([&]() { bSuccess &= DecodeVolumeLossless(Encoded, Decoded.Get()); });
+  bSuccess &= FMemory::Memcmp(Voxels.Get(), Decoded.Get(), TotalSize) == 0;
+  Decoded.Reset();
+
+  // Plain zlib on the same voxels, as a baseline for the prediction.
+  TArray<TArray<uint8>> Chunks;
+  CompressInChunks(Voxels.Get(), TotalSize, BENCHMARK_CHUNK_SIZE, Chunks);
+  int64 ZlibSize = 0;
+  for (const TArray<uint8>& Chunk : Chunks) {
+    ZlibSize += Chunk.Num();
+  }
+
+  const FString Result = FString::Printf(
+      TEXT("Volume codec on %s (%lld B): ratio %.2fx (zlib only %.2fx), encode %.2f GB/s, "
+           "decode %.2f GB/s, %s"),
+      *MhdFileName, TotalSize, double(TotalSize) / FMath::Max(Encoded.Num(), 1),
+      double(TotalSize) / FMath::Max<int64>(ZlibSize, 1),
+      GigabytesPerSecond(TotalSize, EncodeSeconds), GigabytesPerSecond(TotalSize, DecodeSeconds),
+      bSuccess ? TEXT("lossless") : TEXT("DECODED DATA DIFFERS"));
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+// Loads a MHD volume for the light propagation benchmarks, classified by a linear ramp from
+// transparent to opaque over the whole intensity domain, and returns the dimensions of a half
+// resolution light volume for it.
+static bool LoadBenchmarkLightPropagationVolume(const FString MhdFileName,
+                                                FLightPropagationVolume& OutVolume,
+                                                FIntVector& OutLightVolumeDimensions) {
+  FMhdInfo Info = FMhdInfo::LoadAndParseMhdFile(MhdFileName);
+  if (!Info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return false;
+  }
+  EPixelFormat PixelFormat;
+  auto Voxels = LoadMhdDataConverted(Info, MhdFileName, PixelFormat);
+  if (!Voxels) {
+    return false;
+  }
+
+  TArray<float> Opacities;
+  Opacities.SetNumUninitialized(BENCHMARK_TF_SIZE);
+  for (int32 i = 0; i < BENCHMARK_TF_SIZE; i++) {
+    Opacities[i] = float(i) / (BENCHMARK_TF_SIZE - 1);
+  }
+  if (!OutVolume.InitFromVoxels(Voxels.Get(), Info.Dimensions, PixelFormat, Opacities,
+                                FVector2D(0.0f, 1.0f))) {
+    return false;
+  }
+  OutLightVolumeDimensions = FIntVector(FMath::DivideAndRoundUp(Info.Dimensions.X, 2),
+                                        FMath::DivideAndRoundUp(Info.Dimensions.Y, 2),
+                                        FMath::DivideAndRoundUp(Info.Dimensions.Z, 2));
+  return true;
+}
+
+// Volume at the origin, clipping plane far away so nothing is cut.
+static FRaymarchWorldParameters GetBenchmarkWorldParameters() {
+  FRaymarchWorldParameters WorldParameters;
+  WorldParameters.VolumeTransform = FTransform::Identity;
+  WorldParameters.ClippingPlaneParameters =
+      FClippingPlaneParameters(FVector(0.0f, 0.0f, -1000.0f), FVector(0.0f, 0.0f, 1.0f));
+  return WorldParameters;
+}
+
+FString BenchmarkFusedLightPropagation(const FString MhdFileName, const int32 NumLights) {
+  FLightPropagationVolume Volume;
+  FIntVector LightVolumeDimensions;
+  if (!LoadBenchmarkLightPropagationVolume(MhdFileName, Volume, LightVolumeDimensions)) {
+    return FString();
+  }
+  const int64 LightVoxels =
+      (int64)LightVolumeDimensions.X * LightVolumeDimensions.Y * LightVolumeDimensions.Z;
+
+  FRandomStream Random(42);
+  TArray<FDirLightParameters> Lights;
+  for (int32 i = 0; i < NumLights; i++) {
+    Lights.Add(FDirLightParameters(Random.GetUnitVector(), 1.0f / NumLights));
+  }
+  const FRaymarchWorldParameters WorldParameters = GetBenchmarkWorldParameters();
+
+  // One by one, every propagation is a sweep. Fused, every face the lights enter through is one
+  // sweep on the CPU, the GPU takes one per MAX_FUSED_DIR_LIGHTS lights.
+  TArray<FDirLightAxisPropagation> Groups[6];
+  GroupDirLightPropagations(Lights, true, LightVolumeDimensions, WorldParameters, Groups);
+  int32 SeparateSweeps = 0;
+  int32 FusedSweeps = 0;
+  int32 FusedGpuSweeps = 0;
+  for (const TArray<FDirLightAxisPropagation>& Group : Groups) {
+    SeparateSweeps += Group.Num();
+    FusedSweeps += Group.Num() > 0 ? 1 : 0;
+    FusedGpuSweeps += FMath::DivideAndRoundUp(Group.Num(), MAX_FUSED_DIR_LIGHTS);
+  }
+
+  TArray<float> Separate;
+  Separate.SetNumUninitialized(LightVoxels);
+  const double SeparateSeconds = TimeBestOfThree([&]() {
+    FMemory::Memzero(Separate.GetData(), LightVoxels * sizeof(float));
+    for (const FDirLightParameters& Light : Lights) {
+      AddDirLightToLightVolume_Cpu(Volume, Separate.GetData(), LightVolumeDimensions, Light, true,
+                                   WorldParameters);
+    }
+  });
+  TArray<float> Fused;
+  Fused.SetNumUninitialized(LightVoxels);
+  const double FusedSeconds = TimeBestOfThree([&]() {
+    FMemory::Memzero(Fused.GetData(), LightVoxels * sizeof(float));
+    AddDirLightsToLightVolume_Cpu(Volume, Fused.GetData(), LightVolumeDimensions, Lights, true,
+                                  WorldParameters);
+  });
+
+  float MaxDifference = 0.0f;
+  for (int64 i = 0; i < LightVoxels; i++) {
+    MaxDifference = FMath::Max(MaxDifference, FMath::Abs(Separate[i] - Fused[i]));
+  }
+
+  // Every sweep reads and writes every light volume voxel once. The data volume is still sampled
+  // once per light and voxel, at the offsets of the light.
+  const FString Result = FString::Printf(
+      TEXT("Fused light propagation of %d lights on %s (light volume %dx%dx%d): sweeps %d -> %d "
+           "(GPU %d), light volume voxel reads and writes saved %lld (GPU %lld), separate %.3f s, "
+           "fused %.3f s (%.2fx), max difference %g"),
+      NumLights, *MhdFileName, LightVolumeDimensions.X, LightVolumeDimensions.Y,
+      LightVolumeDimensions.Z, SeparateSweeps, FusedSweeps, FusedGpuSweeps,
+      (SeparateSweeps - FusedSweeps) * LightVoxels, (SeparateSweeps - FusedGpuSweeps) * LightVoxels,
+      SeparateSeconds, FusedSeconds, FusedSeconds > 0.0 ? SeparateSeconds / FusedSeconds : 0.0,
+      MaxDifference);
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+// Whether ChangeDirLightInSingleLightVolume_RenderThread changes the light with
+// FChangeDirLightShader - otherwise it used to remove and add the light separately.
+static bool HaveSameMajorAxes(const FDirLightParameters& OldLight,
+                              const FDirLightParameters& NewLight,
+                              const FRaymarchWorldParameters& WorldParameters) {
+  FDirLightParameters OldLocalLight, NewLocalLight;
+  FMajorAxes OldAxes, NewAxes;
+  GetLocalLightParamsAndAxes(OldLight, WorldParameters.VolumeTransform, OldLocalLight, OldAxes);
+  GetLocalLightParamsAndAxes(NewLight, WorldParameters.VolumeTransform, NewLocalLight, NewAxes);
+  return OldAxes.FaceWeight[0].first == NewAxes.FaceWeight[0].first &&
+         OldAxes.FaceWeight[1].first == NewAxes.FaceWeight[1].first;
+}
+
+FString BenchmarkLightRotation(const FString MhdFileName, const int32 NumSteps) {
+  FLightPropagationVolume Volume;
+  FIntVector LightVolumeDimensions;
+  if (!LoadBenchmarkLightPropagationVolume(MhdFileName, Volume, LightVolumeDimensions) ||
+      NumSteps < 1) {
+    return FString();
+  }
+  const int64 LightVoxels =
+      (int64)LightVolumeDimensions.X * LightVolumeDimensions.Y * LightVolumeDimensions.Z;
+  const FRaymarchWorldParameters WorldParameters = GetBenchmarkWorldParameters();
+
+  // The light turns around Z once while going up and down three times, so it crosses between all
+  // the side axes and from the sides to the top and back.
+  TArray<FDirLightParameters> Steps;
+  for (int32 Step = 0; Step <= NumSteps; Step++) {
+    const float Angle = 2.0f * PI * Step / NumSteps;
+    const float Elevation = 0.4f + 0.6f * FMath::Sin(3.0f * Angle);
+    Steps.Add(FDirLightParameters(
+        FVector(FMath::Cos(Angle), FMath::Sin(Angle), Elevation).GetSafeNormal(), 1.0f));
+  }
+
+  TArray<float> Separate;
+  Separate.SetNumZeroed(LightVoxels);
+  TArray<float> SinglePass;
+  SinglePass.SetNumZeroed(LightVoxels);
+  AddDirLightToLightVolume_Cpu(Volume, Separate.GetData(), LightVolumeDimensions, Steps[0], true,
+                               WorldParameters);
+  AddDirLightToLightVolume_Cpu(Volume, SinglePass.GetData(), LightVolumeDimensions, Steps[0],
+                               true, WorldParameters);
+
+  // Steps where the major axes stay the same take the same path both ways, only the steps crossing
+  // between axes are compared.
+  int32 CrossingSteps = 0;
+  int32 SeparateSweeps = 0;
+  int32 SinglePassSweeps = 0;
+  double SeparateSeconds = 0.0;
+  double SinglePassSeconds = 0.0;
+  double SinglePassMaxSeconds = 0.0;
+  double UnchangedSeconds = 0.0;
+  for (int32 Step = 1; Step <= NumSteps; Step++) {
+    const FDirLightParameters& OldLight = Steps[Step - 1];
+    const FDirLightParameters& NewLight = Steps[Step];
+
+    TArray<FDirLightAxisPropagation> Groups[6];
+    GroupDirLightPropagations({OldLight}, false, LightVolumeDimensions, WorldParameters, Groups);
+    GroupDirLightPropagations({NewLight}, true, LightVolumeDimensions, WorldParameters, Groups);
+    // Removing and adding separately takes a sweep per propagation.
+    int32 Sweeps = 0;
+    int32 OldSweeps = 0;
+    for (const TArray<FDirLightAxisPropagation>& Group : Groups) {
+      Sweeps += Group.Num() > 0 ? 1 : 0;
+      OldSweeps += Group.Num();
+    }
+
+    double StartTime = FPlatformTime::Seconds();
+    ChangeDirLightInLightVolume_Cpu(Volume, SinglePass.GetData(), LightVolumeDimensions, OldLight,
+                                    NewLight, WorldParameters);
+    const double Seconds = FPlatformTime::Seconds() - StartTime;
+
+    if (HaveSameMajorAxes(OldLight, NewLight, WorldParameters)) {
+      ChangeDirLightInLightVolume_Cpu(Volume, Separate.GetData(), LightVolumeDimensions, OldLight,
+                                      NewLight, WorldParameters);
+      UnchangedSeconds += Seconds;
+      continue;
+    }
+    StartTime = FPlatformTime::Seconds();
+    AddDirLightToLightVolume_Cpu(Volume, Separate.GetData(), LightVolumeDimensions, OldLight,
+                                 false, WorldParameters);
+    AddDirLightToLightVolume_Cpu(Volume, Separate.GetData(), LightVolumeDimensions, NewLight, true,
+                                 WorldParameters);
+    SeparateSeconds += FPlatformTime::Seconds() - StartTime;
+    SinglePassSeconds += Seconds;
+    SinglePassMaxSeconds = FMath::Max(SinglePassMaxSeconds, Seconds);
+    SeparateSweeps += OldSweeps;
+    SinglePassSweeps += Sweeps;
+    CrossingSteps++;
+  }
+
+  // How far the incrementally changed light volumes drifted from adding the last light directly.
+  TArray<float> Direct;
+  Direct.SetNumZeroed(LightVoxels);
+  AddDirLightToLightVolume_Cpu(Volume, Direct.GetData(), LightVolumeDimensions, Steps[NumSteps],
+                               true, WorldParameters);
+  float SeparateDrift = 0.0f;
+  float SinglePassDrift = 0.0f;
+  for (int64 i = 0; i < LightVoxels; i++) {
+    SeparateDrift = FMath::Max(SeparateDrift, FMath::Abs(Separate[i] - Direct[i]));
+    SinglePassDrift = FMath::Max(SinglePassDrift, FMath::Abs(SinglePass[i] - Direct[i]));
+  }
+
+  const int32 UnchangedSteps = NumSteps - CrossingSteps;
+  const int32 Crossings = FMath::Max(CrossingSteps, 1);
+  const FString Result = FString::Printf(
+      TEXT("Rotating a light in %d steps on %s (light volume %dx%dx%d): %d steps keep the major "
+           "axes, %.4f s per step. %d steps cross between axes: %.2f sweeps per step (was %.2f), "
+           "%.4f s per step (max %.4f, remove + add %.4f). Drift from direct addition %g (remove "
+           "+ add %g)"),
+      NumSteps, *MhdFileName, LightVolumeDimensions.X, LightVolumeDimensions.Y,
+      LightVolumeDimensions.Z, UnchangedSteps, UnchangedSeconds / FMath::Max(UnchangedSteps, 1),
+      CrossingSteps, float(SinglePassSweeps) / Crossings, float(SeparateSweeps) / Crossings,
+      SinglePassSeconds / Crossings, SinglePassMaxSeconds, SeparateSeconds / Crossings,
+      SinglePassDrift, SeparateDrift);
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+FString BenchmarkLightVolumeCaching(const FString MhdFileName, const int32 NumStates) {
+  FLightPropagationVolume Volume;
+  FIntVector LightVolumeDimensions;
+  if (!LoadBenchmarkLightPropagationVolume(MhdFileName, Volume, LightVolumeDimensions) ||
+      NumStates < 1) {
+    return FString();
+  }
+  const int64 LightVoxels =
+      (int64)LightVolumeDimensions.X * LightVolumeDimensions.Y * LightVolumeDimensions.Z;
+  const FRaymarchWorldParameters WorldParameters = GetBenchmarkWorldParameters();
+
+  // Every state is a lighting preset of a key and a fill light.
+  FRandomStream Random(42);
+  TArray<TArray<FDirLightParameters>> States;
+  TArray<FLightVolumeCacheKey> Keys;
+  for (int32 i = 0; i < NumStates; i++) {
+    States.Add({FDirLightParameters(Random.GetUnitVector(), 0.7f),
+                FDirLightParameters(Random.GetUnitVector(), 0.3f)});
+    Keys.Add(FLightVolumeCacheKey::Make(FBasicRaymarchRenderingResources(), States[i],
+                                        WorldParameters));
+  }
+
+  // Big enough to keep all the states.
+  FLightVolumeCache Cache(MAX_int64);
+  TArray<float> LightVolume;
+  LightVolume.SetNumUninitialized(LightVoxels);
+  TArray<uint32> Checksums;
+  double PropagationSeconds = 0.0;
+  double StoreSeconds = 0.0;
+  for (int32 i = 0; i < NumStates; i++) {
+    double StartTime = FPlatformTime::Seconds();
+    FMemory::Memzero(LightVolume.GetData(), LightVoxels * sizeof(float));
+    AddDirLightsToLightVolume_Cpu(Volume, LightVolume.GetData(), LightVolumeDimensions, States[i],
+                                  true, WorldParameters);
+    PropagationSeconds += FPlatformTime::Seconds() - StartTime;
+
+    StartTime = FPlatformTime::Seconds();
+    Cache.StoreVoxels(Keys[i], LightVolume.GetData(), LightVolumeDimensions);
+    StoreSeconds += FPlatformTime::Seconds() - StartTime;
+    Checksums.Add(FCrc::MemCrc32(LightVolume.GetData(), LightVoxels * sizeof(float)));
+  }
+
+  // Go back to the states in reverse order, so every restore is a different light volume.
+  bool bSuccess = true;
+  double RestoreSeconds = 0.0;
+  for (int32 i = NumStates - 1; i >= 0; i--) {
+    const double StartTime = FPlatformTime::Seconds();
+    const bool bRestored =
+        Cache.RestoreVoxels(Keys[i], LightVolume.GetData(), LightVolumeDimensions);
+    RestoreSeconds += FPlatformTime::Seconds() - StartTime;
+    bSuccess &= bRestored && FCrc::MemCrc32(LightVolume.GetData(),
+                                            LightVoxels * sizeof(float)) == Checksums[i];
+  }
+
+  const FString Result = FString::Printf(
+      TEXT("Caching %d lighting states of 2 lights on %s (light volume %dx%dx%d): propagating "
+           "%.4f s per state, caching %.4f s, restoring %.4f s (%.1fx faster than propagating). "
+           "%.2f MB per cached state (%.2f MB uncompressed), %s"),
+      NumStates, *MhdFileName, LightVolumeDimensions.X, LightVolumeDimensions.Y,
+      LightVolumeDimensions.Z, PropagationSeconds / NumStates, StoreSeconds / NumStates,
+      RestoreSeconds / NumStates, PropagationSeconds / FMath::Max(RestoreSeconds, 1e-9),
+      Cache.GetUsedBytes() / (1024.0 * 1024.0) / NumStates,
+      LightVoxels * sizeof(float) / (1024.0 * 1024.0),
+      bSuccess ? TEXT("all restored exactly") : TEXT("RESTORED LIGHT VOLUMES DIFFER"));
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
+
+FString BenchmarkShVisibility(const FString MhdFileName, const int32 NumDirections,
+                              const int32 NumSteps) {
+  FLightPropagationVolume Volume;
+  FIntVector LightVolumeDimensions;
+  if (!LoadBenchmarkLightPropagationVolume(MhdFileName, Volume, LightVolumeDimensions) ||
+      NumDirections < 1 || NumSteps < 1) {
+    return FString();
+  }
+  const int64 LightVoxels =
+      (int64)LightVolumeDimensions.X * LightVolumeDimensions.Y * LightVolumeDimensions.Z;
+  const FRaymarchWorldParameters WorldParameters = GetBenchmarkWorldParameters();
+  const FIntVector VisibilityDimensions(FMath::DivideAndRoundUp(LightVolumeDimensions.X, 2),
+                                        FMath::DivideAndRoundUp(LightVolumeDimensions.Y, 2),
+                                        FMath::DivideAndRoundUp(LightVolumeDimensions.Z, 2));
+
+  double StartTime = FPlatformTime::Seconds();
+  FShVisibilityVolume Visibility;
+  Visibility.Precompute(Volume, VisibilityDimensions, WorldParameters, NumDirections);
+  const double PrecomputeSeconds = FPlatformTime::Seconds() - StartTime;
+
+  // The same path as in BenchmarkLightRotation.
+  TArray<FDirLightParameters> Steps;
+  for (int32 Step = 0; Step <= NumSteps; Step++) {
+    const float Angle = 2.0f * PI * Step / NumSteps;
+    const float Elevation = 0.4f + 0.6f * FMath::Sin(3.0f * Angle);
+    Steps.Add(FDirLightParameters(
+        FVector(FMath::Cos(Angle), FMath::Sin(Angle), Elevation).GetSafeNormal(), 1.0f));
+  }
+
+  TArray<float> Changed;
+  Changed.SetNumZeroed(LightVoxels);
+  TArray<float> Relit;
+  Relit.SetNumUninitialized(LightVoxels);
+  AddDirLightToLightVolume_Cpu(Volume, Changed.GetData(), LightVolumeDimensions, Steps[0], true,
+                               WorldParameters);
+  double ChangeSeconds = 0.0;
+  double RelightSeconds = 0.0;
+  double RelightMaxSeconds = 0.0;
+  for (int32 Step = 1; Step <= NumSteps; Step++) {
+    StartTime = FPlatformTime::Seconds();
+    ChangeDirLightInLightVolume_Cpu(Volume, Changed.GetData(), LightVolumeDimensions,
+                                    Steps[Step - 1], Steps[Step], WorldParameters);
+    ChangeSeconds += FPlatformTime::Seconds() - StartTime;
+
+    StartTime = FPlatformTime::Seconds();
+    Visibility.Relight({Steps[Step]}, WorldParameters.VolumeTransform, Relit.GetData(),
+                       LightVolumeDimensions);
+    const double Seconds = FPlatformTime::Seconds() - StartTime;
+    RelightSeconds += Seconds;
+    RelightMaxSeconds = FMath::Max(RelightMaxSeconds, Seconds);
+  }
+
+  // Low-order SH smooth the shadows, compare the last relit light volume with propagating it.
+  double ErrorSum = 0.0;
+  double LightSum = 0.0;
+  for (int64 i = 0; i < LightVoxels; i++) {
+    ErrorSum += FMath::Abs(Relit[i] - Changed[i]);
+    LightSum += Changed[i];
+  }
+
+  const FString Result = FString::Printf(
+      TEXT("SH visibility of %s from %d directions (light volume %dx%dx%d, visibility %dx%dx%d): "
+           "precompute %.2f s, %.2f MB (light volume %.2f MB). Turning a light in %d steps: "
+           "relight %.4f s per step (max %.4f), changing the light %.4f s per step. Mean "
+           "relative difference to propagating %.3f"),
+      *MhdFileName, NumDirections, LightVolumeDimensions.X, LightVolumeDimensions.Y,
+      LightVolumeDimensions.Z, VisibilityDimensions.X, VisibilityDimensions.Y,
+      VisibilityDimensions.Z, PrecomputeSeconds, Visibility.GetAllocatedSize() / (1024.0 * 1024.0),
+      LightVoxels * sizeof(float) / (1024.0 * 1024.0), NumSteps, RelightSeconds / NumSteps,
+      RelightMaxSeconds, ChangeSeconds / NumSteps, ErrorSum / FMath::Max(LightSum, 1e-9));
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Result);
+  return Result;
+}
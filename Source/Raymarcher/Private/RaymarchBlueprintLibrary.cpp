@@ -2,10 +2,16 @@
 // Developed by Tomas Bartipan (tomas.bartipan@tum.de)
 
 #include "RaymarchBlueprintLibrary.h"
+#include "BrickedVolume.h"
 #include "Experimental.h"
+#include "LightPropagationCpu.h"
+#include "LightVolumeCache.h"
 #include "MhdInfo.h"
+#include "RaymarchBenchmarks.h"
 #include "RaymarchRendering.h"
+#include "ShVisibilityVolume.h"
 #include "TextureHelperFunctions.h"
+#include "VolumeAssetSaveQueue.h"
 
 #include "Classes/Engine/World.h"
 #include "Public/AssetRegistryModule.h"
@@ -64,6 +70,61 @@ void URaymarchBlueprintLibrary::AddDirLightToSingleVolume(
   });
 }
 
+void URaymarchBlueprintLibrary::AddDirLightsToSingleVolume(
+    FBasicRaymarchRenderingResources Resources, const TArray<FDirLightParameters> LightParameters,
+    const bool Added, const FRaymarchWorldParameters WorldParameters, bool& LightsAdded) {
+  if (!Resources.VolumeTextureRef || !Resources.TFTextureRef || !Resources.ALightVolumeRef ||
+      !Resources.VolumeTextureRef->Resource || !Resources.TFTextureRef->Resource ||
+      !Resources.ALightVolumeRef->Resource ||
+      !Resources.VolumeTextureRef->Resource->TextureRHI ||
+      !Resources.TFTextureRef->Resource->TextureRHI ||
+      !Resources.ALightVolumeRef->Resource->TextureRHI) {
+    LightsAdded = false;
+    return;
+  }
+  LightsAdded = true;
+
+  // Call the actual rendering code on RenderThread.
+  ENQUEUE_RENDER_COMMAND(CaptureCommand)
+  ([=](FRHICommandListImmediate& RHICmdList) {
+    AddDirLightsToSingleLightVolume_RenderThread(RHICmdList, Resources, LightParameters, Added,
+                                                 WorldParameters);
+  });
+}
+
+void URaymarchBlueprintLibrary::AddDirLightToSingleVolumeOnCpu(
+    FBasicRaymarchRenderingResources Resources, const FDirLightParameters LightParameters,
+    const bool Added, const FRaymarchWorldParameters WorldParameters, bool& LightAdded) {
+  LightAdded = false;
+  FLightPropagationVolume Volume;
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  if (!LightVolume || !LightVolume->PlatformData || LightVolume->PlatformData->Mips.Num() == 0 ||
+      LightVolume->PlatformData->PixelFormat != PF_R32_FLOAT ||
+      !Volume.Init(Resources.VolumeTextureRef, Resources.TFTextureRef,
+                   Resources.TFRangeParameters)) {
+    MY_LOG("Can't propagate light on the CPU, the textures have no CPU copy.");
+    return;
+  }
+
+  FTexture2DMipMap& Mip = LightVolume->PlatformData->Mips[0];
+  const FIntVector Dimensions(Mip.SizeX, Mip.SizeY, Mip.SizeZ);
+  const int64 TotalSize = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z * sizeof(float);
+  if (Mip.BulkData.GetBulkDataSize() != TotalSize) {
+    MY_LOG("Can't propagate light on the CPU, the light volume has no CPU copy.");
+    return;
+  }
+  TUniquePtr<uint8> LightData(new uint8[TotalSize]);
+  FMemory::Memcpy(LightData.Get(), Mip.BulkData.LockReadOnly(), TotalSize);
+  Mip.BulkData.Unlock();
+
+  AddDirLightToLightVolume_Cpu(Volume, (float*)LightData.Get(), Dimensions, LightParameters, Added,
+                               WorldParameters);
+
+  // Format and dimensions stay the same, so the light volume is uploaded straight from the buffer.
+  LightAdded = UpdateVolumeTextureAsset(LightVolume, PF_R32_FLOAT, Dimensions, MoveTemp(LightData),
+                                        false, false, LightVolume->bUAVCompatible);
+}
+
 void URaymarchBlueprintLibrary::CreateLightVolumeUAV(FBasicRaymarchRenderingResources Resources,
                                                      FBasicRaymarchRenderingResources& OutResources,
                                                      bool& Success) {
@@ -108,6 +169,125 @@ void URaymarchBlueprintLibrary::ChangeDirLightInSingleVolume(
   });
 }
 
+void URaymarchBlueprintLibrary::CheckLightRotationRoundTrip(
+    FBasicRaymarchRenderingResources Resources, const FDirLightParameters LightParameters,
+    const FRaymarchWorldParameters WorldParameters, float& MaxDifference, bool& Success,
+    int32 NumSteps) {
+  MaxDifference = 0.0f;
+  Success = false;
+  if (NumSteps < 1 || !Resources.VolumeTextureRef || !Resources.VolumeTextureRef->Resource ||
+      !Resources.TFTextureRef || !Resources.TFTextureRef->Resource ||
+      !Resources.ALightVolumeRef || !Resources.ALightVolumeRef->Resource) {
+    return;
+  }
+
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  const int64 NumVoxels =
+      (int64)LightVolume->GetSizeX() * LightVolume->GetSizeY() * LightVolume->GetSizeZ();
+  TArray<float> Before, After;
+  Before.SetNumUninitialized(NumVoxels);
+  After.SetNumUninitialized(NumVoxels);
+  float* BeforeData = Before.GetData();
+  float* AfterData = After.GetData();
+  bool bRead = false;
+
+  // The last step goes back to the original light exactly, not to a rotation by 360 degrees.
+  TArray<FDirLightParameters> Steps;
+  Steps.Add(LightParameters);
+  for (int32 Step = 1; Step < NumSteps; Step++) {
+    const FQuat Rotation(FVector::UpVector, 2.0f * PI * Step / NumSteps);
+    Steps.Add(FDirLightParameters(Rotation.RotateVector(LightParameters.LightDirection),
+                                  LightParameters.LightIntensity));
+  }
+  Steps.Add(LightParameters);
+
+  ENQUEUE_RENDER_COMMAND(CaptureCommand)
+  ([=, &bRead](FRHICommandListImmediate& RHICmdList) {
+    FRHITexture3D* Texture = Resources.ALightVolumeRef->Resource->TextureRHI->GetTexture3D();
+    if (!ReadVolumeTexture_RenderThread(RHICmdList, Texture, BeforeData)) {
+      return;
+    }
+    for (int32 Step = 1; Step < Steps.Num(); Step++) {
+      ChangeDirLightInSingleLightVolume_RenderThread(RHICmdList, Resources, Steps[Step - 1],
+                                                     Steps[Step], WorldParameters);
+    }
+    bRead = ReadVolumeTexture_RenderThread(RHICmdList, Texture, AfterData);
+  });
+  FlushRenderingCommands();
+  if (!bRead) {
+    return;
+  }
+
+  for (int64 i = 0; i < NumVoxels; i++) {
+    MaxDifference = FMath::Max(MaxDifference, FMath::Abs(After[i] - Before[i]));
+  }
+  Success = true;
+  UE_LOG(LogTemp, Log,
+         TEXT("Turning a light around %s in %d steps changed the light volume by up to %g."),
+         *LightVolume->GetName(), NumSteps, MaxDifference);
+}
+
+void URaymarchBlueprintLibrary::CacheLightVolume(const FBasicRaymarchRenderingResources Resources,
+                                                 const TArray<FDirLightParameters> LightParameters,
+                                                 const FRaymarchWorldParameters WorldParameters) {
+  FLightVolumeCache::Get().Store(
+      FLightVolumeCacheKey::Make(Resources, LightParameters, WorldParameters), Resources);
+}
+
+void URaymarchBlueprintLibrary::RestoreCachedLightVolume(
+    const FBasicRaymarchRenderingResources Resources,
+    const TArray<FDirLightParameters> LightParameters,
+    const FRaymarchWorldParameters WorldParameters, bool& Restored) {
+  Restored = FLightVolumeCache::Get().Restore(
+      FLightVolumeCacheKey::Make(Resources, LightParameters, WorldParameters), Resources);
+}
+
+void URaymarchBlueprintLibrary::SetLightVolumeCacheBudget(int32 BudgetMegabytes,
+                                                          bool KeepInVideoMemory) {
+  FLightVolumeCache& Cache = FLightVolumeCache::Get();
+  Cache.SetResidency(KeepInVideoMemory ? ELightVolumeCacheResidency::Gpu
+                                       : ELightVolumeCacheResidency::Cpu);
+  Cache.SetBudget((int64)FMath::Max(BudgetMegabytes, 0) * 1024 * 1024);
+}
+
+void URaymarchBlueprintLibrary::ClearLightVolumeCache(UVolumeTexture* Volume) {
+  if (Volume) {
+    FLightVolumeCache::Get().RemoveVolume(FName(*Volume->GetPathName()));
+  }
+}
+
+void URaymarchBlueprintLibrary::PrecomputeShVisibility(
+    const FBasicRaymarchRenderingResources Resources,
+    const FRaymarchWorldParameters WorldParameters, bool& Started, int32 NumDirections,
+    int32 Downsampling) {
+  Started = FShVisibilityVolumes::Get().Precompute(Resources, WorldParameters, NumDirections,
+                                                   Downsampling);
+}
+
+void URaymarchBlueprintLibrary::RelightFromShVisibility(
+    const FBasicRaymarchRenderingResources Resources,
+    const TArray<FDirLightParameters> LightParameters,
+    const FRaymarchWorldParameters WorldParameters, bool& Relit) {
+  Relit = false;
+  FShVisibilityVolumePtr Visibility = FShVisibilityVolumes::Get().Find(Resources, WorldParameters);
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  if (!Visibility || !LightVolume->PlatformData ||
+      LightVolume->PlatformData->PixelFormat != PF_R32_FLOAT) {
+    return;
+  }
+
+  const FIntVector Dimensions(LightVolume->GetSizeX(), LightVolume->GetSizeY(),
+                              LightVolume->GetSizeZ());
+  TUniquePtr<uint8> LightData(
+      new uint8[(int64)Dimensions.X * Dimensions.Y * Dimensions.Z * sizeof(float)]);
+  Visibility->Relight(LightParameters, WorldParameters.VolumeTransform, (float*)LightData.Get(),
+                      Dimensions);
+
+  // Format and dimensions stay the same, so the light volume is uploaded straight from the buffer.
+  Relit = UpdateVolumeTextureAsset(LightVolume, PF_R32_FLOAT, Dimensions, MoveTemp(LightData),
+                                   false, false, LightVolume->bUAVCompatible);
+}
+
 void URaymarchBlueprintLibrary::ClearVolumeTexture(UVolumeTexture* VolumeTexture,
                                                    float ClearValue) {
   FRHITexture3D* VolumeTextureResource = VolumeTexture->Resource->TextureRHI->GetTexture3D();
@@ -135,46 +315,93 @@ void URaymarchBlueprintLibrary::ClearResourceLightVolumes(
   });
 }
 
+// Logs the copies made when a raw file is read (and converted slab-by-slab) into an array and then
+// uploaded.
+static void LogStagedRawLoadStats(EMhdElementType ElementType, EPixelFormat PixelFormat,
+                                  int64 NumElements, bool Persistent) {
+  const int64 TotalSize = NumElements * FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int64 ConvertedSize = NumElements * GPixelFormats[PixelFormat].BlockBytes;
+
+  FRawLoadStats Stats;
+  Stats.StagingBytes = TotalSize;
+  Stats.ConversionBytes = FMhdInfo::IsNativePixelFormat(ElementType) ? 0 : TotalSize;
+  Stats.BulkDataBytes = ConvertedSize;
+  Stats.SourceBytes = GetEditorSourceCopySize(PixelFormat, Persistent, ConvertedSize);
+  UE_LOG(LogTemp, Log, TEXT("%s"), *Stats.ToString());
+}
+
 void URaymarchBlueprintLibrary::LoadRawIntoVolumeTextureAsset(FString RawFileName,
                                                               UVolumeTexture* inTexture,
                                                               FIntVector Dimensions,
                                                               EMhdElementType ElementType,
                                                               bool Persistent) {
-  const int64 TotalSize = Dimensions.X * Dimensions.Y * Dimensions.Z *
-                          FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int64 NumElements = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z;
+  const int64 TotalSize = NumElements * FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+
+  // Natively supported formats can go straight from the mapped file into the texture.
+  if (FMhdInfo::IsNativePixelFormat(ElementType)) {
+    auto MappedFile = FMappedRawFile::Open(RawFileName, TotalSize);
+    if (MappedFile) {
+      EPixelFormat PixelFormat = FMhdInfo::ElementTypeInfo[int32(ElementType)].MatchingPixelFormat;
+      UpdateVolumeTextureAsset(inTexture, PixelFormat, Dimensions, MappedFile->GetData(),
+                               Persistent);
+
+      FRawLoadStats Stats;
+      Stats.bMapped = true;
+      Stats.BulkDataBytes = TotalSize;
+      Stats.SourceBytes = GetEditorSourceCopySize(PixelFormat, Persistent, TotalSize);
+      UE_LOG(LogTemp, Log, TEXT("%s"), *Stats.ToString());
+      return;
+    }
+  }
 
-  auto TempArray = LoadRawFileIntoArray(RawFileName, TotalSize);
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadRawFileConverted(RawFileName, NumElements, ElementType, PixelFormat);
   if (!TempArray) {
     return;
   }
 
-  EPixelFormat PixelFormat = FMhdInfo::ConvertToBestPixelFormat(
-      TempArray, Dimensions.X * Dimensions.Y * Dimensions.Z, ElementType);
-
-  auto ptr = TempArray.Get();
-
   // Actually update the asset.
   bool Success = false;
-  UpdateVolumeTextureAsset(inTexture, PixelFormat, Dimensions, ptr, Persistent);
+  UpdateVolumeTextureAsset(inTexture, PixelFormat, Dimensions, MoveTemp(TempArray), Persistent);
+
+  LogStagedRawLoadStats(ElementType, PixelFormat, NumElements, Persistent);
 }
 
 void URaymarchBlueprintLibrary::LoadRawIntoNewVolumeTextureAsset(
     FString RawFileName, FString TextureName, FIntVector Dimensions, EMhdElementType ElementType,
     bool Persistent, UVolumeTexture*& LoadedTexture) {
-  const int64 TotalSize = Dimensions.X * Dimensions.Y * Dimensions.Z *
-                          FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  const int64 NumElements = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z;
+  const int64 TotalSize = NumElements * FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+
+  // Natively supported formats can go straight from the mapped file into the texture.
+  if (FMhdInfo::IsNativePixelFormat(ElementType)) {
+    auto MappedFile = FMappedRawFile::Open(RawFileName, TotalSize);
+    if (MappedFile) {
+      EPixelFormat PixelFormat = FMhdInfo::ElementTypeInfo[int32(ElementType)].MatchingPixelFormat;
+      CreateVolumeTextureAsset(TextureName, PixelFormat, Dimensions, LoadedTexture,
+                               MappedFile->GetData(), Persistent);
+
+      FRawLoadStats Stats;
+      Stats.bMapped = true;
+      Stats.BulkDataBytes = TotalSize;
+      Stats.SourceBytes = GetEditorSourceCopySize(PixelFormat, Persistent, TotalSize);
+      UE_LOG(LogTemp, Log, TEXT("%s"), *Stats.ToString());
+      return;
+    }
+  }
 
-  auto TempArray = LoadRawFileIntoArray(RawFileName, TotalSize);
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadRawFileConverted(RawFileName, NumElements, ElementType, PixelFormat);
   if (!TempArray) {
     return;
   }
 
-  EPixelFormat PixelFormat = FMhdInfo::ConvertToBestPixelFormat(
-      TempArray, Dimensions.X * Dimensions.Y * Dimensions.Z, ElementType);
-
   // Actually create the asset.
   bool Success = CreateVolumeTextureAsset(TextureName, PixelFormat, Dimensions, LoadedTexture,
-                                          TempArray.Get(), Persistent);
+                                          MoveTemp(TempArray), Persistent);
+
+  LogStagedRawLoadStats(ElementType, PixelFormat, NumElements, Persistent);
 }
 
 void URaymarchBlueprintLibrary::LoadMhdIntoNewVolumeTextureAsset(
@@ -190,8 +417,19 @@ void URaymarchBlueprintLibrary::LoadMhdIntoNewVolumeTextureAsset(
   WorldDimensions = info.GetWorldDimensions();
   TextureDimensions = info.Dimensions;
 
-  LoadRawIntoNewVolumeTextureAsset(FileName.Replace(TEXT(".mhd"), TEXT(".raw")), TextureName,
-                                   info.Dimensions, info.ElementType, Persistent, LoadedTexture);
+  if (!info.IsPlainRawFile()) {
+    EPixelFormat PixelFormat;
+    auto TempArray = LoadMhdDataConverted(info, FileName, PixelFormat);
+    if (TempArray) {
+      CreateVolumeTextureAsset(TextureName, PixelFormat, info.Dimensions, LoadedTexture,
+                               MoveTemp(TempArray), Persistent);
+    }
+    return;
+  }
+
+  const FString DataFileName = info.GetDataFilePath(FileName);
+  LoadRawIntoNewVolumeTextureAsset(DataFileName, TextureName, info.Dimensions, info.ElementType,
+                                   Persistent, LoadedTexture);
 }
 
 void URaymarchBlueprintLibrary::LoadMhdIntoVolumeTextureAsset(
@@ -207,8 +445,174 @@ void URaymarchBlueprintLibrary::LoadMhdIntoVolumeTextureAsset(
   WorldDimensions = info.GetWorldDimensions();
   TextureDimensions = info.Dimensions;
 
-  LoadRawIntoVolumeTextureAsset(FileName.Replace(TEXT(".mhd"), TEXT(".raw")), VolumeAsset,
-                                info.Dimensions, info.ElementType, Persistent);
+  if (!info.IsPlainRawFile()) {
+    EPixelFormat PixelFormat;
+    auto TempArray = LoadMhdDataConverted(info, FileName, PixelFormat);
+    if (TempArray) {
+      UpdateVolumeTextureAsset(VolumeAsset, PixelFormat, info.Dimensions, MoveTemp(TempArray),
+                               Persistent);
+    }
+    return;
+  }
+
+  const FString DataFileName = info.GetDataFilePath(FileName);
+  LoadRawIntoVolumeTextureAsset(DataFileName, VolumeAsset, info.Dimensions, info.ElementType,
+                                Persistent);
+}
+
+void URaymarchBlueprintLibrary::LoadMhdIntoNewVolumeTextureAssetWindowed(
+    FString FileName, FString TextureName, float WindowMin, float WindowMax, bool EightBit,
+    bool Persistent, FIntVector& TextureDimensions, FVector& WorldDimensions,
+    UVolumeTexture*& LoadedTexture) {
+  FMhdInfo info = FMhdInfo::LoadAndParseMhdFile(FileName);
+  if (!info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return;
+  }
+
+  WorldDimensions = info.GetWorldDimensions();
+  TextureDimensions = info.Dimensions;
+
+  const FVoxelWindow Window{WindowMin, WindowMax, EightBit ? PF_G8 : PF_G16};
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadMhdDataConverted(info, FileName, PixelFormat, &Window);
+  if (TempArray) {
+    CreateVolumeTextureAsset(TextureName, PixelFormat, info.Dimensions, LoadedTexture,
+                             MoveTemp(TempArray), Persistent);
+  }
+}
+
+void URaymarchBlueprintLibrary::LoadMhdRegionIntoNewVolumeTextureAsset(
+    FString FileName, FString TextureName, FIntVector RegionMin, FIntVector RegionSize,
+    bool Persistent, FIntVector& TextureDimensions, FVector& WorldDimensions,
+    FVector& RegionCenterOffset, UVolumeTexture*& LoadedTexture) {
+  FMhdInfo info = FMhdInfo::LoadAndParseMhdFile(FileName);
+  if (!info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return;
+  }
+
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadMhdRegionConverted(info, FileName, RegionMin, RegionSize, PixelFormat);
+  if (!TempArray) {
+    return;
+  }
+
+  TextureDimensions = RegionSize;
+  WorldDimensions = info.Spacing * FVector(RegionSize);
+  const FVector RegionCenter = FVector(RegionMin) + FVector(RegionSize) * 0.5f;
+  RegionCenterOffset = info.Spacing * (RegionCenter - FVector(info.Dimensions) * 0.5f);
+  CreateVolumeTextureAsset(TextureName, PixelFormat, RegionSize, LoadedTexture,
+                           MoveTemp(TempArray), Persistent);
+}
+
+bool URaymarchBlueprintLibrary::ConvertMhdToBrickedVolumeFile(FString MhdFileName,
+                                                              FString OutFileName,
+                                                              int32 BrickSize, bool Compress,
+                                                              float OccupancyThreshold) {
+  return ConvertMhdToBrickedVolume(MhdFileName, OutFileName, BrickSize, Compress,
+                                   OccupancyThreshold);
+}
+
+void URaymarchBlueprintLibrary::LoadBrickedVolumeRegionIntoNewVolumeTextureAsset(
+    FString FileName, FString TextureName, FIntVector RegionMin, FIntVector RegionSize,
+    bool Persistent, FIntVector& TextureDimensions, FVector& WorldDimensions,
+    FVector& RegionCenterOffset, UVolumeTexture*& LoadedTexture) {
+  FBrickedVolume Volume;
+  if (!Volume.Open(FileName)) {
+    return;
+  }
+
+  EPixelFormat PixelFormat;
+  auto TempArray = Volume.LoadRegionConverted(RegionMin, RegionSize, PixelFormat);
+  if (!TempArray) {
+    return;
+  }
+
+  TextureDimensions = RegionSize;
+  WorldDimensions = Volume.GetSpacing() * FVector(RegionSize);
+  const FVector RegionCenter = FVector(RegionMin) + FVector(RegionSize) * 0.5f;
+  RegionCenterOffset =
+      Volume.GetSpacing() * (RegionCenter - FVector(Volume.GetDimensions()) * 0.5f);
+  CreateVolumeTextureAsset(TextureName, PixelFormat, RegionSize, LoadedTexture,
+                           MoveTemp(TempArray), Persistent);
+}
+
+void URaymarchBlueprintLibrary::LoadMhdIntoNewVolumeRepresentation(
+    FString FileName, FString TextureName, bool Persistent,
+    UVolumeRepresentation*& Representation) {
+  FMhdInfo info = FMhdInfo::LoadAndParseMhdFile(FileName);
+  if (!info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return;
+  }
+
+  // Always read and convert (even natively supported types), the statistics are gathered from the
+  // converted slabs.
+  FVoxelStatisticsAccumulator Statistics;
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadMhdDataConverted(info, FileName, PixelFormat, nullptr, nullptr, &Statistics);
+  if (!TempArray) {
+    return;
+  }
+
+  UVolumeTexture* Texture = nullptr;
+  CreateVolumeTextureAsset(TextureName, PixelFormat, info.Dimensions, Texture,
+                           MoveTemp(TempArray), Persistent);
+  Representation = NewObject<UVolumeRepresentation>();
+  Representation->Texture = Texture;
+  Representation->Dimensions = info.Dimensions;
+  Representation->VolumeSizeInMM = info.GetWorldDimensions();
+  Representation->Statistics = Statistics.GetStatistics();
+}
+
+void URaymarchBlueprintLibrary::LoadMhdIntoNewCompressedVolumeRepresentation(
+    FString FileName, FString AssetName, bool SaveNow, UVolumeRepresentation*& Representation) {
+  FMhdInfo info = FMhdInfo::LoadAndParseMhdFile(FileName);
+  if (!info.ParseSuccessful) {
+    MY_LOG("MHD Parsing failed!");
+    return;
+  }
+
+  FVoxelStatisticsAccumulator Statistics;
+  EPixelFormat PixelFormat;
+  auto TempArray = LoadMhdDataConverted(info, FileName, PixelFormat, nullptr, nullptr, &Statistics);
+  if (!TempArray) {
+    return;
+  }
+
+  const FString PackageName = TEXT("/Game/GeneratedTextures/") + AssetName;
+  UPackage* Package = CreatePackage(NULL, *PackageName);
+  Package->FullyLoad();
+  UVolumeRepresentation* NewRepresentation = NewObject<UVolumeRepresentation>(
+      (UObject*)Package, FName(*AssetName), RF_Public | RF_Standalone);
+  if (!NewRepresentation->SetCompressedVoxels(TempArray.Get(), PixelFormat, info.Dimensions)) {
+    MY_LOG("Volume could not be compressed, no volume representation was created.");
+    // Don't leave the empty representation in the package.
+    NewRepresentation->ClearFlags(RF_Public | RF_Standalone);
+    NewRepresentation->MarkPendingKill();
+    return;
+  }
+  NewRepresentation->VolumeSizeInMM = info.GetWorldDimensions();
+  NewRepresentation->Statistics = Statistics.GetStatistics();
+  FAssetRegistryModule::AssetCreated(NewRepresentation);
+  Representation = NewRepresentation;
+
+  if (SaveNow) {
+    FVolumeAssetSaveQueue::Get().Enqueue(Package, NewRepresentation);
+  }
+}
+
+FVector2D URaymarchBlueprintLibrary::GetAutoWindowIntensityDomain(
+    const FVolumeStatistics& Statistics) {
+  if (!Statistics.bValid) {
+    return FVector2D(0.0f, 1.0f);
+  }
+  // Volumes with (almost) a single value have no usable percentile range.
+  if (Statistics.HighPercentile <= Statistics.LowPercentile) {
+    return FVector2D(Statistics.Min, FMath::Max(Statistics.Max, Statistics.Min + SMALL_NUMBER));
+  }
+  return FVector2D(Statistics.LowPercentile, Statistics.HighPercentile);
 }
 
 void URaymarchBlueprintLibrary::TryVolumeTextureSliceWrite(FIntVector Dimensions,
@@ -416,6 +820,10 @@ void URaymarchBlueprintLibrary::CreateBasicRaymarchingResources(
       RHICreateUnorderedAccessView(OutParameters.ALightVolumeRef->Resource->TextureRHI);
 
   OutParameters.isInitialized = true;
+
+  // A new volume (or the same one loaded again) needs its SH visibility precomputed again, if
+  // there was one for this light volume.
+  FShVisibilityVolumes::Get().Refresh(OutParameters, true);
 }
 
 void URaymarchBlueprintLibrary::CheckBasicRaymarchingResources(
@@ -472,6 +880,40 @@ void URaymarchBlueprintLibrary::GenerateDistanceField(
   });
 }
 
+FString URaymarchBlueprintLibrary::BenchmarkCompressedMhdLoading(FString FileName) {
+  return BenchmarkCompressedLoading(FileName);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkVoxelConversionKernels(int32 NumVoxels) {
+  return BenchmarkVoxelConversion(NumVoxels);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkMhdFolderCatalog(FString Directory) {
+  return BenchmarkMhdCatalog(Directory);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkVolumeCompression(FString FileName) {
+  return BenchmarkVolumeCodec(FileName);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkFusedLights(FString FileName, int32 NumLights) {
+  return BenchmarkFusedLightPropagation(FileName, NumLights);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkRotatingLight(FString FileName, int32 NumSteps) {
+  return BenchmarkLightRotation(FileName, NumSteps);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkLightVolumeCache(FString FileName, int32 NumStates) {
+  return BenchmarkLightVolumeCaching(FileName, NumStates);
+}
+
+FString URaymarchBlueprintLibrary::BenchmarkShVisibilityRelighting(FString FileName,
+                                                                   int32 NumDirections,
+                                                                   int32 NumSteps) {
+  return BenchmarkShVisibility(FileName, NumDirections, NumSteps);
+}
+
 void URaymarchBlueprintLibrary::CustomLog(FString LoggedString, float Duration) {
   GEngine->AddOnScreenDebugMessage(-1, Duration, FColor::Yellow, LoggedString);
 }
@@ -501,6 +943,8 @@ void URaymarchBlueprintLibrary::ChangeTFInResources(
   Resources.TFRangeParameters = TFParameters;
   Resources.TFTextureRef = TransferFunction;
   OutResources = Resources;
+  // The SH visibility depends on the transfer function.
+  FShVisibilityVolumes::Get().Refresh(OutResources, false);
 }
 
 void URaymarchBlueprintLibrary::ChangeViewportProperties(FVector2D Origin, FVector2D Size) {
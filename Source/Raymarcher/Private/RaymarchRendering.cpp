@@ -16,6 +16,10 @@ IMPLEMENT_SHADER_TYPE(, FAddDirLightShader,
                       TEXT("/Plugin/VolumeRaymarching/Private/AddDirLightShader.usf"),
                       TEXT("MainComputeShader"), SF_Compute)
 
+IMPLEMENT_SHADER_TYPE(, FAddDirLightsShader,
+                      TEXT("/Plugin/VolumeRaymarching/Private/AddDirLightsShader.usf"),
+                      TEXT("MainComputeShader"), SF_Compute)
+
 IMPLEMENT_SHADER_TYPE(, FChangeDirLightShader,
                       TEXT("/Plugin/VolumeRaymarching/Private/ChangeDirLightShader.usf"),
                       TEXT("MainComputeShader"), SF_Compute)
@@ -24,6 +28,14 @@ IMPLEMENT_SHADER_TYPE(, FClearVolumeTextureShader,
                       TEXT("/Plugin/VolumeRaymarching/Private/ClearVolumeTextureShader.usf"),
                       TEXT("MainComputeShader"), SF_Compute)
 
+IMPLEMENT_SHADER_TYPE(, FCopyVolumeTextureShader,
+                      TEXT("/Plugin/VolumeRaymarching/Private/CopyVolumeTextureShader.usf"),
+                      TEXT("CopyToTextureCS"), SF_Compute)
+
+IMPLEMENT_SHADER_TYPE(, FReadVolumeTextureShader,
+                      TEXT("/Plugin/VolumeRaymarching/Private/CopyVolumeTextureShader.usf"),
+                      TEXT("CopyToBufferCS"), SF_Compute)
+
 IMPLEMENT_SHADER_TYPE(, FClearFloatRWTextureCS,
                       TEXT("/Plugin/VolumeRaymarching/Private/ClearTextureShader.usf"),
                       TEXT("MainComputeShader"), SF_Compute)
@@ -52,21 +64,28 @@ ETextureSourceFormat PixelFormatToSourceFormat(EPixelFormat PixelFormat) {
   }
 }
 
-FIntVector GetTransposedDimensions(const FMajorAxes& Axes, const FRHITexture3D* VolumeRef,
+FIntVector GetTransposedDimensions(const FMajorAxes& Axes, const FIntVector Dimensions,
                                    const unsigned index) {
   FCubeFace face = Axes.FaceWeight[index].first;
   unsigned axis = (uint8)face / 2;
   switch (axis) {
     case 0:  // going along X -> Volume Y = x, volume Z = y
-      return FIntVector(VolumeRef->GetSizeY(), VolumeRef->GetSizeZ(), VolumeRef->GetSizeX());
+      return FIntVector(Dimensions.Y, Dimensions.Z, Dimensions.X);
     case 1:  // going along Y -> Volume X = x, volume Z = y
-      return FIntVector(VolumeRef->GetSizeX(), VolumeRef->GetSizeZ(), VolumeRef->GetSizeY());
+      return FIntVector(Dimensions.X, Dimensions.Z, Dimensions.Y);
     case 2:  // going along Z -> Volume X = x, volume Y = y
-      return FIntVector(VolumeRef->GetSizeX(), VolumeRef->GetSizeY(), VolumeRef->GetSizeZ());
+      return FIntVector(Dimensions.X, Dimensions.Y, Dimensions.Z);
     default: check(false); return FIntVector(0, 0, 0);
   }
 }
 
+FIntVector GetTransposedDimensions(const FMajorAxes& Axes, const FRHITexture3D* VolumeRef,
+                                   const unsigned index) {
+  return GetTransposedDimensions(
+      Axes, FIntVector(VolumeRef->GetSizeX(), VolumeRef->GetSizeY(), VolumeRef->GetSizeZ()),
+      index);
+}
+
 int GetAxisDirection(const FMajorAxes& Axes, unsigned index) {
   // All even axis number are going down on their respective axes.
   return ((uint8)Axes.FaceWeight[index].first % 2 ? 1 : -1);
@@ -250,14 +269,9 @@ FSamplerStateRHIRef GetBufferSamplerRef(uint32 BorderColorInt) {
                                                            AM_Border, 0, 0, 0, 1, BorderColorInt));
 }
 
-// Returns the color int required for the given light color and major axis (single channel)
-uint32 GetBorderColorIntSingle(FDirLightParameters LightParams, FMajorAxes MajorAxes,
-                               unsigned index) {
-  // Set alpha channel to the texture's red channel (when reading single-channel, only red component
-  // is read)
-  FLinearColor LightColor =
-      FLinearColor(LightParams.LightIntensity * MajorAxes.FaceWeight[index].second, 0.0, 0.0, 0.0);
-  return LightColor.ToFColor(true).ToPackedARGB();
+FSamplerStateRHIRef GetTransmittanceBufferSamplerRef() {
+  // 1 is exact in the 8-bit border color, unlike the light alphas.
+  return GetBufferSamplerRef(FLinearColor(1.0, 0.0, 0.0, 0.0).ToFColor(true).ToPackedARGB());
 }
 
 // Returns the light's alpha at this major axis and weight (single channel)
@@ -303,6 +317,62 @@ void GetLoopStartStopIndexes(int& OutStart, int& OutStop, int& OutAxisDirection,
   }
 }
 
+FDirLightAxisPropagation GetDirLightAxisPropagation(
+    const FDirLightParameters& LocalLightParameters, const FMajorAxes& LocalMajorAxes,
+    const unsigned index, const FIntVector LightVolumeDimensions,
+    const FRaymarchWorldParameters WorldParameters) {
+  FDirLightAxisPropagation Propagation;
+  Propagation.Face = LocalMajorAxes.FaceWeight[index].first;
+  Propagation.TransposedDimensions =
+      GetTransposedDimensions(LocalMajorAxes, LightVolumeDimensions, index);
+  Propagation.PermutationMatrix = GetPermutationMatrix(LocalMajorAxes, index);
+  Propagation.UVOffset = GetUVOffset(Propagation.Face, -LocalLightParameters.LightDirection,
+                                     Propagation.TransposedDimensions);
+  GetStepSizeAndUVWOffset(Propagation.Face, -LocalLightParameters.LightDirection,
+                          Propagation.TransposedDimensions, WorldParameters, Propagation.StepSize,
+                          Propagation.UVWOffset);
+  // Normalize UVW offset to length of largest voxel size, same as in
+  // AddDirLightToSingleLightVolume_RenderThread.
+  const int LowestVoxelCount =
+      FMath::Min3(Propagation.TransposedDimensions.X, Propagation.TransposedDimensions.Y,
+                  Propagation.TransposedDimensions.Z);
+  Propagation.UVWOffset.Normalize();
+  Propagation.UVWOffset *= 1.0f / LowestVoxelCount;
+  Propagation.LightAlpha = GetLightAlpha(LocalLightParameters, LocalMajorAxes, index);
+  GetLoopStartStopIndexes(Propagation.Start, Propagation.Stop, Propagation.AxisDirection,
+                          LocalMajorAxes, index, Propagation.TransposedDimensions.Z);
+  return Propagation;
+}
+
+void GroupDirLightPropagations(const TArray<FDirLightParameters>& LightParameters,
+                               const bool Added, const FIntVector LightVolumeDimensions,
+                               const FRaymarchWorldParameters WorldParameters,
+                               TArray<FDirLightAxisPropagation> OutGroups[6]) {
+  for (const FDirLightParameters& Light : LightParameters) {
+    // Can't have directional light without direction...
+    if (Light.LightDirection == FVector(0.0, 0.0, 0.0)) {
+      UE_LOG(LogTemp, Warning, TEXT("Skipping a directional light that doesn't have a direction."));
+      continue;
+    }
+    FDirLightParameters LocalLightParams;
+    FMajorAxes LocalMajorAxes;
+    GetLocalLightParamsAndAxes(Light, WorldParameters.VolumeTransform, LocalLightParams,
+                               LocalMajorAxes);
+    for (unsigned i = 0; i < 2; i++) {
+      // Break if the axis weight == 0
+      if (LocalMajorAxes.FaceWeight[i].second == 0) {
+        break;
+      }
+      FDirLightAxisPropagation Propagation = GetDirLightAxisPropagation(
+          LocalLightParams, LocalMajorAxes, i, LightVolumeDimensions, WorldParameters);
+      if (!Added) {
+        Propagation.LightAlpha = -Propagation.LightAlpha;
+      }
+      OutGroups[(uint8)Propagation.Face].Add(Propagation);
+    }
+  }
+}
+
 // Used for swapping read/write buffers - transitions one to Readable and other to Writable.
 void TransitionBufferResources(FRHICommandListImmediate& RHICmdList,
                                FTextureRHIParamRef NewlyReadableTexture,
@@ -324,6 +394,10 @@ DECLARE_GPU_STAT_NAMED(GPUChangingLights, TEXT("ChangingLightsInVolume"));
 DECLARE_FLOAT_COUNTER_STAT(TEXT("ClearingLights"), STAT_GPU_ClearingLights, STATGROUP_GPU);
 DECLARE_GPU_STAT_NAMED(GPUClearingLights, TEXT("ClearingLightsInVolume"));
 
+// For making statistics about GPU use - Copying Light Volumes in and out of the cache.
+DECLARE_FLOAT_COUNTER_STAT(TEXT("CopyingLights"), STAT_GPU_CopyingLights, STATGROUP_GPU);
+DECLARE_GPU_STAT_NAMED(GPUCopyingLights, TEXT("CopyingLightVolumes"));
+
 void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICmdList,
                                                  FBasicRaymarchRenderingResources Resources,
                                                  const FDirLightParameters LightParameters,
@@ -369,12 +443,11 @@ void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICm
         LocalMajorAxes, Resources.ALightVolumeRef->Resource->TextureRHI->GetTexture3D(), i);
     OneAxisReadWriteBufferResources& Buffers = GetBuffers(LocalMajorAxes, i, Resources);
 
-    float LightAlpha = GetLightAlpha(LocalLightParams, LocalMajorAxes, i);
-
+    // The buffers hold the transmittance, the light alpha is applied in the shader.
     ClearFloatTextureRW(RHICmdList, Buffers.UAVs[0],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), LightAlpha);
+                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), 1.0f);
     ClearFloatTextureRW(RHICmdList, Buffers.UAVs[1],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), LightAlpha);
+                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), 1.0f);
   }
 
   // Find and set compute shader
@@ -408,8 +481,7 @@ void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICm
     }
     OneAxisReadWriteBufferResources& Buffers = GetBuffers(LocalMajorAxes, i, Resources);
 
-    uint32 ColorInt = GetBorderColorIntSingle(LocalLightParams, LocalMajorAxes, i);
-    FSamplerStateRHIRef readBuffSampler = GetBufferSamplerRef(ColorInt);
+    FSamplerStateRHIRef readBuffSampler = GetTransmittanceBufferSamplerRef();
 
     // Get the X, Y and Z transposed into the current axis orientation.
     FIntVector TransposedDimensions = GetTransposedDimensions(
@@ -437,6 +509,8 @@ void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICm
     UVWOffset *= LongestVoxelSide;
 
     ComputeShader->SetStepSize(RHICmdList, ShaderRHI, StepSize);
+    ComputeShader->SetLightAlpha(RHICmdList, ShaderRHI,
+                                 GetLightAlpha(LocalLightParams, LocalMajorAxes, i));
     ComputeShader->SetPermutationMatrix(RHICmdList, ShaderRHI, PermutationMatrix);
     ComputeShader->SetUVOffset(RHICmdList, ShaderRHI, UVOffset);
     ComputeShader->SetUVWOffset(RHICmdList, ShaderRHI, UVWOffset);
@@ -470,6 +544,131 @@ void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICm
                                 EResourceTransitionPipeline::EComputeToGfx, AVolumeUAV);
 }
 
+// Read-write buffer arrays for FAddDirLightsShader by size. Sweeps never overlap, so volumes with
+// the same buffer sizes share them. Only touched on the render thread.
+static TMap<FIntPoint, OneAxisFusedBufferResources> FusedBuffers;
+
+// Returns the buffer arrays of the given size, making them the first time they're needed - most
+// volumes never propagate several lights at once or change a light across axes.
+static OneAxisFusedBufferResources& GetFusedBuffers_RenderThread(const FIntPoint Size) {
+  check(IsInRenderingThread());
+  OneAxisFusedBufferResources* Found = FusedBuffers.Find(Size);
+  if (Found) {
+    return *Found;
+  }
+  OneAxisFusedBufferResources& Buffers = FusedBuffers.Add(Size);
+  FRHIResourceCreateInfo CreateInfo(FClearValueBinding::Transparent);
+  for (int i = 0; i < 2; i++) {
+    Buffers.Buffers[i] =
+        RHICreateTexture2DArray(Size.X, Size.Y, MAX_FUSED_DIR_LIGHTS, PF_R32_FLOAT, 1,
+                                TexCreate_ShaderResource | TexCreate_UAV, CreateInfo);
+    Buffers.UAVs[i] = RHICreateUnorderedAccessView(Buffers.Buffers[i], 0);
+  }
+  return Buffers;
+}
+
+void ReleaseFusedBuffers_RenderThread() {
+  check(IsInRenderingThread());
+  FusedBuffers.Empty();
+}
+
+// Propagates grouped lights (see GroupDirLightPropagations) with FAddDirLightsShader - one sweep
+// per face the lights enter through, or more if there's more lights than the buffer arrays have
+// layers.
+static void PropagateDirLightGroups_RenderThread(FRHICommandListImmediate& RHICmdList,
+                                                 FBasicRaymarchRenderingResources& Resources,
+                                                 const TArray<FDirLightAxisPropagation> Groups[6],
+                                                 const FRaymarchWorldParameters& WorldParameters) {
+  // Transform clipping parameters into local space.
+  FClippingPlaneParameters LocalClippingParameters = GetLocalClippingParameters(WorldParameters);
+
+  // Find and set compute shader
+  TShaderMap<FGlobalShaderType>* GlobalShaderMap = GetGlobalShaderMap(ERHIFeatureLevel::SM5);
+  TShaderMapRef<FAddDirLightsShader> ComputeShader(GlobalShaderMap);
+  FComputeShaderRHIParamRef ShaderRHI = ComputeShader->GetComputeShader();
+  RHICmdList.SetComputeShader(ShaderRHI);
+
+  FUnorderedAccessViewRHIRef AVolumeUAV = Resources.ALightVolumeUAVRef;
+  RHICmdList.TransitionResource(EResourceTransitionAccess::ERWNoBarrier,
+                                EResourceTransitionPipeline::EGfxToCompute, AVolumeUAV);
+
+  ComputeShader->SetRaymarchParameters(RHICmdList, ShaderRHI, LocalClippingParameters,
+                                       Resources.TFRangeParameters.IntensityDomain);
+  ComputeShader->SetRaymarchResources(
+      RHICmdList, ShaderRHI, Resources.VolumeTextureRef->Resource->TextureRHI->GetTexture3D(),
+      Resources.TFTextureRef->Resource->TextureRHI->GetTexture2D());
+  ComputeShader->SetALightVolume(RHICmdList, ShaderRHI, AVolumeUAV);
+
+  FSamplerStateRHIRef ReadBuffSampler = GetTransmittanceBufferSamplerRef();
+
+  for (int32 Face = 0; Face < 6; Face++) {
+    const TArray<FDirLightAxisPropagation>& Group = Groups[Face];
+    // Groups with more lights than the buffer arrays have layers take more sweeps.
+    for (int32 First = 0; First < Group.Num(); First += MAX_FUSED_DIR_LIGHTS) {
+      const int32 NumLights = FMath::Min(Group.Num() - First, MAX_FUSED_DIR_LIGHTS);
+      FVector4 PixelOffsets[MAX_FUSED_DIR_LIGHTS];
+      FVector4 UVWOffsets[MAX_FUSED_DIR_LIGHTS];
+      FVector4 LightParams[MAX_FUSED_DIR_LIGHTS];
+      for (int32 i = 0; i < NumLights; i++) {
+        const FDirLightAxisPropagation& Propagation = Group[First + i];
+        PixelOffsets[i] = FVector4(Propagation.UVOffset.X, Propagation.UVOffset.Y, 0.0f, 0.0f);
+        UVWOffsets[i] = FVector4(Propagation.UVWOffset, 0.0f);
+        LightParams[i] = FVector4(Propagation.StepSize, Propagation.LightAlpha, 0.0f, 0.0f);
+      }
+
+      // Dimensions, permutation and loop are the same for all lights entering through a face.
+      const FDirLightAxisPropagation& Sweep = Group[First];
+      OneAxisFusedBufferResources& Buffers = GetFusedBuffers_RenderThread(
+          FIntPoint(Sweep.TransposedDimensions.X, Sweep.TransposedDimensions.Y));
+
+      ComputeShader->SetPermutationMatrix(RHICmdList, ShaderRHI, Sweep.PermutationMatrix);
+      ComputeShader->SetLights(RHICmdList, ShaderRHI, PixelOffsets, UVWOffsets, LightParams,
+                               NumLights);
+
+      uint32 GroupSizeX =
+          FMath::DivideAndRoundUp(Sweep.TransposedDimensions.X, NUM_THREADS_PER_GROUP_DIMENSION);
+      uint32 GroupSizeY =
+          FMath::DivideAndRoundUp(Sweep.TransposedDimensions.Y, NUM_THREADS_PER_GROUP_DIMENSION);
+
+      for (int j = Sweep.Start; j != Sweep.Stop; j += Sweep.AxisDirection) {
+        // Switch read and write buffers each row. The first slice doesn't read, so the buffers
+        // don't need to be cleared.
+        ComputeShader->SetLoop(RHICmdList, ShaderRHI, j, j == Sweep.Start, Buffers.Buffers[j % 2],
+                               ReadBuffSampler, Buffers.UAVs[1 - j % 2]);
+        DispatchComputeShader(RHICmdList, *ComputeShader, GroupSizeX, GroupSizeY, 1);
+      }
+    }
+  }
+
+  // Unbind UAVs.
+  ComputeShader->UnbindResources(RHICmdList, ShaderRHI);
+
+  // Transition resources back to the renderer.
+  RHICmdList.TransitionResource(EResourceTransitionAccess::EReadable,
+                                EResourceTransitionPipeline::EComputeToGfx, AVolumeUAV);
+}
+
+void AddDirLightsToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICmdList,
+                                                  FBasicRaymarchRenderingResources Resources,
+                                                  const TArray<FDirLightParameters> LightParameters,
+                                                  const bool Added,
+                                                  const FRaymarchWorldParameters WorldParameters) {
+  check(IsInRenderingThread());
+
+  const FIntVector LightVolumeSize =
+      FIntVector(Resources.ALightVolumeRef->GetSizeX(), Resources.ALightVolumeRef->GetSizeY(),
+                 Resources.ALightVolumeRef->GetSizeZ());
+  TArray<FDirLightAxisPropagation> Groups[6];
+  GroupDirLightPropagations(LightParameters, Added, LightVolumeSize, WorldParameters, Groups);
+
+  // For GPU profiling.
+  SCOPED_DRAW_EVENTF(RHICmdList, AddDirLightsToSingleLightVolume_RenderThread,
+                     TEXT("Adding Lights"));
+  SCOPED_GPU_STAT(RHICmdList, GPUAddingLights);
+
+  PropagateDirLightGroups_RenderThread(RHICmdList, Resources, Groups, WorldParameters);
+}
+
 void ChangeDirLightInSingleLightVolume_RenderThread(
     FRHICommandListImmediate& RHICmdList, FBasicRaymarchRenderingResources Resources,
     const FDirLightParameters RemovedLightParameters,
@@ -494,13 +693,27 @@ void ChangeDirLightInSingleLightVolume_RenderThread(
   GetLocalLightParamsAndAxes(AddedLightParameters, WorldParameters.VolumeTransform,
                              AddedLocalLightParams, AddedLocalMajorAxes);
 
-  // If lights have different major axes, do a separate removal and addition.
+  // If lights have different major axes, remove and add them in the same sweeps anyway. The
+  // removal and addition along the faces both lights enter through share a sweep, which merges
+  // their difference into the light volume once per voxel. Only the faces just one of them enters
+  // through need a sweep of their own, so crossing between axes takes 2 or 3 sweeps instead of 4.
   if (RemovedLocalMajorAxes.FaceWeight[0].first != AddedLocalMajorAxes.FaceWeight[0].first ||
       RemovedLocalMajorAxes.FaceWeight[1].first != AddedLocalMajorAxes.FaceWeight[1].first) {
-    AddDirLightToSingleLightVolume_RenderThread(RHICmdList, Resources, RemovedLightParameters,
-                                                false, WorldParameters);
-    AddDirLightToSingleLightVolume_RenderThread(RHICmdList, Resources, AddedLightParameters, true,
-                                                WorldParameters);
+    const FIntVector LightVolumeSize =
+        FIntVector(Resources.ALightVolumeRef->GetSizeX(), Resources.ALightVolumeRef->GetSizeY(),
+                   Resources.ALightVolumeRef->GetSizeZ());
+    TArray<FDirLightAxisPropagation> Groups[6];
+    GroupDirLightPropagations({RemovedLightParameters}, false, LightVolumeSize, WorldParameters,
+                              Groups);
+    GroupDirLightPropagations({AddedLightParameters}, true, LightVolumeSize, WorldParameters,
+                              Groups);
+
+    // For GPU profiling.
+    SCOPED_DRAW_EVENTF(RHICmdList, ChangeDirLightInSingleLightVolume_RenderThread,
+                       TEXT("Changing Lights"));
+    SCOPED_GPU_STAT(RHICmdList, GPUChangingLights);
+
+    PropagateDirLightGroups_RenderThread(RHICmdList, Resources, Groups, WorldParameters);
     return;
   }
 
@@ -513,21 +726,12 @@ void ChangeDirLightInSingleLightVolume_RenderThread(
         RemovedLocalMajorAxes, Resources.ALightVolumeRef->Resource->TextureRHI->GetTexture3D(), i);
     OneAxisReadWriteBufferResources& Buffers = GetBuffers(RemovedLocalMajorAxes, i, Resources);
 
-    float RemovedLightAlpha = GetLightAlpha(RemovedLocalLightParams, RemovedLocalMajorAxes, i);
-    float AddedLightAlpha = GetLightAlpha(AddedLocalLightParams, AddedLocalMajorAxes, i);
-
-    // Clear R/W buffers for Removed Light
-    ClearFloatTextureRW(RHICmdList, Buffers.UAVs[0],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y),
-                        RemovedLightAlpha);
-    ClearFloatTextureRW(RHICmdList, Buffers.UAVs[1],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y),
-                        RemovedLightAlpha);
-    // Clear R/W buffers for Added Light
-    ClearFloatTextureRW(RHICmdList, Buffers.UAVs[2],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), AddedLightAlpha);
-    ClearFloatTextureRW(RHICmdList, Buffers.UAVs[3],
-                        FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), AddedLightAlpha);
+    // Clear R/W buffers for both lights to full transmittance, the light alphas are applied in the
+    // shader.
+    for (int32 BufferIndex = 0; BufferIndex < 4; BufferIndex++) {
+      ClearFloatTextureRW(RHICmdList, Buffers.UAVs[BufferIndex],
+                          FIntPoint(TransposedDimensions.X, TransposedDimensions.Y), 1.0f);
+    }
   }
 
   // For GPU profiling.
@@ -559,13 +763,9 @@ void ChangeDirLightInSingleLightVolume_RenderThread(
   ComputeShader->SetALightVolume(RHICmdList, ShaderRHI, AVolumeUAV);
 
   for (unsigned i = 0; i < 2; i++) {
-    // Get Color ints for texture borders.
-    uint32 RemovedColorInt =
-        GetBorderColorIntSingle(RemovedLocalLightParams, RemovedLocalMajorAxes, i);
-    uint32 AddedColorInt = GetBorderColorIntSingle(AddedLocalLightParams, AddedLocalMajorAxes, i);
-    // Get the sampler for read buffer to use border with the proper light color.
-    FSamplerStateRHIRef RemovedReadBuffSampler = GetBufferSamplerRef(RemovedColorInt);
-    FSamplerStateRHIRef AddedReadBuffSampler = GetBufferSamplerRef(AddedColorInt);
+    // Both read buffers hold transmittances, so they share the sampler with a border of 1.
+    FSamplerStateRHIRef RemovedReadBuffSampler = GetTransmittanceBufferSamplerRef();
+    FSamplerStateRHIRef AddedReadBuffSampler = RemovedReadBuffSampler;
 
     OneAxisReadWriteBufferResources& Buffers = GetBuffers(RemovedLocalMajorAxes, i, Resources);
     // TODO take these from buffers.
@@ -608,6 +808,9 @@ void ChangeDirLightInSingleLightVolume_RenderThread(
     RemovedUVWOffset *= LongestVoxelSide;
 
     ComputeShader->SetStepSizes(RHICmdList, ShaderRHI, AddedStepSize, RemovedStepSize);
+    ComputeShader->SetLightAlphas(
+        RHICmdList, ShaderRHI, GetLightAlpha(AddedLocalLightParams, AddedLocalMajorAxes, i),
+        GetLightAlpha(RemovedLocalLightParams, RemovedLocalMajorAxes, i));
 
     ComputeShader->SetPixelOffsets(RHICmdList, ShaderRHI, AddedPixOffset, RemovedPixOffset);
     ComputeShader->SetUVWOffsets(RHICmdList, ShaderRHI, AddedUVWOffset, RemovedUVWOffset);
@@ -687,6 +890,82 @@ void ClearVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList,
                                 EResourceTransitionPipeline::EComputeToGfx, VolumeUAVRef);
 }
 
+void CopyVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture3D* Source,
+                                    FRHITexture3D* Target) {
+  TShaderMap<FGlobalShaderType>* GlobalShaderMap = GetGlobalShaderMap(ERHIFeatureLevel::SM5);
+  TShaderMapRef<FCopyVolumeTextureShader> ComputeShader(GlobalShaderMap);
+
+  // For GPU profiling.
+  SCOPED_DRAW_EVENTF(RHICmdList, CopyVolumeTexture_RenderThread, TEXT("Copying light volume"));
+  SCOPED_GPU_STAT(RHICmdList, GPUCopyingLights);
+
+  RHICmdList.SetComputeShader(ComputeShader->GetComputeShader());
+  FUnorderedAccessViewRHIRef TargetUAVRef = RHICreateUnorderedAccessView(Target);
+  // Every thread writes its own voxels only, see ClearVolumeTexture_RenderThread.
+  RHICmdList.TransitionResource(EResourceTransitionAccess::ERWNoBarrier,
+                                EResourceTransitionPipeline::EGfxToCompute, TargetUAVRef);
+
+  ComputeShader->SetParameters(RHICmdList, Source, TargetUAVRef, Target->GetSizeZ());
+
+  uint32 GroupSizeX =
+      FMath::DivideAndRoundUp((int32)Target->GetSizeX(), NUM_THREADS_PER_GROUP_DIMENSION);
+  uint32 GroupSizeY =
+      FMath::DivideAndRoundUp((int32)Target->GetSizeY(), NUM_THREADS_PER_GROUP_DIMENSION);
+
+  DispatchComputeShader(RHICmdList, *ComputeShader, GroupSizeX, GroupSizeY, 1);
+  ComputeShader->UnbindResources(RHICmdList);
+
+  RHICmdList.TransitionResource(EResourceTransitionAccess::EReadable,
+                                EResourceTransitionPipeline::EComputeToGfx, TargetUAVRef);
+}
+
+bool ReadVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture3D* Source,
+                                    float* OutVoxels) {
+  TShaderMap<FGlobalShaderType>* GlobalShaderMap = GetGlobalShaderMap(ERHIFeatureLevel::SM5);
+  TShaderMapRef<FReadVolumeTextureShader> ComputeShader(GlobalShaderMap);
+
+  const int64 TotalSize =
+      (int64)Source->GetSizeX() * Source->GetSizeY() * Source->GetSizeZ() * sizeof(float);
+  if (TotalSize > MAX_uint32) {
+    UE_LOG(LogTemp, Warning, TEXT("Volume texture too big to be read back."));
+    return false;
+  }
+  const uint32 BufferSize = (uint32)TotalSize;
+  FRHIResourceCreateInfo CreateInfo;
+  FVertexBufferRHIRef Buffer = RHICreateVertexBuffer(
+      BufferSize, BUF_UnorderedAccess | BUF_ShaderResource, CreateInfo);
+  FUnorderedAccessViewRHIRef BufferUAVRef = RHICreateUnorderedAccessView(Buffer, PF_R32_FLOAT);
+
+  {
+    // For GPU profiling.
+    SCOPED_DRAW_EVENTF(RHICmdList, ReadVolumeTexture_RenderThread, TEXT("Reading light volume"));
+    SCOPED_GPU_STAT(RHICmdList, GPUCopyingLights);
+
+    RHICmdList.SetComputeShader(ComputeShader->GetComputeShader());
+    RHICmdList.TransitionResource(EResourceTransitionAccess::ERWNoBarrier,
+                                  EResourceTransitionPipeline::EGfxToCompute, BufferUAVRef);
+
+    ComputeShader->SetParameters(RHICmdList, Source, BufferUAVRef, Source->GetSizeZ());
+
+    uint32 GroupSizeX =
+        FMath::DivideAndRoundUp((int32)Source->GetSizeX(), NUM_THREADS_PER_GROUP_DIMENSION);
+    uint32 GroupSizeY =
+        FMath::DivideAndRoundUp((int32)Source->GetSizeY(), NUM_THREADS_PER_GROUP_DIMENSION);
+
+    DispatchComputeShader(RHICmdList, *ComputeShader, GroupSizeX, GroupSizeY, 1);
+    ComputeShader->UnbindResources(RHICmdList);
+
+    RHICmdList.TransitionResource(EResourceTransitionAccess::EReadable,
+                                  EResourceTransitionPipeline::EComputeToGfx, BufferUAVRef);
+  }
+
+  // Locking for reading flushes the command list and waits until the GPU wrote the buffer.
+  const void* BufferData = RHILockVertexBuffer(Buffer, 0, BufferSize, RLM_ReadOnly);
+  FMemory::Memcpy(OutVoxels, BufferData, BufferSize);
+  RHIUnlockVertexBuffer(Buffer);
+  return true;
+}
+
 #undef LOCTEXT_NAMESPACE
 
 /*
@@ -2,7 +2,12 @@
 // Developed by Tomas Bartipan (tomas.bartipan@tum.de)
 
 #include "Raymarcher.h"
+#include "Misc/CoreDelegates.h"
+#include "LightVolumeCache.h"
 #include "Misc/Paths.h"
+#include "RaymarchRendering.h"
+#include "ShVisibilityVolume.h"
+#include "VolumeAssetSaveQueue.h"
 
 #define LOCTEXT_NAMESPACE "FRaymarcherModule"
 
@@ -13,11 +18,29 @@ void FRaymarcherModule::StartupModule() {
   FString PluginShaderDir = FPaths::Combine(FPaths::ProjectPluginsDir(), TEXT("VolumeRaymarching"));
   PluginShaderDir = FPaths::Combine(PluginShaderDir, TEXT("Shaders"));
   AddShaderSourceDirectoryMapping(TEXT("/Plugin/VolumeRaymarching"), PluginShaderDir);
+
+  PreExitHandle =
+      FCoreDelegates::OnPreExit.AddStatic(&FRaymarcherModule::FlushAndReleaseResources);
 }
 
 void FRaymarcherModule::ShutdownModule() {
   // This function may be called during shutdown to clean up your module.  For modules that support
   // dynamic reloading, we call this function before unloading the module.
+  FCoreDelegates::OnPreExit.Remove(PreExitHandle);
+  FlushAndReleaseResources();
+}
+
+void FRaymarcherModule::FlushAndReleaseResources() {
+  // Assets still being saved in the background have to be written before the engine goes away, SH
+  // visibility precomputes have to stop before the volumes they read are gone.
+  // Cached light volumes in video memory and the fused light propagation buffers have to be
+  // released while the RHI is still there.
+  FVolumeAssetSaveQueue::Get().Flush();
+  FLightVolumeCache::Get().Empty();
+  FShVisibilityVolumes::Get().Empty();
+  ENQUEUE_RENDER_COMMAND(ReleaseFusedBuffersCommand)
+  ([](FRHICommandListImmediate& RHICmdList) { ReleaseFusedBuffers_RenderThread(); });
+  FlushRenderingCommands();
 }
 
 #undef LOCTEXT_NAMESPACE
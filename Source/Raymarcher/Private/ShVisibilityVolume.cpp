@@ -0,0 +1,289 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "ShVisibilityVolume.h"
+#include "Async/Async.h"
+#include "Async/ParallelFor.h"
+
+// Evaluates the real SH basis functions of bands 0 to 2 in a unit direction.
+static void EvaluateShBasis(const FVector& Direction,
+                            float OutBasis[SH_VISIBILITY_NUM_COEFFICIENTS]) {
+  const float X = Direction.X;
+  const float Y = Direction.Y;
+  const float Z = Direction.Z;
+  OutBasis[0] = 0.282095f;
+  OutBasis[1] = 0.488603f * Y;
+  OutBasis[2] = 0.488603f * Z;
+  OutBasis[3] = 0.488603f * X;
+  OutBasis[4] = 1.092548f * X * Y;
+  OutBasis[5] = 1.092548f * Y * Z;
+  OutBasis[6] = 0.315392f * (3.0f * Z * Z - 1.0f);
+  OutBasis[7] = 1.092548f * X * Z;
+  OutBasis[8] = 0.546274f * (X * X - Y * Y);
+}
+
+// The Index-th of Count directions on a Fibonacci spiral - evenly spread over the sphere, so every
+// direction stands for the same solid angle.
+static FVector GetSphereDirection(const int32 Index, const int32 Count) {
+  const float GoldenAngle = PI * (3.0f - FMath::Sqrt(5.0f));
+  const float Z = 1.0f - (2.0f * Index + 1.0f) / Count;
+  const float Radius = FMath::Sqrt(FMath::Max(1.0f - Z * Z, 0.0f));
+  const float Angle = GoldenAngle * Index;
+  return FVector(Radius * FMath::Cos(Angle), Radius * FMath::Sin(Angle), Z);
+}
+
+bool FShVisibilityVolume::Precompute(const FLightPropagationVolume& Volume,
+                                     const FIntVector VisibilityDimensions,
+                                     const FRaymarchWorldParameters& WorldParameters,
+                                     const int32 NumDirections,
+                                     const FThreadSafeBool* bCancelled) {
+  if (NumDirections < 1 || VisibilityDimensions.X < 1 || VisibilityDimensions.Y < 1 ||
+      VisibilityDimensions.Z < 1) {
+    return false;
+  }
+  Dimensions = VisibilityDimensions;
+  const int64 NumVoxels = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z;
+  const int64 SliceVoxels = (int64)Dimensions.X * Dimensions.Y;
+  Coefficients.SetNumZeroed(NumVoxels * SH_VISIBILITY_NUM_COEFFICIENTS);
+
+  TArray<float> Visibility;
+  Visibility.SetNumUninitialized(NumVoxels);
+  for (int32 i = 0; i < NumDirections; i++) {
+    if (bCancelled && *bCancelled) {
+      return false;
+    }
+    const FVector LocalDirection = GetSphereDirection(i, NumDirections);
+    // Monte Carlo projection - every direction is weighted by its share of the sphere.
+    float Basis[SH_VISIBILITY_NUM_COEFFICIENTS];
+    EvaluateShBasis(LocalDirection, Basis);
+    for (float& Value : Basis) {
+      Value *= 4.0f * PI / NumDirections;
+    }
+
+    // The propagation takes world directions and transforms them into local space.
+    FMemory::Memzero(Visibility.GetData(), NumVoxels * sizeof(float));
+    AddDirLightToLightVolume_Cpu(
+        Volume, Visibility.GetData(), Dimensions,
+        FDirLightParameters(WorldParameters.VolumeTransform.TransformVector(LocalDirection), 1.0f),
+        true, WorldParameters);
+
+    ParallelFor(Dimensions.Z, [&](const int32 Z) {
+      const float* Source = Visibility.GetData() + Z * SliceVoxels;
+      for (int32 k = 0; k < SH_VISIBILITY_NUM_COEFFICIENTS; k++) {
+        float* Plane = Coefficients.GetData() + k * NumVoxels + Z * SliceVoxels;
+        const float Weight = Basis[k];
+        for (int64 v = 0; v < SliceVoxels; v++) {
+          Plane[v] += Weight * Source[v];
+        }
+      }
+    });
+  }
+  return true;
+}
+
+void FShVisibilityVolume::Relight(const TArray<FDirLightParameters>& LightParameters,
+                                  const FTransform& VolumeTransform, float* OutLightVolume,
+                                  const FIntVector LightVolumeDimensions) const {
+  // The light volume is linear in the lights, so all of them are folded into a single set of
+  // weights first.
+  float Weights[SH_VISIBILITY_NUM_COEFFICIENTS] = {0.0f};
+  for (const FDirLightParameters& Light : LightParameters) {
+    FDirLightParameters LocalLight;
+    FMajorAxes LocalAxes;
+    GetLocalLightParamsAndAxes(Light, VolumeTransform, LocalLight, LocalAxes);
+    float Basis[SH_VISIBILITY_NUM_COEFFICIENTS];
+    EvaluateShBasis(LocalLight.LightDirection, Basis);
+    for (int32 k = 0; k < SH_VISIBILITY_NUM_COEFFICIENTS; k++) {
+      Weights[k] += LocalLight.LightIntensity * Basis[k];
+    }
+  }
+
+  const int64 NumVoxels = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z;
+  const int64 SliceVoxels = (int64)Dimensions.X * Dimensions.Y;
+  const bool bUpsample = LightVolumeDimensions != Dimensions;
+  TArray<float> Relit;
+  if (bUpsample) {
+    Relit.SetNumUninitialized(NumVoxels);
+  }
+  float* Target = bUpsample ? Relit.GetData() : OutLightVolume;
+
+  ParallelFor(Dimensions.Z, [&](const int32 Z) {
+    float* Row = Target + Z * SliceVoxels;
+    const float* Planes = Coefficients.GetData() + Z * SliceVoxels;
+    for (int64 v = 0; v < SliceVoxels; v++) {
+      Row[v] = Weights[0] * Planes[v];
+    }
+    for (int32 k = 1; k < SH_VISIBILITY_NUM_COEFFICIENTS; k++) {
+      const float* Plane = Planes + k * NumVoxels;
+      const float Weight = Weights[k];
+      for (int64 v = 0; v < SliceVoxels; v++) {
+        Row[v] += Weight * Plane[v];
+      }
+    }
+    // Truncating the SH makes it ring, which must not turn into negative light.
+    for (int64 v = 0; v < SliceVoxels; v++) {
+      Row[v] = FMath::Max(Row[v], 0.0f);
+    }
+  });
+  if (!bUpsample) {
+    return;
+  }
+
+  // Trilinear interpolation between voxel centers, clamped at the borders.
+  const FVector Scale(float(Dimensions.X) / LightVolumeDimensions.X,
+                      float(Dimensions.Y) / LightVolumeDimensions.Y,
+                      float(Dimensions.Z) / LightVolumeDimensions.Z);
+  auto GetCoordinate = [](const int32 Index, const float Scale, const int32 Size, int32& OutLow,
+                          int32& OutHigh, float& OutFraction) {
+    const float Coordinate =
+        FMath::Clamp((Index + 0.5f) * Scale - 0.5f, 0.0f, float(Size - 1));
+    OutLow = FMath::FloorToInt(Coordinate);
+    OutHigh = FMath::Min(OutLow + 1, Size - 1);
+    OutFraction = Coordinate - OutLow;
+  };
+  TArray<int32> XLow, XHigh;
+  TArray<float> XFraction;
+  XLow.SetNumUninitialized(LightVolumeDimensions.X);
+  XHigh.SetNumUninitialized(LightVolumeDimensions.X);
+  XFraction.SetNumUninitialized(LightVolumeDimensions.X);
+  for (int32 X = 0; X < LightVolumeDimensions.X; X++) {
+    GetCoordinate(X, Scale.X, Dimensions.X, XLow[X], XHigh[X], XFraction[X]);
+  }
+
+  ParallelFor(LightVolumeDimensions.Z, [&](const int32 Z) {
+    int32 Z0, Z1;
+    float FZ;
+    GetCoordinate(Z, Scale.Z, Dimensions.Z, Z0, Z1, FZ);
+    for (int32 Y = 0; Y < LightVolumeDimensions.Y; Y++) {
+      int32 Y0, Y1;
+      float FY;
+      GetCoordinate(Y, Scale.Y, Dimensions.Y, Y0, Y1, FY);
+      const float* Rows[4] = {&Relit[(Z0 * Dimensions.Y + Y0) * Dimensions.X],
+                              &Relit[(Z0 * Dimensions.Y + Y1) * Dimensions.X],
+                              &Relit[(Z1 * Dimensions.Y + Y0) * Dimensions.X],
+                              &Relit[(Z1 * Dimensions.Y + Y1) * Dimensions.X]};
+      const float RowWeights[4] = {(1 - FZ) * (1 - FY), (1 - FZ) * FY, FZ * (1 - FY), FZ * FY};
+      float* Output =
+          OutLightVolume + ((int64)Z * LightVolumeDimensions.Y + Y) * LightVolumeDimensions.X;
+      for (int32 X = 0; X < LightVolumeDimensions.X; X++) {
+        float Value = 0.0f;
+        for (int32 r = 0; r < 4; r++) {
+          Value += RowWeights[r] * FMath::Lerp(Rows[r][XLow[X]], Rows[r][XHigh[X]], XFraction[X]);
+        }
+        Output[X] = Value;
+      }
+    }
+  });
+}
+
+FShVisibilityVolumes& FShVisibilityVolumes::Get() {
+  static FShVisibilityVolumes Volumes;
+  return Volumes;
+}
+
+bool FShVisibilityVolumes::Precompute(const FBasicRaymarchRenderingResources& Resources,
+                                      const FRaymarchWorldParameters& WorldParameters,
+                                      const int32 NumDirections, const int32 Downsampling) {
+  UVolumeTexture* LightVolume = Resources.ALightVolumeRef;
+  FLightPropagationVolume Volume;
+  if (!LightVolume || NumDirections < 1 || Downsampling < 1 ||
+      !Volume.Init(Resources.VolumeTextureRef, Resources.TFTextureRef,
+                   Resources.TFRangeParameters)) {
+    MY_LOG("Can't precompute the SH visibility, the textures have no CPU copy.");
+    return false;
+  }
+  const FIntVector Dimensions(FMath::DivideAndRoundUp(LightVolume->GetSizeX(), Downsampling),
+                              FMath::DivideAndRoundUp(LightVolume->GetSizeY(), Downsampling),
+                              FMath::DivideAndRoundUp(LightVolume->GetSizeZ(), Downsampling));
+
+  // A precompute still running for an older state would only be dropped, so it's stopped first.
+  FPendingVolume& Pending = Volumes.FindOrAdd(FName(*LightVolume->GetPathName()));
+  Cancel(Pending);
+  Pending.Key =
+      FLightVolumeCacheKey::Make(Resources, TArray<FDirLightParameters>(), WorldParameters);
+  Pending.WorldParameters = WorldParameters;
+  Pending.NumDirections = NumDirections;
+  Pending.Downsampling = Downsampling;
+  Pending.bCancelled = MakeShared<FThreadSafeBool, ESPMode::ThreadSafe>(false);
+  Pending.Volume = Async<FShVisibilityVolumePtr>(
+      EAsyncExecution::ThreadPool, [Volume = MoveTemp(Volume), Dimensions, WorldParameters,
+                                    NumDirections, bCancelled = Pending.bCancelled]() {
+        TSharedPtr<FShVisibilityVolume, ESPMode::ThreadSafe> Visibility =
+            MakeShared<FShVisibilityVolume, ESPMode::ThreadSafe>();
+        if (!Visibility->Precompute(Volume, Dimensions, WorldParameters, NumDirections,
+                                    bCancelled.Get())) {
+          return FShVisibilityVolumePtr();
+        }
+        return FShVisibilityVolumePtr(Visibility);
+      });
+  return true;
+}
+
+bool FShVisibilityVolumes::Refresh(const FBasicRaymarchRenderingResources& Resources,
+                                   const bool bVolumeChanged) {
+  if (!Resources.ALightVolumeRef) {
+    return false;
+  }
+  const FPendingVolume* Pending = Volumes.Find(FName(*Resources.ALightVolumeRef->GetPathName()));
+  if (!Pending) {
+    return false;
+  }
+  if (!bVolumeChanged &&
+      Pending->Key == FLightVolumeCacheKey::Make(Resources, TArray<FDirLightParameters>(),
+                                                 Pending->WorldParameters)) {
+    return false;
+  }
+  // Precompute takes a reference into the map it changes.
+  const FRaymarchWorldParameters WorldParameters = Pending->WorldParameters;
+  return Precompute(Resources, WorldParameters, Pending->NumDirections, Pending->Downsampling);
+}
+
+FShVisibilityVolumePtr FShVisibilityVolumes::Find(
+    const FBasicRaymarchRenderingResources& Resources,
+    const FRaymarchWorldParameters& WorldParameters) const {
+  if (!Resources.ALightVolumeRef) {
+    return nullptr;
+  }
+  const FPendingVolume* Pending = Volumes.Find(FName(*Resources.ALightVolumeRef->GetPathName()));
+  if (!Pending || !Pending->Volume.IsReady() ||
+      Pending->Key !=
+          FLightVolumeCacheKey::Make(Resources, TArray<FDirLightParameters>(), WorldParameters)) {
+    return nullptr;
+  }
+  return Pending->Volume.Get();
+}
+
+void FShVisibilityVolumes::Flush() {
+  for (TPair<FName, FPendingVolume>& Pending : Volumes) {
+    Pending.Value.Volume.Wait();
+  }
+}
+
+void FShVisibilityVolumes::Remove(UVolumeTexture* LightVolume) {
+  if (!LightVolume) {
+    return;
+  }
+  const FName Name(*LightVolume->GetPathName());
+  FPendingVolume* Pending = Volumes.Find(Name);
+  if (Pending) {
+    Cancel(*Pending);
+    Volumes.Remove(Name);
+  }
+}
+
+void FShVisibilityVolumes::Empty() {
+  for (TPair<FName, FPendingVolume>& Pending : Volumes) {
+    Cancel(Pending.Value);
+  }
+  Volumes.Empty();
+}
+
+void FShVisibilityVolumes::Cancel(FPendingVolume& Pending) {
+  if (!Pending.Volume.IsValid()) {
+    return;
+  }
+  if (Pending.bCancelled) {
+    *Pending.bCancelled = true;
+  }
+  Pending.Volume.Wait();
+}
@@ -2,10 +2,25 @@
 // Developed by Tomas Bartipan (tomas.bartipan@tum.de)
 
 #include "TextureHelperFunctions.h"
+#include "MhdCompression.h"
+#include "VolumeAssetSaveQueue.h"
 
-bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntVector Dimensions,
-                              UVolumeTexture*& LoadedTexture, uint8* BulkData, bool Persistent,
-                              bool SaveNow, bool UAVCompatible) {
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+// Size of the slabs read by LoadRawFileConverted. Large enough to keep the per-read overhead low,
+// small enough that a handful of slabs in flight don't matter next to the volume itself.
+#define RAW_FILE_SLAB_SIZE (16 * 1024 * 1024)
+
+// Rows of a region closer together than this are read as one span - the OS reads whole pages, so
+// skipping smaller gaps doesn't save any I/O, only adds reads.
+#define RAW_REGION_MAX_GAP (4 * 1024)
+
+// Shared by both CreateVolumeTextureAsset overloads. If OwnedBulkData is given, it holds BulkData
+// and is freed as soon as the voxels are copied into the mip.
+static bool CreateVolumeTextureAssetImpl(FString AssetName, EPixelFormat PixelFormat,
+                                         FIntVector Dimensions, UVolumeTexture*& LoadedTexture,
+                                         const uint8* BulkData, TUniquePtr<uint8>* OwnedBulkData,
+                                         bool Persistent, bool SaveNow, bool UAVCompatible) {
   FString PackageName = TEXT("/Game/GeneratedTextures/");
   PackageName += AssetName;
   UPackage* Package = CreatePackage(NULL, *PackageName);
@@ -49,6 +64,10 @@ bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntV
   }
 
   mip->BulkData.Unlock();
+  // Everything from here on (including the source data of persistent textures) reads the mip.
+  if (OwnedBulkData) {
+    OwnedBulkData->Reset();
+  }
   // Add the new MIP to the list of mips.
   VolumeTexture->PlatformData->Mips.Add(mip);
 
@@ -68,15 +87,12 @@ bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntV
   // Pass out the reference to our brand new texture.
   LoadedTexture = VolumeTexture;
 
-  // Only save the asset if that is needed (as this is a disk operation and takes a long time)
+  // Only save the asset if that is needed. The file is written in the background (see
+  // FVolumeAssetSaveQueue), the texture can be used right away.
   // The texture does not need to be persistent to be saved, but if it's not, only a dummy 0x0x0
   // texture is saved.
   if (SaveNow) {
-    FString PackageFileName = FPackageName::LongPackageNameToFilename(
-        PackageName, FPackageName::GetAssetPackageExtension());
-    return UPackage::SavePackage(Package, VolumeTexture,
-                                 EObjectFlags::RF_Public | EObjectFlags::RF_Standalone,
-                                 *PackageFileName, GError, nullptr, true, true, SAVE_NoError);
+    return FVolumeAssetSaveQueue::Get().Enqueue(Package, VolumeTexture);
   } else {
     return true;
   }
@@ -106,19 +122,57 @@ bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntV
   // ActualMips++;
   //}
 }
-bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
-                              FIntVector Dimensions, uint8* BulkData, bool Persistent /*= false*/,
-                              bool SaveNow /*= false*/, bool UAVCompatible /*= false*/) {
+// Defined below, shared by the region updates and the in-place path of UpdateVolumeTextureAsset.
+static bool UpdateVolumeTextureBoxes(UVolumeTexture* VolumeTexture,
+                                     const TArray<FIntVector>& RegionMins,
+                                     const TArray<FIntVector>& RegionSizes, const uint8* Source,
+                                     const FIntVector SourceDimensions,
+                                     const TArray<FIntVector>& SourceMins,
+                                     TUniquePtr<uint8>* OwnedSource = nullptr,
+                                     bool* OutSourceSynced = nullptr);
+
+// Shared by both UpdateVolumeTextureAsset overloads, OwnedBulkData as in
+// CreateVolumeTextureAssetImpl.
+static bool UpdateVolumeTextureAssetImpl(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
+                                         FIntVector Dimensions, const uint8* BulkData,
+                                         TUniquePtr<uint8>* OwnedBulkData, bool Persistent,
+                                         bool SaveNow, bool UAVCompatible) {
   if (!VolumeTexture) {
     return false;
   }
 
+  int PixelByteSize = GPixelFormats[PixelFormat].BlockBytes;
+  const long long TotalSize = (long long)Dimensions.X * Dimensions.Y * Dimensions.Z * PixelByteSize;
+
+  // If only the voxels change, copy them into the existing texture and upload them instead of
+  // reallocating the data and recreating the resource.
+  const FTexturePlatformData* ExistingData = VolumeTexture->PlatformData;
+  bool bSourceSynced = false;
+  if (BulkData && ExistingData && ExistingData->PixelFormat == PixelFormat &&
+      ExistingData->SizeX == Dimensions.X && ExistingData->SizeY == Dimensions.Y &&
+      ExistingData->NumSlices == Dimensions.Z &&
+      VolumeTexture->bUAVCompatible == UAVCompatible &&
+      UpdateVolumeTextureBoxes(VolumeTexture, {FIntVector(0, 0, 0)}, {Dimensions}, BulkData,
+                               Dimensions, {FIntVector(0, 0, 0)}, OwnedBulkData, &bSourceSynced)) {
+#if WITH_EDITORONLY_DATA
+    // The source data was updated together with the mip already, it's only created again if there
+    // was none yet (or it has a different format).
+    if (bSourceSynced &&
+        VolumeTexture->Source.GetFormat() == PixelFormatToSourceFormat(PixelFormat)) {
+      return HandleTextureEditorData(VolumeTexture, PixelFormat, false, Dimensions, nullptr);
+    }
+#endif  // WITH_EDITORONLY_DATA
+    // An owned buffer now belongs to the upload, so the source data is created from the mip.
+    FByteBulkData& MipData = VolumeTexture->PlatformData->Mips[0].BulkData;
+    const bool RetVal = HandleTextureEditorData(VolumeTexture, PixelFormat, Persistent, Dimensions,
+                                                (const uint8*)MipData.LockReadOnly());
+    MipData.Unlock();
+    return RetVal;
+  }
+
   if (!VolumeTexture->PlatformData) {
     VolumeTexture->PlatformData = new FTexturePlatformData();
   }
-
-  int PixelByteSize = GPixelFormats[PixelFormat].BlockBytes;
-  const long long TotalSize = (long long)Dimensions.X * Dimensions.Y * Dimensions.Z * PixelByteSize;
   // Create the texture with given name and location. This will overwrite any existing asset with
   // that name.
 
@@ -157,6 +211,9 @@ bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelF
     FMemory::Memset(ByteArray, 0, TotalSize);
   }
   Mip->BulkData.Unlock();
+  if (OwnedBulkData) {
+    OwnedBulkData->Reset();
+  }
 
   // If saving fails because of unsupported source format when we want persistent, texture will be
   // updated, but false returned. This is a bit weird.
@@ -172,6 +229,191 @@ bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelF
   return RetVal;
 }
 
+bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntVector Dimensions,
+                              UVolumeTexture*& LoadedTexture, const uint8* BulkData,
+                              bool Persistent, bool SaveNow, bool UAVCompatible) {
+  return CreateVolumeTextureAssetImpl(AssetName, PixelFormat, Dimensions, LoadedTexture, BulkData,
+                                      nullptr, Persistent, SaveNow, UAVCompatible);
+}
+
+bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntVector Dimensions,
+                              UVolumeTexture*& LoadedTexture, TUniquePtr<uint8>&& BulkData,
+                              bool Persistent, bool SaveNow, bool UAVCompatible) {
+  const uint8* Voxels = BulkData.Get();
+  return CreateVolumeTextureAssetImpl(AssetName, PixelFormat, Dimensions, LoadedTexture, Voxels,
+                                      &BulkData, Persistent, SaveNow, UAVCompatible);
+}
+
+bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
+                              FIntVector Dimensions, const uint8* BulkData,
+                              bool Persistent /*= false*/,
+                              bool SaveNow /*= false*/, bool UAVCompatible /*= false*/) {
+  return UpdateVolumeTextureAssetImpl(VolumeTexture, PixelFormat, Dimensions, BulkData, nullptr,
+                                      Persistent, SaveNow, UAVCompatible);
+}
+
+bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
+                              FIntVector Dimensions, TUniquePtr<uint8>&& BulkData,
+                              bool Persistent, bool SaveNow, bool UAVCompatible) {
+  const uint8* Voxels = BulkData.Get();
+  return UpdateVolumeTextureAssetImpl(VolumeTexture, PixelFormat, Dimensions, Voxels, &BulkData,
+                                      Persistent, SaveNow, UAVCompatible);
+}
+
+// Copies a box of Size voxels from one volume into another.
+static void CopyVoxelBox(const uint8* Source, const FIntVector SourceDimensions,
+                         const FIntVector SourceMin, uint8* Destination,
+                         const FIntVector DestinationDimensions, const FIntVector DestinationMin,
+                         const FIntVector Size, const int32 BytesPerVoxel) {
+  const int64 RowBytes = (int64)Size.X * BytesPerVoxel;
+  for (int32 Z = 0; Z < Size.Z; Z++) {
+    for (int32 Y = 0; Y < Size.Y; Y++) {
+      const int64 SourceOffset =
+          (((int64)(SourceMin.Z + Z) * SourceDimensions.Y + SourceMin.Y + Y) * SourceDimensions.X +
+           SourceMin.X) *
+          BytesPerVoxel;
+      const int64 DestinationOffset = (((int64)(DestinationMin.Z + Z) * DestinationDimensions.Y +
+                                        DestinationMin.Y + Y) *
+                                           DestinationDimensions.X +
+                                       DestinationMin.X) *
+                                      BytesPerVoxel;
+      FMemory::Memcpy(Destination + DestinationOffset, Source + SourceOffset, RowBytes);
+    }
+  }
+}
+
+// Box I is read from Source at SourceMins[I], Source has SourceDimensions voxels. If OwnedSource
+// holds a single packed box, the box is uploaded straight from it and the upload takes ownership.
+// OutSourceSynced tells whether the editor source data was updated too.
+static bool UpdateVolumeTextureBoxes(UVolumeTexture* VolumeTexture,
+                                     const TArray<FIntVector>& RegionMins,
+                                     const TArray<FIntVector>& RegionSizes, const uint8* Source,
+                                     const FIntVector SourceDimensions,
+                                     const TArray<FIntVector>& SourceMins,
+                                     TUniquePtr<uint8>* OwnedSource, bool* OutSourceSynced) {
+  if (OutSourceSynced) {
+    *OutSourceSynced = false;
+  }
+  if (!VolumeTexture || !VolumeTexture->Resource || !VolumeTexture->PlatformData ||
+      VolumeTexture->PlatformData->Mips.Num() != 1 || !Source) {
+    return false;
+  }
+  const EPixelFormat PixelFormat = VolumeTexture->PlatformData->PixelFormat;
+  const int32 BytesPerVoxel = GPixelFormats[PixelFormat].BlockBytes;
+  FTexture2DMipMap& Mip = VolumeTexture->PlatformData->Mips[0];
+  const FIntVector Dimensions(Mip.SizeX, Mip.SizeY, Mip.SizeZ);
+  const int64 TotalSize = (int64)Dimensions.X * Dimensions.Y * Dimensions.Z * BytesPerVoxel;
+  // Cooked textures may have dropped their CPU copy once the resource was created.
+  if (Mip.BulkData.GetBulkDataSize() != TotalSize) {
+    return false;
+  }
+
+  if (RegionMins.Num() == 0) {
+    return true;
+  }
+
+  // Pack the boxes one after another for the upload.
+  TArray<int64> UploadOffsets;
+  int64 UploadSize = 0;
+  for (int32 i = 0; i < RegionMins.Num(); i++) {
+    const FIntVector Min = RegionMins[i];
+    const FIntVector Max = Min + RegionSizes[i];
+    if (Min.X < 0 || Min.Y < 0 || Min.Z < 0 || Max.X > Dimensions.X || Max.Y > Dimensions.Y ||
+        Max.Z > Dimensions.Z || RegionSizes[i].X <= 0 || RegionSizes[i].Y <= 0 ||
+        RegionSizes[i].Z <= 0) {
+      MY_LOG("Updated region is not inside the volume texture.");
+      return false;
+    }
+    UploadOffsets.Add(UploadSize);
+    UploadSize += (int64)RegionSizes[i].X * RegionSizes[i].Y * RegionSizes[i].Z * BytesPerVoxel;
+  }
+  TSharedPtr<uint8, ESPMode::ThreadSafe> OwnedUpload;
+  if (OwnedSource && OwnedSource->IsValid() && RegionMins.Num() == 1 &&
+      SourceDimensions == RegionSizes[0]) {
+    OwnedUpload = TSharedPtr<uint8, ESPMode::ThreadSafe>(OwnedSource->Release());
+  }
+  TArray<uint8> UploadData;
+  if (!OwnedUpload.IsValid()) {
+    UploadData.SetNumUninitialized(UploadSize);
+  }
+
+  uint8* MipData = (uint8*)Mip.BulkData.Lock(LOCK_READ_WRITE);
+  // A single box (e.g. a whole-volume update) is copied slice by slice, so it's parallel too.
+  const bool bSplitSlices = RegionMins.Num() == 1;
+  ParallelFor(bSplitSlices ? RegionSizes[0].Z : RegionMins.Num(), [&](int32 Item) {
+    const int32 i = bSplitSlices ? 0 : Item;
+    const FIntVector Slice(0, 0, bSplitSlices ? Item : 0);
+    const FIntVector Size(RegionSizes[i].X, RegionSizes[i].Y, bSplitSlices ? 1 : RegionSizes[i].Z);
+    CopyVoxelBox(Source, SourceDimensions, SourceMins[i] + Slice, MipData, Dimensions,
+                 RegionMins[i] + Slice, Size, BytesPerVoxel);
+    if (!OwnedUpload.IsValid()) {
+      CopyVoxelBox(Source, SourceDimensions, SourceMins[i] + Slice,
+                   UploadData.GetData() + UploadOffsets[i], RegionSizes[i], Slice, Size,
+                   BytesPerVoxel);
+    }
+  });
+  Mip.BulkData.Unlock();
+
+#if WITH_EDITORONLY_DATA
+  // Keep the source data of persistent textures in sync, so saving them saves the update.
+  FTextureSource& TextureSource = VolumeTexture->Source;
+  if (TextureSource.IsValid() && TextureSource.GetSizeX() == Dimensions.X &&
+      TextureSource.GetSizeY() == Dimensions.Y && TextureSource.GetNumSlices() == Dimensions.Z &&
+      TextureSource.GetBytesPerPixel() == BytesPerVoxel) {
+    uint8* SourceData = TextureSource.LockMip(0);
+    for (int32 i = 0; i < RegionMins.Num(); i++) {
+      CopyVoxelBox(Source, SourceDimensions, SourceMins[i], SourceData, Dimensions, RegionMins[i],
+                   RegionSizes[i], BytesPerVoxel);
+    }
+    TextureSource.UnlockMip(0);
+    if (OutSourceSynced) {
+      *OutSourceSynced = true;
+    }
+  }
+#endif  // WITH_EDITORONLY_DATA
+
+  TArray<FUpdateTextureRegion3D> UploadRegions;
+  for (int32 i = 0; i < RegionMins.Num(); i++) {
+    UploadRegions.Emplace(RegionMins[i].X, RegionMins[i].Y, RegionMins[i].Z, 0, 0, 0,
+                          RegionSizes[i].X, RegionSizes[i].Y, RegionSizes[i].Z);
+  }
+  FTextureResource* Resource = VolumeTexture->Resource;
+  ENQUEUE_RENDER_COMMAND(UpdateVolumeTextureRegionsCommand)
+  ([Resource, BytesPerVoxel, UploadRegions, UploadOffsets, OwnedUpload,
+    UploadData = MoveTemp(UploadData)](FRHICommandListImmediate& RHICmdList) {
+    if (!Resource->TextureRHI) {
+      return;
+    }
+    FRHITexture3D* Texture = Resource->TextureRHI->GetTexture3D();
+    const uint8* Upload = OwnedUpload.IsValid() ? OwnedUpload.Get() : UploadData.GetData();
+    for (int32 i = 0; i < UploadRegions.Num(); i++) {
+      const FUpdateTextureRegion3D& Region = UploadRegions[i];
+      RHIUpdateTexture3D(Texture, 0, Region, Region.Width * BytesPerVoxel,
+                         Region.Width * Region.Height * BytesPerVoxel,
+                         Upload + UploadOffsets[i]);
+    }
+  });
+  return true;
+}
+
+bool UpdateVolumeTextureRegion(UVolumeTexture* VolumeTexture, FIntVector RegionMin,
+                               FIntVector RegionSize, const uint8* RegionData) {
+  return UpdateVolumeTextureBoxes(VolumeTexture, {RegionMin}, {RegionSize}, RegionData, RegionSize,
+                                  {FIntVector(0, 0, 0)});
+}
+
+bool UpdateVolumeTextureRegions(UVolumeTexture* VolumeTexture, const TArray<FIntVector>& RegionMins,
+                                const TArray<FIntVector>& RegionSizes, const uint8* Voxels) {
+  if (RegionMins.Num() != RegionSizes.Num() || !VolumeTexture || !VolumeTexture->PlatformData) {
+    return false;
+  }
+  const FIntVector Dimensions(VolumeTexture->PlatformData->SizeX,
+                              VolumeTexture->PlatformData->SizeY,
+                              VolumeTexture->PlatformData->NumSlices);
+  return UpdateVolumeTextureBoxes(VolumeTexture, RegionMins, RegionSizes, Voxels, Dimensions,
+                                  RegionMins);
+}
+
 bool HandleTextureEditorData(UTexture* Texture, const EPixelFormat PixelFormat,
                              const bool Persistent, const FIntVector Dimensions,
                              const uint8* BulkData) {
@@ -196,7 +438,9 @@ bool HandleTextureEditorData(UTexture* Texture, const EPixelFormat PixelFormat,
           0, 10, FColor::Red, "Trying to create persistent asset with unsupported pixel format!");
       return false;
     }
-    // Otherwise initialize the source struct with our size and bulk data.
+    // Otherwise initialize the source struct with our size and bulk data. This is stored
+    // uncompressed - UVolumeRepresentation::SetCompressedVoxels stores volumes losslessly
+    // compressed instead.
     Texture->Source.Init(Dimensions.X, Dimensions.Y, Dimensions.Z, 1, TextureSourceFormat,
                          BulkData);
   }
@@ -237,9 +481,826 @@ TUniquePtr<uint8> LoadRawFileIntoArray(const FString FileName, const int64 Bytes
   return LoadedArray;
 }
 
-bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint Dimensions,
-                          uint8* BulkData, bool Persistent, bool UAVCompatible, bool SaveNow,
-                          TextureAddress TilingX, TextureAddress TilingY) {
+// Returns the path under which a raw file can be opened - either the absolute path or relative to
+// the content directory. Returns an empty string if the file can't be found.
+static FString ResolveRawFilePath(const FString FileName) {
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  if (PlatformFile.FileExists(*FileName)) {
+    return FileName;
+  }
+  FString FullPath = FPaths::ProjectContentDir() + FileName;
+  if (PlatformFile.FileExists(*FullPath)) {
+    return FullPath;
+  }
+  return FString();
+}
+
+// Number of concurrent reads used when the caller doesn't specify it.
+static int32 GetDefaultReadsInFlight() {
+  return FMath::Clamp(FPlatformMisc::NumberOfCoresIncludingHyperthreads(), 2, 16);
+}
+
+bool ReadRawFileInSlabs(
+    const FString FileName, const int64 BytesToLoad, const int64 SlabSize, uint8* Destination,
+    TFunctionRef<void(uint8* SlabData, int64 SlabOffset, int64 SlabBytes)> ProcessSlab,
+    int32 MaxReadsInFlight, int64 HeaderSize, FVolumeLoadProgress* Progress) {
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  const FString FilePath = ResolveRawFilePath(FileName);
+  if (FilePath.IsEmpty()) {
+    MY_LOG("File could not be opened.");
+    return false;
+  }
+
+  const int64 FileSize = PlatformFile.FileSize(*FilePath);
+  if (HeaderSize < 0) {
+    // The data is at the end of the file.
+    HeaderSize = FMath::Max<int64>(FileSize - BytesToLoad, 0);
+  }
+  if (FileSize - HeaderSize < BytesToLoad) {
+    MY_LOG("File is smaller than expected, cannot read volume.");
+    return false;
+  } else if (FileSize - HeaderSize > BytesToLoad) {
+    MY_LOG(
+        "File is larger than expected, check your dimensions and pixel format (nonfatal, but the "
+        "texture will probably be screwed up)");
+  }
+
+  const int64 NumSlabs = FMath::DivideAndRoundUp(BytesToLoad, SlabSize);
+  if (MaxReadsInFlight <= 0) {
+    MaxReadsInFlight = GetDefaultReadsInFlight();
+  }
+  const int32 NumReaders = int32(FMath::Min<int64>(MaxReadsInFlight, NumSlabs));
+  if (Progress) {
+    Progress->Start(BytesToLoad);
+  }
+
+  // Readers grab the next unread slab until all are done. While one reader converts its slab, the
+  // others keep the disk busy.
+  FThreadSafeCounter NextSlab;
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  ParallelFor(NumReaders, [&](int32 ReaderIndex) {
+    TUniquePtr<IFileHandle> FileHandle(PlatformFile.OpenRead(*FilePath));
+    if (!FileHandle) {
+      bFailed = true;
+      return;
+    }
+    TUniquePtr<uint8[]> ScratchBuffer;
+    if (!Destination) {
+      ScratchBuffer.Reset(new uint8[SlabSize]);
+    }
+
+    for (int64 Slab = NextSlab.Increment() - 1; Slab < NumSlabs && !bFailed && !bCanceled;
+         Slab = NextSlab.Increment() - 1) {
+      const int64 SlabOffset = Slab * SlabSize;
+      const int64 SlabBytes = FMath::Min(SlabSize, BytesToLoad - SlabOffset);
+      uint8* SlabData = Destination ? Destination + SlabOffset : ScratchBuffer.Get();
+
+      if (!FileHandle->Seek(HeaderSize + SlabOffset) || !FileHandle->Read(SlabData, SlabBytes)) {
+        bFailed = true;
+        return;
+      }
+      ProcessSlab(SlabData, SlabOffset, SlabBytes);
+      if (Progress && !Progress->Advance(SlabBytes)) {
+        bCanceled = true;
+      }
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return false;
+  }
+  if (bFailed) {
+    MY_LOG("Reading the file failed.");
+    return false;
+  }
+  return true;
+}
+
+bool ReadRawFileSeries(
+    const TArray<FString>& FileNames, const int64 BytesPerFile, uint8* Destination,
+    TFunctionRef<void(uint8* FileData, int64 FileOffset, int64 FileBytes)> ProcessFile,
+    int32 MaxReadsInFlight, int64 HeaderSize, FVolumeLoadProgress* Progress) {
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  const int32 NumFiles = FileNames.Num();
+  if (MaxReadsInFlight <= 0) {
+    MaxReadsInFlight = GetDefaultReadsInFlight();
+  }
+  const int32 NumReaders = FMath::Min(MaxReadsInFlight, NumFiles);
+  if (Progress) {
+    Progress->Start(NumFiles * BytesPerFile);
+  }
+
+  // Readers grab the next unread file until all are done, same as in ReadRawFileInSlabs.
+  FThreadSafeCounter NextFile;
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  FThreadSafeBool bLargerThanExpected(false);
+  ParallelFor(NumReaders, [&](int32 ReaderIndex) {
+    TUniquePtr<uint8[]> ScratchBuffer;
+    if (!Destination) {
+      ScratchBuffer.Reset(new uint8[BytesPerFile]);
+    }
+
+    for (int32 File = NextFile.Increment() - 1; File < NumFiles && !bFailed && !bCanceled;
+         File = NextFile.Increment() - 1) {
+      const FString FilePath = ResolveRawFilePath(FileNames[File]);
+      TUniquePtr<IFileHandle> FileHandle(
+          FilePath.IsEmpty() ? nullptr : PlatformFile.OpenRead(*FilePath));
+      const int64 FileSize = FileHandle ? FileHandle->Size() : 0;
+      const int64 FileHeaderSize =
+          HeaderSize < 0 ? FMath::Max<int64>(FileSize - BytesPerFile, 0) : HeaderSize;
+      if (!FileHandle || FileSize - FileHeaderSize < BytesPerFile) {
+        UE_LOG(LogTemp, Warning, TEXT("Slice file %s is missing or too small."), *FileNames[File]);
+        bFailed = true;
+        return;
+      }
+      if (FileSize - FileHeaderSize > BytesPerFile) {
+        bLargerThanExpected = true;
+      }
+
+      const int64 FileOffset = File * BytesPerFile;
+      uint8* FileData = Destination ? Destination + FileOffset : ScratchBuffer.Get();
+      if (!FileHandle->Seek(FileHeaderSize) || !FileHandle->Read(FileData, BytesPerFile)) {
+        bFailed = true;
+        return;
+      }
+      ProcessFile(FileData, FileOffset, BytesPerFile);
+      if (Progress && !Progress->Advance(BytesPerFile)) {
+        bCanceled = true;
+      }
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return false;
+  }
+  if (bFailed) {
+    MY_LOG("Reading the file series failed.");
+    return false;
+  }
+  if (bLargerThanExpected) {
+    MY_LOG(
+        "Files are larger than expected, check your dimensions and pixel format (nonfatal, but the "
+        "texture will probably be screwed up)");
+  }
+  return true;
+}
+
+// Converts elements to the best pixel format, or through the window if one is given.
+static void ConvertOrWindowElements(const uint8* Source, uint8* Dest, const int64 NumElements,
+                                    const EMhdElementType ElementType, const FVoxelWindow* Window,
+                                    const bool SwapBytes) {
+  if (Window) {
+    FMhdInfo::WindowElements(Source, Dest, NumElements, ElementType, *Window, SwapBytes);
+  } else {
+    FMhdInfo::ConvertElements(Source, Dest, NumElements, ElementType, SwapBytes);
+  }
+}
+
+// Reads NumElements elements of SourceElementSize bytes from a single raw file or a file series and
+// converts every slab as it lands with Convert into a new array of ConvertedElementSize bytes per
+// element, adding the converted slab to Statistics if provided. If elements don't grow or shrink,
+// slabs are read straight into the final array and converted in-place. Otherwise every reader
+// converts from its own scratch slab.
+static TUniquePtr<uint8> ReadRawFilesConverted(
+    const TArray<FString>& FileNames, const int64 NumElements, const int32 SourceElementSize,
+    const int32 ConvertedElementSize, const int64 HeaderSize,
+    TFunctionRef<void(const uint8* Source, uint8* Dest, int64 Count)> Convert,
+    FVolumeLoadProgress* Progress, FVoxelStatisticsAccumulator* Statistics) {
+  if (FileNames.Num() == 0 || NumElements % FileNames.Num() != 0) {
+    MY_LOG("Volume can't be split evenly between its data files, cannot read volume.");
+    return nullptr;
+  }
+
+  auto ConvertedArray = TUniquePtr<uint8>(new uint8[NumElements * ConvertedElementSize]);
+  uint8* ConvertedData = ConvertedArray.Get();
+  uint8* ReadDestination = (SourceElementSize == ConvertedElementSize) ? ConvertedData : nullptr;
+  auto ConvertSlab = [&](uint8* SlabData, int64 SlabOffset, int64 SlabBytes) {
+    const int64 FirstElement = SlabOffset / SourceElementSize;
+    uint8* ConvertedSlab = ConvertedData + FirstElement * ConvertedElementSize;
+    Convert(SlabData, ConvertedSlab, SlabBytes / SourceElementSize);
+    if (Statistics) {
+      // The converted slab is still warm in the cache.
+      Statistics->AddVoxels(ConvertedSlab, SlabBytes / SourceElementSize);
+    }
+  };
+
+  bool bSuccess;
+  if (FileNames.Num() == 1) {
+    // Slabs hold a whole number of elements, so they can be converted independently.
+    const int64 SlabSize = RAW_FILE_SLAB_SIZE - (RAW_FILE_SLAB_SIZE % SourceElementSize);
+    bSuccess = ReadRawFileInSlabs(FileNames[0], NumElements * SourceElementSize, SlabSize,
+                                  ReadDestination, ConvertSlab, 0, HeaderSize, Progress);
+  } else {
+    // Every file is one slab.
+    const int64 BytesPerFile = (NumElements / FileNames.Num()) * SourceElementSize;
+    bSuccess = ReadRawFileSeries(FileNames, BytesPerFile, ReadDestination, ConvertSlab, 0,
+                                 HeaderSize, Progress);
+  }
+
+  if (!bSuccess) {
+    return nullptr;
+  }
+  MY_LOG("File was successfully read!");
+  return ConvertedArray;
+}
+
+TUniquePtr<uint8> LoadRawFileConverted(const FString FileName, const int64 NumElements,
+                                       const EMhdElementType ElementType,
+                                       EPixelFormat& OutPixelFormat, const FVoxelWindow* Window,
+                                       const bool ByteOrderMSB, const int64 HeaderSize,
+                                       FVolumeLoadProgress* Progress,
+                                       FVoxelStatisticsAccumulator* Statistics) {
+  return LoadRawFileSeriesConverted({FileName}, NumElements, ElementType, OutPixelFormat, Window,
+                                    ByteOrderMSB, HeaderSize, Progress, Statistics);
+}
+
+TUniquePtr<uint8> LoadRawFileSeriesConverted(const TArray<FString>& FileNames,
+                                             const int64 NumElements,
+                                             const EMhdElementType ElementType,
+                                             EPixelFormat& OutPixelFormat,
+                                             const FVoxelWindow* Window, const bool ByteOrderMSB,
+                                             const int64 HeaderSize,
+                                             FVolumeLoadProgress* Progress,
+                                             FVoxelStatisticsAccumulator* Statistics) {
+  const int32 SourceElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  OutPixelFormat = Window ? Window->PixelFormat : FMhdInfo::GetConvertedPixelFormat(ElementType);
+  const int32 ConvertedElementSize = GPixelFormats[OutPixelFormat].BlockBytes;
+  if (SourceElementSize == 0 || OutPixelFormat == PF_Unknown) {
+    MY_LOG("Unknown element type, cannot read volume.");
+    return nullptr;
+  }
+  if (Statistics) {
+    Statistics->Start(OutPixelFormat);
+  }
+
+  return ReadRawFilesConverted(
+      FileNames, NumElements, SourceElementSize, ConvertedElementSize, HeaderSize,
+      [&](const uint8* Source, uint8* Dest, int64 Count) {
+        ConvertOrWindowElements(Source, Dest, Count, ElementType, Window, ByteOrderMSB);
+      },
+      Progress, Statistics);
+}
+
+TUniquePtr<uint8> LoadRawFilesPacked(const TArray<FString>& FileNames, const int64 NumVoxels,
+                                     const int32 NumChannels, const EMhdElementType ElementType,
+                                     EPixelFormat& OutPixelFormat, const bool ByteOrderMSB,
+                                     const int64 HeaderSize, FVolumeLoadProgress* Progress) {
+  const int32 SourceVoxelSize =
+      FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes * NumChannels;
+  OutPixelFormat = FMhdInfo::GetPackedPixelFormat(ElementType);
+  if (SourceVoxelSize == 0 || OutPixelFormat == PF_Unknown) {
+    MY_LOG("Unknown element type, cannot read volume.");
+    return nullptr;
+  }
+  if (NumChannels < 1 || NumChannels > 4) {
+    MY_LOG("Only volumes with 1 to 4 channels can be packed into a texture.");
+    return nullptr;
+  }
+
+  return ReadRawFilesConverted(
+      FileNames, NumVoxels, SourceVoxelSize, GPixelFormats[OutPixelFormat].BlockBytes, HeaderSize,
+      [&](const uint8* Source, uint8* Dest, int64 Count) {
+        FMhdInfo::PackChannels(Source, Dest, Count, NumChannels, ElementType, ByteOrderMSB);
+      },
+      Progress, nullptr);
+}
+
+TUniquePtr<uint8> LoadCompressedRawFileConverted(const FString FileName, const FMhdInfo& Info,
+                                                 EPixelFormat& OutPixelFormat,
+                                                 const FVoxelWindow* Window,
+                                                 FVolumeLoadProgress* Progress,
+                                                 FVoxelStatisticsAccumulator* Statistics) {
+  const EMhdElementType ElementType = Info.ElementType;
+  const int32 SourceElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  OutPixelFormat = Window ? Window->PixelFormat : FMhdInfo::GetConvertedPixelFormat(ElementType);
+  const int32 ConvertedElementSize = GPixelFormats[OutPixelFormat].BlockBytes;
+  if (SourceElementSize == 0 || OutPixelFormat == PF_Unknown) {
+    MY_LOG("Unknown element type, cannot read volume.");
+    return nullptr;
+  }
+
+  const int64 NumElements = (int64)Info.Dimensions.X * Info.Dimensions.Y * Info.Dimensions.Z;
+  const int64 UncompressedSize = NumElements * SourceElementSize;
+
+  // The compressed size is optional in the header, if missing, use the whole file.
+  int64 CompressedSize = Info.CompressedDataSize;
+  if (CompressedSize <= 0) {
+    CompressedSize = IFileManager::Get().FileSize(*FileName);
+    if (CompressedSize <= 0) {
+      CompressedSize = IFileManager::Get().FileSize(*(FPaths::ProjectContentDir() + FileName));
+    }
+    if (CompressedSize <= 0) {
+      MY_LOG("Compressed data file doesn't exist or is empty.");
+      return nullptr;
+    }
+  }
+
+  // Map the compressed file if possible, read it into memory otherwise.
+  TUniquePtr<uint8> CompressedArray;
+  const uint8* CompressedData = nullptr;
+  auto MappedFile = FMappedRawFile::Open(FileName, CompressedSize);
+  if (MappedFile) {
+    CompressedData = MappedFile->GetData();
+  } else {
+    CompressedArray = LoadRawFileIntoArray(FileName, CompressedSize);
+    if (!CompressedArray) {
+      return nullptr;
+    }
+    CompressedData = CompressedArray.Get();
+  }
+
+  auto ConvertedArray = TUniquePtr<uint8>(new uint8[NumElements * ConvertedElementSize]);
+  uint8* ConvertedData = ConvertedArray.Get();
+  if (Statistics) {
+    Statistics->Start(OutPixelFormat);
+  }
+  auto ConvertRange = [&](uint8* Data, int64 Offset, int64 Bytes) {
+    const int64 FirstElement = Offset / SourceElementSize;
+    uint8* ConvertedRange = ConvertedData + FirstElement * ConvertedElementSize;
+    ConvertOrWindowElements(Data, ConvertedRange, Bytes / SourceElementSize, ElementType, Window,
+                            Info.ByteOrderMSB);
+    if (Statistics) {
+      Statistics->AddVoxels(ConvertedRange, Bytes / SourceElementSize);
+    }
+  };
+
+  bool bSuccess;
+  if (Info.CompressedChunkSizes.Num() > 0 && Info.CompressedChunkSize % SourceElementSize == 0) {
+    const bool bSameSize = (SourceElementSize == ConvertedElementSize);
+    bSuccess = InflateChunksInParallel(CompressedData, CompressedSize, Info.CompressedChunkSizes,
+                                       Info.CompressedChunkSize, UncompressedSize,
+                                       bSameSize ? ConvertedData : nullptr, ConvertRange,
+                                       Progress);
+  } else {
+    // Slabs hold a whole number of elements, so they can be converted independently.
+    const int64 SlabSize = RAW_FILE_SLAB_SIZE - (RAW_FILE_SLAB_SIZE % SourceElementSize);
+    bSuccess = InflateInSlabs(CompressedData, CompressedSize, UncompressedSize, SlabSize,
+                              ConvertRange, Progress);
+  }
+
+  if (!bSuccess) {
+    return nullptr;
+  }
+  MY_LOG("File was successfully read!");
+  return ConvertedArray;
+}
+
+TUniquePtr<uint8> LoadMhdDataConverted(const FMhdInfo& Info, const FString MhdFileName,
+                                       EPixelFormat& OutPixelFormat, const FVoxelWindow* Window,
+                                       FVolumeLoadProgress* Progress,
+                                       FVoxelStatisticsAccumulator* Statistics) {
+  const int64 NumElements = (int64)Info.Dimensions.X * Info.Dimensions.Y * Info.Dimensions.Z;
+  const TArray<FString> DataFiles = Info.DataFiles.Num() > 0
+                                        ? Info.GetDataFilePaths(MhdFileName)
+                                        : TArray<FString>{Info.GetDataFilePath(MhdFileName)};
+  if (Info.NumChannels > 1) {
+    if (Info.CompressedData || Window) {
+      MY_LOG("Multi-channel MHDs can't be compressed or windowed.");
+      return nullptr;
+    }
+    if (Statistics) {
+      // Leaves the statistics invalid, they are only gathered for single-channel data.
+      Statistics->Start(PF_Unknown);
+    }
+    return LoadRawFilesPacked(DataFiles, NumElements, Info.NumChannels, Info.ElementType,
+                              OutPixelFormat, Info.ByteOrderMSB, Info.HeaderSize, Progress);
+  }
+  if (Info.DataFiles.Num() > 0) {
+    if (Info.CompressedData) {
+      MY_LOG("Compressed multi-file MHDs are not supported.");
+      return nullptr;
+    }
+    return LoadRawFileSeriesConverted(DataFiles, NumElements, Info.ElementType, OutPixelFormat,
+                                      Window, Info.ByteOrderMSB, Info.HeaderSize, Progress,
+                                      Statistics);
+  }
+  if (Info.CompressedData) {
+    return LoadCompressedRawFileConverted(DataFiles[0], Info, OutPixelFormat, Window, Progress,
+                                          Statistics);
+  }
+  return LoadRawFileConverted(DataFiles[0], NumElements, Info.ElementType, OutPixelFormat, Window,
+                              Info.ByteOrderMSB, Info.HeaderSize, Progress, Statistics);
+}
+
+bool FRawSliceReader::Read(const int32 Z, const int64 Offset, uint8* Dest, const int64 Bytes) {
+  const int32 File = Z / SlicesPerFile;
+  if (File != OpenedFile && !Open(File)) {
+    return false;
+  }
+  const int64 Position = FileHeaderSize + (Z % SlicesPerFile) * SliceBytes + Offset;
+  return FileHandle->Seek(Position) && FileHandle->Read(Dest, Bytes);
+}
+
+bool FRawSliceReader::Open(const int32 File) {
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  const FString FilePath = ResolveRawFilePath(FileNames[File]);
+  FileHandle.Reset(FilePath.IsEmpty() ? nullptr : PlatformFile.OpenRead(*FilePath));
+  OpenedFile = -1;
+  const int64 BytesPerFile = SliceBytes * SlicesPerFile;
+  const int64 FileSize = FileHandle ? FileHandle->Size() : 0;
+  FileHeaderSize = HeaderSize < 0 ? FMath::Max<int64>(FileSize - BytesPerFile, 0) : HeaderSize;
+  if (!FileHandle || FileSize - FileHeaderSize < BytesPerFile) {
+    UE_LOG(LogTemp, Warning, TEXT("Data file %s is missing or too small."), *FileNames[File]);
+    return false;
+  }
+  OpenedFile = File;
+  return true;
+}
+
+TUniquePtr<uint8> LoadRawFilesRegionConverted(
+    const TArray<FString>& FileNames, const FIntVector VolumeDimensions,
+    const FIntVector RegionMin, const FIntVector RegionSize, const EMhdElementType ElementType,
+    EPixelFormat& OutPixelFormat, const FVoxelWindow* Window, const bool ByteOrderMSB,
+    const int64 HeaderSize, FVolumeLoadProgress* Progress,
+    FVoxelStatisticsAccumulator* Statistics) {
+  const int32 SourceElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  OutPixelFormat = Window ? Window->PixelFormat : FMhdInfo::GetConvertedPixelFormat(ElementType);
+  const int32 ConvertedElementSize = GPixelFormats[OutPixelFormat].BlockBytes;
+  if (SourceElementSize == 0 || OutPixelFormat == PF_Unknown) {
+    MY_LOG("Unknown element type, cannot read volume.");
+    return nullptr;
+  }
+  const FIntVector RegionMax = RegionMin + RegionSize;
+  if (RegionSize.X <= 0 || RegionSize.Y <= 0 || RegionSize.Z <= 0 || RegionMin.X < 0 ||
+      RegionMin.Y < 0 || RegionMin.Z < 0 || RegionMax.X > VolumeDimensions.X ||
+      RegionMax.Y > VolumeDimensions.Y || RegionMax.Z > VolumeDimensions.Z) {
+    MY_LOG("Region is empty or not inside the volume.");
+    return nullptr;
+  }
+  if (FileNames.Num() == 0 || VolumeDimensions.Z % FileNames.Num() != 0) {
+    MY_LOG("Volume can't be split evenly between its data files, cannot read volume.");
+    return nullptr;
+  }
+
+  const int64 RowBytes = (int64)VolumeDimensions.X * SourceElementSize;
+  const int64 SliceBytes = RowBytes * VolumeDimensions.Y;
+  const int64 RegionRowBytes = (int64)RegionSize.X * SourceElementSize;
+  const int64 RegionSliceVoxels = (int64)RegionSize.X * RegionSize.Y;
+  const int64 ConvertedRowBytes = (int64)RegionSize.X * ConvertedElementSize;
+  // Whole rows are contiguous, so the rows of a slice are one span if the region spans full rows.
+  const bool bSliceAsOneSpan = (RowBytes - RegionRowBytes) <= RAW_REGION_MAX_GAP;
+  const int64 SpanBytes =
+      bSliceAsOneSpan ? (RegionSize.Y - 1) * RowBytes + RegionRowBytes : RegionRowBytes;
+  const int64 RegionOffset = RegionMin.Y * RowBytes + RegionMin.X * SourceElementSize;
+
+  auto ConvertedArray =
+      TUniquePtr<uint8>(new uint8[RegionSliceVoxels * RegionSize.Z * ConvertedElementSize]);
+  if (Statistics) {
+    Statistics->Start(OutPixelFormat);
+  }
+  if (Progress) {
+    Progress->Start(RegionSliceVoxels * RegionSize.Z * SourceElementSize);
+  }
+
+  const int32 NumReaders = FMath::Min(GetDefaultReadsInFlight(), RegionSize.Z);
+  FThreadSafeCounter NextSlice;
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  ParallelFor(NumReaders, [&](int32 ReaderIndex) {
+    FRawSliceReader Reader(FileNames, SliceBytes, VolumeDimensions.Z / FileNames.Num(),
+                           HeaderSize);
+    TUniquePtr<uint8[]> Span(new uint8[SpanBytes]);
+
+    for (int32 Slice = NextSlice.Increment() - 1; Slice < RegionSize.Z && !bFailed && !bCanceled;
+         Slice = NextSlice.Increment() - 1) {
+      const int32 Z = RegionMin.Z + Slice;
+      uint8* SliceDest = ConvertedArray.Get() + Slice * RegionSliceVoxels * ConvertedElementSize;
+      if (bSliceAsOneSpan && !Reader.Read(Z, RegionOffset, Span.Get(), SpanBytes)) {
+        bFailed = true;
+        return;
+      }
+      for (int32 Row = 0; Row < RegionSize.Y; Row++) {
+        const uint8* RowData;
+        if (bSliceAsOneSpan) {
+          RowData = Span.Get() + Row * RowBytes;
+        } else {
+          if (!Reader.Read(Z, RegionOffset + Row * RowBytes, Span.Get(), RegionRowBytes)) {
+            bFailed = true;
+            return;
+          }
+          RowData = Span.Get();
+        }
+        ConvertOrWindowElements(RowData, SliceDest + Row * ConvertedRowBytes, RegionSize.X,
+                                ElementType, Window, ByteOrderMSB);
+      }
+
+      if (Statistics) {
+        Statistics->AddVoxels(SliceDest, RegionSliceVoxels);
+      }
+      if (Progress && !Progress->Advance(RegionSliceVoxels * SourceElementSize)) {
+        bCanceled = true;
+      }
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return nullptr;
+  }
+  if (bFailed) {
+    MY_LOG("Reading the region failed.");
+    return nullptr;
+  }
+  return ConvertedArray;
+}
+
+TUniquePtr<uint8> LoadMhdRegionConverted(const FMhdInfo& Info, const FString MhdFileName,
+                                         const FIntVector RegionMin, const FIntVector RegionSize,
+                                         EPixelFormat& OutPixelFormat, const FVoxelWindow* Window,
+                                         FVolumeLoadProgress* Progress,
+                                         FVoxelStatisticsAccumulator* Statistics) {
+  if (Info.CompressedData || Info.NumChannels > 1) {
+    MY_LOG("Regions can only be loaded from uncompressed single-channel MHDs.");
+    return nullptr;
+  }
+  const TArray<FString> DataFiles = Info.DataFiles.Num() > 0
+                                        ? Info.GetDataFilePaths(MhdFileName)
+                                        : TArray<FString>{Info.GetDataFilePath(MhdFileName)};
+  return LoadRawFilesRegionConverted(DataFiles, Info.Dimensions, RegionMin, RegionSize,
+                                     Info.ElementType, OutPixelFormat, Window, Info.ByteOrderMSB,
+                                     Info.HeaderSize, Progress, Statistics);
+}
+
+// Adds a converted input slice to the accumulators of its output slice, one per output voxel.
+template <typename T>
+static void AccumulateDecimatedSlice(const uint8* SliceData, const FIntVector& Dimensions,
+                                     const int32 Factor, const bool bMax, float* Accumulators) {
+  const T* Voxels = reinterpret_cast<const T*>(SliceData);
+  const int32 OutX = FMath::DivideAndRoundUp(Dimensions.X, Factor);
+  for (int32 Y = 0; Y < Dimensions.Y; Y++) {
+    const T* InRow = Voxels + (int64)Y * Dimensions.X;
+    float* OutRow = Accumulators + (int64)(Y / Factor) * OutX;
+    for (int32 X = 0; X < Dimensions.X; X++) {
+      float& Accumulator = OutRow[X / Factor];
+      Accumulator = bMax ? FMath::Max(Accumulator, float(InRow[X])) : Accumulator + InRow[X];
+    }
+  }
+}
+
+// Writes the accumulators of an output slice as T. Box filter sums are divided by the number of
+// voxels of their block, which is smaller at the far edges of the volume.
+template <typename T>
+static void StoreDecimatedSlice(const float* Accumulators, const FIntVector& Dimensions,
+                                const int32 Factor, const int32 BlockDepth, const bool bMax,
+                                uint8* Dest) {
+  T* OutVoxels = reinterpret_cast<T*>(Dest);
+  const int32 OutX = FMath::DivideAndRoundUp(Dimensions.X, Factor);
+  const int32 OutY = FMath::DivideAndRoundUp(Dimensions.Y, Factor);
+  for (int32 Y = 0; Y < OutY; Y++) {
+    const int32 BlockHeight = FMath::Min(Factor, Dimensions.Y - Y * Factor);
+    for (int32 X = 0; X < OutX; X++) {
+      const int64 Index = (int64)Y * OutX + X;
+      float Value = Accumulators[Index];
+      if (!bMax) {
+        const int32 BlockWidth = FMath::Min(Factor, Dimensions.X - X * Factor);
+        Value /= float(BlockWidth * BlockHeight * BlockDepth);
+      }
+      OutVoxels[Index] = T(TIsFloatingPoint<T>::Value ? Value : Value + 0.5f);
+    }
+  }
+}
+
+TUniquePtr<uint8> LoadRawFilesDecimated(
+    const TArray<FString>& FileNames, const FIntVector VolumeDimensions,
+    const EMhdElementType ElementType, const int32 Factor, const EVolumeDecimation Decimation,
+    EPixelFormat& OutPixelFormat, FIntVector& OutDimensions, const FVoxelWindow* Window,
+    const bool ByteOrderMSB, const int64 HeaderSize, FVolumeLoadProgress* Progress,
+    FVoxelStatisticsAccumulator* Statistics) {
+  const int32 SourceElementSize = FMhdInfo::ElementTypeInfo[int32(ElementType)].SizeBytes;
+  OutPixelFormat = Window ? Window->PixelFormat : FMhdInfo::GetConvertedPixelFormat(ElementType);
+  const int32 ConvertedElementSize = GPixelFormats[OutPixelFormat].BlockBytes;
+  if (SourceElementSize == 0 || OutPixelFormat == PF_Unknown) {
+    MY_LOG("Unknown element type, cannot read volume.");
+    return nullptr;
+  }
+  if (Factor < 1) {
+    MY_LOG("Decimation factor must be at least 1.");
+    return nullptr;
+  }
+  if (FileNames.Num() == 0 || VolumeDimensions.Z % FileNames.Num() != 0) {
+    MY_LOG("Volume can't be split evenly between its data files, cannot read volume.");
+    return nullptr;
+  }
+
+  OutDimensions = FIntVector(FMath::DivideAndRoundUp(VolumeDimensions.X, Factor),
+                             FMath::DivideAndRoundUp(VolumeDimensions.Y, Factor),
+                             FMath::DivideAndRoundUp(VolumeDimensions.Z, Factor));
+  const int64 RowBytes = (int64)VolumeDimensions.X * SourceElementSize;
+  const int64 SliceBytes = RowBytes * VolumeDimensions.Y;
+  const int64 SliceVoxels = (int64)VolumeDimensions.X * VolumeDimensions.Y;
+  const int64 OutSliceVoxels = (int64)OutDimensions.X * OutDimensions.Y;
+  const bool bStride = Decimation == EVolumeDecimation::Stride;
+  const bool bMax = Decimation == EVolumeDecimation::Max;
+  // Striding only needs every Factor-th row - read them one by one if that skips at least a page
+  // between them, otherwise read the whole slice.
+  const bool bReadRows = bStride && (Factor - 1) * RowBytes > RAW_REGION_MAX_GAP;
+  const int64 BytesPerOutSlice = bStride ? (bReadRows ? OutDimensions.Y * RowBytes : SliceBytes)
+                                         : Factor * SliceBytes;
+
+  auto DecimatedArray =
+      TUniquePtr<uint8>(new uint8[OutSliceVoxels * OutDimensions.Z * ConvertedElementSize]);
+  if (Statistics) {
+    Statistics->Start(OutPixelFormat);
+  }
+  if (Progress) {
+    Progress->Start(bStride ? OutDimensions.Z * BytesPerOutSlice
+                            : VolumeDimensions.Z * SliceBytes);
+  }
+
+  auto Accumulate = [&](const uint8* SliceData, float* Accumulators) {
+    switch (OutPixelFormat) {
+      case PF_G8:
+        AccumulateDecimatedSlice<uint8>(SliceData, VolumeDimensions, Factor, bMax, Accumulators);
+        break;
+      case PF_G16:
+        AccumulateDecimatedSlice<uint16>(SliceData, VolumeDimensions, Factor, bMax, Accumulators);
+        break;
+      default:
+        AccumulateDecimatedSlice<float>(SliceData, VolumeDimensions, Factor, bMax, Accumulators);
+    }
+  };
+  auto Store = [&](const float* Accumulators, const int32 BlockDepth, uint8* Dest) {
+    switch (OutPixelFormat) {
+      case PF_G8:
+        StoreDecimatedSlice<uint8>(Accumulators, VolumeDimensions, Factor, BlockDepth, bMax, Dest);
+        break;
+      case PF_G16:
+        StoreDecimatedSlice<uint16>(Accumulators, VolumeDimensions, Factor, BlockDepth, bMax, Dest);
+        break;
+      default:
+        StoreDecimatedSlice<float>(Accumulators, VolumeDimensions, Factor, BlockDepth, bMax, Dest);
+    }
+  };
+
+  const int32 NumReaders = FMath::Min(GetDefaultReadsInFlight(), OutDimensions.Z);
+  FThreadSafeCounter NextSlice;
+  FThreadSafeBool bFailed(false);
+  FThreadSafeBool bCanceled(false);
+  ParallelFor(NumReaders, [&](int32 ReaderIndex) {
+    FRawSliceReader Reader(FileNames, SliceBytes, VolumeDimensions.Z / FileNames.Num(),
+                           HeaderSize);
+    TUniquePtr<uint8[]> SourceSlice(new uint8[bReadRows ? RowBytes : SliceBytes]);
+    // Strided voxels of a row (stride), or the converted input slice and accumulators (filters).
+    TArray<uint8> Gathered;
+    TArray<uint8> ConvertedSlice;
+    TArray<float> Accumulators;
+    if (bStride) {
+      Gathered.SetNumUninitialized(OutDimensions.X * SourceElementSize);
+    } else {
+      ConvertedSlice.SetNumUninitialized(SliceVoxels * ConvertedElementSize);
+      Accumulators.SetNumUninitialized(OutSliceVoxels);
+    }
+
+    for (int32 OutZ = NextSlice.Increment() - 1; OutZ < OutDimensions.Z && !bFailed && !bCanceled;
+         OutZ = NextSlice.Increment() - 1) {
+      uint8* SliceDest = DecimatedArray.Get() + OutZ * OutSliceVoxels * ConvertedElementSize;
+      const int32 FirstZ = OutZ * Factor;
+      if (bStride) {
+        if (!bReadRows && !Reader.Read(FirstZ, 0, SourceSlice.Get(), SliceBytes)) {
+          bFailed = true;
+          return;
+        }
+        for (int32 OutY = 0; OutY < OutDimensions.Y; OutY++) {
+          const int64 RowOffset = OutY * Factor * RowBytes;
+          const uint8* RowData = SourceSlice.Get() + (bReadRows ? 0 : RowOffset);
+          if (bReadRows && !Reader.Read(FirstZ, RowOffset, SourceSlice.Get(), RowBytes)) {
+            bFailed = true;
+            return;
+          }
+          for (int32 OutX = 0; OutX < OutDimensions.X; OutX++) {
+            FMemory::Memcpy(Gathered.GetData() + OutX * SourceElementSize,
+                            RowData + (int64)OutX * Factor * SourceElementSize, SourceElementSize);
+          }
+          ConvertOrWindowElements(Gathered.GetData(),
+                                  SliceDest + OutY * OutDimensions.X * ConvertedElementSize,
+                                  OutDimensions.X, ElementType, Window, ByteOrderMSB);
+        }
+      } else {
+        const int32 BlockDepth = FMath::Min(Factor, VolumeDimensions.Z - FirstZ);
+        const float Initial = bMax ? TNumericLimits<float>::Lowest() : 0.0f;
+        for (float& Accumulator : Accumulators) {
+          Accumulator = Initial;
+        }
+        for (int32 Z = FirstZ; Z < FirstZ + BlockDepth; Z++) {
+          if (!Reader.Read(Z, 0, SourceSlice.Get(), SliceBytes)) {
+            bFailed = true;
+            return;
+          }
+          ConvertOrWindowElements(SourceSlice.Get(), ConvertedSlice.GetData(), SliceVoxels,
+                                  ElementType, Window, ByteOrderMSB);
+          Accumulate(ConvertedSlice.GetData(), Accumulators.GetData());
+        }
+        Store(Accumulators.GetData(), BlockDepth, SliceDest);
+      }
+
+      if (Statistics) {
+        Statistics->AddVoxels(SliceDest, OutSliceVoxels);
+      }
+      const int64 BytesRead =
+          bStride ? BytesPerOutSlice
+                  : FMath::Min(Factor, VolumeDimensions.Z - FirstZ) * SliceBytes;
+      if (Progress && !Progress->Advance(BytesRead)) {
+        bCanceled = true;
+      }
+    }
+  });
+
+  if (bCanceled) {
+    MY_LOG("Loading was canceled.");
+    return nullptr;
+  }
+  if (bFailed) {
+    MY_LOG("Reading the volume failed.");
+    return nullptr;
+  }
+  return DecimatedArray;
+}
+
+TUniquePtr<uint8> LoadMhdDataDecimated(const FMhdInfo& Info, const FString MhdFileName,
+                                       const int32 Factor, const EVolumeDecimation Decimation,
+                                       EPixelFormat& OutPixelFormat, FIntVector& OutDimensions,
+                                       const FVoxelWindow* Window, FVolumeLoadProgress* Progress,
+                                       FVoxelStatisticsAccumulator* Statistics) {
+  if (Info.CompressedData || Info.NumChannels > 1) {
+    MY_LOG("Only uncompressed single-channel MHDs can be loaded decimated.");
+    return nullptr;
+  }
+  const TArray<FString> DataFiles = Info.DataFiles.Num() > 0
+                                        ? Info.GetDataFilePaths(MhdFileName)
+                                        : TArray<FString>{Info.GetDataFilePath(MhdFileName)};
+  return LoadRawFilesDecimated(DataFiles, Info.Dimensions, Info.ElementType, Factor, Decimation,
+                               OutPixelFormat, OutDimensions, Window, Info.ByteOrderMSB,
+                               Info.HeaderSize, Progress, Statistics);
+}
+
+int64 FRawLoadStats::GetTotalBytes() const {
+  return StagingBytes + ConversionBytes + BulkDataBytes + SourceBytes;
+}
+
+FString FRawLoadStats::ToString() const {
+  return FString::Printf(
+      TEXT("Raw load (%s): staging %lld B, conversion %lld B, BulkData %lld B, Source %lld B, "
+           "total %lld B"),
+      bMapped ? TEXT("mapped") : TEXT("read"), StagingBytes, ConversionBytes, BulkDataBytes,
+      SourceBytes, GetTotalBytes());
+}
+
+int64 GetEditorSourceCopySize(const EPixelFormat PixelFormat, const bool Persistent,
+                              const int64 TotalSize) {
+#if WITH_EDITORONLY_DATA
+  if (Persistent && PixelFormatToSourceFormat(PixelFormat) != TSF_Invalid) {
+    return TotalSize;
+  }
+#endif
+  return 0;
+}
+
+TUniquePtr<FMappedRawFile> FMappedRawFile::Open(const FString FileName, const int64 BytesToMap) {
+  IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+  // Try opening as absolute path, then relative to content directory (same as
+  // LoadRawFileIntoArray).
+  IMappedFileHandle* Handle = PlatformFile.OpenMapped(*FileName);
+  if (!Handle) {
+    FString FullPath = FPaths::ProjectContentDir() + FileName;
+    Handle = PlatformFile.OpenMapped(*FullPath);
+  }
+
+  // Not all platforms support mapping files, callers are expected to fall back to reading.
+  if (!Handle) {
+    return nullptr;
+  }
+
+  if (int64(Handle->GetFileSize()) < BytesToMap) {
+    MY_LOG("File is smaller than expected, cannot map volume.");
+    delete Handle;
+    return nullptr;
+  }
+
+  IMappedFileRegion* Region = Handle->MapRegion(0, BytesToMap);
+  if (!Region) {
+    delete Handle;
+    return nullptr;
+  }
+
+  return TUniquePtr<FMappedRawFile>(new FMappedRawFile(Handle, Region));
+}
+
+FMappedRawFile::~FMappedRawFile() {
+  delete Region;
+  delete Handle;
+}
+
+// Shared by both Create2DTextureAsset overloads, OwnedBulkData as in
+// CreateVolumeTextureAssetImpl.
+static bool Create2DTextureAssetImpl(FString AssetName, EPixelFormat PixelFormat,
+                                     FIntPoint Dimensions, const uint8* BulkData,
+                                     TUniquePtr<uint8>* OwnedBulkData, bool Persistent,
+                                     bool UAVCompatible, bool SaveNow, TextureAddress TilingX,
+                                     TextureAddress TilingY) {
   const long TotalSize = (long)Dimensions.X * Dimensions.Y * GPixelFormats[PixelFormat].BlockBytes;
 
   FString PackageName = TEXT("/Game/GeneratedTextures/");
@@ -277,6 +1338,9 @@ bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint
     FMemory::Memset(ByteArray, 0, TotalSize);
   }
   Mip->BulkData.Unlock();
+  if (OwnedBulkData) {
+    OwnedBulkData->Reset();
+  }
 
   FIntVector Dimensions3D = FIntVector(Dimensions.X, Dimensions.Y, 1);
   bool RetVal =
@@ -287,18 +1351,30 @@ bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint
   Package->MarkPackageDirty();
   FAssetRegistryModule::AssetCreated(NewTexture);
 
-  // Only save the asset if that is needed (as this is a disk operation and takes a long time)
+  // Only save the asset if that is needed. The file is written in the background (see
+  // FVolumeAssetSaveQueue).
   if (SaveNow) {
-    FString PackageFileName = FPackageName::LongPackageNameToFilename(
-        PackageName, FPackageName::GetAssetPackageExtension());
-    return UPackage::SavePackage(Package, NewTexture,
-                                 EObjectFlags::RF_Public | EObjectFlags::RF_Standalone,
-                                 *PackageFileName, GError, nullptr, true, true, SAVE_NoError);
+    return FVolumeAssetSaveQueue::Get().Enqueue(Package, NewTexture);
   } else {
     return true;
   }
 }
 
+bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint Dimensions,
+                          uint8* BulkData, bool Persistent, bool UAVCompatible, bool SaveNow,
+                          TextureAddress TilingX, TextureAddress TilingY) {
+  return Create2DTextureAssetImpl(AssetName, PixelFormat, Dimensions, BulkData, nullptr,
+                                  Persistent, UAVCompatible, SaveNow, TilingX, TilingY);
+}
+
+bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint Dimensions,
+                          TUniquePtr<uint8>&& BulkData, bool Persistent, bool UAVCompatible,
+                          bool SaveNow, TextureAddress TilingX, TextureAddress TilingY) {
+  const uint8* Pixels = BulkData.Get();
+  return Create2DTextureAssetImpl(AssetName, PixelFormat, Dimensions, Pixels, &BulkData,
+                                  Persistent, UAVCompatible, SaveNow, TilingX, TilingY);
+}
+
 bool Update2DTextureAsset(UTexture2D* Texture, EPixelFormat PixelFormat, FIntPoint Dimensions,
                           uint8* BulkData, bool Persistent, bool UAVCompatible,
                           TextureAddress TilingX, TextureAddress TilingY) {
@@ -0,0 +1,85 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "VolumeAssetSaveQueue.h"
+#include "Async/Async.h"
+#include "Containers/Ticker.h"
+#include "HAL/FileManager.h"
+#include "Misc/PackageName.h"
+#include "RaymarchRendering.h"
+
+FVolumeAssetSaveQueue& FVolumeAssetSaveQueue::Get() {
+  static FVolumeAssetSaveQueue Queue;
+  return Queue;
+}
+
+bool FVolumeAssetSaveQueue::Enqueue(UPackage* Package, UObject* Asset,
+                                    FOnVolumeAssetSaved OnSaved) {
+  const FString PackageFileName = FPackageName::LongPackageNameToFilename(
+      Package->GetName(), FPackageName::GetAssetPackageExtension());
+  const FString TempFileName = PackageFileName + TEXT(".saving");
+
+  // With SAVE_Async the package is only serialized into memory here, writing it to the file
+  // happens on worker threads.
+  if (!UPackage::SavePackage(Package, Asset, RF_Public | RF_Standalone, *TempFileName, GError,
+                             nullptr, true, true, SAVE_NoError | SAVE_Async)) {
+    UE_LOG(LogTemp, Warning, TEXT("Package %s could not be saved."), *Package->GetName());
+    return false;
+  }
+
+  FPendingSave& Save = Pending[Pending.AddDefaulted()];
+  Save.PackageFileName = PackageFileName;
+  Save.OnSaved = OnSaved;
+  // The engine only tells when all outstanding writes are done. Wait for that on a thread of our
+  // own, blocking a pool thread could starve the very writes it's waiting for.
+  Save.Written = Async<bool>(EAsyncExecution::Thread, [PackageFileName, TempFileName]() {
+    UPackage::WaitForAsyncFileWrites();
+    return IFileManager::Get().Move(*PackageFileName, *TempFileName, true, true);
+  });
+
+  if (!TickerHandle.IsValid()) {
+    TickerHandle = FTicker::GetCoreTicker().AddTicker(
+        FTickerDelegate::CreateRaw(this, &FVolumeAssetSaveQueue::Tick));
+  }
+  return true;
+}
+
+bool FVolumeAssetSaveQueue::Tick(float DeltaTime) {
+  // Callbacks may enqueue further saves, so finished saves are taken out before calling them.
+  TArray<FPendingSave> Finished;
+  for (int32 i = Pending.Num() - 1; i >= 0; i--) {
+    if (Pending[i].Written.IsReady()) {
+      Finished.Add(MoveTemp(Pending[i]));
+      Pending.RemoveAt(i);
+    }
+  }
+  for (int32 i = Finished.Num() - 1; i >= 0; i--) {
+    const bool bSuccess = Finished[i].Written.Get();
+    if (!bSuccess) {
+      UE_LOG(LogTemp, Warning, TEXT("Writing %s failed."), *Finished[i].PackageFileName);
+    }
+    Finished[i].OnSaved.ExecuteIfBound(bSuccess);
+  }
+
+  if (Pending.Num() == 0) {
+    // Returning false removes the ticker.
+    TickerHandle.Reset();
+    return false;
+  }
+  return true;
+}
+
+void FVolumeAssetSaveQueue::Flush() {
+  UPackage::WaitForAsyncFileWrites();
+  while (Pending.Num() > 0) {
+    for (FPendingSave& Save : Pending) {
+      Save.Written.Wait();
+    }
+    if (TickerHandle.IsValid()) {
+      FTicker::GetCoreTicker().RemoveTicker(TickerHandle);
+      TickerHandle.Reset();
+    }
+    // Runs the callbacks. Pending is empty afterwards, unless they enqueued more saves.
+    Tick(0.0f);
+  }
+}
@@ -0,0 +1,268 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "VolumeCodec.h"
+#include "HAL/ThreadSafeBool.h"
+#include "RaymarchRendering.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "zlib.h"
+THIRD_PARTY_INCLUDES_END
+
+// "VLC1" - first four bytes of every encoded volume.
+#define VOLUME_CODEC_MAGIC 0x564C4331
+#define VOLUME_CODEC_VERSION 1
+// Slabs are whole slices of about this many bytes - large enough for deflate to find long runs,
+// small enough that even small volumes are split across all cores.
+#define VOLUME_CODEC_SLAB_SIZE (4 * 1024 * 1024)
+#define VOLUME_CODEC_ZLIB_LEVEL 6
+
+// Everything in front of the slab data.
+struct FEncodedVolumeHeader {
+  FIntVector Dimensions{0, 0, 0};
+  int32 BytesPerVoxel{0};
+  int32 SlicesPerSlab{0};
+  TArray<int64> SlabSizes;
+
+  bool Serialize(FArchive& Ar) {
+    uint32 Magic = VOLUME_CODEC_MAGIC;
+    uint32 Version = VOLUME_CODEC_VERSION;
+    Ar << Magic << Version;
+    if (Ar.IsError() || Magic != VOLUME_CODEC_MAGIC || Version != VOLUME_CODEC_VERSION) {
+      return false;
+    }
+    Ar << Dimensions << BytesPerVoxel << SlicesPerSlab << SlabSizes;
+    return !Ar.IsError();
+  }
+};
+
+// Median edge detector of JPEG-LS (LOCO-I): predicts a voxel from its left, upper and upper-left
+// neighbours, picking an edge if there is one and the plane through them otherwise.
+template <typename T>
+static FORCEINLINE int64 PredictVoxel(const T* Slice, const int32 X, const int32 Y,
+                                      const int32 Width) {
+  const T* Row = Slice + (int64)Y * Width;
+  if (Y == 0) {
+    return X == 0 ? 0 : Row[X - 1];
+  }
+  const T* Up = Row - Width;
+  if (X == 0) {
+    return Up[0];
+  }
+  const int64 Left = Row[X - 1];
+  const int64 Above = Up[X];
+  const int64 Corner = Up[X - 1];
+  if (Corner >= FMath::Max(Left, Above)) {
+    return FMath::Min(Left, Above);
+  }
+  if (Corner <= FMath::Min(Left, Above)) {
+    return FMath::Max(Left, Above);
+  }
+  return Left + Above - Corner;
+}
+
+// Maps a residual (as an N-bit two's complement value) to 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+template <typename T>
+static FORCEINLINE T ZigZag(const T Residual) {
+  return T(T(Residual << 1) ^ T(0 - T(Residual >> (sizeof(T) * 8 - 1))));
+}
+
+template <typename T>
+static FORCEINLINE T UnZigZag(const T Value) {
+  return T(T(Value >> 1) ^ T(0 - T(Value & 1)));
+}
+
+// Encodes NumSlices slices into byte planes of zigzagged residuals and deflates them.
+template <typename T>
+static bool EncodeSlab(const T* Voxels, const FIntVector& Dimensions, const int32 NumSlices,
+                       TArray<uint8>& OutEncoded) {
+  const int64 SliceVoxels = (int64)Dimensions.X * Dimensions.Y;
+  const int64 NumVoxels = SliceVoxels * NumSlices;
+  TArray<uint8> Planes;
+  Planes.SetNumUninitialized(NumVoxels * sizeof(T));
+  uint8* PlaneData = Planes.GetData();
+
+  for (int32 Z = 0; Z < NumSlices; Z++) {
+    const T* Slice = Voxels + Z * SliceVoxels;
+    for (int32 Y = 0; Y < Dimensions.Y; Y++) {
+      for (int32 X = 0; X < Dimensions.X; X++) {
+        const int64 Index = Z * SliceVoxels + (int64)Y * Dimensions.X + X;
+        const T Residual = T(Voxels[Index] - T(PredictVoxel(Slice, X, Y, Dimensions.X)));
+        const T Coded = ZigZag(Residual);
+        for (int32 Byte = 0; Byte < int32(sizeof(T)); Byte++) {
+          PlaneData[Byte * NumVoxels + Index] = uint8(Coded >> (8 * Byte));
+        }
+      }
+    }
+  }
+
+  uLongf EncodedBytes = compressBound(uLong(Planes.Num()));
+  OutEncoded.SetNumUninitialized(EncodedBytes);
+  if (compress2(OutEncoded.GetData(), &EncodedBytes, PlaneData, uLong(Planes.Num()),
+                VOLUME_CODEC_ZLIB_LEVEL) != Z_OK) {
+    return false;
+  }
+  OutEncoded.SetNum(EncodedBytes, false);
+  return true;
+}
+
+// Inflates a slab's byte planes into Planes and reconstructs its voxels.
+template <typename T>
+static bool DecodeSlab(const uint8* Encoded, const int64 EncodedSize, const FIntVector& Dimensions,
+                       const int32 NumSlices, TArray<uint8>& Planes, T* Voxels) {
+  const int64 SliceVoxels = (int64)Dimensions.X * Dimensions.Y;
+  const int64 NumVoxels = SliceVoxels * NumSlices;
+  Planes.SetNumUninitialized(NumVoxels * sizeof(T), false);
+  uLongf DecodedBytes = uLongf(Planes.Num());
+  if (uncompress(Planes.GetData(), &DecodedBytes, Encoded, uLong(EncodedSize)) != Z_OK ||
+      DecodedBytes != uLongf(Planes.Num())) {
+    return false;
+  }
+
+  const uint8* PlaneData = Planes.GetData();
+  for (int32 Z = 0; Z < NumSlices; Z++) {
+    const T* Slice = Voxels + Z * SliceVoxels;
+    for (int32 Y = 0; Y < Dimensions.Y; Y++) {
+      for (int32 X = 0; X < Dimensions.X; X++) {
+        const int64 Index = Z * SliceVoxels + (int64)Y * Dimensions.X + X;
+        T Coded = 0;
+        for (int32 Byte = 0; Byte < int32(sizeof(T)); Byte++) {
+          Coded |= T(T(PlaneData[Byte * NumVoxels + Index]) << (8 * Byte));
+        }
+        Voxels[Index] = T(T(PredictVoxel(Slice, X, Y, Dimensions.X)) + UnZigZag(Coded));
+      }
+    }
+  }
+  return true;
+}
+
+bool EncodeVolumeLossless(const uint8* Voxels, const FIntVector Dimensions,
+                          const int32 BytesPerVoxel, TArray<uint8>& OutEncoded) {
+  if (BytesPerVoxel != 1 && BytesPerVoxel != 2 && BytesPerVoxel != 4) {
+    MY_LOG("Only 1, 2 and 4-byte voxels can be encoded.");
+    return false;
+  }
+  const int64 SliceBytes = (int64)Dimensions.X * Dimensions.Y * BytesPerVoxel;
+  FEncodedVolumeHeader Header;
+  Header.Dimensions = Dimensions;
+  Header.BytesPerVoxel = BytesPerVoxel;
+  Header.SlicesPerSlab =
+      int32(FMath::Clamp<int64>(VOLUME_CODEC_SLAB_SIZE / FMath::Max<int64>(SliceBytes, 1), 1,
+                                FMath::Max(Dimensions.Z, 1)));
+  const int32 NumSlabs = FMath::DivideAndRoundUp(Dimensions.Z, Header.SlicesPerSlab);
+
+  TArray<TArray<uint8>> Slabs;
+  Slabs.SetNum(NumSlabs);
+  FThreadSafeBool bFailed(false);
+  ParallelFor(NumSlabs, [&](int32 Slab) {
+    const int32 FirstZ = Slab * Header.SlicesPerSlab;
+    const int32 NumSlices = FMath::Min(Header.SlicesPerSlab, Dimensions.Z - FirstZ);
+    const uint8* SlabVoxels = Voxels + FirstZ * SliceBytes;
+    bool bSuccess;
+    switch (BytesPerVoxel) {
+      case 1: bSuccess = EncodeSlab(SlabVoxels, Dimensions, NumSlices, Slabs[Slab]); break;
+      case 2:
+        bSuccess = EncodeSlab(reinterpret_cast<const uint16*>(SlabVoxels), Dimensions, NumSlices,
+                              Slabs[Slab]);
+        break;
+      default:
+        bSuccess = EncodeSlab(reinterpret_cast<const uint32*>(SlabVoxels), Dimensions, NumSlices,
+                              Slabs[Slab]);
+    }
+    if (!bSuccess) {
+      bFailed = true;
+    }
+  });
+  if (bFailed) {
+    MY_LOG("Encoding the volume failed.");
+    return false;
+  }
+
+  for (const TArray<uint8>& Slab : Slabs) {
+    Header.SlabSizes.Add(Slab.Num());
+  }
+  OutEncoded.Reset();
+  FMemoryWriter Writer(OutEncoded);
+  Header.Serialize(Writer);
+  for (TArray<uint8>& Slab : Slabs) {
+    OutEncoded.Append(Slab);
+    // Release every slab once it's copied, so the peak stays at about twice the encoded size.
+    Slab.Empty();
+  }
+  return true;
+}
+
+bool GetEncodedVolumeInfo(const TArray<uint8>& Encoded, FIntVector& OutDimensions,
+                          int32& OutBytesPerVoxel) {
+  FMemoryReader Reader(Encoded);
+  FEncodedVolumeHeader Header;
+  if (!Header.Serialize(Reader)) {
+    return false;
+  }
+  OutDimensions = Header.Dimensions;
+  OutBytesPerVoxel = Header.BytesPerVoxel;
+  return true;
+}
+
+bool DecodeVolumeLossless(const TArray<uint8>& Encoded, uint8* Destination) {
+  FMemoryReader Reader(Encoded);
+  FEncodedVolumeHeader Header;
+  if (!Header.Serialize(Reader) || Header.SlicesPerSlab <= 0 ||
+      Header.SlabSizes.Num() !=
+          FMath::DivideAndRoundUp(Header.Dimensions.Z, Header.SlicesPerSlab)) {
+    MY_LOG("Encoded volume header is corrupt.");
+    return false;
+  }
+
+  // Slab offsets follow from their sizes. Every slab has to end inside the encoded data - checked
+  // against the bytes left, so corrupt sizes can't overflow the offset.
+  TArray<int64> SlabOffsets;
+  int64 Offset = Reader.Tell();
+  for (const int64 SlabSize : Header.SlabSizes) {
+    if (SlabSize < 0 || SlabSize > Encoded.Num() - Offset) {
+      MY_LOG("Encoded volume is truncated or corrupt.");
+      return false;
+    }
+    SlabOffsets.Add(Offset);
+    Offset += SlabSize;
+  }
+
+  const FIntVector& Dimensions = Header.Dimensions;
+  const int64 SliceBytes = (int64)Dimensions.X * Dimensions.Y * Header.BytesPerVoxel;
+  FThreadSafeBool bFailed(false);
+  ParallelFor(Header.SlabSizes.Num(), [&](int32 Slab) {
+    const int32 FirstZ = Slab * Header.SlicesPerSlab;
+    const int32 NumSlices = FMath::Min(Header.SlicesPerSlab, Dimensions.Z - FirstZ);
+    const uint8* SlabData = Encoded.GetData() + SlabOffsets[Slab];
+    const int64 SlabSize = Header.SlabSizes[Slab];
+    uint8* SlabVoxels = Destination + FirstZ * SliceBytes;
+    TArray<uint8> Planes;
+    bool bSuccess;
+    switch (Header.BytesPerVoxel) {
+      case 1:
+        bSuccess = DecodeSlab(SlabData, SlabSize, Dimensions, NumSlices, Planes, SlabVoxels);
+        break;
+      case 2:
+        bSuccess = DecodeSlab(SlabData, SlabSize, Dimensions, NumSlices, Planes,
+                              reinterpret_cast<uint16*>(SlabVoxels));
+        break;
+      case 4:
+        bSuccess = DecodeSlab(SlabData, SlabSize, Dimensions, NumSlices, Planes,
+                              reinterpret_cast<uint32*>(SlabVoxels));
+        break;
+      default: bSuccess = false;
+    }
+    if (!bSuccess) {
+      bFailed = true;
+    }
+  });
+  if (bFailed) {
+    MY_LOG("Decoding the volume failed - data is corrupt.");
+    return false;
+  }
+  return true;
+}
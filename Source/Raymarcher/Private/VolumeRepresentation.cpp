@@ -1,13 +1,70 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "VolumeRepresentation.h"
+#include "RaymarchRendering.h"
+#include "TextureHelperFunctions.h"
+#include "VolumeCodec.h"
 
 UVolumeRepresentation::UVolumeRepresentation()
   : Texture{nullptr}
   , VolumeSizeInMM{1.0, 1.0, 1.0}
   , CenterLocation{0.0, 0.0, 0.0}
-  , Dimensions{0, 0, 0} {
+  , Dimensions{0, 0, 0}
+  , CompressedPixelFormat{PF_Unknown} {
 }
 
 UVolumeRepresentation::~UVolumeRepresentation() {
 }
+
+bool UVolumeRepresentation::SetCompressedVoxels(const uint8* Voxels, const EPixelFormat PixelFormat,
+                                                const FIntVector VoxelDimensions) {
+  if (!EncodeVolumeLossless(Voxels, VoxelDimensions, GPixelFormats[PixelFormat].BlockBytes,
+                            CompressedVoxels)) {
+    CompressedVoxels.Empty();
+    CompressedPixelFormat = PF_Unknown;
+    return false;
+  }
+  CompressedPixelFormat = PixelFormat;
+  Dimensions = VoxelDimensions;
+  Texture = NewObject<UVolumeTexture>(this, NAME_None, RF_Transient);
+  UpdateVolumeTextureAsset(Texture, PixelFormat, Dimensions, Voxels, false);
+  MarkPackageDirty();
+  return true;
+}
+
+void UVolumeRepresentation::Serialize(FArchive& Ar) {
+  Super::Serialize(Ar);
+  // Properties are serialized first, so CompressedPixelFormat is known when loading. Archives that
+  // only walk the object (reference collection, memory counting, ...) skip the voxels - duplicating
+  // still copies them, as it loads and saves.
+  if (CompressedPixelFormat != PF_Unknown && (Ar.IsLoading() || Ar.IsSaving()) &&
+      !Ar.IsObjectReferenceCollector()) {
+    CompressedVoxels.BulkSerialize(Ar);
+  }
+}
+
+void UVolumeRepresentation::PostLoad() {
+  Super::PostLoad();
+  if (CompressedPixelFormat != PF_Unknown) {
+    CreateTextureFromCompressedVoxels();
+  }
+}
+
+bool UVolumeRepresentation::CreateTextureFromCompressedVoxels() {
+  FIntVector VoxelDimensions;
+  int32 BytesPerVoxel;
+  if (!GetEncodedVolumeInfo(CompressedVoxels, VoxelDimensions, BytesPerVoxel) ||
+      BytesPerVoxel != GPixelFormats[CompressedPixelFormat].BlockBytes) {
+    MY_LOG("Compressed voxels of volume representation are corrupt.");
+    return false;
+  }
+  const int64 TotalSize =
+      (int64)VoxelDimensions.X * VoxelDimensions.Y * VoxelDimensions.Z * BytesPerVoxel;
+  auto Voxels = TUniquePtr<uint8>(new uint8[TotalSize]);
+  if (!DecodeVolumeLossless(CompressedVoxels, Voxels.Get())) {
+    return false;
+  }
+  Texture = NewObject<UVolumeTexture>(this, NAME_None, RF_Transient);
+  return UpdateVolumeTextureAsset(Texture, CompressedPixelFormat, VoxelDimensions,
+                                  MoveTemp(Voxels), false);
+}
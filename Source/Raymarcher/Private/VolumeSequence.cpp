@@ -0,0 +1,305 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "VolumeSequence.h"
+#include "Async/Async.h"
+#include "HAL/FileManager.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "RaymarchRendering.h"
+#include "TextureHelperFunctions.h"
+
+FVolumeSequenceStreamer::FVolumeSequenceStreamer(const TArray<FString>& InFrameFiles,
+                                                 const int32 InRingSize)
+  : FrameFiles(InFrameFiles), RingSize(FMath::Max(InRingSize, 1)) {
+  WakeUp = FPlatformProcess::GetSynchEventFromPool();
+  Thread = FRunnableThread::Create(this, TEXT("VolumeSequenceStreamer"), 0, TPri_BelowNormal);
+}
+
+FVolumeSequenceStreamer::~FVolumeSequenceStreamer() {
+  if (Thread) {
+    Stop();
+    Thread->WaitForCompletion();
+    delete Thread;
+  }
+  FPlatformProcess::ReturnSynchEventToPool(WakeUp);
+}
+
+void FVolumeSequenceStreamer::SetPlayback(const int32 CurrentFrame, const int32 Step,
+                                          const bool bLoop) {
+  {
+    FScopeLock ScopeLock(&Lock);
+    if (PlaybackFrame == CurrentFrame && PlaybackStep == Step && bPlaybackLoop == bLoop) {
+      return;
+    }
+    PlaybackFrame = CurrentFrame;
+    PlaybackStep = Step != 0 ? Step : 1;
+    bPlaybackLoop = bLoop;
+  }
+  WakeUp->Trigger();
+}
+
+FLoadedVolumePtr FVolumeSequenceStreamer::GetFrame(const int32 Frame) const {
+  FScopeLock ScopeLock(&Lock);
+  const FLoadedVolumePtr* Volume = Ring.Find(Frame);
+  return Volume ? *Volume : nullptr;
+}
+
+TArray<int32> FVolumeSequenceStreamer::GetUpcomingFrames() const {
+  const int32 NumFrames = FrameFiles.Num();
+  TArray<int32> Frames;
+  int32 Frame = PlaybackFrame;
+  for (int32 i = 0; i < RingSize && NumFrames > 0; i++) {
+    if (bPlaybackLoop) {
+      Frame = ((Frame % NumFrames) + NumFrames) % NumFrames;
+    } else if (Frame < 0 || Frame >= NumFrames) {
+      break;
+    }
+    // Short sequences wrap around onto frames that are already upcoming.
+    if (Frames.Contains(Frame)) {
+      break;
+    }
+    Frames.Add(Frame);
+    Frame += PlaybackStep;
+  }
+  return Frames;
+}
+
+int32 FVolumeSequenceStreamer::GetPlaybackDistance(const int32 Frame) const {
+  const int32 NumFrames = FrameFiles.Num();
+  if (!bPlaybackLoop || NumFrames == 0) {
+    return FMath::Abs(Frame - PlaybackFrame);
+  }
+  // Frames playback passed a moment ago are the farthest, it only reaches them after the rest of
+  // the loop - the frames at the start of the sequence come soon when playback is near its end.
+  const int32 Distance = (Frame - PlaybackFrame) * (PlaybackStep < 0 ? -1 : 1);
+  return ((Distance % NumFrames) + NumFrames) % NumFrames;
+}
+
+uint32 FVolumeSequenceStreamer::Run() {
+  while (!LoadProgress.IsCanceled()) {
+    int32 FrameToLoad = INDEX_NONE;
+    {
+      FScopeLock ScopeLock(&Lock);
+      const TArray<int32> Upcoming = GetUpcomingFrames();
+      for (const int32 Frame : Upcoming) {
+        if (!Ring.Contains(Frame) && !FailedFrames.Contains(Frame)) {
+          FrameToLoad = Frame;
+          break;
+        }
+      }
+      // Make room by evicting the frame farthest from playback that isn't upcoming. Upcoming
+      // frames are never evicted, there are at most RingSize of them.
+      if (FrameToLoad != INDEX_NONE && Ring.Num() >= RingSize) {
+        int32 Evicted = INDEX_NONE;
+        for (const TPair<int32, FLoadedVolumePtr>& Entry : Ring) {
+          if (!Upcoming.Contains(Entry.Key) &&
+              (Evicted == INDEX_NONE ||
+               GetPlaybackDistance(Entry.Key) > GetPlaybackDistance(Evicted))) {
+            Evicted = Entry.Key;
+          }
+        }
+        if (Evicted != INDEX_NONE) {
+          Ring.Remove(Evicted);
+        } else {
+          FrameToLoad = INDEX_NONE;
+        }
+      }
+    }
+
+    if (FrameToLoad == INDEX_NONE) {
+      // Everything playback needs next is resident, sleep until it moves on.
+      WakeUp->Wait();
+      continue;
+    }
+
+    // The lock isn't held while loading, so playback can keep taking frames from the ring.
+    const FLoadedVolumePtr Volume = LoadMhdVolume(FrameFiles[FrameToLoad], &LoadProgress);
+
+    FScopeLock ScopeLock(&Lock);
+    if (Volume.IsValid()) {
+      Ring.Add(FrameToLoad, Volume);
+    } else if (!LoadProgress.IsCanceled()) {
+      UE_LOG(LogTemp, Warning, TEXT("Loading frame %d of the volume sequence (%s) failed."),
+             FrameToLoad, *FrameFiles[FrameToLoad]);
+      FailedFrames.Add(FrameToLoad);
+    }
+  }
+  return 0;
+}
+
+void FVolumeSequenceStreamer::Stop() {
+  LoadProgress.Cancel();
+  WakeUp->Trigger();
+}
+
+UVolumeSequence::UVolumeSequence()
+  : Texture(nullptr),
+    bLoop(true),
+    PlaybackPosition(0.0f),
+    FramesPerSecond(0.0f),
+    AverageDeltaTime(1.0f / 60.0f),
+    ShownFrame(-1),
+    NumStalls(0),
+    NumFrames(0) {}
+
+UVolumeSequence* UVolumeSequence::OpenMhdSequence(TArray<FString> FrameFiles, int32 RingSize) {
+  if (FrameFiles.Num() == 0) {
+    MY_LOG("Volume sequence has no frames.");
+    return nullptr;
+  }
+  UVolumeSequence* Sequence = NewObject<UVolumeSequence>();
+  Sequence->Streamer = MakeUnique<FVolumeSequenceStreamer>(FrameFiles, RingSize);
+  Sequence->NumFrames = FrameFiles.Num();
+  return Sequence;
+}
+
+UVolumeSequence* UVolumeSequence::OpenMhdSequenceFolder(FString Directory, int32 RingSize) {
+  TArray<FString> FileNames;
+  IFileManager::Get().FindFiles(FileNames, *Directory, TEXT("mhd"));
+  FileNames.Sort();
+  for (FString& FileName : FileNames) {
+    FileName = FPaths::Combine(Directory, FileName);
+  }
+  return OpenMhdSequence(FileNames, RingSize);
+}
+
+UVolumeSequence* UVolumeSequence::OpenMhdSequenceDeltaEncoded(TArray<FString> FrameFiles,
+                                                              int32 BrickSize,
+                                                              int32 KeyframeInterval) {
+  if (FrameFiles.Num() == 0) {
+    MY_LOG("Volume sequence has no frames.");
+    return nullptr;
+  }
+  UVolumeSequence* Sequence = NewObject<UVolumeSequence>();
+  Sequence->NumFrames = FrameFiles.Num();
+  Sequence->DeltasFuture =
+      Async<TSharedPtr<FVolumeSequenceDeltas, ESPMode::ThreadSafe>>(
+          EAsyncExecution::ThreadPool, [FrameFiles, BrickSize, KeyframeInterval]() {
+            TSharedPtr<FVolumeSequenceDeltas, ESPMode::ThreadSafe> Encoded =
+                MakeShared<FVolumeSequenceDeltas, ESPMode::ThreadSafe>();
+            if (!EncodeMhdSequence(FrameFiles, *Encoded, BrickSize, KeyframeInterval)) {
+              Encoded.Reset();
+            }
+            return Encoded;
+          });
+  return Sequence;
+}
+
+void UVolumeSequence::Play(float Rate) {
+  FramesPerSecond = Rate;
+}
+
+void UVolumeSequence::Pause() {
+  FramesPerSecond = 0.0f;
+}
+
+void UVolumeSequence::SetFrame(int32 Frame) {
+  PlaybackPosition = FMath::Clamp(Frame, 0, FMath::Max(GetNumFrames() - 1, 0));
+}
+
+void UVolumeSequence::BeginDestroy() {
+  // Stops and joins the streaming thread.
+  Streamer.Reset();
+  Super::BeginDestroy();
+}
+
+void UVolumeSequence::Tick(float DeltaTime) {
+  if (DeltasFuture.IsValid()) {
+    if (!DeltasFuture.IsReady()) {
+      return;
+    }
+    Deltas = DeltasFuture.Get();
+    DeltasFuture = TFuture<TSharedPtr<FVolumeSequenceDeltas, ESPMode::ThreadSafe>>();
+    if (!Deltas.IsValid()) {
+      MY_LOG("Encoding the volume sequence failed.");
+      return;
+    }
+    UE_LOG(LogTemp, Display,
+           TEXT("Volume sequence of %d frames encoded into %lld MB (%lld MB raw)."), NumFrames,
+           Deltas->GetTotalStoredBytes() >> 20, (Deltas->GetFrameBytes() * NumFrames) >> 20);
+  }
+
+  AverageDeltaTime = FMath::Lerp(AverageDeltaTime, DeltaTime, 0.1f);
+  if (FramesPerSecond != 0.0f) {
+    PlaybackPosition += FramesPerSecond * DeltaTime;
+    if (bLoop) {
+      PlaybackPosition = FMath::Fmod(PlaybackPosition, float(NumFrames));
+      if (PlaybackPosition < 0.0f) {
+        PlaybackPosition += NumFrames;
+      }
+    } else {
+      PlaybackPosition = FMath::Clamp(PlaybackPosition, 0.0f, float(NumFrames - 1));
+    }
+  }
+  const int32 Frame = FMath::Clamp(FMath::FloorToInt(PlaybackPosition), 0, NumFrames - 1);
+
+  if (Deltas.IsValid()) {
+    if (Frame != ShownFrame) {
+      ShowDeltaFrame(Frame);
+    }
+    return;
+  }
+
+  // At rates above the tick rate some frames are never shown - only prefetch the ones that are.
+  const int32 FramesPerTick =
+      FMath::Max(1, FMath::RoundToInt(FMath::Abs(FramesPerSecond) * AverageDeltaTime));
+  Streamer->SetPlayback(Frame, FramesPerSecond < 0.0f ? -FramesPerTick : FramesPerTick, bLoop);
+
+  if (Frame == ShownFrame) {
+    return;
+  }
+  const FLoadedVolumePtr Volume = Streamer->GetFrame(Frame);
+  if (Volume.IsValid()) {
+    ShowFrame(Frame, *Volume);
+  } else if (ShownFrame >= 0) {
+    NumStalls++;
+  }
+}
+
+TStatId UVolumeSequence::GetStatId() const {
+  RETURN_QUICK_DECLARE_CYCLE_STAT(UVolumeSequence, STATGROUP_Tickables);
+}
+
+void UVolumeSequence::ShowFrame(const int32 Frame, const FLoadedVolume& Volume) {
+  if (!Texture) {
+    Texture = NewObject<UVolumeTexture>(this, NAME_None, RF_Transient);
+  }
+  UpdateVolumeTextureAsset(Texture, Volume.PixelFormat, Volume.Dimensions, Volume.Data.Get(),
+                           false);
+  ShownFrame = Frame;
+  OnFrameShown.Broadcast(Frame);
+}
+
+void UVolumeSequence::ShowDeltaFrame(const int32 Frame) {
+  if (DecodedFrame.Num() != Deltas->GetFrameBytes()) {
+    DecodedFrame.SetNumUninitialized(Deltas->GetFrameBytes());
+    ShownFrame = -1;
+  }
+  // Playing forward only copies the bricks that changed since the shown frame.
+  TArray<int32> ChangedBricks;
+  const bool bPartial = Deltas->SeekFrame(ShownFrame >= 0 ? ShownFrame : INDEX_NONE, Frame,
+                                          DecodedFrame.GetData(), ChangedBricks);
+
+  // Then only those bricks are uploaded, too.
+  bool bUploaded = false;
+  if (bPartial && Texture) {
+    TArray<FIntVector> BrickMins;
+    TArray<FIntVector> BrickSizes;
+    for (const int32 Brick : ChangedBricks) {
+      BrickMins.Add(Deltas->GetBrickOrigin(Brick));
+      BrickSizes.Add(Deltas->GetBrickExtent(Brick));
+    }
+    bUploaded = UpdateVolumeTextureRegions(Texture, BrickMins, BrickSizes, DecodedFrame.GetData());
+  }
+  if (!bUploaded) {
+    if (!Texture) {
+      Texture = NewObject<UVolumeTexture>(this, NAME_None, RF_Transient);
+    }
+    UpdateVolumeTextureAsset(Texture, Deltas->GetPixelFormat(), Deltas->GetDimensions(),
+                             DecodedFrame.GetData(), false);
+  }
+  ShownFrame = Frame;
+  OnFrameShown.Broadcast(Frame);
+}
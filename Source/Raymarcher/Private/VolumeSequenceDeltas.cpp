@@ -0,0 +1,354 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "VolumeSequenceDeltas.h"
+#include "AsyncVolumeLoading.h"
+#include "HAL/FileManager.h"
+#include "RaymarchRendering.h"
+#include "Serialization/MemoryWriter.h"
+
+#include "Runtime/Core/Public/Async/ParallelFor.h"
+
+// "VSQD" - first four bytes of every saved sequence.
+#define VOLUME_SEQUENCE_MAGIC 0x56535144
+// Increase whenever the file layout changes.
+#define VOLUME_SEQUENCE_VERSION 1
+
+// Returns the first byte of a row of a brick inside the volume.
+static FORCEINLINE int64 GetRowOffset(const FIntVector& Dimensions, const int32 BytesPerVoxel,
+                                      const FIntVector& Origin, const int32 Y, const int32 Z) {
+  return (((int64)(Origin.Z + Z) * Dimensions.Y + Origin.Y + Y) * Dimensions.X + Origin.X) *
+         BytesPerVoxel;
+}
+
+// Copies a brick out of a volume into Packed, rows one after another.
+static void PackBrick(const uint8* Volume, const FIntVector& Dimensions, const int32 BytesPerVoxel,
+                      const FIntVector& Origin, const FIntVector& Extent, uint8* Packed) {
+  const int64 RowBytes = (int64)Extent.X * BytesPerVoxel;
+  for (int32 Z = 0; Z < Extent.Z; Z++) {
+    for (int32 Y = 0; Y < Extent.Y; Y++) {
+      FMemory::Memcpy(Packed, Volume + GetRowOffset(Dimensions, BytesPerVoxel, Origin, Y, Z),
+                      RowBytes);
+      Packed += RowBytes;
+    }
+  }
+}
+
+// Copies a packed brick back into its place in the volume.
+static void UnpackBrick(const uint8* Packed, const FIntVector& Dimensions,
+                        const int32 BytesPerVoxel, const FIntVector& Origin,
+                        const FIntVector& Extent, uint8* Volume) {
+  const int64 RowBytes = (int64)Extent.X * BytesPerVoxel;
+  for (int32 Z = 0; Z < Extent.Z; Z++) {
+    for (int32 Y = 0; Y < Extent.Y; Y++) {
+      FMemory::Memcpy(Volume + GetRowOffset(Dimensions, BytesPerVoxel, Origin, Y, Z), Packed,
+                      RowBytes);
+      Packed += RowBytes;
+    }
+  }
+}
+
+static bool IsBrickEqual(const uint8* A, const uint8* B, const FIntVector& Dimensions,
+                         const int32 BytesPerVoxel, const FIntVector& Origin,
+                         const FIntVector& Extent) {
+  const int64 RowBytes = (int64)Extent.X * BytesPerVoxel;
+  for (int32 Z = 0; Z < Extent.Z; Z++) {
+    for (int32 Y = 0; Y < Extent.Y; Y++) {
+      const int64 Offset = GetRowOffset(Dimensions, BytesPerVoxel, Origin, Y, Z);
+      if (FMemory::Memcmp(A + Offset, B + Offset, RowBytes) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+FVolumeSequenceDeltas::FVolumeSequenceDeltas(const FIntVector InDimensions,
+                                             const EPixelFormat InPixelFormat,
+                                             const int32 InBrickSize,
+                                             const int32 InKeyframeInterval)
+  : Dimensions(InDimensions),
+    PixelFormat(InPixelFormat),
+    BytesPerVoxel(GPixelFormats[InPixelFormat].BlockBytes),
+    BrickSize(FMath::Max(InBrickSize, 1)),
+    KeyframeInterval(FMath::Max(InKeyframeInterval, 1)) {
+  BrickCounts = FIntVector(FMath::DivideAndRoundUp(Dimensions.X, BrickSize),
+                           FMath::DivideAndRoundUp(Dimensions.Y, BrickSize),
+                           FMath::DivideAndRoundUp(Dimensions.Z, BrickSize));
+}
+
+FIntVector FVolumeSequenceDeltas::GetBrickCoordinates(const int32 BrickIndex) const {
+  const int32 BricksPerLayer = BrickCounts.X * BrickCounts.Y;
+  return FIntVector(BrickIndex % BrickCounts.X, (BrickIndex % BricksPerLayer) / BrickCounts.X,
+                    BrickIndex / BricksPerLayer);
+}
+
+FIntVector FVolumeSequenceDeltas::GetBrickOrigin(const int32 BrickIndex) const {
+  return GetBrickCoordinates(BrickIndex) * BrickSize;
+}
+
+FIntVector FVolumeSequenceDeltas::GetBrickExtent(const int32 BrickIndex) const {
+  const FIntVector Origin = GetBrickOrigin(BrickIndex);
+  return FIntVector(FMath::Min(BrickSize, Dimensions.X - Origin.X),
+                    FMath::Min(BrickSize, Dimensions.Y - Origin.Y),
+                    FMath::Min(BrickSize, Dimensions.Z - Origin.Z));
+}
+
+int64 FVolumeSequenceDeltas::GetFrameBytes() const {
+  return (int64)Dimensions.X * Dimensions.Y * Dimensions.Z * BytesPerVoxel;
+}
+
+int64 FVolumeSequenceDeltas::GetTotalStoredBytes() const {
+  int64 Bytes = 0;
+  for (const FFrame& Frame : Frames) {
+    Bytes += Frame.Voxels.Num() + Frame.ChangedBricks.Num() * sizeof(int32);
+  }
+  return Bytes;
+}
+
+int32 FVolumeSequenceDeltas::GetKeyframe(const int32 Frame) const {
+  int32 Keyframe = Frame;
+  while (Keyframe > 0 && !Frames[Keyframe].bKeyframe) {
+    Keyframe--;
+  }
+  return Keyframe;
+}
+
+// Returns where every brick starts in the packed voxels of a delta, and their end as last entry.
+static TArray<int64> GetPackedOffsets(const FVolumeSequenceDeltas& Sequence,
+                                      const TArray<int32>& Bricks, const int32 BytesPerVoxel) {
+  TArray<int64> Offsets;
+  Offsets.SetNumUninitialized(Bricks.Num() + 1);
+  int64 Offset = 0;
+  for (int32 i = 0; i < Bricks.Num(); i++) {
+    Offsets[i] = Offset;
+    const FIntVector Extent = Sequence.GetBrickExtent(Bricks[i]);
+    Offset += (int64)Extent.X * Extent.Y * Extent.Z * BytesPerVoxel;
+  }
+  Offsets[Bricks.Num()] = Offset;
+  return Offsets;
+}
+
+void FVolumeSequenceDeltas::AddFrame(const uint8* Voxels) {
+  check(BytesPerVoxel > 0);
+  const int64 FrameBytes = GetFrameBytes();
+  const int32 NumBricks = GetNumBricks();
+  FFrame NewFrame;
+  // The previous frame isn't saved, so the first frame added after loading is a keyframe too.
+  NewFrame.bKeyframe = Frames.Num() == 0 || PreviousFrame.Num() != FrameBytes ||
+                       Frames.Num() - GetKeyframe(Frames.Num() - 1) >= KeyframeInterval;
+
+  if (!NewFrame.bKeyframe) {
+    TArray<bool> Changed;
+    Changed.SetNumZeroed(NumBricks);
+    ParallelFor(NumBricks, [&](int32 Brick) {
+      Changed[Brick] = !IsBrickEqual(PreviousFrame.GetData(), Voxels, Dimensions, BytesPerVoxel,
+                                     GetBrickOrigin(Brick), GetBrickExtent(Brick));
+    });
+    for (int32 Brick = 0; Brick < NumBricks; Brick++) {
+      if (Changed[Brick]) {
+        NewFrame.ChangedBricks.Add(Brick);
+      }
+    }
+    // Past this point the delta doesn't save much, but every frame up to the next keyframe
+    // would have to apply it.
+    NewFrame.bKeyframe = NewFrame.ChangedBricks.Num() * 2 > NumBricks;
+  }
+
+  if (NewFrame.bKeyframe) {
+    NewFrame.ChangedBricks.Empty();
+    NewFrame.Voxels.SetNumUninitialized(FrameBytes);
+    FMemory::Memcpy(NewFrame.Voxels.GetData(), Voxels, FrameBytes);
+    PreviousFrame = NewFrame.Voxels;
+  } else {
+    const TArray<int64> Offsets = GetPackedOffsets(*this, NewFrame.ChangedBricks, BytesPerVoxel);
+    NewFrame.Voxels.SetNumUninitialized(Offsets.Last());
+    ParallelFor(NewFrame.ChangedBricks.Num(), [&](int32 i) {
+      const int32 Brick = NewFrame.ChangedBricks[i];
+      PackBrick(Voxels, Dimensions, BytesPerVoxel, GetBrickOrigin(Brick), GetBrickExtent(Brick),
+                NewFrame.Voxels.GetData() + Offsets[i]);
+    });
+  }
+  Frames.Add(MoveTemp(NewFrame));
+  if (!Frames.Last().bKeyframe) {
+    // The previous frame is brought up to date the same way a decoder would.
+    ApplyFrame(Frames.Num() - 1, PreviousFrame.GetData());
+  }
+}
+
+void FVolumeSequenceDeltas::ApplyFrame(const int32 Frame, uint8* Voxels) const {
+  const FFrame& Delta = Frames[Frame];
+  if (Delta.bKeyframe) {
+    FMemory::Memcpy(Voxels, Delta.Voxels.GetData(), Delta.Voxels.Num());
+    return;
+  }
+  const TArray<int64> Offsets = GetPackedOffsets(*this, Delta.ChangedBricks, BytesPerVoxel);
+  ParallelFor(Delta.ChangedBricks.Num(), [&](int32 i) {
+    const int32 Brick = Delta.ChangedBricks[i];
+    UnpackBrick(Delta.Voxels.GetData() + Offsets[i], Dimensions, BytesPerVoxel,
+                GetBrickOrigin(Brick), GetBrickExtent(Brick), Voxels);
+  });
+}
+
+bool FVolumeSequenceDeltas::SeekFrame(const int32 FromFrame, const int32 ToFrame, uint8* Voxels,
+                                      TArray<int32>& OutChangedBricks) const {
+  OutChangedBricks.Reset();
+  const int32 Keyframe = GetKeyframe(ToFrame);
+  if (FromFrame != INDEX_NONE && FromFrame <= ToFrame && Keyframe <= FromFrame) {
+    for (int32 Frame = FromFrame + 1; Frame <= ToFrame; Frame++) {
+      ApplyFrame(Frame, Voxels);
+      OutChangedBricks.Append(Frames[Frame].ChangedBricks);
+    }
+    if (ToFrame - FromFrame > 1) {
+      OutChangedBricks.Sort();
+      int32 NumUnique = 0;
+      for (int32 i = 0; i < OutChangedBricks.Num(); i++) {
+        if (NumUnique == 0 || OutChangedBricks[NumUnique - 1] != OutChangedBricks[i]) {
+          OutChangedBricks[NumUnique++] = OutChangedBricks[i];
+        }
+      }
+      OutChangedBricks.SetNum(NumUnique, false);
+    }
+    return true;
+  }
+
+  for (int32 Frame = Keyframe; Frame <= ToFrame; Frame++) {
+    ApplyFrame(Frame, Voxels);
+  }
+  return false;
+}
+
+bool FVolumeSequenceDeltas::SaveToFile(const FString FileName) const {
+  TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*FileName));
+  if (!Writer) {
+    MY_LOG("Volume sequence file could not be created.");
+    return false;
+  }
+  uint32 Magic = VOLUME_SEQUENCE_MAGIC;
+  uint32 Version = VOLUME_SEQUENCE_VERSION;
+  FIntVector SavedDimensions = Dimensions;
+  uint8 Format = uint8(PixelFormat);
+  int32 SavedBrickSize = BrickSize;
+  int32 SavedKeyframeInterval = KeyframeInterval;
+  int32 NumFrames = Frames.Num();
+  *Writer << Magic << Version << SavedDimensions << Format << SavedBrickSize
+          << SavedKeyframeInterval << NumFrames;
+  for (const FFrame& Frame : Frames) {
+    FFrame& MutableFrame = const_cast<FFrame&>(Frame);
+    *Writer << MutableFrame.bKeyframe << MutableFrame.ChangedBricks << MutableFrame.Voxels;
+  }
+  return Writer->Close();
+}
+
+bool FVolumeSequenceDeltas::LoadFromFile(const FString FileName) {
+  *this = FVolumeSequenceDeltas();
+  TUniquePtr<FArchive> Reader(IFileManager::Get().CreateFileReader(*FileName, FILEREAD_Silent));
+  if (!Reader) {
+    MY_LOG("Volume sequence file could not be opened.");
+    return false;
+  }
+  uint32 Magic = 0;
+  uint32 Version = 0;
+  *Reader << Magic << Version;
+  if (Reader->IsError() || Magic != VOLUME_SEQUENCE_MAGIC || Version != VOLUME_SEQUENCE_VERSION) {
+    MY_LOG("File is not a volume sequence or was written by a different version.");
+    return false;
+  }
+  FIntVector LoadedDimensions;
+  uint8 Format = 0;
+  int32 LoadedBrickSize = 0;
+  int32 LoadedKeyframeInterval = 0;
+  int32 NumFrames = 0;
+  *Reader << LoadedDimensions << Format << LoadedBrickSize << LoadedKeyframeInterval << NumFrames;
+  if (Reader->IsError() || Format >= PF_MAX || GPixelFormats[Format].BlockBytes <= 0 ||
+      LoadedDimensions.X <= 0 || LoadedDimensions.Y <= 0 || LoadedDimensions.Z <= 0 ||
+      LoadedBrickSize < 1 || NumFrames < 0) {
+    MY_LOG("Volume sequence header is corrupt.");
+    return false;
+  }
+  // Keyframes keep a whole frame in an array, so a frame can't be bigger than that. Every frame
+  // takes bytes in the file, so there can't be more frames than fit in the rest of it.
+  const int64 LoadedFrameBytes = (int64)LoadedDimensions.X * LoadedDimensions.Y *
+                                 LoadedDimensions.Z * GPixelFormats[Format].BlockBytes;
+  TArray<uint8> EmptyFrameBytes;
+  FMemoryWriter EmptyFrameWriter(EmptyFrameBytes);
+  FFrame EmptyFrame;
+  EmptyFrameWriter << EmptyFrame.bKeyframe << EmptyFrame.ChangedBricks << EmptyFrame.Voxels;
+  if (LoadedFrameBytes > MAX_int32 ||
+      (int64)NumFrames * EmptyFrameBytes.Num() > Reader->TotalSize() - Reader->Tell()) {
+    MY_LOG("Volume sequence header is corrupt.");
+    return false;
+  }
+
+  *this = FVolumeSequenceDeltas(LoadedDimensions, EPixelFormat(Format), LoadedBrickSize,
+                                LoadedKeyframeInterval);
+  Frames.SetNum(NumFrames);
+  for (FFrame& Frame : Frames) {
+    *Reader << Frame.bKeyframe << Frame.ChangedBricks << Frame.Voxels;
+  }
+  if (Reader->IsError() || (NumFrames > 0 && !Frames[0].bKeyframe)) {
+    MY_LOG("Volume sequence is truncated or corrupt.");
+    *this = FVolumeSequenceDeltas();
+    return false;
+  }
+
+  // ApplyFrame copies the stored voxels into a frame without checking them, so keyframes must
+  // hold exactly one frame and deltas exactly the bricks they list (in ascending order).
+  const int64 FrameBytes = GetFrameBytes();
+  const int32 NumBricks = GetNumBricks();
+  for (int32 FrameIndex = 0; FrameIndex < NumFrames; FrameIndex++) {
+    const FFrame& Frame = Frames[FrameIndex];
+    bool bValid = true;
+    if (Frame.bKeyframe) {
+      bValid = Frame.ChangedBricks.Num() == 0 && Frame.Voxels.Num() == FrameBytes;
+    } else {
+      for (int32 i = 0; i < Frame.ChangedBricks.Num() && bValid; i++) {
+        bValid = Frame.ChangedBricks[i] >= 0 && Frame.ChangedBricks[i] < NumBricks &&
+                 (i == 0 || Frame.ChangedBricks[i - 1] < Frame.ChangedBricks[i]);
+      }
+      bValid = bValid &&
+               Frame.Voxels.Num() ==
+                   GetPackedOffsets(*this, Frame.ChangedBricks, BytesPerVoxel).Last();
+    }
+    if (!bValid) {
+      UE_LOG(LogTemp, Warning, TEXT("Frame %d of %s has a wrong size or invalid bricks."),
+             FrameIndex, *FileName);
+      *this = FVolumeSequenceDeltas();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool EncodeMhdSequence(const TArray<FString>& FrameFiles, FVolumeSequenceDeltas& OutSequence,
+                       const int32 BrickSize, const int32 KeyframeInterval,
+                       FVolumeLoadProgress* Progress) {
+  if (Progress) {
+    Progress->Start(FrameFiles.Num());
+  }
+  for (int32 i = 0; i < FrameFiles.Num(); i++) {
+    // Every frame is loaded with all threads, then its bricks are compared with all threads.
+    const FLoadedVolumePtr Volume = LoadMhdVolume(FrameFiles[i]);
+    if (!Volume.IsValid()) {
+      UE_LOG(LogTemp, Warning, TEXT("Frame %d of the volume sequence (%s) could not be loaded."),
+             i, *FrameFiles[i]);
+      return false;
+    }
+    if (i == 0) {
+      OutSequence = FVolumeSequenceDeltas(Volume->Dimensions, Volume->PixelFormat, BrickSize,
+                                          KeyframeInterval);
+    } else if (Volume->Dimensions != OutSequence.GetDimensions() ||
+               Volume->PixelFormat != OutSequence.GetPixelFormat()) {
+      UE_LOG(LogTemp, Warning,
+             TEXT("Frame %d of the volume sequence (%s) doesn't match the first frame."), i,
+             *FrameFiles[i]);
+      return false;
+    }
+    OutSequence.AddFrame(Volume->Data.Get());
+    if (Progress && !Progress->Advance(1)) {
+      MY_LOG("Encoding was canceled.");
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,189 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#include "VolumeStatistics.h"
+#include "Misc/ScopeLock.h"
+
+// Fractions of voxels below FVolumeStatistics::LowPercentile and HighPercentile.
+#define VOLUME_STATISTICS_LOW_FRACTION 0.005
+#define VOLUME_STATISTICS_HIGH_FRACTION 0.995
+
+float FVolumeStatistics::GetPercentile(const float Fraction) const {
+  int64 Total = 0;
+  for (const int64 BinCount : Histogram) {
+    Total += BinCount;
+  }
+  if (Total == 0) {
+    return Min;
+  }
+  const double Target = FMath::Clamp(Fraction, 0.0f, 1.0f) * double(Total);
+  int64 Cumulative = 0;
+  for (int32 Bin = 0; Bin < Histogram.Num(); Bin++) {
+    Cumulative += Histogram[Bin];
+    if (Cumulative >= Target) {
+      return Min + (Max - Min) * (Bin + 1) / Histogram.Num();
+    }
+  }
+  return Max;
+}
+
+// Maps a float to a 32-bit key whose unsigned order is the order of the floats.
+static FORCEINLINE uint32 OrderedFloatBits(const float Value) {
+  const uint32 Bits = *reinterpret_cast<const uint32*>(&Value);
+  return (Bits & 0x80000000u) ? ~Bits : (Bits | 0x80000000u);
+}
+
+// Inverse of OrderedFloatBits.
+static FORCEINLINE float FloatFromOrderedBits(const uint32 Key) {
+  const uint32 Bits = (Key & 0x80000000u) ? (Key & 0x7fffffffu) : ~Key;
+  return *reinterpret_cast<const float*>(&Bits);
+}
+
+// Returns the (representative) value of a fine histogram bin.
+static float FineBinValue(const EPixelFormat PixelFormat, const int32 Bin) {
+  switch (PixelFormat) {
+    case PF_G8: return Bin / 255.0f;
+    case PF_G16: return Bin / 65535.0f;
+    // Middle of the range of floats sharing the top 16 bits.
+    default: return FloatFromOrderedBits((uint32(Bin) << 16) | 0x8000u);
+  }
+}
+
+void FVoxelStatisticsAccumulator::Start(const EPixelFormat InPixelFormat) {
+  FScopeLock ScopeLock(&Lock);
+  PixelFormat = InPixelFormat;
+  FineHistogram.Reset();
+  switch (PixelFormat) {
+    case PF_G8: FineHistogram.SetNumZeroed(256); break;
+    case PF_G16:
+    case PF_R32_FLOAT: FineHistogram.SetNumZeroed(65536); break;
+    default: break;
+  }
+  Count = 0;
+  Sum = 0.0;
+  Min = TNumericLimits<float>::Max();
+  Max = TNumericLimits<float>::Lowest();
+}
+
+// Bins integer voxels into LocalHistogram and returns their sum.
+template <typename VoxelType>
+static uint64 BinIntegerVoxels(const VoxelType* Voxels, const int64 NumVoxels,
+                               TArray<uint32>& LocalHistogram, VoxelType& OutMin,
+                               VoxelType& OutMax) {
+  uint32* Bins = LocalHistogram.GetData();
+  uint64 VoxelSum = 0;
+  for (int64 i = 0; i < NumVoxels; i++) {
+    Bins[Voxels[i]]++;
+    VoxelSum += Voxels[i];
+  }
+  // Min and max are the first and last non-empty bins, no need to track them per voxel.
+  int32 First = 0;
+  while (First < LocalHistogram.Num() - 1 && Bins[First] == 0) {
+    First++;
+  }
+  int32 Last = LocalHistogram.Num() - 1;
+  while (Last > 0 && Bins[Last] == 0) {
+    Last--;
+  }
+  OutMin = VoxelType(First);
+  OutMax = VoxelType(Last);
+  return VoxelSum;
+}
+
+void FVoxelStatisticsAccumulator::AddVoxels(const uint8* Data, const int64 NumVoxels) {
+  if (FineHistogram.Num() == 0 || NumVoxels <= 0) {
+    return;
+  }
+
+  // Bin into a local histogram first, so the lock is only taken once per call.
+  TArray<uint32> LocalHistogram;
+  LocalHistogram.SetNumZeroed(FineHistogram.Num());
+  int64 LocalCount = NumVoxels;
+  double LocalSum = 0.0;
+  float LocalMin;
+  float LocalMax;
+
+  if (PixelFormat == PF_G8) {
+    uint8 MinValue, MaxValue;
+    LocalSum = BinIntegerVoxels(Data, NumVoxels, LocalHistogram, MinValue, MaxValue) / 255.0;
+    LocalMin = MinValue / 255.0f;
+    LocalMax = MaxValue / 255.0f;
+  } else if (PixelFormat == PF_G16) {
+    uint16 MinValue, MaxValue;
+    LocalSum = BinIntegerVoxels(reinterpret_cast<const uint16*>(Data), NumVoxels, LocalHistogram,
+                                MinValue, MaxValue) /
+               65535.0;
+    LocalMin = MinValue / 65535.0f;
+    LocalMax = MaxValue / 65535.0f;
+  } else {
+    const float* Voxels = reinterpret_cast<const float*>(Data);
+    uint32* Bins = LocalHistogram.GetData();
+    LocalMin = TNumericLimits<float>::Max();
+    LocalMax = TNumericLimits<float>::Lowest();
+    for (int64 i = 0; i < NumVoxels; i++) {
+      const float Value = Voxels[i];
+      if (FMath::IsNaN(Value)) {
+        LocalCount--;
+        continue;
+      }
+      Bins[OrderedFloatBits(Value) >> 16]++;
+      LocalSum += Value;
+      LocalMin = FMath::Min(LocalMin, Value);
+      LocalMax = FMath::Max(LocalMax, Value);
+    }
+  }
+
+  FScopeLock ScopeLock(&Lock);
+  for (int32 Bin = 0; Bin < FineHistogram.Num(); Bin++) {
+    FineHistogram[Bin] += LocalHistogram[Bin];
+  }
+  Count += LocalCount;
+  Sum += LocalSum;
+  if (LocalCount > 0) {
+    Min = FMath::Min(Min, LocalMin);
+    Max = FMath::Max(Max, LocalMax);
+  }
+}
+
+FVolumeStatistics FVoxelStatisticsAccumulator::GetStatistics() const {
+  FScopeLock ScopeLock(&Lock);
+  FVolumeStatistics Statistics;
+  if (FineHistogram.Num() == 0 || Count == 0) {
+    return Statistics;
+  }
+  Statistics.bValid = true;
+  Statistics.Min = Min;
+  Statistics.Max = Max;
+  Statistics.Mean = float(Sum / Count);
+
+  const double LowTarget = VOLUME_STATISTICS_LOW_FRACTION * Count;
+  const double HighTarget = VOLUME_STATISTICS_HIGH_FRACTION * Count;
+  bool bLowFound = false;
+  bool bHighFound = false;
+  const float Range = Max - Min;
+  Statistics.Histogram.SetNumZeroed(VOLUME_STATISTICS_BINS);
+
+  // Walk the fine histogram once, picking the percentiles and rebinning it to [Min, Max].
+  uint64 Cumulative = 0;
+  for (int32 Bin = 0; Bin < FineHistogram.Num(); Bin++) {
+    if (FineHistogram[Bin] == 0) {
+      continue;
+    }
+    const float Value = FMath::Clamp(FineBinValue(PixelFormat, Bin), Min, Max);
+    Cumulative += FineHistogram[Bin];
+    if (!bLowFound && Cumulative >= LowTarget) {
+      Statistics.LowPercentile = Value;
+      bLowFound = true;
+    }
+    if (!bHighFound && Cumulative >= HighTarget) {
+      Statistics.HighPercentile = Value;
+      bHighFound = true;
+    }
+    const int32 CoarseBin =
+        Range > 0.0f ? FMath::Min(int32((Value - Min) / Range * VOLUME_STATISTICS_BINS),
+                                  VOLUME_STATISTICS_BINS - 1)
+                     : 0;
+    Statistics.Histogram[CoarseBin] += FineHistogram[Bin];
+  }
+  return Statistics;
+}
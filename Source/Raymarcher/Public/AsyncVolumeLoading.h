@@ -0,0 +1,152 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains functions for loading volumes on worker threads and async Blueprint nodes built on them.
+// Reading, decompressing and converting the data happens on the thread pool, only creating or
+// updating the texture is done on the game thread once the data is ready.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "Engine/VolumeTexture.h"
+#include "Kismet/BlueprintAsyncActionBase.h"
+
+#include "MhdInfo.h"
+#include "VolumeLoadProgress.h"
+#include "VolumeStatistics.h"
+
+#include "AsyncVolumeLoading.generated.h"
+
+/** Voxel data of a volume loaded on a worker thread, ready to be put into a texture. */
+struct FLoadedVolume {
+  TUniquePtr<uint8> Data;
+  EPixelFormat PixelFormat{PF_Unknown};
+  FIntVector Dimensions{0, 0, 0};
+  FVector WorldDimensions{0.0f, 0.0f, 0.0f};
+  // Gathered while converting the data (see FVoxelStatisticsAccumulator).
+  FVolumeStatistics Statistics;
+};
+
+typedef TSharedPtr<FLoadedVolume, ESPMode::ThreadSafe> FLoadedVolumePtr;
+typedef TSharedPtr<FVolumeLoadProgress, ESPMode::ThreadSafe> FVolumeLoadProgressPtr;
+
+/** Parses an MHD file and loads its data on the calling thread (see LoadMhdDataConverted). Returns
+ * nullptr if loading failed or was canceled through Progress. */
+FLoadedVolumePtr LoadMhdVolume(const FString MhdFileName, FVolumeLoadProgress* Progress = nullptr,
+                               const FVoxelWindow* Window = nullptr);
+
+/** Parses an MHD file and loads its data on the thread pool (see LoadMhdDataConverted). The future
+ * is set to the loaded volume, or to nullptr if loading failed or was canceled through Progress.
+ * Progress is optional. */
+TFuture<FLoadedVolumePtr> LoadMhdDataAsync(
+    const FString MhdFileName, FVolumeLoadProgressPtr Progress = nullptr,
+    const TOptional<FVoxelWindow> Window = TOptional<FVoxelWindow>());
+
+/** Loads a raw file of the given dimensions and element type on the thread pool (see
+ * LoadRawFileConverted). Same result and progress handling as LoadMhdDataAsync. */
+TFuture<FLoadedVolumePtr> LoadRawDataAsync(const FString RawFileName, const FIntVector Dimensions,
+                                           const EMhdElementType ElementType,
+                                           FVolumeLoadProgressPtr Progress = nullptr);
+
+/** Loads an MHD file reduced by Factor along every axis on the thread pool (see
+ * LoadMhdDataDecimated). WorldDimensions are those of the full volume. Same result and progress
+ * handling as LoadMhdDataAsync. */
+TFuture<FLoadedVolumePtr> LoadMhdDataDecimatedAsync(const FString MhdFileName, const int32 Factor,
+                                                    const EVolumeDecimation Decimation,
+                                                    FVolumeLoadProgressPtr Progress = nullptr);
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FVolumeLoadProgressDelegate, float, Fraction);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_FourParams(FVolumeLoadedDelegate, UVolumeTexture*, Texture,
+                                              FIntVector, TextureDimensions, FVector,
+                                              WorldDimensions, const FVolumeStatistics&,
+                                              Statistics);
+
+/** Async Blueprint nodes loading MHD and raw volumes into volume textures without blocking the game
+ * thread. All delegates are called on the game thread. */
+UCLASS()
+class ULoadVolumeAsyncAction : public UBlueprintAsyncActionBase {
+  GENERATED_BODY()
+public:
+  /** Called every frame while the volume is loading, with the fraction loaded so far. */
+  UPROPERTY(BlueprintAssignable)
+  FVolumeLoadProgressDelegate OnProgress;
+
+  /** Called once the preview texture has been created, by the nodes loading a preview first. */
+  UPROPERTY(BlueprintAssignable)
+  FVolumeLoadedDelegate OnPreview;
+
+  /** Called once the texture has been created or updated. */
+  UPROPERTY(BlueprintAssignable)
+  FVolumeLoadedDelegate OnLoaded;
+
+  /** Called if loading failed or was canceled. The texture is not modified in that case. */
+  UPROPERTY(BlueprintAssignable)
+  FVolumeLoadedDelegate OnFailed;
+
+  /** Async version of LoadMhdIntoNewVolumeTextureAsset. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher",
+            meta = (BlueprintInternalUseOnly = "true"))
+  static ULoadVolumeAsyncAction* LoadMhdIntoNewVolumeTextureAssetAsync(FString FileName,
+                                                                       FString TextureName,
+                                                                       bool Persistent);
+
+  /** Async version of LoadMhdIntoVolumeTextureAsset. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher",
+            meta = (BlueprintInternalUseOnly = "true"))
+  static ULoadVolumeAsyncAction* LoadMhdIntoVolumeTextureAssetAsync(FString FileName,
+                                                                    UVolumeTexture* VolumeAsset,
+                                                                    bool Persistent);
+
+  /** Like LoadMhdIntoNewVolumeTextureAssetAsync, but first loads the volume decimated by
+   * PreviewFactor into a new texture named TextureName_Preview and calls OnPreview with it, then
+   * refines to the full resolution in the background. OnProgress reports the preview first, then
+   * the full volume. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher",
+            meta = (BlueprintInternalUseOnly = "true"))
+  static ULoadVolumeAsyncAction* LoadMhdWithPreviewIntoNewVolumeTextureAssetAsync(
+      FString FileName, FString TextureName, int32 PreviewFactor, EVolumeDecimation Decimation,
+      bool Persistent);
+
+  /** Async version of LoadRawIntoNewVolumeTextureAsset. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher",
+            meta = (BlueprintInternalUseOnly = "true"))
+  static ULoadVolumeAsyncAction* LoadRawIntoNewVolumeTextureAssetAsync(
+      FString RawFileName, FString TextureName, FIntVector Dimensions,
+      EMhdElementType ElementType, bool Persistent);
+
+  /** Async version of LoadRawIntoVolumeTextureAsset. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher",
+            meta = (BlueprintInternalUseOnly = "true"))
+  static ULoadVolumeAsyncAction* LoadRawIntoVolumeTextureAssetAsync(
+      FString RawFileName, UVolumeTexture* VolumeAsset, FIntVector Dimensions,
+      EMhdElementType ElementType, bool Persistent);
+
+  /** Stops loading at the next slab boundary. OnFailed is called once the worker threads have
+   * stopped - or right away when the node is activated, if it's canceled before that. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  void Cancel();
+
+  virtual void Activate() override;
+
+private:
+  // Polls the load on the game thread, uploads the texture and fires the delegates when done.
+  bool Tick(float DeltaTime);
+
+  // Starts the load on the thread pool, set by the factory functions.
+  TFunction<TFuture<FLoadedVolumePtr>(FVolumeLoadProgressPtr)> StartLoad;
+  // Starts loading the preview, which is done before StartLoad is called. Optional.
+  TFunction<TFuture<FLoadedVolumePtr>(FVolumeLoadProgressPtr)> StartPreviewLoad;
+
+  // Texture to update, or name of the texture to create if there is none.
+  UPROPERTY()
+  UVolumeTexture* TargetTexture;
+  FString TextureName;
+  bool bPersistent;
+  // Set by Cancel, so canceling before Activate (when there is no Progress yet) isn't lost.
+  bool bCanceled = false;
+
+  FVolumeLoadProgressPtr Progress;
+  TFuture<FLoadedVolumePtr> Future;
+  TFuture<FLoadedVolumePtr> PreviewFuture;
+};
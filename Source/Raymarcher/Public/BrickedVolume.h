@@ -0,0 +1,116 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a bricked volume file format for volumes that don't fit into memory. The volume is cut
+// into cubic bricks that are stored (optionally zlib-compressed) one after another, preceded by an
+// index with the position and a min/max/occupancy summary of every brick. Any subset of bricks can
+// be read by random access, and bricks that are empty or constant never have to be read at all.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "MhdInfo.h"
+#include "PixelFormat.h"
+#include "VolumeLoadProgress.h"
+
+/** Position and summary of a single brick, stored in the brick index. */
+struct FBrickInfo {
+  // Position of the brick's data in the file and its size there.
+  int64 Offset{0};
+  int32 StoredSize{0};
+  // Bricks are stored uncompressed if compressing them doesn't make them smaller.
+  bool bCompressed{false};
+  // Constant bricks aren't stored at all, their value (the bytes of one voxel) is kept here.
+  bool bConstant{false};
+  uint64 ConstantValue{0};
+  // Range of the brick's voxel values, in the volume's element type.
+  float Min{0.0f};
+  float Max{0.0f};
+  // Fraction of the brick's voxels above the volume's occupancy threshold.
+  float Occupancy{0.0f};
+
+  /** No voxel of the brick is above the occupancy threshold. */
+  bool IsEmpty() const { return Occupancy == 0.0f; }
+
+  friend FArchive& operator<<(FArchive& Ar, FBrickInfo& Brick);
+};
+
+/** Read access to a bricked volume file. Open only reads the header and the brick index, bricks
+ * are read on demand. All const functions can be called from several threads at once. */
+class FBrickedVolume {
+public:
+  /** Opens a file written by ConvertMhdToBrickedVolume. Returns false if it doesn't exist or isn't
+   * a bricked volume of this version. */
+  bool Open(const FString InFileName);
+
+  FIntVector GetDimensions() const { return Dimensions; }
+  FVector GetSpacing() const { return Spacing; }
+  EMhdElementType GetElementType() const { return ElementType; }
+  int32 GetBrickSize() const { return BrickSize; }
+  float GetOccupancyThreshold() const { return OccupancyThreshold; }
+
+  /** Number of bricks along every axis. */
+  FIntVector GetBrickCounts() const { return BrickCounts; }
+
+  /** Bricks are indexed with X changing fastest, like voxels. */
+  int32 GetBrickIndex(const FIntVector Brick) const {
+    return (Brick.Z * BrickCounts.Y + Brick.Y) * BrickCounts.X + Brick.X;
+  }
+
+  FIntVector GetBrickCoordinates(const int32 BrickIndex) const;
+
+  /** First voxel of the brick in the volume. */
+  FIntVector GetBrickOrigin(const int32 BrickIndex) const {
+    return GetBrickCoordinates(BrickIndex) * BrickSize;
+  }
+
+  /** Voxels of the brick along every axis - BrickSize, except at the far edges of the volume. */
+  FIntVector GetBrickExtent(const int32 BrickIndex) const;
+
+  const TArray<FBrickInfo>& GetBricks() const { return Bricks; }
+
+  /** Returns the bricks overlapping the box of RegionSize voxels starting at RegionMin. If
+   * bSkipEmpty is set, bricks without any voxel above the occupancy threshold are left out. */
+  TArray<int32> FindBricks(const FIntVector RegionMin, const FIntVector RegionSize,
+                           const bool bSkipEmpty = false) const;
+
+  /** Reads the given bricks in parallel, each reader with its own file handle, in file order.
+   * ProcessBrick is called from worker threads with the decompressed voxels of every brick (X
+   * fastest, GetBrickExtent voxels, in the volume's element type). Constant bricks are filled
+   * from the index without reading anything. Returns false if a brick couldn't be read or
+   * decompressed, or loading was canceled through Progress. */
+  bool ReadBricks(const TArray<int32>& BrickIndices,
+                  TFunctionRef<void(int32 BrickIndex, const uint8* Voxels)> ProcessBrick,
+                  FVolumeLoadProgress* Progress = nullptr) const;
+
+  /** Loads the box of RegionSize voxels starting at RegionMin, converted to the pixel format
+   * returned by FMhdInfo::GetConvertedPixelFormat. Only the bricks overlapping the box are read.
+   * Returns nullptr if the region isn't inside the volume or reading failed. */
+  TUniquePtr<uint8> LoadRegionConverted(const FIntVector RegionMin, const FIntVector RegionSize,
+                                        EPixelFormat& OutPixelFormat,
+                                        FVolumeLoadProgress* Progress = nullptr) const;
+
+private:
+  // Reads a single brick's voxels into Voxels (GetBrickExtent voxels) with the given handle.
+  bool ReadBrick(IFileHandle& FileHandle, const int32 BrickIndex, TArray<uint8>& StoredData,
+                 uint8* Voxels) const;
+
+  FString FileName;
+  FIntVector Dimensions{0, 0, 0};
+  FVector Spacing{1.0f, 1.0f, 1.0f};
+  EMhdElementType ElementType{EMhdElementType::MET_UNKNOWN};
+  int32 BrickSize{0};
+  float OccupancyThreshold{0.0f};
+  FIntVector BrickCounts{0, 0, 0};
+  TArray<FBrickInfo> Bricks;
+};
+
+/** Converts an uncompressed single-channel MHD volume (single file or series, big-endian data is
+ * swapped to little-endian) into a bricked volume file. The volume is streamed one layer of bricks
+ * (BrickSize slices) at a time, so it never has to fit into memory. The bricks of a layer are
+ * summarized and compressed in parallel. Occupancy counts voxels above OccupancyThreshold.
+ */
+bool ConvertMhdToBrickedVolume(const FString MhdFileName, const FString OutFileName,
+                               const int32 BrickSize = 64, const bool bCompress = true,
+                               const float OccupancyThreshold = 0.0f);
@@ -0,0 +1,78 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a CPU implementation of the light propagation done by AddDirLightShader.usf (see
+// AddDirLightToSingleLightVolume_RenderThread). It produces the same light volume without a GPU, so
+// illumination can be precomputed on machines that don't have one, and is a reference to validate
+// the shaders against.
+//
+// Like on the GPU, every major axis of the light is swept slice by slice. The rows of a slice are
+// processed in parallel and the read buffer is sampled by a vectorized bilinear kernel - the
+// offset into the read buffer is the same for the whole sweep, so every output row only blends
+// two shifted input rows with constant weights. Lights entering the volume through the same face
+// are swept together, see AddDirLightsToLightVolume_Cpu.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RaymarchRendering.h"
+
+/** The data volume and transfer function a light is propagated through, as the shaders sample
+ * them. */
+struct RAYMARCHER_API FLightPropagationVolume {
+  FIntVector Dimensions{0, 0, 0};
+  // Voxels in the units the shaders sample them in - normalized to [0, 1] for 8 and 16-bit
+  // textures, raw values for float textures - X fastest.
+  TArray<float> Intensities;
+  // Opacity of the transfer function's texels, from the lowest intensity to the highest.
+  TArray<float> TFOpacities;
+  FVector2D IntensityDomain{0.0f, 1.0f};
+
+  /** Fills the volume from the CPU copy (mip 0 of the platform data) of the textures. Supports
+   * G8, G16 and R32_FLOAT volumes and FloatRGBA or B8G8R8A8 transfer functions. Returns false if a
+   * texture has no CPU copy or a format that isn't supported. */
+  bool Init(UVolumeTexture* Volume, UTexture2D* TransferFunction,
+            const FTransferFunctionRangeParameters& TFRange);
+
+  /** Fills the volume from voxels in memory, in one of the pixel formats Init supports. The
+   * transfer function is given as its opacities directly. */
+  bool InitFromVoxels(const uint8* Voxels, const FIntVector VolumeDimensions,
+                      const EPixelFormat PixelFormat, const TArray<float>& Opacities,
+                      const FVector2D Domain);
+
+  /** Same as SampleDataVolume(...).a in RaymarcherCommon.usf - a trilinear sample at the clamped
+   * UVW (fading to zero half a voxel outside the volume), remapped into the intensity domain,
+   * classified by the transfer function and corrected for StepSize. */
+  float SampleOpacity(const FVector& UVW, const float StepSize) const;
+};
+
+/** CPU counterpart of AddDirLightToSingleLightVolume_RenderThread. Adds (or removes) a directional
+ * light to LightVolume, which holds LightVolumeDimensions floats, X fastest - the light volume can
+ * be smaller than the data volume, as with half resolution light volumes.
+ * The result matches the GPU up to float precision. (The GPU keeps the transmittance in its read
+ * buffers, so the light entering from outside is 1 there, which the 8-bit border color holds
+ * exactly - the CPU keeps the light itself.) */
+void AddDirLightToLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                  const FIntVector LightVolumeDimensions,
+                                  const FDirLightParameters LightParameters, const bool Added,
+                                  const FRaymarchWorldParameters WorldParameters);
+
+/** CPU counterpart of AddDirLightsToSingleLightVolume_RenderThread. Adds (or removes) all the
+ * lights at once - the lights entering the volume through the same face share one sweep, which
+ * reads and writes the light volume once per voxel for all of them. Gives the same result as
+ * adding the lights one by one, up to float rounding. */
+void AddDirLightsToLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                   const FIntVector LightVolumeDimensions,
+                                   const TArray<FDirLightParameters>& LightParameters,
+                                   const bool Added,
+                                   const FRaymarchWorldParameters WorldParameters);
+
+/** CPU counterpart of ChangeDirLightInSingleLightVolume_RenderThread. Removes the old light and
+ * adds the new one in the same sweeps, whether their major axes are the same or not - along the
+ * faces both enter the volume through, the difference of the two lights is merged into the light
+ * volume at once. */
+void ChangeDirLightInLightVolume_Cpu(const FLightPropagationVolume& Volume, float* LightVolume,
+                                     const FIntVector LightVolumeDimensions,
+                                     const FDirLightParameters OldLightParameters,
+                                     const FDirLightParameters NewLightParameters,
+                                     const FRaymarchWorldParameters WorldParameters);
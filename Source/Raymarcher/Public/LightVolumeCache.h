@@ -0,0 +1,169 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a cache of computed light volumes. Going back to a lighting state that was seen before
+// (a lighting preset, a transfer function toggled back and forth, a clipping plane returned to its
+// old position) restores the light volume with a copy instead of clearing it and propagating all
+// the lights again.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "RaymarchRendering.h"
+
+// Quantization of the light state in cache keys, in steps per unit. States closer than a step are
+// treated as the same state - the light volumes they give differ by much less than a voxel shows.
+// Light directions (normalized, in local space).
+#define LIGHT_VOLUME_CACHE_DIRECTION_STEPS 256.0f
+// Light intensities.
+#define LIGHT_VOLUME_CACHE_INTENSITY_STEPS 256.0f
+// Clipping plane center and direction (in local 0-1 texture space, see GetLocalClippingParameters).
+#define LIGHT_VOLUME_CACHE_CLIPPING_STEPS 256.0f
+// Scale of the volume's transform, which the light propagation's step sizes depend on.
+#define LIGHT_VOLUME_CACHE_SCALE_STEPS 1024.0f
+
+/** Where a light volume cache keeps its light volumes. */
+enum class ELightVolumeCacheResidency : uint8 {
+  // Compressed losslessly in system memory (see VolumeCodec.h). Caching a light volume propagated
+  // on the GPU reads it back, which waits for the GPU.
+  Cpu,
+  // In video memory as uncompressed textures. Caching and restoring are copies on the GPU.
+  Gpu
+};
+
+/** Identifies the state a light volume was computed for - the data volume, transfer function,
+ * clipping plane and all lights in it. Everything is quantized (see the defines above) and in the
+ * volume's local space, so moving or rotating the volume together with its lights gives the same
+ * key. */
+struct RAYMARCHER_API FLightVolumeCacheKey {
+  // Path name of the data volume texture.
+  FName VolumeId;
+  FIntVector LightVolumeDimensions{0, 0, 0};
+  // Hash of the transfer function's texels and range parameters, see HashTransferFunction.
+  uint32 TransferFunctionHash = 0;
+  FIntVector ClippingCenter{0, 0, 0};
+  FIntVector ClippingDirection{0, 0, 0};
+  FIntVector Scale{0, 0, 0};
+  // Local direction (X, Y, Z) and intensity of every light, sorted, so the order the lights are
+  // given in doesn't matter.
+  TArray<int32> Lights;
+
+  /** Makes the key of the light volume of Resources with the given lights in it. */
+  static FLightVolumeCacheKey Make(const FBasicRaymarchRenderingResources& Resources,
+                                   const TArray<FDirLightParameters>& LightParameters,
+                                   const FRaymarchWorldParameters& WorldParameters);
+
+  bool operator==(const FLightVolumeCacheKey& Other) const;
+  bool operator!=(const FLightVolumeCacheKey& Other) const { return !(*this == Other); }
+  friend RAYMARCHER_API uint32 GetTypeHash(const FLightVolumeCacheKey& Key);
+};
+
+/** Hashes the texels of a transfer function (mip 0 of its CPU copy - or its path name, if it has
+ * none) together with the range it's applied to. */
+RAYMARCHER_API uint32 HashTransferFunction(UTexture2D* TransferFunction,
+                                           const FTransferFunctionRangeParameters& TFRange);
+
+/** Keeps computed light volumes up to a memory budget, evicting the least recently used ones when
+ * it's exceeded. A light volume propagated on the GPU is cached with Store and restored with
+ * Restore, light volumes propagated on the CPU (see LightPropagationCpu.h) are cached straight
+ * from their voxels with StoreVoxels and RestoreVoxels.
+ * The cache doesn't notice changes of a data volume's voxels - call RemoveVolume after changing
+ * them. Must only be used from the game thread. */
+class RAYMARCHER_API FLightVolumeCache {
+public:
+  explicit FLightVolumeCache(const int64 InBudgetBytes = 256 * 1024 * 1024,
+                             const ELightVolumeCacheResidency InResidency =
+                                 ELightVolumeCacheResidency::Cpu);
+
+  /** The cache used by the blueprint functions. Emptied before the engine exits. */
+  static FLightVolumeCache& Get();
+
+  /** Caches the light volume of Resources under Key, as it is once the render commands enqueued so
+   * far are done. Replaces the light volume cached under Key before, if there is one. */
+  void Store(const FLightVolumeCacheKey& Key, const FBasicRaymarchRenderingResources& Resources);
+
+  /** Overwrites the light volume of Resources with the one cached under Key. Light volumes cached
+   * in system memory are uploaded together with the texture's CPU copy, light volumes cached in
+   * video memory are only copied on the GPU, so the CPU copy keeps its old voxels then.
+   * Returns false if nothing is cached under Key (or the cached light volume doesn't fit the
+   * texture), the light volume isn't touched then. */
+  bool Restore(const FLightVolumeCacheKey& Key, const FBasicRaymarchRenderingResources& Resources);
+
+  /** Caches a light volume of Dimensions floats, X fastest, under Key. It's always compressed in
+   * system memory. */
+  void StoreVoxels(const FLightVolumeCacheKey& Key, const float* LightVolume,
+                   const FIntVector Dimensions);
+
+  /** Copies the light volume cached under Key into OutLightVolume, which holds Dimensions floats.
+   * Returns false if nothing of these dimensions is cached under Key. */
+  bool RestoreVoxels(const FLightVolumeCacheKey& Key, float* OutLightVolume,
+                     const FIntVector Dimensions);
+
+  /** Removes all light volumes computed for the data volume with the given path name. */
+  void RemoveVolume(const FName VolumeId);
+
+  /** Removes all light volumes, waiting for all compressions still running - also those of light
+   * volumes that were evicted or replaced already. */
+  void Empty();
+
+  /** Sets the memory budget, evicting light volumes if they don't fit it anymore. A single light
+   * volume is kept even if it's bigger than the budget. */
+  void SetBudget(const int64 InBudgetBytes);
+  int64 GetBudget() const { return BudgetBytes; }
+
+  /** Changes where light volumes cached from now on are kept, the ones cached already stay. */
+  void SetResidency(const ELightVolumeCacheResidency InResidency) { Residency = InResidency; }
+  ELightVolumeCacheResidency GetResidency() const { return Residency; }
+
+  /** Number of cached light volumes. */
+  int32 Num() const { return Entries.Num(); }
+
+  /** Memory used by the cached light volumes. */
+  int64 GetUsedBytes() const;
+
+private:
+  struct FEntry {
+    ELightVolumeCacheResidency Residency = ELightVolumeCacheResidency::Cpu;
+    FIntVector Dimensions{0, 0, 0};
+    // The compressed voxels of light volumes kept in system memory.
+    TArray<uint8> Encoded;
+    // The copy of light volumes kept in video memory. Only touched on the render thread.
+    FTexture3DRHIRef Texture;
+    // Set once Encoded is filled in (compressed on the thread pool after the render thread read the
+    // light volume back) or the render thread made the copy in Texture.
+    FThreadSafeBool bReady;
+    // Memory used, the uncompressed size until Encoded is filled in.
+    FThreadSafeCounter64 Bytes;
+  };
+  // Entries are filled in on the render thread, which holds a reference until it's done.
+  typedef TSharedPtr<FEntry, ESPMode::ThreadSafe> FEntryPtr;
+
+  // Adds (or replaces) the entry under Key as the most recently used one and evicts entries that
+  // don't fit the budget anymore.
+  void Add(const FLightVolumeCacheKey& Key, const FEntryPtr& Entry);
+
+  // Returns the entry under Key and marks it as the most recently used one.
+  FEntryPtr Find(const FLightVolumeCacheKey& Key);
+
+  // Decodes the entry (waiting for the render thread to fill it in first).
+  bool Decode(FEntry& Entry, float* OutLightVolume);
+
+  // Waits until the render thread and the compression on the thread pool filled the entry in.
+  void WaitUntilReady(FEntry& Entry);
+
+  void EvictToBudget();
+
+  TMap<FLightVolumeCacheKey, FEntryPtr> Entries;
+  // Keys from the least to the most recently used one. A cache holds a handful of light volumes
+  // (each is megabytes), so keeping them in an array is cheaper than a linked list.
+  TArray<FLightVolumeCacheKey> LruOrder;
+  int64 BudgetBytes;
+  ELightVolumeCacheResidency Residency;
+  // Number of light volumes read back or compressed on the render thread and the thread pool. An
+  // entry keeps being compressed after it's evicted, so Empty can't wait for the entries only.
+  // Shared with the tasks, which decrement it when they're done.
+  TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> PendingEncodes;
+};
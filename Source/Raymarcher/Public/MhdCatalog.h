@@ -0,0 +1,62 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a persistent catalog of MHD header metadata, so browsing folders with thousands of
+// volumes only needs to parse the headers that changed since the folder was last opened.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MhdInfo.h"
+
+/** Metadata of a single MHD volume, as stored in the catalog. */
+struct FMhdCatalogEntry {
+  FString MhdFileName;
+  // Modification time (in FDateTime ticks) and size of the header file when it was parsed. The
+  // header is parsed again if either of them changes.
+  int64 ModificationTicks{0};
+  int64 HeaderFileSize{0};
+  FIntVector Dimensions{0, 0, 0};
+  FVector Spacing{0.0f, 0.0f, 0.0f};
+  EMhdElementType ElementType{EMhdElementType::MET_UNKNOWN};
+  int32 NumChannels{1};
+  bool CompressedData{false};
+  // Size of the (uncompressed) voxel data in bytes.
+  int64 DataSize{0};
+
+  FMhdCatalogEntry() {}
+  FMhdCatalogEntry(const FString& FileName, const FDateTime ModificationTime, const int64 FileSize,
+                   const FMhdInfo& Info);
+
+  FVector GetWorldDimensions() const { return Spacing * FVector(Dimensions); }
+
+  friend FArchive& operator<<(FArchive& Ar, FMhdCatalogEntry& Entry);
+};
+
+/** Catalog of MHD headers, keyed by the full path of the .mhd file. Saved to disk as a small binary
+ * file, so it can be kept next to a study folder or in the project's Saved directory. */
+class FMhdCatalog {
+public:
+  /** Loads a catalog saved with SaveToFile. Returns false (and leaves the catalog empty) if the
+   * file doesn't exist or was written by a different catalog version. */
+  bool LoadFromFile(const FString CatalogFileName);
+
+  bool SaveToFile(const FString CatalogFileName) const;
+
+  /** Brings the catalog up to date with the .mhd files in Directory. Headers that are new or whose
+   * size or modification time changed are parsed (in parallel), all other entries are reused
+   * without touching the files. Entries of files in Directory that no longer exist are removed.
+   * Returns the number of headers that were parsed. */
+  int32 UpdateFromDirectory(const FString Directory, const bool bRecursive = false);
+
+  /** Returns the entry of the given .mhd file or nullptr if it isn't in the catalog. Relative
+   * paths are resolved against the working directory. */
+  const FMhdCatalogEntry* Find(const FString MhdFileName) const;
+
+  const TMap<FString, FMhdCatalogEntry>& GetEntries() const { return Entries; }
+
+  void Empty() { Entries.Empty(); }
+
+private:
+  TMap<FString, FMhdCatalogEntry> Entries;
+};
@@ -0,0 +1,53 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains functions for decoding zlib-compressed MHD data files (CompressedData = True) and for
+// writing such files in a way that allows decoding them in parallel.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VolumeLoadProgress.h"
+
+/** Inflates zlib (or gzip) compressed data on the calling thread and hands the decompressed bytes
+ * to ProcessSlab in slabs of SlabSize bytes (the last one may be shorter), so the decompressed data
+ * never has to be fully resident. Data consisting of several concatenated streams (as written by
+ * CompressInChunks) is decoded as one.
+ * If Progress is provided, every slab is reported to it and decoding stops once it is canceled.
+ * Returns false if the data is corrupt, doesn't decompress to exactly UncompressedSize bytes or
+ * decoding was canceled.
+ */
+bool InflateInSlabs(
+    const uint8* CompressedData, const int64 CompressedSize, const int64 UncompressedSize,
+    const int64 SlabSize,
+    TFunctionRef<void(uint8* SlabData, int64 SlabOffset, int64 SlabBytes)> ProcessSlab,
+    FVolumeLoadProgress* Progress = nullptr);
+
+/** Decompresses data written as independent zlib streams in parallel. Every stream decompresses to
+ * ChunkSize bytes (the last one may be shorter) and CompressedChunkSizes holds the compressed size
+ * of each stream, in order.
+ * If Destination is provided, chunks are decompressed directly to their offset in it, otherwise
+ * into a temporary buffer per chunk. ProcessChunk is called from worker threads as soon as a chunk
+ * is decoded. Progress works the same as in InflateInSlabs, per chunk.
+ * Returns false if the chunk table doesn't match the sizes, a chunk fails to decompress or
+ * decoding was canceled.
+ */
+bool InflateChunksInParallel(
+    const uint8* CompressedData, const int64 CompressedSize,
+    const TArray<int64>& CompressedChunkSizes, const int64 ChunkSize, const int64 UncompressedSize,
+    uint8* Destination,
+    TFunctionRef<void(uint8* ChunkData, int64 ChunkOffset, int64 ChunkBytes)> ProcessChunk,
+    FVolumeLoadProgress* Progress = nullptr);
+
+/** Compresses Data as independent zlib streams of ChunkSize uncompressed bytes each, in parallel.
+ * Written back to back, the streams are a valid compressed MHD data file that both
+ * InflateInSlabs and InflateChunksInParallel can decode. */
+void CompressInChunks(const uint8* Data, const int64 Size, const int64 ChunkSize,
+                      TArray<TArray<uint8>>& OutChunks, const int32 CompressionLevel = 6);
+
+/** Compresses the data file of an uncompressed MHD volume into independently decodable chunks.
+ * Writes the chunks to a .zraw file next to OutMhdFileName and a copy of the original header
+ * pointing to it, with CompressedData, CompressedDataSize and CompressedDataChunks set.
+ */
+bool CompressMhdForParallelLoading(const FString MhdFileName, const FString OutMhdFileName,
+                                   const int64 ChunkSize = 16 * 1024 * 1024);
@@ -19,6 +19,17 @@ enum class EMhdElementType : uint8 {
   MET_UNKNOWN UMETA(DisplayName = "Unknown"),
 };
 
+/** How decimated loading reduces every block of voxels to one. */
+UENUM(BlueprintType)
+enum class EVolumeDecimation : uint8 {
+  // Takes the first voxel of every block, so only part of the file has to be read.
+  Stride UMETA(DisplayName = "Stride"),
+  // Averages the block.
+  Box UMETA(DisplayName = "Box filter"),
+  // Takes the block's maximum, keeps thin bright structures (vessels, contrast) visible.
+  Max UMETA(DisplayName = "Max filter"),
+};
+
 struct FMhdElementTypeInfo {
   FString Name;
   int32 SizeBytes;
@@ -26,17 +37,40 @@ struct FMhdElementTypeInfo {
   EMhdElementType ElementType;
 };
 
+/** Linear window applied to voxel values when loading. Values in [Min, Max] are mapped to the full
+ * range of PixelFormat (PF_G8 or PF_G16), values outside of it are clamped. */
+struct FVoxelWindow {
+  float Min;
+  float Max;
+  EPixelFormat PixelFormat;
+};
+
 class FMhdInfo {
 public:
   static FMhdElementTypeInfo ElementTypeInfo[7];
 
   bool ParseSuccessful{false};
   int32 NDims{0};
+  // Number of values per voxel (ElementNumberOfChannels), stored interleaved.
+  int32 NumChannels{1};
+  // Bytes to skip at the start of every data file. -1 means the data is at the end of the file.
+  int64 HeaderSize{0};
   FIntVector Dimensions{0, 0, 0};
   FVector Position{0.0, 0.0, 0.0};
   FVector Spacing{0.0f, 0.0f, 0.0f};
   bool CompressedData{false};
+  // Whether the data file is big-endian (BinaryDataByteOrderMSB / ElementByteOrderMSB = True).
+  bool ByteOrderMSB{false};
+  // Size of the compressed data file (0 if not specified in the header).
+  int64 CompressedDataSize{0};
+  // For data written as independent zlib streams (see CompressInChunks), the number of uncompressed
+  // bytes per stream and the compressed size of each stream. Empty for regular zlib data.
+  int64 CompressedChunkSize{0};
+  TArray<int64> CompressedChunkSizes;
   FString DataFile{""};
+  // File names in order if ElementDataFile is a LIST or a file name pattern (e.g. Slice%03d.raw 1
+  // 100 1). Every file holds an equal part of the volume along Z. Empty for a single data file.
+  TArray<FString> DataFiles;
   EMhdElementType ElementType{EMhdElementType::MET_UNKNOWN};
 
   FMhdInfo(FIntVector Dims, FVector Spaces)
@@ -47,11 +81,68 @@ public:
 
   static FMhdInfo ParseFromString(const FString FileName);
 
+  /** Parses a header from its raw (ASCII or UTF-8) bytes. Tokenizes the header in place, so apart
+   * from the file names stored in the result, parsing doesn't allocate. Header doesn't need to be
+   * null-terminated.*/
+  static FMhdInfo ParseFromBytes(const ANSICHAR *Header, const int64 HeaderLength);
+
+  /** Converts the data in DataArray in-place to the format returned by GetConvertedPixelFormat.
+   * The data is converted in chunks of ChunkSize source bytes. Narrowing conversions (e.g. double
+   * to float) need one chunk of scratch memory and shrink DataArray afterwards, so the peak extra
+   * memory is bounded by the chunk size instead of the volume size. Big-endian data
+   * (ByteOrderMSB) is byte-swapped as part of the conversion.*/
   static EPixelFormat ConvertToBestPixelFormat(TUniquePtr<uint8> &DataArray, uint64 NumElements,
-                                               EMhdElementType Type);
+                                               EMhdElementType Type, bool ByteOrderMSB = false,
+                                               int64 ChunkSize = 64 * 1024 * 1024);
+
+  /** Returns true if data of this element type can be uploaded into a texture as-is (without
+   * going through ConvertToBestPixelFormat first).*/
+  static bool IsNativePixelFormat(EMhdElementType Type);
+
+  /** Returns the pixel format data of this element type ends up in after conversion.*/
+  static EPixelFormat GetConvertedPixelFormat(EMhdElementType Type);
+
+  /** Returns the RGBA pixel format multi-channel data of this element type is packed into -
+   * PF_R8G8B8A8 for MET_UCHAR, PF_FloatRGBA (16-bit float) for everything else.*/
+  static EPixelFormat GetPackedPixelFormat(EMhdElementType Type);
+
+  /** Packs NumVoxels voxels of NumChannels (1 to 4) interleaved values of the given type from
+   * Source into one GetPackedPixelFormat texel each in Dest. Channel 0 goes to R, 1 to G and so on,
+   * missing channels are set to zero. Values are not rescaled, only converted to half floats (where
+   * they are clamped to +-65504). Runs on the calling thread only.*/
+  static void PackChannels(const uint8* Source, uint8* Dest, int64 NumVoxels, int32 NumChannels,
+                           EMhdElementType Type, bool SwapBytes = false);
+
+  /** Returns true if the data can be loaded as a plain raw file of native-endian, single-channel
+   * elements without a header (e.g. mapped straight into a texture).*/
+  bool IsPlainRawFile() const;
+
+  /** Converts NumElements elements of the given type from Source to the format returned by
+   * GetConvertedPixelFormat and writes them to Dest, using the kernels in VoxelConversion.h.
+   * Runs on the calling thread only, so it is meant to be called on chunks of a volume. Source and
+   * Dest may point to the same memory. If SwapBytes is set, Source is big-endian and is converted
+   * to native byte order in the same pass.*/
+  static void ConvertElements(const uint8* Source, uint8* Dest, int64 NumElements,
+                              EMhdElementType Type, bool SwapBytes = false);
+
+  /** Maps NumElements elements of the given type from Source through the window and writes them to
+   * Dest in the window's pixel format. Same threading and in-place rules as ConvertElements,
+   * except that windowing 8-bit data to PF_G16 can't be done in-place.*/
+  static void WindowElements(const uint8* Source, uint8* Dest, int64 NumElements,
+                             EMhdElementType Type, const FVoxelWindow& Window,
+                             bool SwapBytes = false);
 
   FVector GetWorldDimensions() const;
 
+  /** Returns the path of the data file belonging to the given MHD file. Uses ElementDataFile
+   * (relative to the MHD file's directory) and falls back to the MHD file name with the extension
+   * replaced by .raw/.zraw if the header doesn't name an existing file.*/
+  FString GetDataFilePath(const FString MhdFileName) const;
+
+  /** Returns the paths of all files of a multi-file volume (see DataFiles), relative names resolved
+   * against the MHD file's directory.*/
+  TArray<FString> GetDataFilePaths(const FString MhdFileName) const;
+
   FString ToString() const;
 
   EPixelFormat GetMatchingPixelFormat() const;
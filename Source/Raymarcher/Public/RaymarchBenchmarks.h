@@ -0,0 +1,59 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains benchmarks of the volume loading and processing paths. Every benchmark returns a
+// human-readable summary which is also written to the log.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Measures how fast an uncompressed MHD volume would load if stored compressed. Reads the raw
+ * data from disk, compresses it in chunks in memory and times both the streaming and the
+ * chunk-parallel decompression. The effective load throughput assumes reading the compressed file
+ * at the measured disk throughput, overlapped with decompression. */
+FString BenchmarkCompressedLoading(const FString MhdFileName);
+
+/** Compares the vectorized voxel conversion and windowing kernels (see VoxelConversion.h) with a
+ * scalar per-element ParallelFor for every supported type pair, on NumElements random voxels.
+ * Throughput is given in GB/s of source data. */
+FString BenchmarkVoxelConversion(const int32 NumElements = 64 * 1024 * 1024);
+
+/** Measures opening a folder of MHD volumes through an FMhdCatalog - building the catalog from
+ * scratch (parsing every header), saving and loading it, and refreshing a loaded catalog when no
+ * header changed. */
+FString BenchmarkMhdCatalog(const FString Directory);
+
+/** Measures the lossless volume codec (see VolumeCodec.h) on a MHD volume, converted to the pixel
+ * format it would be stored in. Reports the compression ratio next to plain zlib on the same data,
+ * and the encode and decode throughput in GB/s of voxel data. Decoded voxels are checked against
+ * the original. */
+FString BenchmarkVolumeCodec(const FString MhdFileName);
+
+/** Compares propagating NumLights random directional lights through a MHD volume one by one with
+ * propagating them together (see AddDirLightsToLightVolume_Cpu), on the CPU into a half resolution
+ * light volume. Reports the sweeps through the volume and the light volume voxel accesses both
+ * take on the CPU and the GPU, the measured times and the largest difference of the results. */
+FString BenchmarkFusedLightPropagation(const FString MhdFileName, const int32 NumLights = 4);
+
+/** Turns a directional light around a MHD volume in NumSteps steps, changing it in a half
+ * resolution light volume on the CPU after every step (see ChangeDirLightInLightVolume_Cpu).
+ * For the steps where the light's major axes change, compares the sweeps and time per step with
+ * removing and adding the light separately. Also reports how far both light volumes drifted from
+ * adding the final light directly. */
+FString BenchmarkLightRotation(const FString MhdFileName, const int32 NumSteps = 360);
+
+/** Propagates NumStates random lighting presets through a MHD volume on the CPU, caches the
+ * resulting half resolution light volumes (see LightVolumeCache.h) and goes back to all of them.
+ * Compares the time restoring a cached light volume takes with propagating its lights again and
+ * reports the memory a cached light volume takes. */
+FString BenchmarkLightVolumeCaching(const FString MhdFileName, const int32 NumStates = 8);
+
+/** Precomputes the SH visibility of a MHD volume from NumDirections directions (see
+ * ShVisibilityVolume.h) at half the resolution of a half resolution light volume, then turns a
+ * light around the volume like BenchmarkLightRotation. Compares the time relighting from the
+ * visibility takes per step with changing the light on the CPU (see
+ * ChangeDirLightInLightVolume_Cpu) and reports the precompute time, the memory the visibility
+ * takes and how much the relit light volume differs from the propagated one. */
+FString BenchmarkShVisibility(const FString MhdFileName, const int32 NumDirections = 64,
+                              const int32 NumSteps = 90);
@@ -13,6 +13,7 @@
 #include "UObject/ObjectMacros.h"
 
 #include "MhdInfo.h"
+#include "VolumeRepresentation.h"
 
 #include "RaymarchBlueprintLibrary.generated.h"
 
@@ -36,6 +37,26 @@ public:
                                         const FRaymarchWorldParameters WorldParameters,
                                         bool& LightAdded, FVector& LocalLightDir);
 
+  /** Adds (or removes) several lights to light volume at once. Lights entering the volume through
+   * the same face are propagated together, which is faster than adding them one by one. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void AddDirLightsToSingleVolume(const FBasicRaymarchRenderingResources Resources,
+                                         const TArray<FDirLightParameters> LightParameters,
+                                         const bool Added,
+                                         const FRaymarchWorldParameters WorldParameters,
+                                         bool& LightsAdded);
+
+  /** Adds a light to light volume like AddDirLightToSingleVolume, but propagates it on the CPU
+   * (see LightPropagationCpu.h) from the CPU copies of the textures and uploads the result. Starts
+   * from the light volume's CPU copy, lights added on the GPU since it was last uploaded are lost.
+   */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void AddDirLightToSingleVolumeOnCpu(const FBasicRaymarchRenderingResources Resources,
+                                             const FDirLightParameters LightParameters,
+                                             const bool Added,
+                                             const FRaymarchWorldParameters WorldParameters,
+                                             bool& LightAdded);
+
   /** Adds a light to light volume.	 */
   UFUNCTION(BlueprintCallable, Category = "Raymarcher")
   static void CreateLightVolumeUAV(FBasicRaymarchRenderingResources Resources,
@@ -49,6 +70,65 @@ public:
                                            const FRaymarchWorldParameters WorldParameters,
                                            bool& LightAdded, FVector& LocalLightDir);
 
+  /** Turns a light that's in the light volume a full circle around the world's Z axis in NumSteps
+   * changes and back to where it started. Reads the light volume back before and after (which
+   * waits for the GPU) and returns the largest difference - changing a light must cancel out
+   * exactly, so anything above float rounding is drift that would build up while moving lights. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void CheckLightRotationRoundTrip(FBasicRaymarchRenderingResources Resources,
+                                          const FDirLightParameters LightParameters,
+                                          const FRaymarchWorldParameters WorldParameters,
+                                          float& MaxDifference, bool& Success,
+                                          int32 NumSteps = 36);
+
+  /** Caches the light volume of Resources, which has the given lights in it, so going back to the
+   * same lights (and transfer function and clipping plane) later can restore it with
+   * RestoreCachedLightVolume instead of propagating the lights again. See LightVolumeCache.h. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void CacheLightVolume(const FBasicRaymarchRenderingResources Resources,
+                               const TArray<FDirLightParameters> LightParameters,
+                               const FRaymarchWorldParameters WorldParameters);
+
+  /** Restores the light volume of Resources to the one cached for the given lights. If none is
+   * cached, the light volume isn't touched and Restored is false - clear it and add the lights
+   * then. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void RestoreCachedLightVolume(const FBasicRaymarchRenderingResources Resources,
+                                       const TArray<FDirLightParameters> LightParameters,
+                                       const FRaymarchWorldParameters WorldParameters,
+                                       bool& Restored);
+
+  /** Sets the memory the light volume cache may use and whether light volumes cached from now on
+   * are kept in video memory (uncompressed, cached and restored by copies on the GPU) or in system
+   * memory (compressed, caching reads the light volume back from the GPU). */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void SetLightVolumeCacheBudget(int32 BudgetMegabytes, bool KeepInVideoMemory);
+
+  /** Removes the light volumes cached for a volume texture, which has to be done after changing
+   * its voxels. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void ClearLightVolumeCache(UVolumeTexture* Volume);
+
+  /** Starts precomputing the SH visibility of the volume in Resources on the thread pool (see
+   * ShVisibilityVolume.h), sampled from NumDirections directions at 1 / Downsampling of the light
+   * volume's resolution. Creating the resources again or changing their transfer function starts
+   * it again by itself, changing the clipping plane or scale of the volume needs another call.
+   * Started is false if the textures have no CPU copy. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void PrecomputeShVisibility(const FBasicRaymarchRenderingResources Resources,
+                                     const FRaymarchWorldParameters WorldParameters,
+                                     bool& Started, int32 NumDirections = 64,
+                                     int32 Downsampling = 2);
+
+  /** Rebuilds the light volume of Resources with the given lights from the precomputed SH
+   * visibility, replacing everything in it, and uploads it. Relit is false if no visibility was
+   * precomputed for the current state yet - add the lights then. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void RelightFromShVisibility(const FBasicRaymarchRenderingResources Resources,
+                                      const TArray<FDirLightParameters> LightParameters,
+                                      const FRaymarchWorldParameters WorldParameters,
+                                      bool& Relit);
+
   /** Clears a light volume. */
   UFUNCTION(BlueprintCallable, Category = "Raymarcher")
   static void ClearVolumeTexture(UVolumeTexture* VolumeTexture, float ClearValue);
@@ -103,6 +183,70 @@ public:
                                             bool Persistent, FIntVector& TextureDimensions,
                                             FVector& WorldDimensions);
 
+  /** Loads a MHD file into a newly created 8-bit (or 16-bit if EightBit is false) Volume Texture
+  Asset, linearly mapping values between WindowMin and WindowMax to the full range of the texture
+  (e.g. a Hounsfield window for CT data). Values outside of the window are clamped. **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void LoadMhdIntoNewVolumeTextureAssetWindowed(FString FileName, FString TextureName,
+                                                       float WindowMin, float WindowMax,
+                                                       bool EightBit, bool Persistent,
+                                                       FIntVector& TextureDimensions,
+                                                       FVector& WorldDimensions,
+                                                       UVolumeTexture*& LoadedTexture);
+
+  /** Loads the box of RegionSize voxels starting at RegionMin of a MHD file into a newly created
+  Volume Texture Asset, reading only the parts of the file the box covers. WorldDimensions are the
+  dimensions of the box, RegionCenterOffset is where the box's center is relative to the center of
+  the whole volume (both in mm, along the volume's axes) - offset the volume by it to keep the box
+  where it is in the full volume. Only uncompressed single-channel volumes are supported. **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void LoadMhdRegionIntoNewVolumeTextureAsset(FString FileName, FString TextureName,
+                                                     FIntVector RegionMin, FIntVector RegionSize,
+                                                     bool Persistent, FIntVector& TextureDimensions,
+                                                     FVector& WorldDimensions,
+                                                     FVector& RegionCenterOffset,
+                                                     UVolumeTexture*& LoadedTexture);
+
+  /** Converts an uncompressed MHD volume into a bricked volume file of BrickSize^3 bricks, each
+  compressed unless that doesn't make it smaller, with an index holding every brick's min/max and
+  the fraction of its voxels above OccupancyThreshold. Volumes larger than memory can be converted.
+  **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static bool ConvertMhdToBrickedVolumeFile(FString MhdFileName, FString OutFileName,
+                                            int32 BrickSize = 64, bool Compress = true,
+                                            float OccupancyThreshold = 0.0f);
+
+  /** Same as LoadMhdRegionIntoNewVolumeTextureAsset, for a bricked volume file. Only the bricks
+  overlapping the region are read, constant bricks are filled without reading them. **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void LoadBrickedVolumeRegionIntoNewVolumeTextureAsset(
+      FString FileName, FString TextureName, FIntVector RegionMin, FIntVector RegionSize,
+      bool Persistent, FIntVector& TextureDimensions, FVector& WorldDimensions,
+      FVector& RegionCenterOffset, UVolumeTexture*& LoadedTexture);
+
+  /** Loads a MHD file into a newly created Volume Texture Asset and returns a Volume Representation
+  of it, including the intensity statistics (range, mean, histogram, percentiles) gathered while
+  the data was converted. **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void LoadMhdIntoNewVolumeRepresentation(FString FileName, FString TextureName,
+                                                 bool Persistent,
+                                                 UVolumeRepresentation*& Representation);
+
+  /** Loads a MHD file into a newly created Volume Representation asset which stores the voxels
+  losslessly compressed (see VolumeCodec.h) instead of in a persistent texture, whose source data
+  would be saved uncompressed. The representation's texture is transient and decoded from the
+  compressed voxels in parallel whenever the asset is loaded. If the voxels can't be compressed
+  (e.g. 8 byte formats), no asset is created and Representation is left unchanged. **/
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static void LoadMhdIntoNewCompressedVolumeRepresentation(FString FileName, FString AssetName,
+                                                           bool SaveNow,
+                                                           UVolumeRepresentation*& Representation);
+
+  /** Returns the robust intensity range of a volume (its 0.5th to 99.5th percentile), to be used as
+   * the IntensityDomain of a transfer function. */
+  UFUNCTION(BlueprintPure, Category = "Raymarcher")
+  static FVector2D GetAutoWindowIntensityDomain(const FVolumeStatistics& Statistics);
+
   //
   //
   // Functions for handling transfer functions and color curves follow.
@@ -157,6 +301,48 @@ public:
   UFUNCTION(BlueprintCallable, Category = "Raymarcher")
   static void TryVolumeTextureSliceWrite(FIntVector Dimensions, UVolumeTexture* inTexture);
 
+  /** Benchmarks loading the given uncompressed MHD volume as if it was stored zlib-compressed
+   * (see BenchmarkCompressedLoading). Returns the measured throughputs. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkCompressedMhdLoading(FString FileName);
+
+  /** Benchmarks the vectorized voxel conversion kernels against scalar conversion (see
+   * BenchmarkVoxelConversion). Returns the measured throughputs. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkVoxelConversionKernels(int32 NumVoxels = 67108864);
+
+  /** Benchmarks building, saving, loading and refreshing an MHD catalog of the given folder (see
+   * BenchmarkMhdCatalog). Returns the measured times. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkMhdFolderCatalog(FString Directory);
+
+  /** Benchmarks the lossless volume codec on the given MHD volume (see BenchmarkVolumeCodec).
+   * Returns the compression ratio and throughputs. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkVolumeCompression(FString FileName);
+
+  /** Benchmarks propagating several lights at once against propagating them one by one on the CPU
+   * (see BenchmarkFusedLightPropagation). Returns the sweeps and voxel accesses saved and the
+   * measured times. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkFusedLights(FString FileName, int32 NumLights = 4);
+
+  /** Benchmarks changing a light that's turned around the volume on the CPU (see
+   * BenchmarkLightRotation). Returns the sweeps and time per step. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkRotatingLight(FString FileName, int32 NumSteps = 360);
+
+  /** Benchmarks restoring cached light volumes against propagating their lights again on the CPU
+   * (see BenchmarkLightVolumeCaching). Returns the measured times and cache sizes. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkLightVolumeCache(FString FileName, int32 NumStates = 8);
+
+  /** Benchmarks relighting from a precomputed SH visibility against changing the light on the CPU
+   * (see BenchmarkShVisibility). Returns the precompute time, memory and times per relight. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static FString BenchmarkShVisibilityRelighting(FString FileName, int32 NumDirections = 64,
+                                                 int32 NumSteps = 90);
+
   /** Logs a string to the on-screen debug messages */
   UFUNCTION(BlueprintCallable, Category = "Raymarcher")
   static void CustomLog(FString LoggedString, float Duration);
@@ -25,8 +25,12 @@
 #include <vector>     // std::pair, std::make_pair
 #include "RaymarchRendering.generated.h"
 
+// On-screen messages can only be added on the game thread, loaders running on worker threads (see
+// AsyncVolumeLoading.h) only write to the log.
 #define MY_LOG(x)                                                        \
-  if (GEngine) {                                                         \
+  if (!IsInGameThread()) {                                               \
+    UE_LOG(LogTemp, Log, TEXT("%s"), TEXT(x));                           \
+  } else if (GEngine) {                                                  \
     GEngine->AddOnScreenDebugMessage(-1, 2.0f, FColor::Yellow, TEXT(x)); \
   }
 
@@ -98,6 +102,18 @@ struct OneAxisReadWriteBufferResources {
   FUnorderedAccessViewRHIRef UAVs[4];
 };
 
+// Number of lights propagated in one sweep by FAddDirLightsShader. Has to be the size of the buffer
+// arrays in OneAxisFusedBufferResources, the shader gets it as MAX_FUSED_DIR_LIGHTS as well.
+#define MAX_FUSED_DIR_LIGHTS 4
+
+// A structure for 2 switchable read-write buffer arrays, with a layer for each of the lights
+// propagated along one axis at once. See AddDirLightsToSingleLightVolume_RenderThread. Unlike the
+// read-write buffers, these are made on the render thread the first time a sweep needs them.
+struct OneAxisFusedBufferResources {
+  FTexture2DArrayRHIRef Buffers[2];
+  FUnorderedAccessViewRHIRef UAVs[2];
+};
+
 /** A structure holding all resources related to a single raymarchable volume - its texture ref, the
    TF texture ref and TF Range parameters,
     light volume texture ref, and read-write buffers used for propagating along all axes. */
@@ -228,8 +244,71 @@ public:
 
 FSamplerStateRHIRef GetBufferSamplerRef(uint32 BorderColorInt);
 
-uint32 GetBorderColorIntSingle(FDirLightParameters LightParams, FMajorAxes MajorAxes,
-                               unsigned index);
+// Returns the sampler for the light propagation read buffers. They hold the part of the light
+// that's left (the transmittance), so the light coming from outside is exactly 1 for all lights.
+FSamplerStateRHIRef GetTransmittanceBufferSamplerRef();
+
+// Helpers computing how a light is propagated along one of its major axes (index 0 or 1), shared by
+// AddDirLightToSingleLightVolume_RenderThread and its CPU counterpart (see LightPropagationCpu.h).
+
+// Returns the light volume dimensions reordered so that propagation goes along Z.
+FIntVector GetTransposedDimensions(const FMajorAxes& Axes, const FIntVector Dimensions,
+                                   const unsigned index);
+
+FVector2D GetUVOffset(FCubeFace Axis, FVector LightPosition, FIntVector TransposedDimensions);
+
+void GetStepSizeAndUVWOffset(FCubeFace Axis, FVector LightPosition, FIntVector TransposedDimensions,
+                             const FRaymarchWorldParameters WorldParameters, float& OutStepSize,
+                             FVector& OutUVWOffset);
+
+void GetLocalLightParamsAndAxes(const FDirLightParameters& LightParameters,
+                                const FTransform& VolumeTransform,
+                                FDirLightParameters& OutLocalLightParameters,
+                                FMajorAxes& OutLocalMajorAxes);
+
+FClippingPlaneParameters GetLocalClippingParameters(const FRaymarchWorldParameters WorldParameters);
+
+float GetLightAlpha(FDirLightParameters LightParams, FMajorAxes MajorAxes, unsigned index);
+
+FMatrix GetPermutationMatrix(FMajorAxes MajorAxes, unsigned index);
+
+void GetLoopStartStopIndexes(int& OutStart, int& OutStop, int& OutAxisDirection,
+                             const FMajorAxes& MajorAxes, const unsigned& index,
+                             const int zDimension);
+
+/** Everything needed to propagate a light along one of its major axes that stays the same for all
+ * slices. */
+struct FDirLightAxisPropagation {
+  // The face the light enters the volume through.
+  FCubeFace Face;
+  FIntVector TransposedDimensions;
+  FMatrix PermutationMatrix;
+  // Offset into the read buffer.
+  FVector2D UVOffset;
+  // Offset of the occluding sample, normalized to the length of the largest voxel side.
+  FVector UVWOffset;
+  float StepSize;
+  // The light entering the volume along this axis. Negative if the light is being removed.
+  float LightAlpha;
+  int Start;
+  int Stop;
+  int AxisDirection;
+};
+
+FDirLightAxisPropagation GetDirLightAxisPropagation(const FDirLightParameters& LocalLightParameters,
+                                                    const FMajorAxes& LocalMajorAxes,
+                                                    const unsigned index,
+                                                    const FIntVector LightVolumeDimensions,
+                                                    const FRaymarchWorldParameters WorldParameters);
+
+/** Sorts the propagations of all lights along their major axes by the face they enter the volume
+ * through and appends them to OutGroups. All propagations in OutGroups[face] go along the same axis
+ * in the same direction, so they can share one sweep through the volume - also when some of them
+ * are added and others removed. Lights without a direction are skipped. */
+void GroupDirLightPropagations(const TArray<FDirLightParameters>& LightParameters,
+                               const bool Added, const FIntVector LightVolumeDimensions,
+                               const FRaymarchWorldParameters WorldParameters,
+                               TArray<FDirLightAxisPropagation> OutGroups[6]);
 
 void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICmdList,
                                                  FBasicRaymarchRenderingResources Resources,
@@ -237,15 +316,39 @@ void AddDirLightToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICm
                                                  const bool Added,
                                                  const FRaymarchWorldParameters WorldParameters);
 
+/** Adds (or removes) several directional lights at once. The propagations of all lights entering
+ * the volume through the same face share one sweep, which reads and writes the light volume once
+ * per voxel for all of them. Up to MAX_FUSED_DIR_LIGHTS lights are propagated per sweep. */
+void AddDirLightsToSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICmdList,
+                                                  FBasicRaymarchRenderingResources Resources,
+                                                  const TArray<FDirLightParameters> LightParameters,
+                                                  const bool Added,
+                                                  const FRaymarchWorldParameters WorldParameters);
+
 void ChangeDirLightInSingleLightVolume_RenderThread(FRHICommandListImmediate& RHICmdList,
                                                     FBasicRaymarchRenderingResources Resources,
                                                     const FDirLightParameters OldLightParameters,
                                                     const FDirLightParameters NewLightParameters,
                                                     const FRaymarchWorldParameters WorldParameters);
 
+/** Releases the read-write buffer arrays made for AddDirLightsToSingleLightVolume_RenderThread and
+ * light changes across axes. They're made again when they're needed next. */
+void ReleaseFusedBuffers_RenderThread();
+
 void ClearVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList,
                                      FRHITexture3D* ALightVolumeResource, float ClearValue);
 
+/** Copies Source into Target, a UAV compatible volume texture of the same size and format (a
+ * single float channel), on the GPU. */
+void CopyVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture3D* Source,
+                                    FRHITexture3D* Target);
+
+/** Reads a single float channel volume texture back from the GPU into OutVoxels, which has to hold
+ * all its voxels (X fastest). Waits for the GPU to finish all work submitted so far. Returns false
+ * (leaving OutVoxels untouched) if the volume is too big for a single readback buffer (4 GB). */
+bool ReadVolumeTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture3D* Source,
+                                    float* OutVoxels);
+
 void GenerateVolumeTextureMipLevels_RenderThread(FRHICommandListImmediate& RHICmdList,
                                                  FIntVector Dimensions,
                                                  FRHITexture3D* VolumeResource,
@@ -300,6 +403,96 @@ protected:
   FShaderParameter ZSize;
 };
 
+// Compute Shader used for copying a float volume texture into another one (see
+// CopyVolumeTexture_RenderThread).
+class FCopyVolumeTextureShader : public FGlobalShader {
+  DECLARE_SHADER_TYPE(FCopyVolumeTextureShader, Global)
+
+public:
+  static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+    return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+  }
+
+  FCopyVolumeTextureShader(){};
+
+  FCopyVolumeTextureShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+    : FGlobalShader(Initializer) {
+    Source.Bind(Initializer.ParameterMap, TEXT("Source"), SPF_Mandatory);
+    Target.Bind(Initializer.ParameterMap, TEXT("Target"), SPF_Mandatory);
+    ZSize.Bind(Initializer.ParameterMap, TEXT("ZSize"), SPF_Mandatory);
+  }
+
+  virtual void SetParameters(FRHICommandListImmediate& RHICmdList, FTextureRHIParamRef SourceRef,
+                             FUnorderedAccessViewRHIParamRef TargetRef, int ZSizeParam) {
+    FComputeShaderRHIParamRef ShaderRHI = GetComputeShader();
+    SetTextureParameter(RHICmdList, ShaderRHI, Source, SourceRef);
+    SetUAVParameter(RHICmdList, ShaderRHI, Target, TargetRef);
+    SetShaderValue(RHICmdList, ShaderRHI, ZSize, ZSizeParam);
+  }
+
+  void UnbindResources(FRHICommandList& RHICmdList) {
+    FComputeShaderRHIParamRef ShaderRHI = GetComputeShader();
+    SetTextureParameter(RHICmdList, ShaderRHI, Source, FTextureRHIParamRef());
+    SetUAVParameter(RHICmdList, ShaderRHI, Target, FUnorderedAccessViewRHIParamRef());
+  }
+
+  virtual bool Serialize(FArchive& Ar) override {
+    bool bShaderHasOutdatedParameters = FGlobalShader::Serialize(Ar);
+    Ar << Source << Target << ZSize;
+    return bShaderHasOutdatedParameters;
+  }
+
+protected:
+  FShaderResourceParameter Source;
+  FShaderResourceParameter Target;
+  FShaderParameter ZSize;
+};
+
+// Compute Shader used for copying a float volume texture into a buffer, so it can be read back to
+// the CPU (see ReadVolumeTexture_RenderThread).
+class FReadVolumeTextureShader : public FGlobalShader {
+  DECLARE_SHADER_TYPE(FReadVolumeTextureShader, Global)
+
+public:
+  static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+    return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+  }
+
+  FReadVolumeTextureShader(){};
+
+  FReadVolumeTextureShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+    : FGlobalShader(Initializer) {
+    Source.Bind(Initializer.ParameterMap, TEXT("Source"), SPF_Mandatory);
+    TargetBuffer.Bind(Initializer.ParameterMap, TEXT("TargetBuffer"), SPF_Mandatory);
+    ZSize.Bind(Initializer.ParameterMap, TEXT("ZSize"), SPF_Mandatory);
+  }
+
+  virtual void SetParameters(FRHICommandListImmediate& RHICmdList, FTextureRHIParamRef SourceRef,
+                             FUnorderedAccessViewRHIParamRef TargetBufferRef, int ZSizeParam) {
+    FComputeShaderRHIParamRef ShaderRHI = GetComputeShader();
+    SetTextureParameter(RHICmdList, ShaderRHI, Source, SourceRef);
+    SetUAVParameter(RHICmdList, ShaderRHI, TargetBuffer, TargetBufferRef);
+    SetShaderValue(RHICmdList, ShaderRHI, ZSize, ZSizeParam);
+  }
+
+  void UnbindResources(FRHICommandList& RHICmdList) {
+    FComputeShaderRHIParamRef ShaderRHI = GetComputeShader();
+    SetTextureParameter(RHICmdList, ShaderRHI, Source, FTextureRHIParamRef());
+    SetUAVParameter(RHICmdList, ShaderRHI, TargetBuffer, FUnorderedAccessViewRHIParamRef());
+  }
+
+  virtual bool Serialize(FArchive& Ar) override {
+    bool bShaderHasOutdatedParameters = FGlobalShader::Serialize(Ar);
+    Ar << Source << TargetBuffer << ZSize;
+    return bShaderHasOutdatedParameters;
+  }
+
+protected:
+  FShaderResourceParameter Source;
+  FShaderResourceParameter TargetBuffer;
+  FShaderParameter ZSize;
+};
+
 // Compute shader for clearing a single-channel 2D float RW texture
 class FClearFloatRWTextureCS : public FGlobalShader {
   DECLARE_SHADER_TYPE(FClearFloatRWTextureCS, Global);
@@ -355,7 +548,9 @@ class FRaymarchVolumeShader : public FGlobalShader {
 public:
   FRaymarchVolumeShader() : FGlobalShader() {}
 
-  FRaymarchVolumeShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+  // Shaders with a step size per light (see FAddDirLightsShader) don't bind the common one.
+  FRaymarchVolumeShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer,
+                        const bool bBindStepSize = true)
     : FGlobalShader(Initializer) {
     Volume.Bind(Initializer.ParameterMap, TEXT("Volume"), SPF_Mandatory);
     VolumeSampler.Bind(Initializer.ParameterMap, TEXT("VolumeSampler"), SPF_Mandatory);
@@ -367,7 +562,9 @@ public:
                                 SPF_Mandatory);
 
     TFIntensityDomain.Bind(Initializer.ParameterMap, TEXT("TFIntensityDomain"), SPF_Mandatory);
-    StepSize.Bind(Initializer.ParameterMap, TEXT("StepSize"), SPF_Mandatory);
+    if (bBindStepSize) {
+      StepSize.Bind(Initializer.ParameterMap, TEXT("StepSize"), SPF_Mandatory);
+    }
   }
 
   void SetRaymarchResources(FRHICommandListImmediate& RHICmdList,
@@ -441,8 +638,9 @@ class FLightPropagationShader : public FRaymarchVolumeShader {
 public:
   FLightPropagationShader() : FRaymarchVolumeShader() {}
 
-  FLightPropagationShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
-    : FRaymarchVolumeShader(Initializer) {
+  FLightPropagationShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer,
+                          const bool bBindStepSize = true)
+    : FRaymarchVolumeShader(Initializer, bBindStepSize) {
     Loop.Bind(Initializer.ParameterMap, TEXT("Loop"), SPF_Mandatory);
     PermutationMatrix.Bind(Initializer.ParameterMap, TEXT("PermutationMatrix"), SPF_Mandatory);
 
@@ -521,6 +719,7 @@ public:
     // Volume texture + Transfer function uniforms
     PrevPixelOffset.Bind(Initializer.ParameterMap, TEXT("PrevPixelOffset"), SPF_Mandatory);
     UVWOffset.Bind(Initializer.ParameterMap, TEXT("UVWOffset"), SPF_Mandatory);
+    LightAlpha.Bind(Initializer.ParameterMap, TEXT("LightAlpha"), SPF_Mandatory);
   }
 
   void SetUVOffset(FRHICommandListImmediate& RHICmdList, FComputeShaderRHIParamRef ShaderRHI,
@@ -533,9 +732,14 @@ public:
     SetShaderValue(RHICmdList, ShaderRHI, UVWOffset, pUVWOffset);
   }
 
+  void SetLightAlpha(FRHICommandListImmediate& RHICmdList, FComputeShaderRHIParamRef ShaderRHI,
+                     float pLightAlpha) {
+    SetShaderValue(RHICmdList, ShaderRHI, LightAlpha, pLightAlpha);
+  }
+
   virtual bool Serialize(FArchive& Ar) override {
     bool bShaderHasOutdatedParameters = FLightPropagationShader::Serialize(Ar);
-    Ar << PrevPixelOffset << UVWOffset;
+    Ar << PrevPixelOffset << UVWOffset << LightAlpha;
     return bShaderHasOutdatedParameters;
   }
 
@@ -544,6 +748,8 @@ protected:
   FShaderParameter PrevPixelOffset;
   // And the offset in the volume from the previous volume sample.
   FShaderParameter UVWOffset;
+  // The light's alpha along the current axis - the buffers only hold the transmittance.
+  FShaderParameter LightAlpha;
 };
 
 // A shader implementing adding or removing a single directional light.
@@ -604,6 +810,7 @@ public:
     RemovedWriteBuffer.Bind(Initializer.ParameterMap, TEXT("RemovedWriteBuffer"), SPF_Mandatory);
     RemovedUVWOffset.Bind(Initializer.ParameterMap, TEXT("RemovedUVWOffset"), SPF_Mandatory);
     RemovedStepSize.Bind(Initializer.ParameterMap, TEXT("RemovedStepSize"), SPF_Mandatory);
+    RemovedLightAlpha.Bind(Initializer.ParameterMap, TEXT("RemovedLightAlpha"), SPF_Mandatory);
   }
 
   static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
@@ -645,6 +852,12 @@ public:
     SetShaderValue(RHICmdList, ShaderRHI, RemovedStepSize, pRemovedStepSize);
   }
 
+  void SetLightAlphas(FRHICommandListImmediate& RHICmdList, FComputeShaderRHIParamRef ShaderRHI,
+                      float pAddedLightAlpha, float pRemovedLightAlpha) {
+    SetShaderValue(RHICmdList, ShaderRHI, LightAlpha, pAddedLightAlpha);
+    SetShaderValue(RHICmdList, ShaderRHI, RemovedLightAlpha, pRemovedLightAlpha);
+  }
+
   virtual void UnbindResources(FRHICommandListImmediate& RHICmdList,
                                FComputeShaderRHIParamRef ShaderRHI) override {
     // Unbind parent and also our added parameters.
@@ -656,7 +869,7 @@ public:
   virtual bool Serialize(FArchive& Ar) override {
     bool bShaderHasOutdatedParameters = FDirLightPropagationShader::Serialize(Ar);
     Ar << RemovedPrevPixelOffset << RemovedReadBuffer << RemovedReadBufferSampler
-       << RemovedWriteBuffer << RemovedStepSize << RemovedUVWOffset;
+       << RemovedWriteBuffer << RemovedStepSize << RemovedUVWOffset << RemovedLightAlpha;
     return bShaderHasOutdatedParameters;
   }
 
@@ -675,4 +888,75 @@ protected:
   FShaderParameter RemovedStepSize;
   // Removed light UVW offset
   FShaderParameter RemovedUVWOffset;
+  // Removed light alpha
+  FShaderParameter RemovedLightAlpha;
+};
+
+// A shader adding or removing up to MAX_FUSED_DIR_LIGHTS directional lights that enter the volume
+// through the same face. Every light has its own layer in the read/write buffer arrays and its own
+// offsets, step size and light alpha, but all of them share one pass over the slice.
+// See AddDirLightsShader.usf and AddDirLightsToSingleLightVolume_RenderThread
+class FAddDirLightsShader : public FLightPropagationShader {
+  DECLARE_SHADER_TYPE(FAddDirLightsShader, Global)
+
+public:
+  FAddDirLightsShader() : FLightPropagationShader() {}
+
+  // The step sizes are bound with the other per-light parameters in LightParameters.
+  FAddDirLightsShader(const ShaderMetaType::CompiledShaderInitializerType& Initializer)
+    : FLightPropagationShader(Initializer, false) {
+    FirstSlice.Bind(Initializer.ParameterMap, TEXT("FirstSlice"), SPF_Mandatory);
+    NumLights.Bind(Initializer.ParameterMap, TEXT("NumLights"), SPF_Mandatory);
+    PrevPixelOffsets.Bind(Initializer.ParameterMap, TEXT("PrevPixelOffsets"), SPF_Mandatory);
+    UVWOffsets.Bind(Initializer.ParameterMap, TEXT("UVWOffsets"), SPF_Mandatory);
+    LightParameters.Bind(Initializer.ParameterMap, TEXT("LightParameters"), SPF_Mandatory);
+  }
+
+  static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters) {
+    return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+  }
+
+  static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters,
+                                           FShaderCompilerEnvironment& OutEnvironment) {
+    FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+    OutEnvironment.SetDefine(TEXT("MAX_FUSED_DIR_LIGHTS"), MAX_FUSED_DIR_LIGHTS);
+  }
+
+  // Sets loop-dependent uniforms in the pipeline. The read buffer isn't read in the first slice.
+  void SetLoop(FRHICommandListImmediate& RHICmdList, FComputeShaderRHIParamRef ShaderRHI,
+               const unsigned loopIndex, const bool bFirstSlice,
+               const FTexture2DArrayRHIRef pReadBuffer, const FSamplerStateRHIRef pReadBuffSampler,
+               const FUnorderedAccessViewRHIRef pWriteBuffer) {
+    SetShaderValue(RHICmdList, ShaderRHI, Loop, loopIndex);
+    SetShaderValue(RHICmdList, ShaderRHI, FirstSlice, bFirstSlice ? 1 : 0);
+    SetUAVParameter(RHICmdList, ShaderRHI, WriteBuffer, pWriteBuffer);
+    SetTextureParameter(RHICmdList, ShaderRHI, ReadBuffer, ReadBufferSampler, pReadBuffSampler,
+                        pReadBuffer);
+  }
+
+  // Sets the per-light uniforms, see AddDirLightsShader.usf for what the vectors contain.
+  void SetLights(FRHICommandListImmediate& RHICmdList, FComputeShaderRHIParamRef ShaderRHI,
+                 const FVector4* pPrevPixelOffsets, const FVector4* pUVWOffsets,
+                 const FVector4* pLightParameters, const int32 pNumLights) {
+    check(pNumLights > 0 && pNumLights <= MAX_FUSED_DIR_LIGHTS);
+    SetShaderValue(RHICmdList, ShaderRHI, NumLights, pNumLights);
+    SetShaderValueArray(RHICmdList, ShaderRHI, PrevPixelOffsets, pPrevPixelOffsets, pNumLights);
+    SetShaderValueArray(RHICmdList, ShaderRHI, UVWOffsets, pUVWOffsets, pNumLights);
+    SetShaderValueArray(RHICmdList, ShaderRHI, LightParameters, pLightParameters, pNumLights);
+  }
+
+  virtual bool Serialize(FArchive& Ar) override {
+    bool bShaderHasOutdatedParameters = FLightPropagationShader::Serialize(Ar);
+    Ar << FirstSlice << NumLights << PrevPixelOffsets << UVWOffsets << LightParameters;
+    return bShaderHasOutdatedParameters;
+  }
+
+protected:
+  // Set in the first slice of a sweep, where all light enters unoccluded.
+  FShaderParameter FirstSlice;
+  FShaderParameter NumLights;
+  // Per-light read buffer offsets, UVW offsets and step size + light alpha.
+  FShaderParameter PrevPixelOffsets;
+  FShaderParameter UVWOffsets;
+  FShaderParameter LightParameters;
 };
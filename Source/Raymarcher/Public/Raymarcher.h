@@ -12,6 +12,13 @@ public:
 	/** IModuleInterface implementation */
 	virtual void StartupModule() override;
 	virtual void ShutdownModule() override;
+
+private:
+	/** Writes assets still being saved and releases everything the plugin keeps around. Runs before
+	 * the engine exits and when the module is unloaded. */
+	static void FlushAndReleaseResources();
+
+	FDelegateHandle PreExitHandle;
 };
 
 // Declare our own log category
@@ -0,0 +1,114 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a precomputed visibility volume for relighting without propagating the lights. For a
+// directional light, every voxel of the light volume gets the light's intensity times a
+// visibility depending only on the light's direction (the part of the light reaching the voxel
+// along its major axes, see AddDirLightToSingleLightVolume_RenderThread). The visibility is
+// sampled for a fixed set of directions once, by propagating a light from every one of them on the
+// CPU, and projected on spherical harmonics (SH) per voxel. Rebuilding the light volume for any
+// set of lights is then a dot product of the SH coefficients per voxel.
+//
+// Low-order SH only keep the low frequencies of the visibility, so the result is a smoothed
+// version of propagating the lights - hard shadows get soft. The visibility is kept in a volume
+// smaller than the light volume and interpolated up.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "HAL/ThreadSafeBool.h"
+#include "LightPropagationCpu.h"
+#include "LightVolumeCache.h"
+#include "RaymarchRendering.h"
+
+// Number of SH coefficients per voxel - bands 0 to 2.
+#define SH_VISIBILITY_NUM_COEFFICIENTS 9
+
+/** The visibility of every voxel of a (downsampled) light volume as SH coefficients. */
+struct RAYMARCHER_API FShVisibilityVolume {
+  FIntVector Dimensions{0, 0, 0};
+  // SH_VISIBILITY_NUM_COEFFICIENTS planes of Dimensions voxels (X fastest), one per coefficient, so
+  // relighting streams through all of them at once.
+  TArray<float> Coefficients;
+
+  /** Propagates a light from NumDirections directions evenly spread over the sphere (in the
+   * volume's local space) through Volume into a light volume of VisibilityDimensions on the CPU
+   * and projects the results on SH. Takes as long as adding NumDirections lights on the CPU.
+   * The visibility depends on the clipping plane and the volume's scale in WorldParameters, not on
+   * its rotation or position. Stops and returns false as soon as bCancelled is set. */
+  bool Precompute(const FLightPropagationVolume& Volume, const FIntVector VisibilityDimensions,
+                  const FRaymarchWorldParameters& WorldParameters, const int32 NumDirections,
+                  const FThreadSafeBool* bCancelled = nullptr);
+
+  /** Rebuilds a light volume of LightVolumeDimensions floats (X fastest) with the given lights in
+   * it, overwriting all its voxels. If it's bigger than the visibility volume, the visibility is
+   * interpolated trilinearly. */
+  void Relight(const TArray<FDirLightParameters>& LightParameters,
+               const FTransform& VolumeTransform, float* OutLightVolume,
+               const FIntVector LightVolumeDimensions) const;
+
+  /** Memory taken by the coefficients. */
+  int64 GetAllocatedSize() const { return Coefficients.GetAllocatedSize(); }
+};
+
+typedef TSharedPtr<const FShVisibilityVolume, ESPMode::ThreadSafe> FShVisibilityVolumePtr;
+
+/** Precomputes SH visibility volumes on the thread pool and keeps the latest one of every light
+ * volume. Has to be precomputed again after loading a volume or changing its transfer function,
+ * clipping plane or scale - until it's done, Find returns nothing for the new state. Refresh does
+ * that with the parameters of the last precompute, the blueprint library calls it when resources
+ * are created (a volume was loaded) and when their transfer function changes. Must only be used
+ * from the game thread. */
+class RAYMARCHER_API FShVisibilityVolumes {
+public:
+  static FShVisibilityVolumes& Get();
+
+  /** Starts precomputing the visibility of the volume in Resources for its light volume, at
+   * 1 / Downsampling of the light volume's resolution (see FShVisibilityVolume::Precompute).
+   * Returns false if the textures have no CPU copy. A precompute still running for the light
+   * volume is cancelled (and waited for). */
+  bool Precompute(const FBasicRaymarchRenderingResources& Resources,
+                  const FRaymarchWorldParameters& WorldParameters, const int32 NumDirections,
+                  const int32 Downsampling);
+
+  /** Precomputes the visibility of the volume in Resources again with the world parameters,
+   * directions and downsampling it was last precomputed with, if it was precomputed before and the
+   * state changed since (or always, if bVolumeChanged - the key only knows the volume's name).
+   * Returns true if a precompute was started. */
+  bool Refresh(const FBasicRaymarchRenderingResources& Resources, const bool bVolumeChanged);
+
+  /** Returns the visibility precomputed for the light volume of Resources, if it's done and was
+   * precomputed for the current data volume, transfer function, clipping plane and scale. */
+  FShVisibilityVolumePtr Find(const FBasicRaymarchRenderingResources& Resources,
+                              const FRaymarchWorldParameters& WorldParameters) const;
+
+  /** Waits until all precomputes are done. */
+  void Flush();
+
+  /** Removes the visibility of the given light volume, cancelling its precompute if it's still
+   * running. */
+  void Remove(UVolumeTexture* LightVolume);
+
+  /** Removes all visibility volumes, cancelling the precomputes still running. Called
+   * automatically before the engine exits. */
+  void Empty();
+
+private:
+  struct FPendingVolume {
+    // The state the visibility is precomputed for, see FLightVolumeCacheKey (without lights).
+    FLightVolumeCacheKey Key;
+    TFuture<FShVisibilityVolumePtr> Volume;
+    TSharedPtr<FThreadSafeBool, ESPMode::ThreadSafe> bCancelled;
+    // What it was precomputed with, for Refresh.
+    FRaymarchWorldParameters WorldParameters;
+    int32 NumDirections = 0;
+    int32 Downsampling = 1;
+  };
+
+  // Cancels the precompute of Pending, if it's still running, and waits for it to stop.
+  static void Cancel(FPendingVolume& Pending);
+
+  // Keyed by the light volume's path name.
+  TMap<FName, FPendingVolume> Volumes;
+};
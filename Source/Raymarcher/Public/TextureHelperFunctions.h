@@ -13,6 +13,7 @@
 #include "Engine/VolumeTexture.h"
 #include "Engine/World.h"
 #include "Kismet/BlueprintFunctionLibrary.h"
+#include "Async/MappedFileHandle.h"
 #include "Logging/MessageLog.h"
 #include "PipelineStateCache.h"
 #include "RHIStaticStates.h"
@@ -20,23 +21,61 @@
 #include "SceneUtils.h"
 #include "UObject/ObjectMacros.h"
 
+#include "MhdInfo.h"
+#include "VolumeLoadProgress.h"
+#include "VolumeStatistics.h"
+
 /** Creates a Volume Texture asset with the given name, pixel format and dimensions and fills it
   with the bulk data provided. It can be set to be persistent and UAV compatible and can also
-  be immediately saved to disk.
+  be immediately saved to disk. Saving happens in the background (see FVolumeAssetSaveQueue), the
+  texture can be used right away.
   Returns a reference to the created texture in the CreatedTexture param.
 */
 bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntVector Dimensions,
-                              UVolumeTexture*& CreatedTexture, uint8* BulkData = nullptr,
+                              UVolumeTexture*& CreatedTexture, const uint8* BulkData = nullptr,
+                              bool Persistent = false, bool SaveNow = false,
+                              bool UAVCompatible = false);
+
+/** Same as above, but takes ownership of the voxels (as returned by the loaders). The engine's bulk
+ * data can't adopt an existing allocation, so the voxels are still copied into the mip once, but
+ * the buffer is freed right after that - before the source data of persistent textures is created
+ * - so one volume less is allocated at the peak. */
+bool CreateVolumeTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntVector Dimensions,
+                              UVolumeTexture*& CreatedTexture, TUniquePtr<uint8>&& BulkData,
                               bool Persistent = false, bool SaveNow = false,
                               bool UAVCompatible = false);
 
 /** Updates the provided Volume Texture asset to have the provided format, dimensions and pixel
- * data*/
+ * data. If the format, dimensions and UAV compatibility don't change, the data is copied into the
+ * existing texture and uploaded without recreating its resource (see UpdateVolumeTextureRegion).*/
 bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
-                              FIntVector Dimensions, uint8* BulkData = nullptr,
+                              FIntVector Dimensions, const uint8* BulkData = nullptr,
                               bool Persistent = false, bool SaveNow = false,
                               bool UAVCompatible = false);
 
+/** Same as above, but takes ownership of the voxels. When the texture is updated in place, they
+ * are uploaded straight from the buffer, which is freed once the render thread is done with it -
+ * no copy is made for the upload. Otherwise, the buffer is freed right after it's copied into the
+ * mip, as with CreateVolumeTextureAsset. */
+bool UpdateVolumeTextureAsset(UVolumeTexture* VolumeTexture, EPixelFormat PixelFormat,
+                              FIntVector Dimensions, TUniquePtr<uint8>&& BulkData,
+                              bool Persistent = false, bool SaveNow = false,
+                              bool UAVCompatible = false);
+
+/** Overwrites the box of RegionSize voxels starting at RegionMin in a volume texture that already
+ * has data and a resource. RegionData holds the box's voxels in the texture's pixel format, X
+ * fastest. The texture's CPU copy (and its source data, if it's persistent) is updated in place and
+ * only the box is uploaded on the render thread - the texture resource isn't recreated.
+ * Returns false if the texture has no data or resource yet, or the box isn't inside it. */
+bool UpdateVolumeTextureRegion(UVolumeTexture* VolumeTexture, FIntVector RegionMin,
+                               FIntVector RegionSize, const uint8* RegionData);
+
+/** Like UpdateVolumeTextureRegion for several boxes at once, all taken from Voxels, which holds a
+ * whole volume of the texture's dimensions and pixel format. The boxes are copied in parallel and
+ * uploaded by a single render command. */
+bool UpdateVolumeTextureRegions(UVolumeTexture* VolumeTexture, const TArray<FIntVector>& RegionMins,
+                                const TArray<FIntVector>& RegionSizes, const uint8* Voxels);
+
 /** Creates a 2D Texture asset with the given name from the provided bulk data with the given
  * format.*/
 bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint Dimensions,
@@ -44,6 +83,13 @@ bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint
                           bool UAVCompatible = false, bool SaveNow = false,
                           TextureAddress TilingX = TA_Clamp, TextureAddress TilingY = TA_Clamp);
 
+/** Same as above, but takes ownership of the pixels and frees them as soon as they are copied into
+ * the mip (see the CreateVolumeTextureAsset overload taking ownership). */
+bool Create2DTextureAsset(FString AssetName, EPixelFormat PixelFormat, FIntPoint Dimensions,
+                          TUniquePtr<uint8>&& BulkData, bool Persistent = false,
+                          bool UAVCompatible = false, bool SaveNow = false,
+                          TextureAddress TilingX = TA_Clamp, TextureAddress TilingY = TA_Clamp);
+
 /** Updates the provided 2D Texture asset to have the provided format, dimensions and pixel data*/
 bool Update2DTextureAsset(UTexture2D* Texture, EPixelFormat PixelFormat, FIntPoint Dimensions,
                           uint8* BulkData = nullptr, bool Persistent = false,
@@ -56,8 +102,237 @@ bool HandleTextureEditorData(UTexture* Texture, const EPixelFormat PixelFormat,
                              const bool Persistent, const FIntVector Dimensions,
                              const uint8* BulkData);
 
-/**
- */
+/** Reads BytesToLoad bytes of a raw file into a newly allocated array. The file name can be an
+ * absolute path or relative to the project content directory.*/
 TUniquePtr<uint8> LoadRawFileIntoArray(const FString FileName, const int64 BytesToLoad);
 
+/** Reads BytesToLoad bytes of a raw file in slabs of SlabSize bytes. Up to MaxReadsInFlight slabs
+ * are read concurrently with positioned reads (each reader has its own file handle) and each slab is
+ * handed to ProcessSlab on the reading thread as soon as it lands, so disk reads and processing of
+ * already-read slabs overlap.
+ * If Destination is provided, slabs are read directly to their offset in it, otherwise every reader
+ * uses its own SlabSize scratch buffer. ProcessSlab gets the slab data, its offset in the file and
+ * its size.
+ * MaxReadsInFlight <= 0 picks a default based on the number of cores.
+ * The first HeaderSize bytes of the file are skipped. HeaderSize -1 means the data is at the end of
+ * the file, whatever comes before it (same as in MHD headers).
+ * If Progress is provided, every processed slab is reported to it and reading stops once it is
+ * canceled.
+ * Returns false if the file can't be opened, is too small, a read fails or reading was canceled.
+ */
+bool ReadRawFileInSlabs(
+    const FString FileName, const int64 BytesToLoad, const int64 SlabSize, uint8* Destination,
+    TFunctionRef<void(uint8* SlabData, int64 SlabOffset, int64 SlabBytes)> ProcessSlab,
+    int32 MaxReadsInFlight = 0, int64 HeaderSize = 0, FVolumeLoadProgress* Progress = nullptr);
+
+/** Reads a volume stored as a series of raw files of BytesPerFile bytes each (e.g. one file per
+ * slice). Files are read concurrently, up to MaxReadsInFlight at once, each straight to its offset
+ * in Destination if provided (otherwise into a scratch buffer per reader), and handed to
+ * ProcessFile as soon as they land, same as the slabs in ReadRawFileInSlabs. HeaderSize is
+ * skipped in every file and Progress is reported to per file.
+ * Returns false if any of the files is missing, too small or fails to read, or reading was
+ * canceled.
+ */
+bool ReadRawFileSeries(
+    const TArray<FString>& FileNames, const int64 BytesPerFile, uint8* Destination,
+    TFunctionRef<void(uint8* FileData, int64 FileOffset, int64 FileBytes)> ProcessFile,
+    int32 MaxReadsInFlight = 0, int64 HeaderSize = 0, FVolumeLoadProgress* Progress = nullptr);
+
+/** Loads a raw file containing NumElements elements of the given type and converts it to the best
+ * pixel format while reading (see ReadRawFileInSlabs and FMhdInfo::ConvertElements). The file is
+ * never fully resident in its original type unless no conversion is needed.
+ * If a Window is given, values are windowed into its pixel format instead (see
+ * FMhdInfo::WindowElements). Big-endian files (ByteOrderMSB) are byte-swapped in the same pass.
+ * Safe to call from any thread. Progress is passed on to ReadRawFileInSlabs. If Statistics is
+ * provided, every slab is added to it right after it is converted, so the statistics of the
+ * converted volume come without another pass over it.
+ * Returns nullptr if reading failed or was canceled.
+ */
+TUniquePtr<uint8> LoadRawFileConverted(const FString FileName, const int64 NumElements,
+                                       const EMhdElementType ElementType,
+                                       EPixelFormat& OutPixelFormat,
+                                       const FVoxelWindow* Window = nullptr,
+                                       const bool ByteOrderMSB = false,
+                                       const int64 HeaderSize = 0,
+                                       FVolumeLoadProgress* Progress = nullptr,
+                                       FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Same as LoadRawFileConverted for a volume split evenly across several raw files (an MHD with
+ * an ElementDataFile LIST or file name pattern), read with ReadRawFileSeries.
+ */
+TUniquePtr<uint8> LoadRawFileSeriesConverted(const TArray<FString>& FileNames,
+                                             const int64 NumElements,
+                                             const EMhdElementType ElementType,
+                                             EPixelFormat& OutPixelFormat,
+                                             const FVoxelWindow* Window = nullptr,
+                                             const bool ByteOrderMSB = false,
+                                             const int64 HeaderSize = 0,
+                                             FVolumeLoadProgress* Progress = nullptr,
+                                             FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Loads a multi-channel volume (channels interleaved per voxel, as in MHDs with
+ * ElementNumberOfChannels > 1) from a single raw file or a file series and packs up to four
+ * channels into one RGBA texel per voxel in the same pass (see FMhdInfo::PackChannels), so all
+ * channels can be sampled with one texture fetch.
+ * Returns nullptr if reading failed or the volume has more than four channels.
+ */
+TUniquePtr<uint8> LoadRawFilesPacked(const TArray<FString>& FileNames, const int64 NumVoxels,
+                                     const int32 NumChannels, const EMhdElementType ElementType,
+                                     EPixelFormat& OutPixelFormat, const bool ByteOrderMSB = false,
+                                     const int64 HeaderSize = 0,
+                                     FVolumeLoadProgress* Progress = nullptr);
+
+/** Loads the zlib-compressed data file of an MHD volume (CompressedData = True) and converts it to
+ * the best pixel format while decompressing. If the header lists the compressed chunk sizes
+ * (CompressedDataChunks, see CompressMhdForParallelLoading), chunks are decompressed in parallel,
+ * otherwise the data is inflated as one stream, slab by slab. Windowing works the same as in
+ * LoadRawFileConverted, and so do Progress and Statistics.
+ * Returns nullptr if the file can't be read or fails to decompress.
+ */
+TUniquePtr<uint8> LoadCompressedRawFileConverted(const FString FileName, const FMhdInfo& Info,
+                                                 EPixelFormat& OutPixelFormat,
+                                                 const FVoxelWindow* Window = nullptr,
+                                                 FVolumeLoadProgress* Progress = nullptr,
+                                                 FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Loads and converts the voxel data of a parsed MHD file, picking the right loader for
+ * compressed, big-endian, header-prefixed, multi-channel and multi-file volumes. Plain raw files
+ * are read and converted like in LoadRawFileConverted.
+ * Doesn't touch any UObjects, so it can run on a worker thread (see LoadMhdDataAsync).
+ * Statistics are gathered for single-channel volumes only.
+ * Returns nullptr if loading failed or was canceled through Progress.
+ */
+TUniquePtr<uint8> LoadMhdDataConverted(const FMhdInfo& Info, const FString MhdFileName,
+                                       EPixelFormat& OutPixelFormat,
+                                       const FVoxelWindow* Window = nullptr,
+                                       FVolumeLoadProgress* Progress = nullptr,
+                                       FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Reads parts of the slices of a volume stored in one raw file or split evenly along Z across
+ * several (SlicesPerFile slices each). Files are opened when first needed and kept open while
+ * consecutive slices come from them. HeaderSize works as in ReadRawFileInSlabs, per file.
+ * Not thread-safe, every reader thread needs its own.
+ */
+class FRawSliceReader {
+public:
+  FRawSliceReader(const TArray<FString>& InFileNames, const int64 InSliceBytes,
+                  const int32 InSlicesPerFile, const int64 InHeaderSize)
+    : FileNames(InFileNames),
+      SliceBytes(InSliceBytes),
+      SlicesPerFile(InSlicesPerFile),
+      HeaderSize(InHeaderSize) {}
+
+  /** Reads Bytes bytes starting Offset bytes into slice Z. Returns false if the file is missing,
+   * too small or the read failed. */
+  bool Read(const int32 Z, const int64 Offset, uint8* Dest, const int64 Bytes);
+
+private:
+  bool Open(const int32 File);
+
+  const TArray<FString>& FileNames;
+  const int64 SliceBytes;
+  const int32 SlicesPerFile;
+  const int64 HeaderSize;
+  TUniquePtr<IFileHandle> FileHandle;
+  int32 OpenedFile{-1};
+  int64 FileHeaderSize{0};
+};
+
+/** Loads the box of voxels from RegionMin to RegionMin + RegionSize - 1 of a volume with the given
+ * dimensions, stored in one raw file or split evenly along Z across several (same as in
+ * LoadRawFileSeriesConverted). Only the rows covering the region are read, with positioned reads,
+ * one slice per task. Rows of a slice closer together than a page are read as a single span. The
+ * region is converted (or windowed) while reading, the same way as in LoadRawFileConverted.
+ * Returns nullptr if the region isn't inside the volume or reading failed.
+ */
+TUniquePtr<uint8> LoadRawFilesRegionConverted(
+    const TArray<FString>& FileNames, const FIntVector VolumeDimensions,
+    const FIntVector RegionMin, const FIntVector RegionSize, const EMhdElementType ElementType,
+    EPixelFormat& OutPixelFormat, const FVoxelWindow* Window = nullptr,
+    const bool ByteOrderMSB = false, const int64 HeaderSize = 0,
+    FVolumeLoadProgress* Progress = nullptr, FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Loads a region of a parsed MHD file with LoadRawFilesRegionConverted. Compressed and
+ * multi-channel volumes are not supported.
+ */
+TUniquePtr<uint8> LoadMhdRegionConverted(const FMhdInfo& Info, const FString MhdFileName,
+                                         const FIntVector RegionMin, const FIntVector RegionSize,
+                                         EPixelFormat& OutPixelFormat,
+                                         const FVoxelWindow* Window = nullptr,
+                                         FVolumeLoadProgress* Progress = nullptr,
+                                         FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Loads a volume reduced by Factor along every axis (rounded up, returned in OutDimensions) in
+ * one streaming pass, for a quick preview. The volume is stored like in
+ * LoadRawFilesRegionConverted. Every output slice is made by one task from its Factor input slices,
+ * which are read, converted and filtered without ever holding the full volume. With
+ * EVolumeDecimation::Stride, only every Factor-th slice (and row, if that skips whole pages) is
+ * read. Returns nullptr if reading failed or was canceled.
+ */
+TUniquePtr<uint8> LoadRawFilesDecimated(
+    const TArray<FString>& FileNames, const FIntVector VolumeDimensions,
+    const EMhdElementType ElementType, const int32 Factor, const EVolumeDecimation Decimation,
+    EPixelFormat& OutPixelFormat, FIntVector& OutDimensions, const FVoxelWindow* Window = nullptr,
+    const bool ByteOrderMSB = false, const int64 HeaderSize = 0,
+    FVolumeLoadProgress* Progress = nullptr, FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Loads a parsed MHD file decimated with LoadRawFilesDecimated. Compressed and multi-channel
+ * volumes are not supported.
+ */
+TUniquePtr<uint8> LoadMhdDataDecimated(const FMhdInfo& Info, const FString MhdFileName,
+                                       const int32 Factor, const EVolumeDecimation Decimation,
+                                       EPixelFormat& OutPixelFormat, FIntVector& OutDimensions,
+                                       const FVoxelWindow* Window = nullptr,
+                                       FVolumeLoadProgress* Progress = nullptr,
+                                       FVoxelStatisticsAccumulator* Statistics = nullptr);
+
+/** Byte counts of the full-volume copies made at each stage of loading a raw file into a texture.
+ * Used to check how much memory traffic a given load path causes. */
+struct FRawLoadStats {
+  // Whether the file was memory-mapped instead of being read into a staging array.
+  bool bMapped{false};
+  // Bytes read from disk into a staging array (zero when the file is mapped).
+  int64 StagingBytes{0};
+  // Bytes touched by converting the staging array to a supported pixel format.
+  int64 ConversionBytes{0};
+  // Bytes copied into the mip BulkData.
+  int64 BulkDataBytes{0};
+  // Bytes copied into the (editor-only) texture Source for persistent textures.
+  int64 SourceBytes{0};
+
+  int64 GetTotalBytes() const;
+  FString ToString() const;
+};
+
+/** Returns how many bytes HandleTextureEditorData will copy into the texture Source for a texture of
+ * the given format and size (zero for non-persistent textures, unsupported formats and non-editor
+ * builds). */
+int64 GetEditorSourceCopySize(const EPixelFormat PixelFormat, const bool Persistent,
+                              const int64 TotalSize);
+
+/** A read-only memory mapping of the first N bytes of a raw file. The mapped memory can be handed
+ * directly to CreateVolumeTextureAsset/UpdateVolumeTextureAsset, so the file contents are copied
+ * only once (page cache -> BulkData) instead of going through a staging array first.
+ */
+class FMappedRawFile {
+public:
+  ~FMappedRawFile();
+
+  /** Maps BytesToMap bytes of the given file. The file name can be an absolute path or relative to
+   * the project content directory. Returns nullptr if the file can't be opened, is too small or the
+   * platform doesn't support mapping files.*/
+  static TUniquePtr<FMappedRawFile> Open(const FString FileName, const int64 BytesToMap);
+
+  const uint8* GetData() const { return Region->GetMappedPtr(); }
+  int64 GetSize() const { return Region->GetMappedSize(); }
+
+private:
+  FMappedRawFile(IMappedFileHandle* InHandle, IMappedFileRegion* InRegion)
+    : Handle(InHandle), Region(InRegion) {}
+
+  // The region has to be released before the handle it was mapped from.
+  IMappedFileHandle* Handle;
+  IMappedFileRegion* Region;
+};
+
 ETextureSourceFormat PixelFormatToSourceFormat(EPixelFormat PixelFormat);
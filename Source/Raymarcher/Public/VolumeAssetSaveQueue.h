@@ -0,0 +1,50 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a queue saving generated assets (volume textures, transfer functions, volume
+// representations) to disk in the background, so creating them with SaveNow doesn't block the
+// editor until the file is written.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "UObject/Package.h"
+
+DECLARE_DELEGATE_OneParam(FOnVolumeAssetSaved, bool /* bSuccess */);
+
+/** Saves packages without waiting for the disk. Enqueue serializes the package right away on the
+ * game thread - which takes a snapshot of the asset, so it can be used and changed immediately -
+ * and the engine writes the file from worker threads. The file is written next to the package
+ * file under a temporary name, then moved over it, so an interrupted save never leaves a
+ * truncated asset. Must only be used from the game thread. */
+class FVolumeAssetSaveQueue {
+public:
+  static FVolumeAssetSaveQueue& Get();
+
+  /** Starts saving the package containing Asset. OnSaved is called on the game thread once the
+   * file is in place (or writing it failed). Returns false if the package couldn't be serialized,
+   * OnSaved isn't called then. */
+  bool Enqueue(UPackage* Package, UObject* Asset, FOnVolumeAssetSaved OnSaved = {});
+
+  /** Number of saves whose files aren't in place yet. */
+  int32 GetNumPending() const { return Pending.Num(); }
+
+  /** Waits until all enqueued saves are written and calls their callbacks. Called automatically
+   * before the engine exits. */
+  void Flush();
+
+private:
+  struct FPendingSave {
+    FString PackageFileName;
+    // Set once the file has been written and moved in place, to whether that succeeded.
+    TFuture<bool> Written;
+    FOnVolumeAssetSaved OnSaved;
+  };
+
+  // Calls the callbacks of the saves that finished since the last tick.
+  bool Tick(float DeltaTime);
+
+  TArray<FPendingSave> Pending;
+  FDelegateHandle TickerHandle;
+};
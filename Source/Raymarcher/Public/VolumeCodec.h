@@ -0,0 +1,27 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains a lossless codec for voxel data, tuned for smooth (CT, MR) volumes. Every voxel is
+// predicted from its already coded neighbours in the same slice with the median edge detector of
+// JPEG-LS, the prediction residuals are zigzag-mapped to small unsigned values, split into byte
+// planes (so the mostly-zero high bytes of 16-bit residuals form long runs) and deflated.
+// The volume is coded in independent slabs of whole slices, which are encoded and decoded in
+// parallel.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Losslessly encodes a volume of 1, 2 or 4-byte voxels (of any pixel format - voxels are coded as
+ * unsigned integers) into OutEncoded. Returns false for unsupported voxel sizes. */
+bool EncodeVolumeLossless(const uint8* Voxels, const FIntVector Dimensions,
+                          const int32 BytesPerVoxel, TArray<uint8>& OutEncoded);
+
+/** Reads the dimensions and voxel size of an encoded volume without decoding it. Returns false if
+ * Encoded wasn't written by EncodeVolumeLossless. */
+bool GetEncodedVolumeInfo(const TArray<uint8>& Encoded, FIntVector& OutDimensions,
+                          int32& OutBytesPerVoxel);
+
+/** Decodes a volume encoded with EncodeVolumeLossless into Destination, which has to hold all of
+ * its voxels (see GetEncodedVolumeInfo). Returns false if the data is corrupt. */
+bool DecodeVolumeLossless(const TArray<uint8>& Encoded, uint8* Destination);
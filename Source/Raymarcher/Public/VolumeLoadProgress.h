@@ -0,0 +1,44 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter64.h"
+
+/** Progress and cancellation state of a volume load, shared between the threads doing the loading
+ * and whoever waits for it. All functions can be called from any thread.
+ * The loaders (ReadRawFileInSlabs, InflateInSlabs, ...) report every slab they finish and stop
+ * with an error at the next slab boundary once the load is canceled.
+ */
+class FVolumeLoadProgress {
+public:
+  /** Returns the fraction of the volume that was read and converted so far, in [0, 1]. */
+  float GetFraction() const {
+    const int64 Total = TotalBytes.GetValue();
+    return Total > 0 ? FMath::Min(float(double(DoneBytes.GetValue()) / Total), 1.0f) : 0.0f;
+  }
+
+  void Cancel() { bCanceled = true; }
+
+  bool IsCanceled() const { return bCanceled; }
+
+  /** Sets the number of bytes the loader is going to process and resets the progress. */
+  void Start(const int64 Bytes) {
+    DoneBytes.Reset();
+    TotalBytes.Set(Bytes);
+  }
+
+  /** Reports Bytes more bytes as processed. Returns false if the load was canceled and the loader
+   * should stop. */
+  bool Advance(const int64 Bytes) {
+    DoneBytes.Add(Bytes);
+    return !bCanceled;
+  }
+
+private:
+  FThreadSafeCounter64 DoneBytes;
+  FThreadSafeCounter64 TotalBytes;
+  FThreadSafeBool bCanceled{false};
+};
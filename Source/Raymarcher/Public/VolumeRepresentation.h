@@ -4,6 +4,8 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Engine/VolumeTexture.h"
+#include "VolumeStatistics.h"
 
 #include "VolumeRepresentation.generated.h"
 
@@ -41,6 +43,12 @@ public:
   UPROPERTY(BlueprintReadWrite, EditAnywhere)
   FIntVector Dimensions;
 
+  /**
+   * Intensity statistics of the volume, gathered while it was loaded.
+   */
+  UPROPERTY(BlueprintReadWrite, EditAnywhere)
+  FVolumeStatistics Statistics;
+
   /**
    * Tags associated with this volume.
    * This can be used to indicate modality, which post-processing operations were applied etc..
@@ -50,4 +58,32 @@ public:
    */
   UPROPERTY(BlueprintReadWrite, EditAnywhere)
   TMap<FString, FString> Tags;
+
+  /**
+   * Stores the voxels losslessly compressed (see VolumeCodec.h) in this object, and sets Texture
+   * to a transient texture holding them. When the representation is saved, only the compressed
+   * voxels are written - the texture is recreated from them (decoded in parallel) when it's loaded.
+   * Use this instead of a persistent texture, whose source data is stored uncompressed.
+   */
+  bool SetCompressedVoxels(const uint8* Voxels, const EPixelFormat PixelFormat,
+                           const FIntVector VoxelDimensions);
+
+  /**
+   * Size of the compressed voxels in bytes, zero if they aren't stored compressed.
+   */
+  int64 GetCompressedSize() const { return CompressedVoxels.Num(); }
+
+  virtual void Serialize(FArchive& Ar) override;
+  virtual void PostLoad() override;
+
+private:
+  // Recreates the transient texture from CompressedVoxels.
+  bool CreateTextureFromCompressedVoxels();
+
+  // Pixel format of the compressed voxels, PF_Unknown if there are none. Saved as a property so
+  // Serialize knows whether compressed voxels follow when loading older assets.
+  UPROPERTY()
+  TEnumAsByte<EPixelFormat> CompressedPixelFormat;
+
+  TArray<uint8> CompressedVoxels;
 };
@@ -0,0 +1,176 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains playback of time series of volumes (e.g. cardiac or perfusion sequences), one MHD file
+// per timepoint. A background thread keeps a ring buffer of decoded frames filled with the frames
+// playback is about to reach, so switching frames only copies resident voxels into the texture and
+// never waits for the disk. Alternatively, the whole sequence is kept in memory delta-encoded (see
+// VolumeSequenceDeltas.h) and frames are reconstructed from their changed bricks.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Engine/VolumeTexture.h"
+#include "HAL/Runnable.h"
+#include "Tickable.h"
+
+#include "AsyncVolumeLoading.h"
+#include "VolumeSequenceDeltas.h"
+
+#include "VolumeSequence.generated.h"
+
+/** Keeps up to RingSize decoded frames of a sequence in memory and loads the frames playback needs
+ * next on its own thread. Frames that playback has moved away from are evicted first. */
+class FVolumeSequenceStreamer : public FRunnable {
+public:
+  FVolumeSequenceStreamer(const TArray<FString>& InFrameFiles, const int32 InRingSize);
+  virtual ~FVolumeSequenceStreamer();
+
+  /** Tells the streamer where playback is. Frames are prefetched starting at CurrentFrame, Step
+   * frames apart (negative when playing backwards), wrapping around the end if bLoop is set. */
+  void SetPlayback(const int32 CurrentFrame, const int32 Step, const bool bLoop);
+
+  /** Returns the frame if it's in the ring buffer, nullptr if it isn't loaded (yet). Never blocks
+   * on loading. The returned frame stays valid even if it's evicted afterwards. */
+  FLoadedVolumePtr GetFrame(const int32 Frame) const;
+
+  int32 GetNumFrames() const { return FrameFiles.Num(); }
+  int32 GetRingSize() const { return RingSize; }
+
+  // FRunnable interface.
+  virtual uint32 Run() override;
+  virtual void Stop() override;
+
+private:
+  // Frames playback will reach next, in the order it reaches them. Expects Lock to be held.
+  TArray<int32> GetUpcomingFrames() const;
+
+  // How far playback is from Frame, in frames. When looping, it's counted in the playback direction
+  // around the end of the sequence. Expects Lock to be held.
+  int32 GetPlaybackDistance(const int32 Frame) const;
+
+  const TArray<FString> FrameFiles;
+  const int32 RingSize;
+
+  // Guards everything below.
+  mutable FCriticalSection Lock;
+  TMap<int32, FLoadedVolumePtr> Ring;
+  // Frames that failed to load aren't retried, so a broken file can't keep the thread busy.
+  TSet<int32> FailedFrames;
+  int32 PlaybackFrame{0};
+  int32 PlaybackStep{1};
+  bool bPlaybackLoop{true};
+
+  // Canceled when the streamer stops, which also aborts the frame being loaded.
+  FVolumeLoadProgress LoadProgress;
+  FEvent* WakeUp;
+  FRunnableThread* Thread;
+};
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FVolumeSequenceFrameDelegate, int32, Frame);
+
+/** Plays back a sequence of MHD volumes (one per timepoint, in order) in a single volume texture.
+ * Ticks on its own, in game and in the editor, as long as it's referenced. */
+UCLASS(BlueprintType)
+class RAYMARCHER_API UVolumeSequence : public UObject, public FTickableGameObject {
+  GENERATED_BODY()
+public:
+  UVolumeSequence();
+
+  /** Opens a sequence of MHD files. RingSize frames are kept decoded in memory - it bounds the
+   * memory used and how far ahead frames are prefetched. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static UVolumeSequence* OpenMhdSequence(TArray<FString> FrameFiles, int32 RingSize = 8);
+
+  /** Opens all MHD files in Directory as a sequence, ordered by file name. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static UVolumeSequence* OpenMhdSequenceFolder(FString Directory, int32 RingSize = 8);
+
+  /** Opens a sequence of MHD files and keeps all of it in memory, delta-encoded in bricks of
+   * BrickSize voxels with a keyframe at least every KeyframeInterval frames. The frames are loaded
+   * and encoded on the thread pool, playback starts once that's done (see IsEncoding). Use this
+   * for sequences where little changes between frames - memory grows with the changes. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  static UVolumeSequence* OpenMhdSequenceDeltaEncoded(TArray<FString> FrameFiles,
+                                                      int32 BrickSize = 16,
+                                                      int32 KeyframeInterval = 30);
+
+  /**
+   * Transient texture showing the current frame. Created when the first frame is shown.
+   */
+  UPROPERTY(BlueprintReadOnly)
+  UVolumeTexture* Texture;
+
+  /**
+   * Start over at the other end when playback reaches the end of the sequence.
+   */
+  UPROPERTY(BlueprintReadWrite, EditAnywhere)
+  bool bLoop;
+
+  /** Called every time a new frame has been put into Texture. */
+  UPROPERTY(BlueprintAssignable)
+  FVolumeSequenceFrameDelegate OnFrameShown;
+
+  /** Plays the sequence at Rate frames per second, backwards if Rate is negative. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  void Play(float Rate);
+
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  void Pause();
+
+  /** Jumps to the given frame. It's shown as soon as it's loaded. */
+  UFUNCTION(BlueprintCallable, Category = "Raymarcher")
+  void SetFrame(int32 Frame);
+
+  UFUNCTION(BlueprintPure, Category = "Raymarcher")
+  int32 GetNumFrames() const { return NumFrames; }
+
+  /** A delta-encoded sequence is still being loaded. */
+  UFUNCTION(BlueprintPure, Category = "Raymarcher")
+  bool IsEncoding() const { return DeltasFuture.IsValid(); }
+
+  /** The delta-encoded frames, nullptr for streamed sequences or while they are being encoded. */
+  const FVolumeSequenceDeltas* GetDeltas() const { return Deltas.Get(); }
+
+  /** The frame in Texture, -1 before the first frame is shown. */
+  UFUNCTION(BlueprintPure, Category = "Raymarcher")
+  int32 GetShownFrame() const { return ShownFrame; }
+
+  /** Number of ticks on which playback waited for a frame that wasn't prefetched yet and the
+   * previous frame stayed on screen. If this keeps growing, the disk can't keep up with the rate.
+   */
+  UFUNCTION(BlueprintPure, Category = "Raymarcher")
+  int32 GetNumStalls() const { return NumStalls; }
+
+  virtual void BeginDestroy() override;
+
+  // FTickableGameObject interface.
+  virtual void Tick(float DeltaTime) override;
+  virtual bool IsTickable() const override {
+    return Streamer.IsValid() || Deltas.IsValid() || DeltasFuture.IsValid();
+  }
+  virtual bool IsTickableInEditor() const override { return true; }
+  virtual TStatId GetStatId() const override;
+
+private:
+  // Copies a resident frame into Texture.
+  void ShowFrame(const int32 Frame, const FLoadedVolume& Volume);
+
+  // Reconstructs a frame of the delta-encoded sequence and copies it into Texture.
+  void ShowDeltaFrame(const int32 Frame);
+
+  // Exactly one of Streamer and Deltas (or DeltasFuture, while encoding) is set.
+  TUniquePtr<FVolumeSequenceStreamer> Streamer;
+  TFuture<TSharedPtr<FVolumeSequenceDeltas, ESPMode::ThreadSafe>> DeltasFuture;
+  TSharedPtr<FVolumeSequenceDeltas, ESPMode::ThreadSafe> Deltas;
+  // The frame reconstructed from Deltas, ShownFrame once it's been put into Texture.
+  TArray<uint8> DecodedFrame;
+  int32 NumFrames;
+  // Playback position in frames, the frame to show is its integer part.
+  float PlaybackPosition;
+  float FramesPerSecond;
+  // Smoothed duration of a tick, used to predict how many frames playback skips per tick.
+  float AverageDeltaTime;
+  int32 ShownFrame;
+  int32 NumStalls;
+};
@@ -0,0 +1,104 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains temporal delta encoding of volume sequences. Consecutive frames of 4D sequences mostly
+// differ in a small part of the volume, so only keyframes are stored in full - every other frame
+// only stores the bricks that changed since the frame before it. Memory per frame and the voxels
+// that have to be copied to go to the next frame both shrink with the amount of change.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PixelFormat.h"
+#include "VolumeLoadProgress.h"
+
+/** A sequence of volumes of equal dimensions and pixel format, stored as keyframes plus the bricks
+ * that changed between consecutive frames. Bricks are cubes of BrickSize voxels (smaller at the far
+ * edges of the volume) indexed with X changing fastest. Decoding functions can be called from
+ * several threads at once, AddFrame can't. */
+class FVolumeSequenceDeltas {
+public:
+  FVolumeSequenceDeltas() {}
+  FVolumeSequenceDeltas(const FIntVector InDimensions, const EPixelFormat InPixelFormat,
+                        const int32 InBrickSize = 16, const int32 InKeyframeInterval = 30);
+
+  /** Appends a frame (Dimensions voxels in PixelFormat). It's stored as a keyframe if it's the
+   * first frame, KeyframeInterval frames have passed since the last keyframe, or more than half
+   * of its bricks changed. Bricks are compared in parallel. */
+  void AddFrame(const uint8* Voxels);
+
+  int32 GetNumFrames() const { return Frames.Num(); }
+  FIntVector GetDimensions() const { return Dimensions; }
+  EPixelFormat GetPixelFormat() const { return PixelFormat; }
+  int32 GetBrickSize() const { return BrickSize; }
+  bool IsKeyframe(const int32 Frame) const { return Frames[Frame].bKeyframe; }
+
+  /** Returns the last keyframe at or before Frame. */
+  int32 GetKeyframe(const int32 Frame) const;
+
+  /** Bytes of a decoded frame. */
+  int64 GetFrameBytes() const;
+
+  /** Bytes stored for a frame - all voxels for keyframes, the changed bricks for others. */
+  int64 GetStoredBytes(const int32 Frame) const { return Frames[Frame].Voxels.Num(); }
+
+  /** Bytes stored for the whole sequence. */
+  int64 GetTotalStoredBytes() const;
+
+  /** Bricks that changed between the previous frame and Frame, in ascending order. Empty for
+   * keyframes, which replace all voxels. */
+  const TArray<int32>& GetChangedBricks(const int32 Frame) const {
+    return Frames[Frame].ChangedBricks;
+  }
+
+  FIntVector GetBrickOrigin(const int32 BrickIndex) const;
+
+  /** Voxels of the brick along every axis - BrickSize, except at the far edges of the volume. */
+  FIntVector GetBrickExtent(const int32 BrickIndex) const;
+
+  /** Turns Voxels, holding the frame before Frame, into Frame by overwriting the bricks that
+   * changed in place, in parallel. Keyframes are copied in full. */
+  void ApplyFrame(const int32 Frame, uint8* Voxels) const;
+
+  /** Turns Voxels, holding FromFrame (or anything if FromFrame is INDEX_NONE), into ToFrame.
+   * Applies the deltas in between if ToFrame follows FromFrame without a keyframe in between,
+   * otherwise decodes ToFrame from its keyframe. Returns false if all voxels were replaced,
+   * true if only the bricks added to OutChangedBricks (sorted, without duplicates) changed. */
+  bool SeekFrame(const int32 FromFrame, const int32 ToFrame, uint8* Voxels,
+                 TArray<int32>& OutChangedBricks) const;
+
+  /** Saves the sequence to a file. Returns false if it couldn't be written. */
+  bool SaveToFile(const FString FileName) const;
+
+  /** Loads a sequence saved with SaveToFile. Returns false if the file doesn't exist, was
+   * written by a different version or is truncated or corrupt, the sequence is empty then. */
+  bool LoadFromFile(const FString FileName);
+
+private:
+  struct FFrame {
+    bool bKeyframe{false};
+    TArray<int32> ChangedBricks;
+    // All voxels of keyframes, otherwise the voxels of the changed bricks one after another.
+    TArray<uint8> Voxels;
+  };
+
+  FIntVector GetBrickCoordinates(const int32 BrickIndex) const;
+  int32 GetNumBricks() const { return BrickCounts.X * BrickCounts.Y * BrickCounts.Z; }
+
+  FIntVector Dimensions{0, 0, 0};
+  EPixelFormat PixelFormat{PF_Unknown};
+  int32 BytesPerVoxel{0};
+  int32 BrickSize{16};
+  int32 KeyframeInterval{30};
+  FIntVector BrickCounts{0, 0, 0};
+  TArray<FFrame> Frames;
+  // The last frame added, the bricks of new frames are compared against it. Not saved.
+  TArray<uint8> PreviousFrame;
+};
+
+/** Loads the MHD files of a sequence one after another and delta-encodes them into OutSequence.
+ * All frames have to have the same dimensions and element type. Returns false if a frame couldn't
+ * be loaded or doesn't match, or encoding was canceled through Progress. */
+bool EncodeMhdSequence(const TArray<FString>& FrameFiles, FVolumeSequenceDeltas& OutSequence,
+                       const int32 BrickSize = 16, const int32 KeyframeInterval = 30,
+                       FVolumeLoadProgress* Progress = nullptr);
@@ -0,0 +1,68 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains intensity statistics of loaded volumes and the accumulator the loaders use to gather
+// them while converting the data, so no extra pass over the volume is needed.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "PixelFormat.h"
+
+#include "VolumeStatistics.generated.h"
+
+// Number of bins of FVolumeStatistics::Histogram.
+#define VOLUME_STATISTICS_BINS 4096
+
+/** Intensity statistics of a volume. All values are in the units the shaders sample the texture in
+ * - normalized to [0, 1] for 8 and 16-bit textures, raw values for float textures - so they can be
+ * used as a transfer function IntensityDomain directly. */
+USTRUCT(BlueprintType) struct FVolumeStatistics {
+  GENERATED_BODY()
+
+  // False if the volume's pixel format isn't supported (only G8, G16 and R32_FLOAT are).
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") bool bValid;
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") float Min;
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") float Max;
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") float Mean;
+  // Values below which 0.5% and 99.5% of the voxels are. Robust against outliers, use these as the
+  // intensity domain for auto-windowing.
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") float LowPercentile;
+  UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "VolumeStatistics") float HighPercentile;
+  // Voxel counts of VOLUME_STATISTICS_BINS equally sized bins spanning [Min, Max].
+  UPROPERTY() TArray<int64> Histogram;
+
+  FVolumeStatistics()
+    : bValid(false), Min(0.0f), Max(0.0f), Mean(0.0f), LowPercentile(0.0f), HighPercentile(0.0f){};
+
+  /** Returns the value below which the given fraction of voxels is, read from the histogram (so
+   * accurate to one bin). */
+  float GetPercentile(const float Fraction) const;
+};
+
+/** Gathers FVolumeStatistics from converted voxel data, slab by slab. Voxels are binned into a fine
+ * histogram - one bin per value for 8 and 16-bit data, one bin per 16-bit float prefix (bfloat16)
+ * for float data - so percentiles are exact for integer textures and accurate to about 0.4% of the
+ * value for float textures. AddVoxels can be called from several threads at once.
+ */
+class FVoxelStatisticsAccumulator {
+public:
+  /** Resets the accumulator for data of the given pixel format. Called by the loaders once they
+   * know the format they convert to. */
+  void Start(const EPixelFormat InPixelFormat);
+
+  /** Adds NumVoxels voxels in the format passed to Start. */
+  void AddVoxels(const uint8* Data, const int64 NumVoxels);
+
+  FVolumeStatistics GetStatistics() const;
+
+private:
+  EPixelFormat PixelFormat{PF_Unknown};
+  mutable FCriticalSection Lock;
+  TArray<uint64> FineHistogram;
+  int64 Count{0};
+  double Sum{0.0};
+  float Min{TNumericLimits<float>::Max()};
+  float Max{TNumericLimits<float>::Lowest()};
+};
@@ -0,0 +1,374 @@
+// (C) Technical University of Munich - Computer Aided Medical Procedures
+// Developed by Tomas Bartipan, Jakob Weiss (jakob.weiss@tum.de)
+
+// Contains vectorized kernels for converting voxel data between element types and for linearly
+// windowing voxel values into 8 or 16 bit textures. The kernels are selected at compile time by the
+// source and destination types. On x86 they use SSE2, or AVX2 if the module is compiled with it,
+// everything else (and the tails of the arrays) is converted by scalar code with identical results.
+//
+// All kernels run on the calling thread - split larger volumes into chunks and use ParallelFor.
+// As long as the destination type is not larger than the source type, Src and Dst may point to the
+// same memory (elements are converted front-to-back).
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#if PLATFORM_CPU_X86_FAMILY
+#define VOXEL_CONVERSION_SSE2 1
+#if defined(__AVX2__)
+#define VOXEL_CONVERSION_AVX2 1
+#else
+#define VOXEL_CONVERSION_AVX2 0
+#endif
+#else
+#define VOXEL_CONVERSION_SSE2 0
+#define VOXEL_CONVERSION_AVX2 0
+#endif
+
+#if VOXEL_CONVERSION_AVX2
+#include <immintrin.h>
+#elif VOXEL_CONVERSION_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace VoxelConversion {
+
+/** Maximum value of an unsigned destination type, as float. */
+template <typename DstType>
+FORCEINLINE float MaxValue() {
+  return float(TNumericLimits<DstType>::Max());
+}
+
+/** Scalar windowing of one value. The vector kernels below compute exactly the same thing. */
+template <typename SrcType, typename DstType>
+FORCEINLINE DstType WindowValue(const SrcType Value, const float WindowMin, const float Scale) {
+  float Scaled = (float(Value) - WindowMin) * Scale;
+  Scaled = Scaled < 0.0f ? 0.0f : Scaled;
+  Scaled = Scaled > MaxValue<DstType>() ? MaxValue<DstType>() : Scaled;
+  return DstType(int32(Scaled + 0.5f));
+}
+
+#if VOXEL_CONVERSION_SSE2
+// Loads 4 elements and converts them to float.
+FORCEINLINE __m128 LoadAsFloat4(const uint8* Src) {
+  int32 Bytes;
+  FMemory::Memcpy(&Bytes, Src, sizeof(Bytes));
+  const __m128i Zero = _mm_setzero_si128();
+  const __m128i Words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(Bytes), Zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(Words, Zero));
+}
+FORCEINLINE __m128 LoadAsFloat4(const uint16* Src) {
+  const __m128i Words = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(Src));
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(Words, _mm_setzero_si128()));
+}
+FORCEINLINE __m128 LoadAsFloat4(const int16* Src) {
+  const __m128i Words = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(Src));
+  // Put every value in the upper half of a 32-bit lane and shift it down with sign extension.
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(Words, Words), 16));
+}
+FORCEINLINE __m128 LoadAsFloat4(const int32* Src) {
+  return _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Src)));
+}
+FORCEINLINE __m128 LoadAsFloat4(const float* Src) {
+  return _mm_loadu_ps(Src);
+}
+FORCEINLINE __m128 LoadAsFloat4(const double* Src) {
+  return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(Src)), _mm_cvtpd_ps(_mm_loadu_pd(Src + 2)));
+}
+
+// Stores 4 int32 values that are already in the range of the destination type.
+FORCEINLINE void StoreInt4(uint8* Dst, const __m128i Values) {
+  const __m128i Words = _mm_packs_epi32(Values, Values);
+  const int32 Bytes = _mm_cvtsi128_si32(_mm_packus_epi16(Words, Words));
+  FMemory::Memcpy(Dst, &Bytes, sizeof(Bytes));
+}
+FORCEINLINE void StoreInt4(uint16* Dst, const __m128i Values) {
+  // SSE2 only has a signed 32 -> 16 bit pack, so shift the values to the signed range and back.
+  const __m128i Bias = _mm_set1_epi32(0x8000);
+  const __m128i Words = _mm_packs_epi32(_mm_sub_epi32(Values, Bias), _mm_setzero_si128());
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(Dst), _mm_xor_si128(Words, _mm_set1_epi16(-0x8000)));
+}
+#endif
+
+#if VOXEL_CONVERSION_AVX2
+// Loads 8 elements and converts them to float.
+FORCEINLINE __m256 LoadAsFloat8(const uint8* Src) {
+  const __m128i Bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(Src));
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(Bytes));
+}
+FORCEINLINE __m256 LoadAsFloat8(const uint16* Src) {
+  const __m128i Words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src));
+  return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(Words));
+}
+FORCEINLINE __m256 LoadAsFloat8(const int16* Src) {
+  const __m128i Words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src));
+  return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(Words));
+}
+FORCEINLINE __m256 LoadAsFloat8(const int32* Src) {
+  return _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(Src)));
+}
+FORCEINLINE __m256 LoadAsFloat8(const float* Src) {
+  return _mm256_loadu_ps(Src);
+}
+FORCEINLINE __m256 LoadAsFloat8(const double* Src) {
+  const __m128 Low = _mm256_cvtpd_ps(_mm256_loadu_pd(Src));
+  const __m128 High = _mm256_cvtpd_ps(_mm256_loadu_pd(Src + 4));
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(Low), High, 1);
+}
+
+// Packs 8 int32 values in the range of uint16 into the low 128 bits, in order.
+FORCEINLINE __m128i PackToUint16x8(const __m256i Values) {
+  // The pack works per 128-bit lane, gather the two useful 64-bit halves afterwards.
+  const __m256i Packed = _mm256_packus_epi32(Values, Values);
+  return _mm256_castsi256_si128(_mm256_permute4x64_epi64(Packed, 0x08));
+}
+
+// Stores 8 int32 values that are already in the range of the destination type.
+FORCEINLINE void StoreInt8(uint8* Dst, const __m256i Values) {
+  const __m128i Words = PackToUint16x8(Values);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(Dst), _mm_packus_epi16(Words, Words));
+}
+FORCEINLINE void StoreInt8(uint16* Dst, const __m256i Values) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst), PackToUint16x8(Values));
+}
+#endif
+
+/** Reverses the byte order of Count elements of ElementSize (2, 4 or 8) bytes. */
+template <int32 ElementSize>
+struct TByteSwapKernel {
+  static_assert(ElementSize == 2 || ElementSize == 4 || ElementSize == 8,
+                "Only 2, 4 and 8 byte elements can be byte-swapped.");
+
+  static void Run(const uint8* Src, uint8* Dst, const int64 Count) {
+    int64 i = 0;
+#if VOXEL_CONVERSION_AVX2
+    // Byte shuffle reversing every element, the same pattern for both 128-bit lanes.
+    const __m256i Shuffle256 =
+        ElementSize == 2
+            ? _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5,
+                               4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+            : ElementSize == 4
+                  ? _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1,
+                                     0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+                  : _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5,
+                                     4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    for (; (i + 32 / ElementSize) <= Count; i += 32 / ElementSize) {
+      const __m256i Values =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Src + i * ElementSize));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + i * ElementSize),
+                          _mm256_shuffle_epi8(Values, Shuffle256));
+    }
+#endif
+#if VOXEL_CONVERSION_SSE2
+    // SSE2 has no byte shuffle - swap the bytes in every 16-bit word with shifts, then reverse the
+    // words within every element with word shuffles.
+    for (; (i + 16 / ElementSize) <= Count; i += 16 / ElementSize) {
+      __m128i Values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i * ElementSize));
+      Values = _mm_or_si128(_mm_slli_epi16(Values, 8), _mm_srli_epi16(Values, 8));
+      if (ElementSize == 4) {
+        Values = _mm_shufflelo_epi16(Values, _MM_SHUFFLE(2, 3, 0, 1));
+        Values = _mm_shufflehi_epi16(Values, _MM_SHUFFLE(2, 3, 0, 1));
+      } else if (ElementSize == 8) {
+        Values = _mm_shufflelo_epi16(Values, _MM_SHUFFLE(0, 1, 2, 3));
+        Values = _mm_shufflehi_epi16(Values, _MM_SHUFFLE(0, 1, 2, 3));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + i * ElementSize), Values);
+    }
+#endif
+    for (; i < Count; i++) {
+      uint8 Element[ElementSize];
+      FMemory::Memcpy(Element, Src + i * ElementSize, ElementSize);
+      for (int32 Byte = 0; Byte < ElementSize; Byte++) {
+        Dst[i * ElementSize + Byte] = Element[ElementSize - 1 - Byte];
+      }
+    }
+  }
+};
+
+/** Single bytes have no byte order. */
+template <>
+struct TByteSwapKernel<1> {
+  static void Run(const uint8* Src, uint8* Dst, const int64 Count) {
+    if (Src != Dst) {
+      FMemory::Memmove(Dst, Src, Count);
+    }
+  }
+};
+
+// Number of elements byte-swapped at once before converting them. Small enough that the swapped
+// block is still in L1 cache when it's converted, so swapping doesn't cost another pass over
+// memory.
+#define VOXEL_CONVERSION_SWAP_BLOCK 1024
+
+/** Runs Kernel(Src, Dst, Count) on byte-swapped source data, one cache-sized block at a time. */
+template <typename SrcType, typename DstType, typename KernelType>
+FORCEINLINE void RunOnSwappedBlocks(const SrcType* Src, DstType* Dst, const int64 Count,
+                                    KernelType Kernel) {
+  SrcType Block[VOXEL_CONVERSION_SWAP_BLOCK];
+  for (int64 i = 0; i < Count; i += VOXEL_CONVERSION_SWAP_BLOCK) {
+    const int64 BlockCount = FMath::Min<int64>(VOXEL_CONVERSION_SWAP_BLOCK, Count - i);
+    TByteSwapKernel<sizeof(SrcType)>::Run(reinterpret_cast<const uint8*>(Src + i),
+                                          reinterpret_cast<uint8*>(Block), BlockCount);
+    Kernel(Block, Dst + i, BlockCount);
+  }
+}
+
+/** Plain type conversion, used for all type pairs without a vectorized specialization. */
+template <typename SrcType, typename DstType>
+struct TConvertKernel {
+  static void Run(const SrcType* Src, DstType* Dst, const int64 Count) {
+    for (int64 i = 0; i < Count; i++) {
+      Dst[i] = DstType(Src[i]);
+    }
+  }
+};
+
+/** Signed to unsigned 16 bit by adding 32768 (-32768 -> 0, 32767 -> 65535). Adding 32768 is the
+ * same as flipping the sign bit. */
+template <>
+struct TConvertKernel<int16, uint16> {
+  static void Run(const int16* Src, uint16* Dst, const int64 Count) {
+    int64 i = 0;
+#if VOXEL_CONVERSION_AVX2
+    const __m256i SignBit256 = _mm256_set1_epi16(-0x8000);
+    for (; i + 16 <= Count; i += 16) {
+      const __m256i Values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Src + i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + i),
+                          _mm256_xor_si256(Values, SignBit256));
+    }
+#endif
+#if VOXEL_CONVERSION_SSE2
+    const __m128i SignBit = _mm_set1_epi16(-0x8000);
+    for (; i + 8 <= Count; i += 8) {
+      const __m128i Values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + i), _mm_xor_si128(Values, SignBit));
+    }
+#endif
+    for (; i < Count; i++) {
+      Dst[i] = uint16(int32(Src[i]) + 0x8000);
+    }
+  }
+};
+
+template <>
+struct TConvertKernel<int32, float> {
+  static void Run(const int32* Src, float* Dst, const int64 Count) {
+    int64 i = 0;
+#if VOXEL_CONVERSION_AVX2
+    for (; i + 8 <= Count; i += 8) {
+      _mm256_storeu_ps(Dst + i, LoadAsFloat8(Src + i));
+    }
+#endif
+#if VOXEL_CONVERSION_SSE2
+    for (; i + 4 <= Count; i += 4) {
+      _mm_storeu_ps(Dst + i, LoadAsFloat4(Src + i));
+    }
+#endif
+    for (; i < Count; i++) {
+      Dst[i] = float(Src[i]);
+    }
+  }
+};
+
+template <>
+struct TConvertKernel<double, float> {
+  static void Run(const double* Src, float* Dst, const int64 Count) {
+    int64 i = 0;
+#if VOXEL_CONVERSION_AVX2
+    for (; i + 8 <= Count; i += 8) {
+      _mm256_storeu_ps(Dst + i, LoadAsFloat8(Src + i));
+    }
+#endif
+#if VOXEL_CONVERSION_SSE2
+    for (; i + 4 <= Count; i += 4) {
+      _mm_storeu_ps(Dst + i, LoadAsFloat4(Src + i));
+    }
+#endif
+    for (; i < Count; i++) {
+      Dst[i] = float(Src[i]);
+    }
+  }
+};
+
+/** Linear windowing to an unsigned 8 or 16 bit type. */
+template <typename SrcType, typename DstType>
+struct TWindowKernel {
+  static_assert(TIsSame<DstType, uint8>::Value || TIsSame<DstType, uint16>::Value,
+                "Voxels can only be windowed to uint8 or uint16.");
+
+  static void Run(const SrcType* Src, DstType* Dst, const int64 Count, const float WindowMin,
+                  const float Scale) {
+    int64 i = 0;
+#if VOXEL_CONVERSION_AVX2
+    const __m256 Min256 = _mm256_set1_ps(WindowMin);
+    const __m256 Scale256 = _mm256_set1_ps(Scale);
+    const __m256 Max256 = _mm256_set1_ps(MaxValue<DstType>());
+    const __m256 Half256 = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= Count; i += 8) {
+      __m256 Scaled = _mm256_mul_ps(_mm256_sub_ps(LoadAsFloat8(Src + i), Min256), Scale256);
+      Scaled = _mm256_min_ps(_mm256_max_ps(Scaled, _mm256_setzero_ps()), Max256);
+      StoreInt8(Dst + i, _mm256_cvttps_epi32(_mm256_add_ps(Scaled, Half256)));
+    }
+#endif
+#if VOXEL_CONVERSION_SSE2
+    const __m128 Min128 = _mm_set1_ps(WindowMin);
+    const __m128 Scale128 = _mm_set1_ps(Scale);
+    const __m128 Max128 = _mm_set1_ps(MaxValue<DstType>());
+    const __m128 Half128 = _mm_set1_ps(0.5f);
+    for (; i + 4 <= Count; i += 4) {
+      __m128 Scaled = _mm_mul_ps(_mm_sub_ps(LoadAsFloat4(Src + i), Min128), Scale128);
+      Scaled = _mm_min_ps(_mm_max_ps(Scaled, _mm_setzero_ps()), Max128);
+      StoreInt4(Dst + i, _mm_cvttps_epi32(_mm_add_ps(Scaled, Half128)));
+    }
+#endif
+    for (; i < Count; i++) {
+      Dst[i] = WindowValue<SrcType, DstType>(Src[i], WindowMin, Scale);
+    }
+  }
+};
+
+}  // namespace VoxelConversion
+
+/** Reverses the byte order of Count voxels (e.g. big-endian to little-endian). */
+template <typename VoxelType>
+FORCEINLINE void SwapVoxelBytes(const VoxelType* Src, VoxelType* Dst, const int64 Count) {
+  VoxelConversion::TByteSwapKernel<sizeof(VoxelType)>::Run(reinterpret_cast<const uint8*>(Src),
+                                                          reinterpret_cast<uint8*>(Dst), Count);
+}
+
+/** Converts Count voxels from SrcType to DstType. Uses a vectorized kernel for int16 -> uint16
+ * (offset by 32768), int32 -> float and double -> float, plain casts for everything else.
+ * If SwapBytes is set, the source data is big-endian and gets byte-swapped as part of the
+ * conversion. */
+template <typename SrcType, typename DstType>
+FORCEINLINE void ConvertVoxels(const SrcType* Src, DstType* Dst, const int64 Count,
+                               const bool SwapBytes = false) {
+  if (SwapBytes && sizeof(SrcType) > 1) {
+    VoxelConversion::RunOnSwappedBlocks(Src, Dst, Count, [](const SrcType* S, DstType* D, int64 N) {
+      VoxelConversion::TConvertKernel<SrcType, DstType>::Run(S, D, N);
+    });
+  } else {
+    VoxelConversion::TConvertKernel<SrcType, DstType>::Run(Src, Dst, Count);
+  }
+}
+
+/** Linearly maps voxel values in [WindowMin, WindowMax] to the full range of DstType (uint8 or
+ * uint16), clamping values outside of the window and rounding to the nearest integer. E.g. a
+ * Hounsfield window of [-1000, 1000] on int16 CT data to uint8. SwapBytes works as in
+ * ConvertVoxels. */
+template <typename SrcType, typename DstType>
+FORCEINLINE void WindowVoxels(const SrcType* Src, DstType* Dst, const int64 Count,
+                              const float WindowMin, const float WindowMax,
+                              const bool SwapBytes = false) {
+  const float Scale = VoxelConversion::MaxValue<DstType>() / FMath::Max(WindowMax - WindowMin,
+                                                                       SMALL_NUMBER);
+  if (SwapBytes && sizeof(SrcType) > 1) {
+    VoxelConversion::RunOnSwappedBlocks(
+        Src, Dst, Count, [&](const SrcType* S, DstType* D, int64 N) {
+          VoxelConversion::TWindowKernel<SrcType, DstType>::Run(S, D, N, WindowMin, Scale);
+        });
+  } else {
+    VoxelConversion::TWindowKernel<SrcType, DstType>::Run(Src, Dst, Count, WindowMin, Scale);
+  }
+}
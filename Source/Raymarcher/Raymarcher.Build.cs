@@ -42,6 +42,9 @@ public class Raymarcher : ModuleRules
 				"Engine"
             }
 			);
+
+		// Used for decompressing MHD data files with CompressedData = True.
+		AddEngineThirdPartyPrivateStaticDependencies(Target, "zlib");
 		
 		
 		DynamicallyLoadedModuleNames.AddRange(